@@ -0,0 +1,165 @@
+
+/*
+    Example of use of libthermo from several threads.
+
+    The input files given on the command line are read in memory and
+    computed many times by nthreads threads at once, each with its own
+    context: the log is discarded, errors are counted and the arrays are
+    allocated through a counting allocator. The free energies are checked
+    against a computation in the main thread and written to out, with the
+    number of errors and of blocks left allocated.
+
+    Usage: thermo_library out nthreads input...
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <thermo.h>
+
+#define LIB_NREP 50
+
+/* Inputs shared (read only) by all threads */
+typedef struct {
+    int n;
+    char **text;
+    size_t *len;
+    double *F;      /* Reference free energies */
+} LibInputs;
+
+/* State of a thread: its context and what its callbacks counted */
+typedef struct {
+    ThermoContext ctx;
+    const LibInputs *in;
+    long nalloc;    /* Blocks currently allocated */
+    int nerr;       /* Error messages received */
+    int nwrong;     /* Results different from the reference */
+} LibThread;
+
+/* Allocator counting the live blocks */
+static void *lib_alloc(void *data, void *ptr, size_t size) {
+    LibThread *t = data;
+    if (size==0) {
+        if (ptr!=NULL) t->nalloc--;
+        free(ptr);
+        return NULL;
+    }
+    if (ptr==NULL) t->nalloc++;
+    return realloc(ptr, size);
+}
+
+/* Error callback counting the messages */
+static void lib_error(void *data, const char *msg) {
+    LibThread *t = data;
+    (void)msg;
+    t->nerr++;
+}
+
+/* Compute all inputs LIB_NREP times, and a broken one once */
+static void *lib_thread(void *arg) {
+    LibThread *t = arg;
+    double res[THERMO_LAST];
+    const char *broken = "temperature = 300\nvibrations = 3\n1.0\nnot a number\n";
+    int i, k;
+    for (k=0; k<LIB_NREP; k++) {
+        for (i=0; i<t->in->n; i++) {
+            if (thermo_compute_into(&(t->ctx), t->in->text[i], t->in->len[i], res)!=EXIT_SUCCESS ||
+                res[THERMO_F]!=t->in->F[i]) t->nwrong++;
+        }
+    }
+    if (thermo_compute_into(&(t->ctx), broken, strlen(broken), res)==EXIT_SUCCESS) t->nwrong++;
+    return NULL;
+}
+
+/* Read a whole file */
+static char *lib_read(const char *fname, size_t *len) {
+    char *text;
+    long size;
+    FILE *fp = fopen(fname, "rb");
+    if (fp==NULL) return NULL;
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    text = malloc((size_t)size+1);
+    if (text!=NULL) {
+        *len = fread(text, 1, (size_t)size, fp);
+        text[*len] = '\0';
+    }
+    fclose(fp);
+    return text;
+}
+
+int main(int argc, char *argv[]) {
+
+    int i, nthreads, nerr = 0, nwrong = 0;
+    long nalloc = 0;
+    double res[THERMO_LAST];
+    LibInputs in;
+    LibThread *t;
+    pthread_t *tid;
+    ThermoContext ctx;
+    FILE *out, *null;
+
+    if (argc<4 || (nthreads = atoi(argv[2]))<1) {
+        fprintf(stderr, "Usage: %s out nthreads input...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* Inputs, and their reference results */
+    null = fopen("/dev/null", "w");
+    thermo_context_init(&ctx);
+    ctx.out = null;
+    in.n    = argc-3;
+    in.text = calloc((size_t)in.n, sizeof(char *));
+    in.len  = calloc((size_t)in.n, sizeof(size_t));
+    in.F    = calloc((size_t)in.n, sizeof(double));
+    for (i=0; i<in.n; i++) {
+        in.text[i] = lib_read(argv[i+3], in.len+i);
+        if (in.text[i]==NULL || thermo_compute_into(&ctx, in.text[i], in.len[i], res)!=EXIT_SUCCESS) {
+            fprintf(stderr, "Failing computing <%s>\n", argv[i+3]);
+            return EXIT_FAILURE;
+        }
+        in.F[i] = res[THERMO_F];
+    }
+
+    /* All threads at once */
+    t   = calloc((size_t)nthreads, sizeof(LibThread));
+    tid = calloc((size_t)nthreads, sizeof(pthread_t));
+    for (i=0; i<nthreads; i++) {
+        thermo_context_init(&(t[i].ctx));
+        t[i].ctx.out   = null;
+        t[i].ctx.error = lib_error;
+        t[i].ctx.alloc = lib_alloc;
+        t[i].ctx.data  = t+i;
+        t[i].in = &in;
+        pthread_create(tid+i, NULL, lib_thread, t+i);
+    }
+    for (i=0; i<nthreads; i++) {
+        pthread_join(tid[i], NULL);
+        nerr   += t[i].nerr>0;
+        nwrong += t[i].nwrong;
+        nalloc += t[i].nalloc;
+    }
+
+    out = fopen(argv[1], "w");
+    if (out==NULL) return EXIT_FAILURE;
+    for (i=0; i<in.n; i++) {
+        fprintf(out, "%-46s = %10.3f\n", strrchr(argv[i+3], '/') ? strrchr(argv[i+3], '/')+1 : argv[i+3], in.F[i]);
+    }
+    fprintf(out, "Threads reporting errors of the broken input: %d of %d\n", nerr, nthreads);
+    fprintf(out, "Wrong results: %d\n", nwrong);
+    fprintf(out, "Blocks left allocated: %ld\n", nalloc);
+    fclose(out);
+
+    for (i=0; i<in.n; i++) free(in.text[i]);
+    free(in.text);
+    free(in.len);
+    free(in.F);
+    free(t);
+    free(tid);
+    fclose(null);
+    return (nwrong==0 && nalloc==0 && nerr==nthreads) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
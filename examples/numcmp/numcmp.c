@@ -0,0 +1,82 @@
+/*
+    Compare an output file to its reference, allowing a relative difference
+    in the numbers: the fields (separated by commas or white space) which are
+    numbers in both files must agree within the tolerance, all the others
+    must be equal. Used for the outputs printed with all their digits, whose
+    last ones change with the optimization of the build (e.g. contraction of
+    multiply and add).
+
+    Usage: thermo_numcmp file reference [tolerance]
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define NUMCMP_TOL 1E-10
+
+/* Read the next field of fp in buf, with the separator following it in sep. Return 0 at the end of the file */
+static int numcmp_field(FILE *fp, char *buf, size_t size, int *sep) {
+    size_t n = 0;
+    int c;
+    while ((c = fgetc(fp))!=EOF && c!=',' && c!=' ' && c!='\t' && c!='\n') {
+        if (n<size-1) buf[n++] = (char)c;
+    }
+    buf[n] = '\0';
+    *sep = c;
+    return (c!=EOF || n>0);
+}
+
+/* True if buf is a whole number, stored in x */
+static int numcmp_number(const char *buf, double *x) {
+    char *end;
+    if (buf[0]=='\0') return 0;
+    *x = strtod(buf, &end);
+    return (*end=='\0');
+}
+
+int main(int argc, char **argv) {
+    char a[256], b[256];
+    int sa, sb, ra, rb, line = 1, ndiff = 0;
+    double x, y, tol = (argc>3) ? atof(argv[3]) : NUMCMP_TOL;
+    FILE *fa, *fb;
+
+    if (argc<3) {
+        fprintf(stderr, "Usage: %s file reference [tolerance]\n", argv[0]);
+        return 1;
+    }
+    fa = fopen(argv[1], "r");
+    fb = fopen(argv[2], "r");
+    if (fa==NULL || fb==NULL) {
+        fprintf(stderr, "Impossible to open <%s>\n", (fa==NULL) ? argv[1] : argv[2]);
+        return 1;
+    }
+
+    while (1) {
+        ra = numcmp_field(fa, a, sizeof(a), &sa);
+        rb = numcmp_field(fb, b, sizeof(b), &sb);
+        if (!ra && !rb) break;
+        if (ra!=rb || sa!=sb) {
+            fprintf(stderr, "Line %d: different fields <%s> and <%s>\n", line, a, b);
+            ndiff++;
+            break;
+        }
+        if (numcmp_number(a, &x) && numcmp_number(b, &y)) {
+            if (fabs(x-y) > tol*fmax(fabs(x), fabs(y))) {
+                fprintf(stderr, "Line %d: %s and %s differ by more than %g\n", line, a, b, tol);
+                ndiff++;
+            }
+        } else if (strcmp(a, b)!=0) {
+            fprintf(stderr, "Line %d: <%s> and <%s> differ\n", line, a, b);
+            ndiff++;
+        }
+        if (sa=='\n') line++;
+    }
+
+    fclose(fa);
+    fclose(fb);
+    return (ndiff>0);
+}
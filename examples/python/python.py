@@ -0,0 +1,50 @@
+#
+# Test of the Python extension: one system from arrays, the frequencies of a
+# hessian, and a batch of inputs computed by several threads.
+#
+# Usage: python3 python.py out inputdir
+#
+
+import sys
+from array import array
+import thermo
+
+out, inputdir = sys.argv[1], sys.argv[2]
+lines = []
+
+def row(name, res):
+    lines.append("%-20s F = %10.3f  S = %10.3f  ZPE = %10.3f" % (name, float(res["F"]), float(res["S"]), float(res["ZPE"])))
+
+# Water from arrays (used in place, no copies)
+inertia = array("d", [1.7704, 0.6169, 1.1535])
+freqs = array("d", [1635.618, 3849.420, 3974.869])
+row("water", thermo.compute(298.15, 0.0, 18.01528, volume=22.465, inertia=inertia, sigma=2, frequencies=freqs))
+
+# Frequencies of a hessian: copied, then in place
+hess = thermo.readhessian("ala6.hes")
+nu = thermo.frequencies(hess)
+nu2 = thermo.frequencies(hess, overwrite=True)
+lines.append("ala6 modes %d, lowest %.3f, highest %.3f, same in place %s" % (len(nu), nu[0], nu[-1], list(nu)==list(nu2)))
+row("ala6", thermo.compute(300.0, 0.0, 1.0, inertia=array("d", [1.0, 1.0, 1.0]), frequencies=nu))
+
+# Batch, with a broken input
+names = ["water/water.inp", "ethane/ethane.inp", "insulin/monomer.inp", "ala6/ala6.inp"]
+inputs = [open(inputdir + "/" + name).read() for name in names]
+inputs.append("temperature = 300\nvibrations = 2\n1.0\nnot a number\n")
+res, failed = thermo.compute_batch(inputs, jobs=3)
+for i, name in enumerate(names):
+    row(name, {k: v[i] for k, v in res.items()})
+lines.append("failed %s" % failed)
+
+# Errors
+try:
+    thermo.compute(300.0, 0.0, 1.0, frequencies=array("f", [1.0]))
+except TypeError as e:
+    lines.append("TypeError: %s" % e)
+try:
+    thermo.frequencies(array("d", [1.0]*10))
+except ValueError as e:
+    lines.append("ValueError: %s" % e)
+
+with open(out, "w") as fp:
+    fp.write("\n".join(lines) + "\n")
@@ -0,0 +1,101 @@
+#
+# Test of the server mode: start thermo --serve on a temporary socket, send
+# the records of examples/batch/batch.inp as pipelined requests, together
+# with FIELDS, an invalid record, a stray END and a request opened inside
+# another, and check the RESULT rows, matched by id, against the batch
+# reference. The checks and the error replies are written to out.
+#
+# Usage: python3 serve.py out thermo inputdir
+#
+
+import os
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+out, thermo, inputdir = sys.argv[1], sys.argv[2], sys.argv[3]
+batchdir = os.path.join(inputdir, "batch")
+lines = []
+
+# Records of the batch: files of the manifest, then inline records
+records = []
+with open(os.path.join(batchdir, "batch.inp")) as fp:
+    name = None
+    for row in fp:
+        if row.startswith("["):
+            name = row.strip()[1:-1]
+            records.append([name, ""])
+        elif name is not None:
+            records[-1][1] += row
+        elif row.strip() and not row.startswith("#"):
+            path = row.strip()
+            records.append([path, open(os.path.join(batchdir, path)).read()])
+
+# Reference rows, by id
+with open(os.path.join(batchdir, "batch.out.ref")) as fp:
+    header = fp.readline().rstrip("\n")
+    reference = {}
+    for row in fp:
+        reference[row.split(" ", 1)[0]] = row.rstrip("\n")
+
+tmpdir = tempfile.mkdtemp(prefix="thermo_serve")
+sock = os.path.join(tmpdir, "sock")
+server = subprocess.Popen([thermo, "--serve", sock, "--jobs", "3"], stderr=subprocess.DEVNULL)
+try:
+    for i in range(200):
+        if os.path.exists(sock):
+            break
+        time.sleep(0.05)
+    conn = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    conn.connect(sock)
+
+    # Everything at once: the replies come when they are ready
+    request = "FIELDS\n"
+    for name, text in records:
+        request += "BEGIN %s\n%sEND\n" % (name, text)
+    request += "BEGIN invalid\ntemperature = 300\nbogus = 1\nEND\n"
+    request += "END\n"
+    request += "BEGIN outer\ntemperature = 300\nBEGIN inner\nmass = 1\nEND\n"
+    conn.sendall(request.encode())
+    expected = 1 + len(records) + 1 + 1 + 2
+
+    data = b""
+    while data.count(b"\n") < expected:
+        chunk = conn.recv(65536)
+        if not chunk:
+            break
+        data += chunk
+    replies = data.decode().splitlines()
+
+    # QUIT closes the connection
+    conn.sendall(b"QUIT\n")
+    conn.settimeout(10)
+    lines.append("QUIT closes the connection: %s" % (conn.recv(1) == b""))
+    conn.close()
+    lines.append("Server alive: %s" % (server.poll() is None))
+finally:
+    server.send_signal(signal.SIGTERM)
+    server.wait(timeout=10)
+    shutil.rmtree(tmpdir, ignore_errors=True)
+
+lines.append("FIELDS as the batch header: %s" % (header in replies))
+results = {}
+errors = []
+for reply in replies:
+    if reply.startswith("RESULT "):
+        row = reply[len("RESULT "):]
+        results[row.split(" ", 1)[0]] = row
+    elif reply.startswith("ERROR "):
+        errors.append(reply)
+for name, text in records:
+    lines.append("RESULT %-32s %s" % (name, results.get(name) == reference.get(name)))
+for reply in sorted(errors):
+    lines.append(reply)
+lines.append("Server exit status: %d" % server.returncode)
+
+with open(out, "w") as fp:
+    fp.write("\n".join(lines) + "\n")
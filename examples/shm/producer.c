@@ -0,0 +1,85 @@
+
+/*
+    Test producer for the shared memory coupling of thermo (--shm).
+
+    Plays the part of a simulation engine: creates a ring, starts thermo on
+    it, pushes nsets sets of frequencies (those of ethane, scaled a little
+    differently at each step) without waiting, and finishes the ring. When
+    thermo is done, the results it published are read back and written to
+    out.
+
+    Usage: thermo_shmproducer out thermo input nsets
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <thermo.h>
+
+#define SHM_NAME  "thermo_shm_test"
+#define SHM_NMODE 18
+
+/* Frequencies of ethane [cm-1] */
+static const double shm_nu[SHM_NMODE] = {
+     418.626,  1116.970,  1117.234,  1170.320,  1375.370,  1375.383,
+    1600.686,  1661.098,  1661.105,  1671.246,  1680.101,  1680.108,
+    2920.897,  2938.218,  2949.950,  2950.374,  2982.908,  2983.305
+};
+
+int main(int argc, char *argv[]) {
+    int i, k, nsets, status;
+    double nu[SHM_NMODE];
+    pid_t pid;
+    FILE *fp;
+    ThermoShm S;
+    ThermoShmResults R;
+
+    if (argc!=5 || (nsets = atoi(argv[4]))<1) {
+        fprintf(stderr, "Usage: %s out thermo input nsets\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* A ring large enough for all sets, so that none is lost and the output is reproducible */
+    if (thermo_shm_create(&S, SHM_NAME, nsets, SHM_NMODE)!=EXIT_SUCCESS) return EXIT_FAILURE;
+
+    pid = fork();
+    if (pid<0) {
+        thermo_shm_close(&S);
+        return EXIT_FAILURE;
+    }
+    if (pid==0) {
+        execl(argv[2], argv[2], "-A", argv[3], "--shm", SHM_NAME, "-o", "thermo.out", (char *)NULL);
+        _exit(127);
+    }
+
+    for (k=0; k<nsets; k++) {
+        for (i=0; i<SHM_NMODE; i++) nu[i] = shm_nu[i]*(1.0+0.002*(k-nsets/2));
+        thermo_shm_push(&S, SHM_NMODE, nu, (k%2==0) ? 0.0 : 310.0);
+    }
+    thermo_shm_finish(&S);
+
+    if (waitpid(pid, &status, 0)!=pid || !WIFEXITED(status) || WEXITSTATUS(status)!=EXIT_SUCCESS ||
+            thermo_shm_results(&S, &R)!=EXIT_SUCCESS) {
+        fprintf(stderr, "thermo failed on the ring\n");
+        thermo_shm_close(&S);
+        return EXIT_FAILURE;
+    }
+    thermo_shm_close(&S);
+
+    fp = fopen(argv[1], "w");
+    if (fp==NULL) return EXIT_FAILURE;
+    fprintf(fp, "Sets computed:  %lu\n", (unsigned long)R.nsets);
+    fprintf(fp, "Sets lost:      %lu\n", (unsigned long)R.nlost);
+    fprintf(fp, "Last T [K]:     %.2f\n", R.T);
+    fprintf(fp, "                    last          mean            sd\n");
+    fprintf(fp, "F_vibqm  %14.6f %14.6f %14.6f\n", R.last[THERMO_F_VIBQM], R.mean[THERMO_F_VIBQM], R.sd[THERMO_F_VIBQM]);
+    fprintf(fp, "S_vibqm  %14.6f %14.6f %14.6f\n", R.last[THERMO_S_VIBQM], R.mean[THERMO_S_VIBQM], R.sd[THERMO_S_VIBQM]);
+    fprintf(fp, "F        %14.6f %14.6f %14.6f\n", R.last[THERMO_F], R.mean[THERMO_F], R.sd[THERMO_F]);
+    fprintf(fp, "S        %14.6f %14.6f %14.6f\n", R.last[THERMO_S], R.mean[THERMO_S], R.sd[THERMO_S]);
+    fclose(fp);
+    return EXIT_SUCCESS;
+}
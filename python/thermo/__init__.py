@@ -0,0 +1,80 @@
+"""
+Thermodynamic quantities from partition functions (Python interface of libthermo).
+
+Arrays are passed to the library without copies: frequencies, moments of
+inertia and hessians can be NumPy arrays of float64 (or anything exporting a
+contiguous buffer of doubles). Results are dictionaries mapping the THERMO_*
+names (without prefix, e.g. "F", "S_VIBQM") to NumPy arrays viewing a single
+results buffer: scalars (0-d arrays) for one system, one value per input for
+a batch. Without NumPy, memoryviews are returned instead.
+
+    import thermo
+    hess = thermo.readhessian("ala6.hes")
+    nu = thermo.frequencies(hess)
+    res = thermo.compute(298.15, 0.0, 18.01528, volume=24.5, inertia=I, sigma=2, frequencies=nu)
+    res["F"]
+
+Copyright (C) 2019 Simone Conti
+"""
+
+from ._thermo import ThermoError, names, LAST, version
+from . import _thermo
+
+try:
+    import numpy as _np
+except ImportError:
+    _np = None
+
+__all__ = ["ThermoError", "names", "compute", "compute_batch", "frequencies", "readhessian"]
+
+
+def _doubles(buf):
+    """View a bytearray of float64 as a NumPy array (or a memoryview)"""
+    if _np is not None:
+        return _np.frombuffer(buf, dtype=_np.float64)
+    return memoryview(buf).cast("d")
+
+
+def _keyed(res, n=None):
+    """Map the THERMO_* names to the values (or columns) of res"""
+    if n is None:
+        if _np is not None:
+            return {names[i]: res[i:i+1].reshape(()) for i in range(1, LAST)}
+        return {names[i]: res[i] for i in range(1, LAST)}
+    if _np is not None:
+        res = res.reshape(n, LAST)
+        return {names[i]: res[:, i] for i in range(1, LAST)}
+    return {names[i]: res[i::LAST] for i in range(1, LAST)}
+
+
+def compute(temperature, energy, mass, **kw):
+    """
+    Thermodynamic quantities of one system. Keywords: volume [dm^3], nmoles,
+    translations, inertia [g/mol A^2], sigma, frequencies [cm-1], solvent,
+    solute_volume, rgyr, asa.
+    """
+    return _keyed(_doubles(_thermo.compute(temperature, energy, mass, **kw)))
+
+
+def compute_batch(inputs, jobs=1):
+    """
+    Thermodynamic quantities of many thermo inputs (str or bytes, in the
+    format of the input files), computed by jobs threads. Return the results
+    (NaN for failed inputs) and the list of the indices of the failed inputs.
+    """
+    inputs = list(inputs)
+    res, failed = _thermo.compute_batch(inputs, jobs)
+    return _keyed(_doubles(res), len(inputs)), failed
+
+
+def frequencies(hessian, translations=3, rotations=3, overwrite=False):
+    """
+    Vibrational frequencies [cm-1] of a hessian of (3 natoms)^2 doubles. With
+    overwrite, the hessian is diagonalized in place (and destroyed).
+    """
+    return _doubles(_thermo.frequencies(hessian, translations, rotations, overwrite))
+
+
+def readhessian(fname):
+    """Hessian of a file, as an array of (3 natoms)^2 doubles"""
+    return _doubles(_thermo.readhessian(fname))
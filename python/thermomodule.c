@@ -0,0 +1,391 @@
+
+/*
+    Python extension of libthermo (module thermo._thermo).
+
+    Arrays (frequencies, moments of inertia, hessians) are taken through the
+    buffer protocol, so that NumPy arrays of float64 (or array.array('d'),
+    memoryviews...) are used in place, without copies. The GIL is released
+    while computing, and results are returned as bytearrays of THERMO_LAST
+    doubles per system, which the thermo package wraps, again without
+    copies, in NumPy arrays keyed by the THERMO_* names.
+
+    Each call computes under its own context: the log is discarded and the
+    first error message becomes the message of the exception.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <cygtools.h>
+#include <thermo.h>
+
+static PyObject *ThermoError = NULL;
+static FILE *module_null = NULL;    /* Sink of the log */
+
+/* Context of a call, with room for its last error message */
+typedef struct {
+    ThermoContext ctx;
+    char msg[1024];
+} ModuleContext;
+
+/* Keep the first error message (the cause of the others), without the position in the source */
+static void module_error(void *data, const char *msg) {
+    ModuleContext *m = data;
+    const char *p = strstr(msg, "ERROR!! ");
+    if (m->msg[0]!='\0') return;
+    p = (p!=NULL) ? p+8 : msg;
+    if (strncmp(p, "Assert failed!", 14)==0 && strchr(p, '\n')!=NULL) p = strchr(p, '\n')+1;
+    snprintf(m->msg, sizeof(m->msg), "%s", p);
+    m->msg[strcspn(m->msg, "\n")] = '\0';
+}
+
+static void module_context(ModuleContext *m) {
+    thermo_context_init(&(m->ctx));
+    m->ctx.out   = module_null;
+    m->ctx.error = module_error;
+    m->ctx.data  = m;
+    m->msg[0]    = '\0';
+}
+
+static PyObject *module_raise(const ModuleContext *m) {
+    PyErr_SetString(ThermoError, (m->msg[0]!='\0') ? m->msg : "Unknown error");
+    return NULL;
+}
+
+/*
+    Get a C contiguous buffer of doubles from obj (None for none). With
+    writable, the buffer must be writable. Set its length in n.
+*/
+static int module_getdoubles(PyObject *obj, Py_buffer *view, bool writable, int *n, const char *what) {
+    view->obj = NULL;
+    view->buf = NULL;
+    *n = 0;
+    if (obj==NULL || obj==Py_None) return 0;
+    if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS|PyBUF_FORMAT|(writable ? PyBUF_WRITABLE : 0))!=0) return -1;
+    if (view->itemsize!=8 || view->format==NULL ||
+        !(strcmp(view->format, "d")==0 || strcmp(view->format, "<d")==0 || strcmp(view->format, "=d")==0)) {
+        PyBuffer_Release(view);
+        PyErr_Format(PyExc_TypeError, "%s must be a contiguous array of float64", what);
+        return -1;
+    }
+    if (view->len/8>INT_MAX) {
+        PyBuffer_Release(view);
+        PyErr_Format(PyExc_ValueError, "%s is too large", what);
+        return -1;
+    }
+    *n = (int)(view->len/8);
+    return 0;
+}
+
+static void module_release(Py_buffer *view) {
+    if (view->obj!=NULL) PyBuffer_Release(view);
+}
+
+/* compute(temperature, energy, mass, ...): results vector of one system */
+static PyObject *module_compute(PyObject *self, PyObject *args, PyObject *kw) {
+    static char *kwlist[] = {"temperature", "energy", "mass", "volume", "nmoles", "translations", "inertia",
+        "sigma", "frequencies", "solvent", "solute_volume", "rgyr", "asa", NULL};
+    double T, E, mass, volume = 1.0, nmoles = 1.0, sigma = 1.0, solute_volume = NAN, rgyr = NAN, asa = NAN;
+    double *res = NULL;
+    int ntr = 3, nrot, nvib, id;
+    PyObject *inertia = NULL, *freqs = NULL, *out;
+    const char *solvent = NULL;
+    char name[32];
+    ThermoSolvent S = { "", NAN, NAN, NAN, NAN, NAN, NAN, NAN, NAN };
+    Py_buffer vI, vnu;
+    ModuleContext m;
+    (void)self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "ddd|ddiOdOzddd", kwlist, &T, &E, &mass, &volume, &nmoles, &ntr,
+        &inertia, &sigma, &freqs, &solvent, &solute_volume, &rgyr, &asa)) return NULL;
+    if (solvent!=NULL) {
+        snprintf(name, sizeof(name), "%s", solvent);
+        id = thermo_get_solvent_from_name(name);
+        if (id<0) return PyErr_Format(PyExc_ValueError, "Unknown solvent <%s>", solvent);
+        S = thermo_get_solvent_from_id(id);
+    }
+    if (module_getdoubles(inertia, &vI, false, &nrot, "inertia")!=0) return NULL;
+    if (module_getdoubles(freqs, &vnu, false, &nvib, "frequencies")!=0) {
+        module_release(&vI);
+        return NULL;
+    }
+
+    out = PyByteArray_FromStringAndSize(NULL, THERMO_LAST*sizeof(double));
+    module_context(&m);
+    if (out!=NULL) {
+        Py_BEGIN_ALLOW_THREADS
+        thermo_context_set(&(m.ctx));
+        res = thermo_compute(T, E, ntr, mass, volume, nmoles, nrot, vI.buf, sigma, nvib, vnu.buf,
+            solute_volume, S.vvdw, S.mass, S.density, S.acentricity, S.permittivity, S.expansion,
+            rgyr, S.rgyr, asa, S.bbox);
+        if (res!=NULL) memcpy(PyByteArray_AS_STRING(out), res, THERMO_LAST*sizeof(double));
+        thermo_free(res);
+        thermo_context_set(NULL);
+        Py_END_ALLOW_THREADS
+    }
+    module_release(&vI);
+    module_release(&vnu);
+    if (out!=NULL && res==NULL) {
+        Py_DECREF(out);
+        return module_raise(&m);
+    }
+    return out;
+}
+
+/*
+    frequencies(hessian, translations=3, rotations=3, overwrite=False):
+    vibrational frequencies of a (3 natoms)^2 hessian in kcal/mol/A^2/amu.
+    The hessian is diagonalized in place with overwrite, else in a copy.
+*/
+static PyObject *module_frequencies(PyObject *self, PyObject *args, PyObject *kw) {
+    static char *kwlist[] = {"hessian", "translations", "rotations", "overwrite", NULL};
+    PyObject *hess, *out = NULL;
+    int ntr = 3, nrot = 3, overwrite = 0, n, nat3, ret = E_FAILURE;
+    Py_buffer vh;
+    Thermo A;
+    ModuleContext m;
+    (void)self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O|iip", kwlist, &hess, &ntr, &nrot, &overwrite)) return NULL;
+    if (module_getdoubles(hess, &vh, overwrite, &n, "hessian")!=0) return NULL;
+    nat3 = (int)lrint(sqrt((double)n));
+    if (nat3*nat3!=n || nat3%3!=0 || nat3<=ntr+nrot) {
+        module_release(&vh);
+        return PyErr_Format(PyExc_ValueError, "The hessian must be a (3 natoms)^2 matrix, with natoms large enough");
+    }
+
+    module_context(&m);
+    thermo_init(&A);
+    A.t = ntr;
+    A.r = nrot;
+    A.natoms = nat3/3;
+    Py_BEGIN_ALLOW_THREADS
+    thermo_context_set(&(m.ctx));
+    if (overwrite) {
+        A.hessian = vh.buf;
+    } else if ((A.hessian = thermo_realloc(NULL, (size_t)n*sizeof(double)))!=NULL) {
+        memcpy(A.hessian, vh.buf, (size_t)n*sizeof(double));
+    }
+    if (A.hessian!=NULL) ret = thermo_calcfreqs(&A);
+    if (overwrite) A.hessian = NULL;
+    thermo_context_set(NULL);
+    Py_END_ALLOW_THREADS
+    module_release(&vh);
+
+    if (ret==E_SUCCESS) out = PyByteArray_FromStringAndSize((const char *)A.nu, (Py_ssize_t)A.v*(Py_ssize_t)sizeof(double));
+    thermo_context_set(&(m.ctx));
+    thermo_delete(&A);
+    thermo_context_set(NULL);
+    return (ret==E_SUCCESS) ? out : module_raise(&m);
+}
+
+/* readhessian(fname): the hessian of a file, as a bytearray of (3 natoms)^2 doubles */
+static PyObject *module_readhessian(PyObject *self, PyObject *args) {
+    const char *fname;
+    PyObject *out = NULL;
+    int ret;
+    Thermo A;
+    ModuleContext m;
+    (void)self;
+
+    if (!PyArg_ParseTuple(args, "s", &fname)) return NULL;
+    module_context(&m);
+    thermo_init(&A);
+    A.hessfile = thermo_realloc(NULL, strlen(fname)+1);
+    if (A.hessfile==NULL) return PyErr_NoMemory();
+    strcpy(A.hessfile, fname);
+    Py_BEGIN_ALLOW_THREADS
+    thermo_context_set(&(m.ctx));
+    ret = thermo_readhessian(&A);
+    thermo_context_set(NULL);
+    Py_END_ALLOW_THREADS
+    if (ret==E_SUCCESS) {
+        out = PyByteArray_FromStringAndSize((const char *)A.hessian, (Py_ssize_t)A.natoms*A.natoms*9*(Py_ssize_t)sizeof(double));
+    }
+    thermo_delete(&A);
+    return (ret==E_SUCCESS) ? out : module_raise(&m);
+}
+
+/* A batch computed by several threads */
+typedef struct {
+    int n;
+    const char **text;
+    size_t *len;
+    double *res;
+    int *status;
+    int next;               /* Next record to compute */
+#ifdef HAVE_THREADS
+    pthread_mutex_t lock;
+#endif
+} ModuleBatch;
+
+static void *module_worker(void *arg) {
+    ModuleBatch *B = arg;
+    ModuleContext m;
+    double *res;
+    int i, k;
+    module_context(&m);
+    for (;;) {
+#ifdef HAVE_THREADS
+        pthread_mutex_lock(&(B->lock));
+#endif
+        i = B->next++;
+#ifdef HAVE_THREADS
+        pthread_mutex_unlock(&(B->lock));
+#endif
+        if (i>=B->n) break;
+        res = B->res + (size_t)i*THERMO_LAST;
+        B->status[i] = thermo_compute_into(&(m.ctx), B->text[i], B->len[i], res);
+        if (B->status[i]!=E_SUCCESS) {
+            for (k=0; k<THERMO_LAST; k++) res[k] = NAN;
+        }
+    }
+    return NULL;
+}
+
+/*
+    compute_batch(inputs, jobs=1): results of a sequence of thermo inputs
+    (str or bytes, in the format of the input files), computed by jobs
+    threads. Return the bytearray of the results (NaN for failed inputs) and
+    the list of the inputs which failed.
+*/
+static PyObject *module_compute_batch(PyObject *self, PyObject *args, PyObject *kw) {
+    static char *kwlist[] = {"inputs", "jobs", NULL};
+    PyObject *seq, *tuple, *item, *out, *failed, *ret;
+    int jobs = 1, i;
+    Py_ssize_t len;
+    ModuleBatch B;
+    (void)self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O|i", kwlist, &seq, &jobs)) return NULL;
+    if (jobs<1) return PyErr_Format(PyExc_ValueError, "The number of jobs must be positive");
+    tuple = PySequence_Tuple(seq);
+    if (tuple==NULL) return NULL;
+    if (PyTuple_GET_SIZE(tuple)>INT_MAX/THERMO_LAST) {
+        Py_DECREF(tuple);
+        return PyErr_Format(PyExc_ValueError, "Too many inputs");
+    }
+
+    memset(&B, 0, sizeof(B));
+    B.n      = (int)PyTuple_GET_SIZE(tuple);
+    B.text   = PyMem_Calloc((size_t)B.n+1, sizeof(char *));
+    B.len    = PyMem_Calloc((size_t)B.n+1, sizeof(size_t));
+    B.status = PyMem_Calloc((size_t)B.n+1, sizeof(int));
+    out = PyByteArray_FromStringAndSize(NULL, (Py_ssize_t)B.n*THERMO_LAST*(Py_ssize_t)sizeof(double));
+    if (B.text==NULL || B.len==NULL || B.status==NULL || out==NULL) goto fail;
+    B.res = (double *)(void *)PyByteArray_AS_STRING(out);
+    for (i=0; i<B.n; i++) {
+        item = PyTuple_GET_ITEM(tuple, i);
+        if (PyUnicode_Check(item)) {
+            B.text[i] = PyUnicode_AsUTF8AndSize(item, &len);
+        } else if (PyBytes_Check(item)) {
+            B.text[i] = PyBytes_AS_STRING(item);
+            len = PyBytes_GET_SIZE(item);
+        } else {
+            PyErr_Format(PyExc_TypeError, "Input %d is neither str nor bytes", i);
+            goto fail;
+        }
+        if (B.text[i]==NULL) goto fail;
+        B.len[i] = (size_t)len;
+    }
+
+    if (jobs>B.n) jobs = (B.n>0) ? B.n : 1;
+    Py_BEGIN_ALLOW_THREADS
+#ifdef HAVE_THREADS
+    pthread_t *tid = PyMem_RawCalloc((size_t)jobs, sizeof(pthread_t));
+    pthread_mutex_init(&(B.lock), NULL);
+    for (i=1; tid!=NULL && i<jobs; i++) {
+        if (pthread_create(tid+i, NULL, module_worker, &B)!=0) break;
+    }
+    module_worker(&B);
+    while (tid!=NULL && --i>0) pthread_join(tid[i], NULL);
+    pthread_mutex_destroy(&(B.lock));
+    PyMem_RawFree(tid);
+#else
+    module_worker(&B);
+#endif
+    Py_END_ALLOW_THREADS
+
+    failed = PyList_New(0);
+    if (failed==NULL) goto fail;
+    for (i=0; i<B.n; i++) {
+        if (B.status[i]!=E_SUCCESS) {
+            item = PyLong_FromLong(i);
+            if (item==NULL || PyList_Append(failed, item)!=0) {
+                Py_XDECREF(item);
+                Py_DECREF(failed);
+                goto fail;
+            }
+            Py_DECREF(item);
+        }
+    }
+    ret = Py_BuildValue("(NN)", out, failed);
+    out = NULL;
+    goto done;
+
+fail:
+    ret = NULL;
+done:
+    Py_XDECREF(out);
+    Py_DECREF(tuple);
+    PyMem_Free(B.text);
+    PyMem_Free(B.len);
+    PyMem_Free(B.status);
+    return ret;
+}
+
+static PyMethodDef module_methods[] = {
+    {"compute", (PyCFunction)(void (*)(void))module_compute, METH_VARARGS|METH_KEYWORDS,
+        "compute(temperature, energy, mass, volume=1, nmoles=1, translations=3, inertia=None, sigma=1,\n"
+        "        frequencies=None, solvent=None, solute_volume=nan, rgyr=nan, asa=nan)\n"
+        "Results vector of one system, as a bytearray of float64."},
+    {"frequencies", (PyCFunction)(void (*)(void))module_frequencies, METH_VARARGS|METH_KEYWORDS,
+        "frequencies(hessian, translations=3, rotations=3, overwrite=False)\n"
+        "Vibrational frequencies [cm-1] of a hessian, as a bytearray of float64."},
+    {"readhessian", (PyCFunction)module_readhessian, METH_VARARGS,
+        "readhessian(fname)\nHessian read from a file, as a bytearray of float64."},
+    {"compute_batch", (PyCFunction)(void (*)(void))module_compute_batch, METH_VARARGS|METH_KEYWORDS,
+        "compute_batch(inputs, jobs=1)\n"
+        "Results of many thermo inputs (one row each) and the list of those failed."},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef module_def = {
+    PyModuleDef_HEAD_INIT, "_thermo", "Thermodynamic quantities from partition functions (libthermo).",
+    -1, module_methods, NULL, NULL, NULL, NULL
+};
+
+PyMODINIT_FUNC PyInit__thermo(void);
+
+PyMODINIT_FUNC
+PyInit__thermo(void)
+{
+    int i;
+    PyObject *mod, *names;
+
+    if (module_null==NULL) module_null = fopen("/dev/null", "w");
+    if (module_null==NULL) return PyErr_SetFromErrno(PyExc_OSError);
+    mod = PyModule_Create(&module_def);
+    if (mod==NULL) return NULL;
+
+    ThermoError = PyErr_NewException("thermo.ThermoError", PyExc_RuntimeError, NULL);
+    names = PyTuple_New(THERMO_LAST);
+    if (ThermoError==NULL || names==NULL) goto fail;
+    for (i=0; i<THERMO_LAST; i++) {
+        PyObject *name = PyUnicode_FromString((i==THERMO_FIRST) ? "FIRST" : thermo_name(i));
+        if (name==NULL) goto fail;
+        PyTuple_SET_ITEM(names, i, name);
+    }
+    Py_INCREF(ThermoError);
+    if (PyModule_AddObject(mod, "ThermoError", ThermoError)!=0 ||
+        PyModule_AddObject(mod, "names", names)!=0 ||
+        PyModule_AddIntConstant(mod, "LAST", THERMO_LAST)!=0 ||
+        PyModule_AddStringConstant(mod, "version", GIT_VERSION)!=0) goto fail;
+    return mod;
+
+fail:
+    Py_XDECREF(names);
+    Py_DECREF(mod);
+    return NULL;
+}
@@ -0,0 +1,574 @@
+
+/*
+    Batch mode: read many thermo records from a single container file and
+    compute all of them in the same process.
+
+    The container file can list thermo input files, one per line (a manifest),
+    and/or contain inline records. An inline record starts with a line
+    "[name]" and is followed by the usual key = value lines, up to the next
+    "[name]" line or the end of the file. Files listed in the manifest must
+    come before the first inline record. Relative paths in the manifest are
+    taken relative to the directory of the container file.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+#include <thermoint.h>
+#include <unistd.h>
+
+
+/* Remove trailing spaces and new lines */
+static void batch_rstrip(char *str) {
+    size_t l = strlen(str);
+    while (l>0 && strchr(" \t\r\n", str[l-1])!=NULL) str[--l] = '\0';
+}
+
+/* Append a new empty record to the batch */
+static ThermoRecord *batch_addrecord(ThermoBatch *B) {
+    ThermoRecord *rec = cyg_malloc(B->rec, (B->nrec+1)*cyg_sizeof(ThermoRecord));
+    cyg_assert(rec!=NULL, NULL, "Memory allocation failed!");
+    B->rec = rec;
+    rec = B->rec + B->nrec;
+    B->nrec++;
+    rec->name = NULL;
+    rec->path = NULL;
+    rec->text = NULL;
+    rec->len  = 0;
+    return rec;
+}
+
+/* Append one line to the text of an inline record */
+static int batch_addline(ThermoRecord *rec, const char *row, size_t *size) {
+    size_t l = strlen(row);
+    if (rec->len+l+1 > *size) {
+        while (rec->len+l+1 > *size) *size = (*size>0) ? 2*(*size) : 1024;
+        char *text = realloc(rec->text, *size);
+        cyg_assert(text!=NULL, E_FAILURE, "Memory allocation failed!");
+        rec->text = text;
+    }
+    memcpy(rec->text+rec->len, row, l+1);
+    rec->len += l;
+    return E_SUCCESS;
+}
+
+/*
+    Return a newly allocated path for fname: if fname is relative, it is taken
+    relative to the directory of the file base.
+*/
+char *
+thermo_resolvepath(const char *base, const char *fname)
+{
+    char *path;
+    const char *end = strrchr(base, '/');
+    size_t ldir = (end==NULL) ? 0 : (size_t)(end-base)+1;
+    if (fname[0]=='/' || ldir==0) return strdup(fname);
+    path = malloc(ldir+strlen(fname)+1);
+    cyg_assert(path!=NULL, NULL, "Memory allocation failed!");
+    memcpy(path, base, ldir);
+    strcpy(path+ldir, fname);
+    return path;
+}
+
+/* Read a batch container file */
+int
+thermo_readbatch(ThermoBatch *B, const char *fname)
+{
+    char *row=NULL, *end;
+    ThermoRecord *rec, *inl=NULL;
+    size_t size=0, rowsize=0;
+    FILE *fp;
+
+    B->nrec = 0;
+    B->rec  = NULL;
+
+    fp = cyg_fopen(fname, "r");
+    cyg_assert(fp!=NULL, E_FAILURE, "Error opening batch file.");
+
+    while (cyg_getline(&row, &rowsize, fp) != -1) {
+
+        /* Start of a new inline record */
+        if (row[0]=='[' && (end=strchr(row, ']'))!=NULL) {
+            *end = '\0';
+            inl = batch_addrecord(B);
+            cyg_assert(inl!=NULL, E_FAILURE, "Impossible to add record <%s>", row+1);
+            inl->name = strdup(row+1);
+            size = 0;
+            continue;
+        }
+
+        /* Body of an inline record */
+        if (inl!=NULL) {
+            cyg_assert(batch_addline(inl, row, &size)==E_SUCCESS, E_FAILURE, "Impossible to read record <%s>", inl->name);
+            continue;
+        }
+
+        /* Manifest entry: skip empty or comment lines */
+        if (cyg_isstrempty(row, "# \n\r\t\0")) continue;
+        batch_rstrip(row);
+        rec = batch_addrecord(B);
+        cyg_assert(rec!=NULL, E_FAILURE, "Impossible to add record <%s>", row);
+        rec->name = strdup(row);
+        rec->path = thermo_resolvepath(fname, row);
+        cyg_assert(rec->path!=NULL, E_FAILURE, "Impossible to add record <%s>", row);
+    }
+
+    fclose(fp);
+    free(row);
+    return E_SUCCESS;
+}
+
+/* Parse one record of a batch */
+int
+thermo_readrecord(Thermo *A, const ThermoRecord *rec)
+{
+    if (rec->path!=NULL) {
+        return thermo_readthermo(A, rec->path);
+    }
+    return thermo_readthermo_buf(A, rec->text, rec->len);
+}
+
+/* Parse and compute one record (in A, already initialized) */
+int
+thermo_computerecord(Thermo *A, const ThermoRecord *rec)
+{
+    int ret;
+    if (thermo_cache_enabled()) return thermo_cache_computerecord(A, rec);
+    ret = thermo_readrecord(A, rec);
+    cyg_assert(ret==E_SUCCESS, E_FAILURE, "Failing reading record <%s>", rec->name);
+    if (A->hessfile) {
+        ret = thermo_readhessian(A);
+        cyg_assert(ret==E_SUCCESS, E_FAILURE, "Failing reading hessian of record <%s>", rec->name);
+        ret = thermo_calcfreqs(A);
+        cyg_assert(ret==E_SUCCESS, E_FAILURE, "Failing calculating frequencies of record <%s>", rec->name);
+    }
+    if (A->qhfile) {
+        ret = thermo_quasiharmonic(A);
+        cyg_assert(ret==E_SUCCESS, E_FAILURE, "Failing the quasi-harmonic analysis of record <%s>", rec->name);
+    }
+    thermo_calcthermo(A);
+    cyg_assert(A->results!=NULL, E_FAILURE, "Failing computing record <%s>", rec->name);
+    return E_SUCCESS;
+}
+
+/* Error callback discarding the messages of a failed estimate */
+static void batch_quiet(void *data, const char *msg) {
+    (void) data;
+    (void) msg;
+}
+
+/* Number of values of a "key = n" or "key = file:name" value, 0 if unknown */
+static int batch_count(const char *val) {
+    char fname[256];
+    int n = 0;
+    if (sscanf(val, " file:%255s", fname)==1) {
+        if (thermo_arraylen(fname, &n)!=E_SUCCESS) n = 0;
+    } else if (sscanf(val, "%d", &n)!=1) {
+        n = 0;
+    }
+    return (n>0) ? n : 0;
+}
+
+/* Cost of diagonalizing the hessian in the file of val: (3 natoms)^3 */
+static double batch_hesscost(const char *val) {
+    char hessfile[128];
+    int nat;
+    double cost = 0.0;
+    FILE *fp;
+    if (sscanf(val, "%127s", hessfile)!=1 || (fp = fopen(hessfile, "r"))==NULL) return cost;
+    if (fscanf(fp, "%d", &nat)==1 && nat>0) cost = pow(3.0*nat, 3.0);
+    fclose(fp);
+    return cost;
+}
+
+/*
+    Cost of a quasi-harmonic analysis from the header of its trajectory (val
+    is the value of the key): nframes (3 natoms)^2 to accumulate the
+    covariance and (3 natoms)^3 to diagonalize it. Zero if the trajectory
+    cannot be opened.
+*/
+static double batch_qhcost(const char *val) {
+    char trajfile[256], massfile[256];
+    const char *opt;
+    int natoms = 0;
+    double *mass = NULL, cost = 0.0, n;
+    ThermoMap massmap = { NULL, 0 };
+    ThermoTraj T;
+
+    if (sscanf(val, "%255s", trajfile)!=1) return cost;
+    if ((opt = strstr(val, " masses "))!=NULL && sscanf(opt, " masses %255s", massfile)==1) {
+        mass = thermo_readarray(massfile, &natoms, false, &massmap);
+    }
+    if (thermo_traj_open(&T, trajfile, natoms)==E_SUCCESS) {
+        n = 3.0*T.natoms;
+        cost = (double)((T.nframes>0) ? T.nframes : 1)*n*n + n*n*n;
+        thermo_traj_close(&T);
+    }
+    thermo_freearray(mass, &massmap);
+    return cost;
+}
+
+/*
+    Cost of a record: with ensemble, also the sum of the costs of the
+    conformers of its ensemble, whose own ensembles are not followed
+*/
+static double batch_cost(const ThermoRecord *rec, bool ensemble) {
+    char *row=NULL, *key, *val, *saveptr, ensfile[256];
+    const char *name;
+    int i, k;
+    size_t rowsize=0;
+    double cost = 1.0;
+    ThermoBatch B;
+    ThermoContext quiet = *thermo_context(), *old;
+    FILE *fp;
+
+    if (rec->path!=NULL) {
+        fp = fopen(rec->path, "r");
+    } else if (rec->len>0) {
+        fp = fmemopen(rec->text, rec->len, "r");
+    } else {
+        return cost;
+    }
+    if (fp==NULL) return cost;
+
+    quiet.error = batch_quiet;
+    old = thermo_context_set(&quiet);
+    while (cyg_getline(&row, &rowsize, fp) != -1) {
+        if (strchr("# \n\r\t", row[0])!=NULL) continue;
+        key = strtok_r(row, "=", &saveptr);
+        val = strtok_r(NULL, "=", &saveptr);
+        if (key==NULL || val==NULL || (k = thermo_findkeyword(key))<0) continue;
+        name = thermo_keyword(k);
+        if (strcmp(name, "vibrations")==0) {
+            cost += batch_count(val);
+        } else if (strcmp(name, "dos")==0) {
+            /* A file holds (frequency, weight) pairs */
+            cost += (strncmp(val+strspn(val, " \t"), "file:", 5)==0) ? batch_count(val)/2 : batch_count(val);
+        } else if (strcmp(name, "hessian")==0) {
+            cost += batch_hesscost(val);
+        } else if (strcmp(name, "quasiharmonic")==0) {
+            cost += batch_qhcost(val);
+        } else if (strcmp(name, "ensemble")==0 && ensemble && sscanf(val, "%255s", ensfile)==1) {
+            /* One full calculation per conformer */
+            if (thermo_readbatch(&B, ensfile)!=E_SUCCESS) continue;
+            for (i=0; i<B.nrec; i++) {
+                cost += batch_cost(B.rec+i, false);
+            }
+            thermo_deletebatch(&B);
+        }
+    }
+    thermo_context_set(old);
+
+    fclose(fp);
+    free(row);
+    return cost;
+}
+
+/*
+    Estimate the cost of a record from its keys, split and matched as the
+    reader does, with the files they name opened as the reader does (from
+    the working directory): (3 natoms)^3 for a hessian, nframes (3 natoms)^2
+    + (3 natoms)^3 for a quasi-harmonic analysis, the number of vibrations
+    or of points of the density of states (also from the header or size of
+    their file) otherwise, plus the costs of the conformers of an ensemble.
+    Only the headers of the files are read, and their errors are left to the
+    computation.
+*/
+double
+thermo_recordcost(const ThermoRecord *rec)
+{
+    return batch_cost(rec, true);
+}
+
+/* Where and how the records are written */
+typedef struct {
+    const ThermoOutput *O;
+    ThermoWriter *w;
+    ThermoResults *R;       /* Results file, for the binary format */
+    int first;              /* Index in the batch of the first record computed */
+    ThermoJournal *J;       /* Restart journal, if any */
+} BatchOutput;
+
+/* Write record i, given its results (NULL if failed) */
+static void batch_output(BatchOutput *out, const ThermoRecord *rec, int i, const Thermo *A, uint64_t key, int status) {
+    if (out->R!=NULL) {
+        thermo_results_put(out->R, out->first+i, A->T, key, (status==E_SUCCESS) ? A->results : NULL);
+    } else if (status==E_SUCCESS) {
+        thermo_output_record(out->O, out->w, rec->name, A->results);
+    }
+    if (status!=E_SUCCESS) fprintf(stderr, "Skipping record <%s>\n", rec->name);
+}
+
+/* Setup a Thermo structure, compute one record, and write it */
+static int batch_runrecord(const ThermoBatch *B, int i, double dnu, BatchOutput *out) {
+    int ret;
+    Thermo A;
+    thermo_init(&A);
+    A.dnu   = dnu;
+    A.nu_np = (int)lrint(ceil(4000.0/dnu));
+    ret = thermo_computerecord(&A, B->rec+i);
+    batch_output(out, B->rec+i, i, &A, (out->R!=NULL) ? thermo_arraykey(thermo_recordkey(B->rec+i, A.hessfile), &A) : 0, ret);
+    thermo_delete(&A);
+    return ret;
+}
+
+#ifdef HAVE_THREADS
+
+/* State shared by all workers of a parallel batch */
+typedef struct {
+    const ThermoBatch *B;
+    const ThermoOutput *O;
+    ThermoResults *R;
+    int first;
+    double dnu;
+    ThermoWriter *w;        /* Writer of each worker, on its output buffer */
+    FILE  **buf;            /* Output buffer of each worker */
+    char  **bufptr;         /* Memory of the output buffer of each worker */
+    size_t *bufsize;        /* Size of the output buffer of each worker */
+    char  **row;            /* Output of each record, ready to be merged */
+    int    *status;         /* Status of each record: -1 running, else return code */
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} BatchJobs;
+
+/* Record with its estimated cost, for sorting */
+typedef struct {
+    double cost;
+    int id;
+} BatchCost;
+
+/* Sort records by decreasing cost, then by input order */
+static int batch_cmpcost(const void *a, const void *b) {
+    const BatchCost *ca = a, *cb = b;
+    if (ca->cost > cb->cost) return -1;
+    if (ca->cost < cb->cost) return  1;
+    return ca->id - cb->id;
+}
+
+/* Compute one record in a worker */
+static void batch_task(int i, int worker, void *data) {
+    BatchJobs *J = data;
+    FILE *fp = J->buf[worker];
+    BatchOutput out = { J->O, J->w+worker, J->R, J->first, NULL };
+    long len;
+    char *row;
+    int ret;
+
+    fpout = stderr;
+    rewind(fp);
+    ret = batch_runrecord(J->B, i, J->dnu, &out);
+    thermo_writer_flush(J->w+worker);
+    fflush(fp);
+    len = ftell(fp);
+    row = malloc((size_t)len+1);
+    if (row!=NULL) {
+        memcpy(row, J->bufptr[worker], (size_t)len);
+        row[len] = '\0';
+    } else {
+        ret = E_FAILURE;
+    }
+
+    pthread_mutex_lock(&J->lock);
+    J->row[i]    = row;
+    J->status[i] = ret;
+    pthread_cond_broadcast(&J->cond);
+    pthread_mutex_unlock(&J->lock);
+}
+
+/* Compute all records on njobs threads, largest first, and write them in input order */
+static int batch_runparallel(const ThermoBatch *B, double dnu, int njobs, const BatchOutput *bout, FILE *out) {
+    int i, nfail=0;
+    int *order;
+    BatchCost *cost;
+    BatchJobs J;
+    ThermoPool *pool;
+
+    /* Schedule the most expensive records first */
+    cost  = cyg_malloc(NULL, B->nrec*cyg_sizeof(BatchCost));
+    order = cyg_malloc(NULL, B->nrec*cyg_sizeof(int));
+    cyg_assert(cost!=NULL && order!=NULL, B->nrec, "Memory allocation failed!");
+    for (i=0; i<B->nrec; i++) {
+        cost[i].cost = thermo_recordcost(B->rec+i);
+        cost[i].id   = i;
+    }
+    qsort(cost, (size_t)B->nrec, sizeof(BatchCost), batch_cmpcost);
+    for (i=0; i<B->nrec; i++) order[i] = cost[i].id;
+    free(cost);
+
+    /* Per-worker output buffers and per-record results */
+    J.B       = B;
+    J.O       = bout->O;
+    J.R       = bout->R;
+    J.first   = bout->first;
+    J.dnu     = dnu;
+    J.w       = cyg_malloc(NULL, njobs*cyg_sizeof(ThermoWriter));
+    J.buf     = cyg_malloc(NULL, njobs*cyg_sizeof(FILE *));
+    J.bufptr  = cyg_malloc(NULL, njobs*cyg_sizeof(char *));
+    J.bufsize = cyg_malloc(NULL, njobs*cyg_sizeof(size_t));
+    J.row     = cyg_malloc(NULL, B->nrec*cyg_sizeof(char *));
+    J.status  = cyg_malloc(NULL, B->nrec*cyg_sizeof(int));
+    cyg_assert(J.w!=NULL && J.buf!=NULL && J.bufptr!=NULL && J.bufsize!=NULL && J.row!=NULL && J.status!=NULL,
+        B->nrec, "Memory allocation failed!");
+    for (i=0; i<njobs; i++) {
+        J.bufptr[i] = NULL;
+        J.buf[i] = open_memstream(J.bufptr+i, J.bufsize+i);
+        cyg_assert(J.buf[i]!=NULL, B->nrec, "Impossible to open output buffer: %s", strerror(errno));
+        thermo_writer_init(J.w+i, J.buf[i]);
+    }
+    for (i=0; i<B->nrec; i++) {
+        J.row[i]    = NULL;
+        J.status[i] = -1;
+    }
+    pthread_mutex_init(&J.lock, NULL);
+    pthread_cond_init(&J.cond, NULL);
+
+    /* Run, merging the outputs in input order as soon as they are ready */
+    pool = thermo_pool_start(njobs, B->nrec, order, batch_task, &J);
+    cyg_assert(pool!=NULL, B->nrec, "Impossible to start the thread pool");
+    for (i=0; i<B->nrec; i++) {
+        pthread_mutex_lock(&J.lock);
+        while (J.status[i]<0) pthread_cond_wait(&J.cond, &J.lock);
+        pthread_mutex_unlock(&J.lock);
+        if (J.status[i]==E_SUCCESS) {
+            fputs(J.row[i], out);
+        } else {
+            nfail++;
+        }
+        if (bout->J!=NULL) thermo_journal_add(bout->J, bout->first+i, J.status[i]);
+        free(J.row[i]);
+    }
+    thermo_pool_wait(pool);
+
+    /* Clean */
+    pthread_mutex_destroy(&J.lock);
+    pthread_cond_destroy(&J.cond);
+    for (i=0; i<njobs; i++) {
+        fclose(J.buf[i]);
+        free(J.bufptr[i]);
+    }
+    free(J.w);
+    free(J.buf);
+    free(J.bufptr);
+    free(J.bufsize);
+    free(J.row);
+    free(J.status);
+    free(order);
+    return nfail;
+}
+
+#endif
+
+/* Write a record coming out of the pipeline */
+static void batch_format(ThermoJob *job, void *data) {
+    BatchOutput *out = data;
+    fwrite(job->log, 1, job->loglen, stderr);
+    batch_output(out, job->rec, job->id, job->A, job->key, job->status);
+    if (out->J!=NULL) thermo_journal_add(out->J, out->first+job->id, job->status);
+}
+
+/*
+    Compute all records of a batch, writing one record per line to out, in
+    input order and in the format and with the fields chosen in O. With the
+    binary format, out must be a regular file, which becomes a results file.
+    With one job the records go through the pipeline, with more jobs they are
+    computed in parallel by a pool of njobs threads. Messages printed while
+    reading the records go to stderr, so that out only contains the results.
+    With a journal J (already open) the records completed by a previous run
+    are skipped, and out is its output: a regular file, open for reading and
+    writing; J is closed on return. Return the number of records that failed.
+*/
+int
+thermo_runbatch(const ThermoBatch *B, double dnu, int njobs, bool timing, const ThermoOutput *O, FILE *out, ThermoJournal *J)
+{
+    int nfail=0, ret;
+    FILE *fplog = fpout;
+    ThermoResults R;
+    ThermoBatch todo = *B;
+    ThermoWriter *w = cyg_malloc(NULL, cyg_sizeof(ThermoWriter));
+    BatchOutput bout = { O, w, NULL, 0, J };
+    if (w==NULL) {
+        if (J!=NULL) thermo_journal_close(J);
+        cyg_logErr("Memory allocation failed!");
+        return B->nrec;
+    }
+
+    fpout = stderr;
+    thermo_writer_init(w, out);
+
+    /* Skip the records done by previous runs */
+    if (J!=NULL) {
+        if (thermo_journal_check(J, B, O)!=E_SUCCESS) {
+            thermo_journal_close(J);
+            free(w);
+            fpout = fplog;
+            return B->nrec;
+        }
+        if (J->ndone>0) fprintf(stderr, "Resuming batch: %d of %d records already done\n", J->ndone, B->nrec);
+        todo.nrec -= J->ndone;
+        todo.rec  += J->ndone;
+        bout.first = J->ndone;
+        nfail      = J->nfail;
+    }
+
+    if (O->format==THERMO_FORMAT_BINARY) {
+        fflush(out);
+        if (J!=NULL && J->resume) {
+            ret = thermo_results_reopen(&R, fileno(out), B->nrec, O);
+        } else {
+            ret = thermo_results_create(&R, fileno(out), B->nrec, B->rec, O);
+        }
+        bout.R = &R;
+    } else if (J!=NULL && J->resume) {
+        /* Drop anything written after the last record in the journal */
+        fflush(out);
+        ret = (ftruncate(fileno(out), (off_t)J->end)==0 && fseeko(out, (off_t)J->end, SEEK_SET)==0) ? E_SUCCESS : E_FAILURE;
+        if (ret!=E_SUCCESS) cyg_logErr("Impossible to truncate output: %s", strerror(errno));
+    } else {
+        thermo_output_header(O, w);
+        ret = E_SUCCESS;
+    }
+    if (ret==E_SUCCESS && J!=NULL) ret = thermo_journal_start(J, out, w, bout.R);
+    if (ret!=E_SUCCESS) {
+        if (J!=NULL) thermo_journal_close(J);
+        free(w);
+        fpout = fplog;
+        return B->nrec;
+    }
+
+#ifdef HAVE_THREADS
+    if (todo.nrec>0 && njobs>1) {
+        thermo_writer_flush(w);
+        nfail += batch_runparallel(&todo, dnu, njobs, &bout, out);
+    } else
+#endif
+    if (todo.nrec>0) {
+        if (njobs>1) fprintf(stderr, "Code compiled without threads support. Using one job.\n");
+        nfail += thermo_pipeline(todo.nrec, todo.rec, NULL, dnu, batch_format, &bout, timing);
+    }
+    thermo_writer_flush(w);
+    if (J!=NULL && thermo_journal_close(J)!=E_SUCCESS) nfail = B->nrec;
+    free(w);
+    if (bout.R!=NULL && thermo_results_close(bout.R)!=E_SUCCESS) nfail = B->nrec;
+    fflush(out);
+    fpout = fplog;
+
+    return nfail;
+}
+
+/* Free all memory of a batch */
+void
+thermo_deletebatch(ThermoBatch *B)
+{
+    int i;
+    for (i=0; i<B->nrec; i++) {
+        free(B->rec[i].name);
+        free(B->rec[i].path);
+        free(B->rec[i].text);
+    }
+    free(B->rec);
+    B->rec  = NULL;
+    B->nrec = 0;
+    return;
+}
+
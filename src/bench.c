@@ -0,0 +1,122 @@
+
+/*
+    Benchmark of the input parser (not installed: make thermo_bench).
+
+    A synthetic input with many vibrations is parsed several times, from
+    memory and through a stream, and the throughput is reported in MB/s.
+    All keywords are checked against the keyword table and random numbers
+    against strtod.
+
+    Usage: thermo_bench [number of vibrations] [repetitions]
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+#include <thermoint.h>
+
+/* Wall time in seconds */
+static double bench_time(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + 1E-6*(double)tv.tv_usec;
+}
+
+/* Random number in [0,1) from a 64 bit xorshift generator */
+static double bench_rand(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return (double)(*s >> 11) * 0x1.0p-53;
+}
+
+/* Write a thermo input with nvib vibrations to a new buffer */
+static char *bench_input(int nvib, size_t *len) {
+    int i;
+    size_t size = 512 + 32*(size_t)nvib, n;
+    uint64_t s = 88172645463325252ULL;
+    char *text = cyg_malloc(NULL, cyg_sizeof(char)*(int)size);
+    cyg_assert(text!=NULL, NULL, "Memory allocation failed!");
+
+    n = (size_t)snprintf(text, size,
+        "# Synthetic input for thermo_bench\n"
+        "temperature = 298.15\nnmoles = 1\nvolume = 24.5\npressure = 1.0\n"
+        "mass = 1234.5678\ntranslations = 3\nsigma = 1\nenergy = -12345.6789\n"
+        "rotations = 3\n1234.5\n2345.6\n3456.7\nvibrations = %d\n", nvib);
+    for (i=0; i<nvib; i++) {
+        n += (size_t)snprintf(text+n, size-n, "%.4f\n", 10.0 + 3990.0*bench_rand(&s));
+    }
+    *len = n;
+    return text;
+}
+
+int main(int argc, char *argv[]) {
+
+    int i, k, nvib = 1000000, nrep = 10, nerr = 0;
+    size_t len;
+    double t0, t, x, y;
+    uint64_t s = 1;
+    char *text, num[64];
+    const char *name;
+    Thermo A;
+    FILE *fp;
+
+    fpout = stderr;
+    if (argc>1) nvib = atoi(argv[1]);
+    if (argc>2) nrep = atoi(argv[2]);
+    cyg_assert(nvib>0 && nrep>0, EXIT_FAILURE, "Usage: %s [number of vibrations] [repetitions]", argv[0]);
+
+    /* Keywords */
+    for (k=0; (name=thermo_keyword(k))!=NULL; k++) {
+        if (thermo_findkeyword(name)!=k) {
+            printf("Keyword <%s> not found\n", name);
+            nerr++;
+        }
+    }
+    if (thermo_findkeyword("unknown")!=-1) {
+        printf("Unknown keyword found\n");
+        nerr++;
+    }
+    printf("%d keywords checked\n", k);
+
+    /* Numbers */
+    for (i=0; i<1000000; i++) {
+        x = ldexp(bench_rand(&s), (int)(80.0*bench_rand(&s))-40);
+        snprintf(num, sizeof(num), (i%2==0) ? "%.*f" : "%.*e", i%18, x);
+        if (thermo_parsedouble(num, num+strlen(num), &y)==NULL || y!=strtod(num, NULL)) {
+            if (nerr++<10) printf("Wrong conversion of <%s>\n", num);
+        }
+    }
+    printf("%d numbers checked\n", i);
+
+    /* Parser */
+    text = bench_input(nvib, &len);
+    cyg_assert(text!=NULL, EXIT_FAILURE, "Failing creating input");
+    printf("Input of %.2f MB with %d vibrations\n", (double)len/1E6, nvib);
+
+    t0 = bench_time();
+    for (i=0; i<nrep; i++) {
+        thermo_init(&A);
+        if (thermo_readthermo_buf(&A, text, len)!=E_SUCCESS || A.v!=nvib) nerr++;
+        thermo_delete(&A);
+    }
+    t = bench_time()-t0;
+    printf("thermo_readthermo_buf: %8.1f MB/s\n", (double)len*nrep/t/1E6);
+
+    t0 = bench_time();
+    for (i=0; i<nrep; i++) {
+        fp = fmemopen(text, len, "r");
+        cyg_assert(fp!=NULL, EXIT_FAILURE, "Impossible to open input: %s", strerror(errno));
+        thermo_init(&A);
+        if (thermo_readthermo_fp(&A, fp)!=E_SUCCESS || A.v!=nvib) nerr++;
+        thermo_delete(&A);
+        fclose(fp);
+    }
+    t = bench_time()-t0;
+    printf("thermo_readthermo_fp:  %8.1f MB/s\n", (double)len*nrep/t/1E6);
+
+    free(text);
+    if (nerr>0) printf("%d errors\n", nerr);
+    return (nerr>0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
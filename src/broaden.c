@@ -0,0 +1,199 @@
+
+/*
+    Broadening of the VDOS histogram.
+
+    The histogram is convolved with a kernel and normalized, at each bin, by
+    the weight of the kernel over the bins in range, so that the spectrum
+    does not drop at the edges (the first bin, at zero frequency, is out of
+    range, as in the original moving average). Triangular and box windows
+    are computed exactly from running prefix sums, in O(bins) whatever their
+    width; Gaussian and Lorentzian kernels of any width by a zero-padded FFT
+    convolution (see fft.c), in O(bins log bins).
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+#include <limits.h>
+
+/* Default half width of the window (or FWHM of the kernel), in bins */
+#define BROADEN_DEFWIDTH 5
+
+/* Values of the FFT convolution below this fraction of the total are roundoff */
+#define BROADEN_FFTTOL 1e-12
+
+static const char *broaden_names[] = { "triangle", "box", "gauss", "lorentz" };
+
+/*
+    Parse a kernel in the kind[:width] form, with the width in cm-1 (half
+    width of the window for triangle and box, full width at half maximum for
+    gauss and lorentz). Without width, the default of 5 bins is used.
+*/
+int
+thermo_broaden_parse(ThermoBroaden *K, const char *str)
+{
+    int k;
+    char *end;
+    const char *colon = strchr(str, ':');
+    size_t l = (colon!=NULL) ? (size_t)(colon-str) : strlen(str);
+
+    K->width = 0.0;
+    for (k=0; k<(int)(sizeof(broaden_names)/sizeof(*broaden_names)); k++) {
+        if (strlen(broaden_names[k])==l && strncmp(str, broaden_names[k], l)==0) break;
+    }
+    cyg_assert(k<(int)(sizeof(broaden_names)/sizeof(*broaden_names)), E_FAILURE,
+            "Unknown broadening <%.*s>: use triangle, box, gauss or lorentz", (int)l, str);
+    K->kind = k;
+    if (colon!=NULL) {
+        K->width = strtod(colon+1, &end);
+        cyg_assert(end!=colon+1 && *end=='\0' && K->width>0.0, E_FAILURE,
+                "Invalid broadening width <%s>: it must be a positive number of cm-1", colon+1);
+    }
+    return E_SUCCESS;
+}
+
+/* Prefix sum C1(v) of the histogram over the bins before v, and C2(v) of C1 over all u<v */
+static double broaden_C1(const double *C1, int n, long v) {
+    return (v<=0) ? 0.0 : (v>=n) ? C1[n] : C1[v];
+}
+static double broaden_C2(const double *C1, const double *C2, int n, long v) {
+    return (v<=0) ? 0.0 : (v<=n+1) ? C2[v] : C2[n+1] + (double)(v-n-1)*C1[n];
+}
+
+/*
+    Window of half width P over c, in out: the box sums the bins i-P..i+P;
+    the triangle weights bin j by P+1-|i-j|, which is the sum of the P+1 boxes
+    of length P+1 covering bin i, a difference of second order prefix sums.
+    C1 and C2 are work arrays of n+1 and n+2 elements.
+*/
+static void broaden_window(const double *c, double *out, int n, long P, bool tri, double *C1, double *C2) {
+    int i;
+    C1[0] = 0.0;
+    for (i=0; i<n; i++) C1[i+1] = C1[i] + c[i];
+    C2[0] = 0.0;
+    for (i=0; i<=n; i++) C2[i+1] = C2[i] + C1[i];
+    for (i=0; i<n; i++) {
+        if (tri) {
+            out[i] = broaden_C2(C1, C2, n, i+P+2) - 2.0*broaden_C2(C1, C2, n, i+1) + broaden_C2(C1, C2, n, i-P);
+        } else {
+            out[i] = broaden_C1(C1, n, i+P+1) - broaden_C1(C1, n, i-P);
+        }
+    }
+}
+
+/*
+    Gaussian or Lorentzian convolution of width w [bins] by FFT: the histogram
+    goes in the real part and the range indicator in the imaginary part, so
+    that both are convolved with the (real and even) kernel at once.
+*/
+static int broaden_fft(const double *c, const double *ind, double *num, double *den, int n, int kind, double w) {
+    int i, N;
+    long m, half;
+    double x, tot = 0.0;
+    double *re, *im, *kr, *ki;
+
+    if (kind==THERMO_BROADEN_GAUSS) {
+        x = w / (2.0*sqrt(2.0*log(2.0)));           /* sigma */
+        half = lrint(ceil(6.0*x));
+    } else {
+        x = w / 2.0;                                /* Half width at half maximum */
+        half = n;
+    }
+    if (half>n) half = n;
+    cyg_assert((long)n+half<=(1L<<30), E_FAILURE, "Too many bins (%d) for the FFT broadening", n);
+    N = thermo_fft_size(n+(int)half);
+
+    re = thermo_realloc(NULL, 4*(size_t)N*sizeof(double));
+    cyg_assert(re!=NULL, E_FAILURE, "Memory allocation failed!");
+    im = re + N;
+    kr = im + N;
+    ki = kr + N;
+    for (i=0; i<N; i++) {
+        re[i] = (i<n) ? c[i] : 0.0;
+        im[i] = (i<n) ? ind[i] : 0.0;
+        kr[i] = ki[i] = 0.0;
+        if (i<n) tot += fabs(c[i]);
+    }
+
+    /* Kernel, wrapped around zero, with unit peak */
+    kr[0] = 1.0;
+    for (m=1; m<=half; m++) {
+        if (kind==THERMO_BROADEN_GAUSS) {
+            kr[m] = exp(-0.5*((double)m/x)*((double)m/x));
+        } else {
+            kr[m] = 1.0/(1.0+((double)m/x)*((double)m/x));
+        }
+        kr[N-m] = kr[m];
+    }
+
+    if (thermo_fft(kr, ki, N, false)!=E_SUCCESS || thermo_fft(re, im, N, false)!=E_SUCCESS) {
+        thermo_free(re);
+        return E_FAILURE;
+    }
+    for (i=0; i<N; i++) {
+        re[i] *= kr[i];
+        im[i] *= kr[i];
+    }
+    if (thermo_fft(re, im, N, true)!=E_SUCCESS) {
+        thermo_free(re);
+        return E_FAILURE;
+    }
+    for (i=0; i<n; i++) {
+        num[i] = (fabs(re[i])<BROADEN_FFTTOL*tot) ? 0.0 : re[i];
+        den[i] = im[i];
+    }
+    thermo_free(re);
+    return E_SUCCESS;
+}
+
+/*
+    Broaden in place the histogram h of n bins of width dnu [cm-1] with the
+    kernel K (the default triangle of 5 bins if NULL).
+*/
+int
+thermo_broaden(double *h, int n, const ThermoBroaden *K, double dnu)
+{
+    int i, ret = E_SUCCESS;
+    int kind = (K!=NULL) ? K->kind : THERMO_BROADEN_TRIANGLE;
+    double w = (K!=NULL && K->width>0.0) ? K->width/dnu : BROADEN_DEFWIDTH;
+    long P;
+    double *ind, *num, *den, *C1, *C2;
+
+    if (n<1) return E_SUCCESS;
+    ind = thermo_realloc(NULL, (5*(size_t)n+3)*sizeof(double));
+    cyg_assert(ind!=NULL, E_FAILURE, "Memory allocation failed!");
+    num = ind + n;
+    den = num + n;
+    C1  = den + n;
+    C2  = C1 + n+1;
+
+    /* Bins in range */
+    h[0] = 0.0;
+    ind[0] = 0.0;
+    for (i=1; i<n; i++) ind[i] = 1.0;
+
+    switch (kind) {
+        case THERMO_BROADEN_TRIANGLE:
+        case THERMO_BROADEN_BOX:
+            P = (w<(double)n) ? lrint(w) : n;
+            broaden_window(h,   num, n, P, kind==THERMO_BROADEN_TRIANGLE, C1, C2);
+            broaden_window(ind, den, n, P, kind==THERMO_BROADEN_TRIANGLE, C1, C2);
+            break;
+        case THERMO_BROADEN_GAUSS:
+        case THERMO_BROADEN_LORENTZ:
+            ret = broaden_fft(h, ind, num, den, n, kind, w);
+            break;
+        default:
+            cyg_logErr("Unknown broadening kernel %d", kind);
+            ret = E_FAILURE;
+    }
+
+    if (ret==E_SUCCESS) {
+        for (i=0; i<n; i++) {
+            h[i] = (den[i]>BROADEN_FFTTOL) ? num[i]/den[i] : 0.0;
+        }
+    }
+    thermo_free(ind);
+    return ret;
+}
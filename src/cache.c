@@ -0,0 +1,330 @@
+
+/*
+    Content-addressed on-disk cache.
+
+    Two kinds of entries are stored in the cache directory:
+
+        eig-<hash>.bin  eigenvalues of a hessian, keyed by the hessian bytes
+        res-<hash>.bin  results vector of a record, keyed by the bytes of
+                        its input and of its hessian
+
+    Eigenvalues do not depend on the number of translations and rotations to
+    skip, so they are shared by all inputs using the same hessian. Each entry
+    is written to a temporary file and renamed, so that concurrent processes
+    can share the same directory and never read a partial entry.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+#include <thermoint.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define CACHE_MAGIC "THERMOC1"
+
+static const char *cache_dir = NULL;
+static const char *cache_prefix[THERMO_CACHE_LAST] = {"eig", "res"};
+static const char *cache_name[THERMO_CACHE_LAST] = {"eigenvalues", "results"};
+static _Atomic long cache_hits[THERMO_CACHE_LAST];
+static _Atomic long cache_miss[THERMO_CACHE_LAST];
+
+/* Hit/miss statistics, printed at exit */
+static void cache_report(void) {
+    int k;
+    fprintf(stderr, "Cache <%s>:", cache_dir);
+    for (k=0; k<THERMO_CACHE_LAST; k++) {
+        fprintf(stderr, " %s %ld hits %ld misses%s", cache_name[k], atomic_load(cache_hits+k),
+            atomic_load(cache_miss+k), (k<THERMO_CACHE_LAST-1) ? ";" : "\n");
+    }
+}
+
+/* Use dir (created if needed) as cache for the rest of the run */
+int
+thermo_cache_open(const char *dir)
+{
+    if (mkdir(dir, 0777)!=0 && errno!=EEXIST) {
+        cyg_logErr("Impossible to create cache directory <%s>: %s", dir, strerror(errno));
+        return E_FAILURE;
+    }
+    cache_dir = dir;
+    atexit(cache_report);
+    return E_SUCCESS;
+}
+
+/* True if a cache is in use */
+bool
+thermo_cache_enabled(void)
+{
+    return cache_dir!=NULL;
+}
+
+/*
+    Update the 64 bit FNV-1a hash h with len bytes of data, taken eight at a
+    time. Start from THERMO_HASH_INIT.
+*/
+uint64_t
+thermo_hash(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t w;
+    for (; len>=8; len-=8, p+=8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 1099511628211ULL;
+    }
+    for (; len>0; len--, p++) {
+        h = (h ^ *p) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Path of an entry */
+static void cache_path(char *path, size_t size, int kind, uint64_t key) {
+    snprintf(path, size, "%s/%s-%016llx.bin", cache_dir, cache_prefix[kind], (unsigned long long)key);
+}
+
+/*
+    Return a newly allocated copy of the entry (with its length in n), or
+    NULL if not in the cache
+*/
+double *
+thermo_cache_get(int kind, uint64_t key, int *n)
+{
+    char path[4096], magic[8];
+    uint64_t k;
+    int64_t len;
+    double *data = NULL;
+    FILE *fp;
+
+    cache_path(path, sizeof(path), kind, key);
+    fp = fopen(path, "rb");
+    if (fp!=NULL) {
+        if (fread(magic, 1, 8, fp)==8 && memcmp(magic, CACHE_MAGIC, 8)==0 &&
+            fread(&k, sizeof(k), 1, fp)==1 && k==key &&
+            fread(&len, sizeof(len), 1, fp)==1 && len>0 && len<INT_MAX &&
+            (data = thermo_realloc(NULL, (size_t)len*sizeof(double)))!=NULL) {
+            if (fread(data, sizeof(double), (size_t)len, fp)==(size_t)len) {
+                *n = (int)len;
+            } else {
+                thermo_free(data);
+                data = NULL;
+            }
+        }
+        fclose(fp);
+    }
+    if (data!=NULL) {
+        atomic_fetch_add(cache_hits+kind, 1);
+    } else {
+        atomic_fetch_add(cache_miss+kind, 1);
+    }
+    return data;
+}
+
+/* Store an entry, atomically replacing any previous one */
+int
+thermo_cache_put(int kind, uint64_t key, const double *data, int n)
+{
+    char path[4096], tmp[4096];
+    int64_t len = n;
+    bool ok;
+    int fd;
+    FILE *fp;
+
+    snprintf(tmp, sizeof(tmp), "%s/.tmp-XXXXXX", cache_dir);
+    fd = mkstemp(tmp);
+    cyg_assert(fd>=0, E_FAILURE, "Impossible to create a file in cache <%s>: %s", cache_dir, strerror(errno));
+    fp = fdopen(fd, "wb");
+    cyg_assert(fp!=NULL, E_FAILURE, "Impossible to write cache file <%s>", tmp);
+    ok = fwrite(CACHE_MAGIC, 1, 8, fp)==8 &&
+         fwrite(&key, sizeof(key), 1, fp)==1 &&
+         fwrite(&len, sizeof(len), 1, fp)==1 &&
+         fwrite(data, sizeof(double), (size_t)n, fp)==(size_t)n;
+    ok = (fclose(fp)==0) && ok;
+
+    cache_path(path, sizeof(path), kind, key);
+    if (!ok || rename(tmp, path)!=0) {
+        cyg_logErr("Impossible to write cache file <%s>: %s", path, strerror(errno));
+        unlink(tmp);
+        return E_FAILURE;
+    }
+    return E_SUCCESS;
+}
+
+/* Key of the results of a record, from the bytes of its input and its hessian */
+uint64_t
+thermo_cache_key(const char *text, size_t len, const char *hess, size_t hesslen)
+{
+    uint64_t h = thermo_hash(THERMO_HASH_INIT, text, len);
+    return thermo_hash(h, hess, hesslen);
+}
+
+/* Add to key the arrays of A read from binary files, which are not in its input */
+uint64_t
+thermo_arraykey(uint64_t key, const Thermo *A)
+{
+    return (A->arrayhash!=0) ? thermo_hash(key, &(A->arrayhash), sizeof(A->arrayhash)) : key;
+}
+
+/*
+    Frequencies of A from the bytes of its hessian file: the eigenvalues are
+    taken from the cache, or the hessian is parsed, diagonalized and its
+    eigenvalues stored.
+*/
+int
+thermo_cache_freqs(Thermo *A, char *hess, size_t hesslen)
+{
+    int ret, n;
+    uint64_t key = thermo_hash(THERMO_HASH_INIT, hess, hesslen);
+    double *eival = thermo_cache_get(THERMO_CACHE_EIGEN, key, &n);
+    FILE *fp;
+
+    if (eival!=NULL) {
+        fprintf(fpout, "Eigenvalues of hessian <%s> taken from the cache\n", A->hessfile);
+        A->natoms = n/3;
+    } else {
+        if (A->hessian==NULL) {
+            fp = fmemopen(hess, hesslen, "r");
+            cyg_assert(fp!=NULL, E_FAILURE, "Impossible to open hessian <%s>: %s", A->hessfile, strerror(errno));
+            ret = thermo_readhessian_fp(A, fp);
+            fclose(fp);
+            cyg_assert(ret==E_SUCCESS, E_FAILURE, "Failing reading hessian <%s>", A->hessfile);
+        }
+        n = A->natoms*3;
+        eival = thermo_realloc(NULL, (size_t)n*sizeof(double));
+        cyg_assert(eival!=NULL, E_FAILURE, "Memory allocation failed!");
+        ret = thermo_calceigen(A, eival);
+        cyg_assert(ret==E_SUCCESS, E_FAILURE, "Failing diagonalizing hessian <%s>", A->hessfile);
+        thermo_cache_put(THERMO_CACHE_EIGEN, key, eival, n);
+    }
+    ret = thermo_eigen2freqs(A, eival);
+    thermo_free(eival);
+    return ret;
+}
+
+/* Parse and compute one record through the cache */
+int
+thermo_cache_computerecord(Thermo *A, const ThermoRecord *rec)
+{
+    int ret, n;
+    char *text = rec->text, *hess = NULL;
+    size_t len = rec->len, hesslen = 0;
+    uint64_t key;
+
+    if (rec->path!=NULL) {
+        text = thermo_slurp(rec->path, &len);
+        cyg_assert(text!=NULL, E_FAILURE, "Failing reading record <%s>", rec->name);
+    }
+    ret = thermo_readthermo_buf(A, text, len);
+    cyg_assert(ret==E_SUCCESS, E_FAILURE, "Failing reading record <%s>", rec->name);
+
+    /* The trajectory of a quasi-harmonic analysis and the conformers of an ensemble are not hashed: no caching */
+    if (A->qhfile || A->ensfile) {
+        if (rec->path!=NULL) free(text);
+        if (A->qhfile) {
+            ret = thermo_quasiharmonic(A);
+            cyg_assert(ret==E_SUCCESS, E_FAILURE, "Failing the quasi-harmonic analysis of record <%s>", rec->name);
+        }
+        thermo_calcthermo(A);
+        cyg_assert(A->results!=NULL, E_FAILURE, "Failing computing record <%s>", rec->name);
+        return E_SUCCESS;
+    }
+    if (A->hessfile) {
+        hess = thermo_slurp(A->hessfile, &hesslen);
+        cyg_assert(hess!=NULL, E_FAILURE, "Failing reading hessian of record <%s>", rec->name);
+    }
+    key = thermo_arraykey(thermo_cache_key(text, len, hess, hesslen), A);
+    if (rec->path!=NULL) free(text);
+
+    A->results = thermo_cache_get(THERMO_CACHE_RESULTS, key, &n);
+    if (A->results==NULL || n!=THERMO_LAST) {
+        thermo_free(A->results);
+        A->results = NULL;
+        if (hess!=NULL) {
+            ret = thermo_cache_freqs(A, hess, hesslen);
+            cyg_assert(ret==E_SUCCESS, E_FAILURE, "Failing calculating frequencies of record <%s>", rec->name);
+        }
+        thermo_calcthermo(A);
+        cyg_assert(A->results!=NULL, E_FAILURE, "Failing computing record <%s>", rec->name);
+        thermo_cache_put(THERMO_CACHE_RESULTS, key, A->results, THERMO_LAST);
+    }
+    free(hess);
+    return E_SUCCESS;
+}
+
+/* Hash of the bytes of a record and of its hessian file (if any), as the key of its results */
+uint64_t
+thermo_recordkey(const ThermoRecord *rec, const char *hessfile)
+{
+    char *text = rec->text, *hess = NULL;
+    size_t len = rec->len, hesslen = 0;
+    uint64_t key;
+    if (rec->path!=NULL) {
+        text = thermo_slurp(rec->path, &len);
+        if (text==NULL) len = 0;
+    }
+    if (hessfile!=NULL) {
+        hess = thermo_slurp(hessfile, &hesslen);
+        if (hess==NULL) hesslen = 0;
+    }
+    key = thermo_cache_key(text, len, hess, hesslen);
+    if (rec->path!=NULL) free(text);
+    free(hess);
+    return key;
+}
+
+/*
+    Read a whole file in memory (NUL terminated, length in len). Regular
+    files are read at once; pipes and other streams, whose size is not
+    known, with thermo_slurp_fp.
+*/
+char *
+thermo_slurp(const char *fname, size_t *len)
+{
+    char *buf;
+    struct stat st;
+    FILE *fp = cyg_fopen(fname, "r");
+    cyg_assert(fp!=NULL, NULL, "Impossible to read <%s>", fname);
+    if (fstat(fileno(fp), &st)!=0 || !S_ISREG(st.st_mode)) {
+        buf = thermo_slurp_fp(fp, len);
+        fclose(fp);
+        return buf;
+    }
+    buf = malloc((size_t)st.st_size+1);
+    if (buf!=NULL) {
+        *len = fread(buf, 1, (size_t)st.st_size, fp);
+        buf[*len] = '\0';
+    }
+    fclose(fp);
+    cyg_assert(buf!=NULL, NULL, "Memory allocation failed!");
+    return buf;
+}
+
+/* Read an open stream up to its end in memory, in a growing buffer (NUL terminated, length in len) */
+char *
+thermo_slurp_fp(FILE *fp, size_t *len)
+{
+    char *buf = NULL, *tmp;
+    size_t size = 0, n;
+
+    *len = 0;
+    do {
+        if (*len+1>=size) {
+            size = (size>0) ? 2*size : 65536;
+            tmp  = realloc(buf, size);
+            if (tmp==NULL) {
+                free(buf);
+                cyg_logErr("Memory allocation failed!");
+                return NULL;
+            }
+            buf = tmp;
+        }
+        n = fread(buf+*len, 1, size-*len-1, fp);
+        *len += n;
+    } while (n>0);
+    buf[*len] = '\0';
+    return buf;
+}
+
@@ -7,28 +7,35 @@
 
 #include <cygtools.h>
 #include <thermo.h>
+#include <thermoint.h>
 
+/* Diagonalize the hessian of A, storing its natoms*3 eigenvalues in eival */
 int
-thermo_calcfreqs(Thermo *A)
+thermo_calceigen(Thermo *A, double *eival)
 {
-
     fprintf(fpout, "Diagonalizing hessian matrix and calculating frequencies...\n");
+    mtx_dsyev(A->natoms*3, A->hessian, eival, "V", "L");
+    return E_SUCCESS;
+}
 
+/* Convert the eigenvalues of the hessian to frequencies, skipping translations and rotations */
+int
+thermo_eigen2freqs(Thermo *A, const double *eival)
+{
     int i, nat3, skip;
-    double *eival;
 
     nat3 = A->natoms*3;
 
-    /* Eigenvalues */
-    eival = cyg_malloc(NULL, nat3*cyg_sizeof(double));
-    cyg_assert(eival!=NULL, E_FAILURE, "Memory allocation failed!");
-
-    /* Frequencies */
-    A->nu = cyg_malloc(A->nu, nat3*cyg_sizeof(double));
+    /* Frequencies (replacing any read from a binary file) */
+    if (A->numap.addr!=NULL) {
+        thermo_freearray(A->nu, &A->numap);
+        A->nu = NULL;
+    }
+    A->nu = thermo_realloc(A->nu, (size_t)nat3*sizeof(double));
     cyg_assert(A->nu!=NULL, E_FAILURE, "Memory allocation failed!");
-
-    /* Diagonalize matrix */
-    mtx_dsyev(nat3, A->hessian, eival, "V", "L");
+    thermo_free(A->w);
+    A->w = NULL;
+    A->mergevar = NAN;
 
     /* Convert eigenvalues to frequencies */
     skip = A->t + A->r;
@@ -42,8 +49,24 @@ thermo_calcfreqs(Thermo *A)
     }
     A->v = nat3-skip;
 
+    return E_SUCCESS;
+}
+
+int
+thermo_calcfreqs(Thermo *A)
+{
+    int ret;
+    double *eival;
+
+    /* Eigenvalues */
+    eival = cyg_malloc(NULL, A->natoms*3*cyg_sizeof(double));
+    cyg_assert(eival!=NULL, E_FAILURE, "Memory allocation failed!");
+
+    ret = thermo_calceigen(A, eival);
+    if (ret==E_SUCCESS) ret = thermo_eigen2freqs(A, eival);
+
     /* Clean and return */
     free(eival);
-    return E_SUCCESS;
+    return ret;
 }
 
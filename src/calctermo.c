@@ -12,26 +12,65 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <cygtools.h>
 #include <thermo.h>
 
-void 
-thermo_calcthermo(Thermo *A) 
+/*
+    Results vector (to be freed) for the system A at temperature T. When the
+    pressure is given the volume follows the temperature. An ensemble of
+    conformers is computed again at T, with its Boltzmann populations at T.
+*/
+double *
+thermo_computeat(const Thermo *A, double T)
 {
-    int i;                          /* Counter */
-    int ndx;
-    double kBT = CNS_kB * A->T;     /* kB T */
-    double tmp;
-
-    A->results = thermo_compute(A->T, A->E, A->t, A->m, A->V, A->n, A->r, A->I, A->s, A->v, A->nu,
+    double V = (A->pressure>0.0) ? A->V*T/A->T : A->V;
+    if (A->ensfile!=NULL) return thermo_ensembleat(A, T, NULL, NULL);
+    return thermo_compute_weighted(T, A->E, A->t, A->m, V, A->n, A->r, A->I, A->s, A->v, A->nu, A->w,
         A->solute_volume, A->solvent.vvdw, A->solvent.mass, A->solvent.density,
         A->solvent.acentricity, A->solvent.permittivity, A->solvent.expansion,
         A->rgyr_m, A->solvent.rgyr, A->asa_m, A->solvent.bbox);
-    double *res = A->results;
+}
+
+void 
+thermo_calcthermo(Thermo *A) 
+{
+    /* Drop the results of a previous call, e.g. at another temperature, and
+       the spectrum, rebuilt on demand by the cumulative and vdos outputs */
+    thermo_free(A->results);
+    thermo_spectrum_free(A->spectrum);
+    A->spectrum = NULL;
+
+    /* Compress degenerate modes, once */
+    if (A->mergetol>0.0 && isnan(A->mergevar) && thermo_mergemodes(A, A->mergetol)!=E_SUCCESS) {
+        thermo_error("thermo_calcthermo: merging degenerate modes failed!\n");
+        A->results = NULL;
+        return;
+    }
+
+    /* Boltzmann ensemble of conformers, each computed from its own record */
+    if (A->ensfile!=NULL) {
+        A->results = NULL;
+        if (thermo_ensemble(A)!=E_SUCCESS) {
+            thermo_error("thermo_calcthermo: ensemble computation failed!\n");
+            return;
+        }
+        thermo_fillthermo(A);
+        return;
+    }
 
-    if (!res) {
-        fprintf(stderr, "thermo_calcthermo: thermo computation failed!\n");
+    A->results = thermo_computeat(A, A->T);
+    if (!A->results) {
+        thermo_error("thermo_calcthermo: thermo computation failed!\n");
         return;
     }
+    thermo_fillthermo(A);
+}
+
+/* Molar and extensive quantities of A from its results vector */
+void
+thermo_fillthermo(Thermo *A)
+{
+    const double *res = A->results;
 
     A->q_elec  = res[THERMO_LNQ_ELEC];
     A->Fm_elec = res[THERMO_F_ELEC];
@@ -59,31 +98,6 @@ thermo_calcthermo(Thermo *A)
     A->Sm_vibqm = res[THERMO_S_VIBQM];
     A->ZPE = res[THERMO_ZPE];
 
-    /* Cumulative Vibrational free energy */
-    A->Fm_vib_cumul_cl   = malloc((size_t)(A->nu_np)*sizeof(double));
-    A->Fm_vib_cumul_cl_k = malloc((size_t)(A->v)*sizeof(double));
-    A->Fm_vib_cumul_qm   = malloc((size_t)(A->nu_np)*sizeof(double));
-    A->Fm_vib_cumul_qm_k = malloc((size_t)(A->v)*sizeof(double));
-    for (i=0; i<A->nu_np; i++) {
-        A->Fm_vib_cumul_cl[i] = 0;
-        A->Fm_vib_cumul_qm[i] = 0;
-    }
-	for (i=0; i<A->v; i++) {
-        ndx = (int)lrint(A->nu[i]/A->dnu);
-        if (ndx>=A->nu_np) {
-            fprintf(fpout, "Warning! ndx=%d greather than nu_np=%d\n", ndx, A->nu_np);
-            ndx = A->nu_np-1;
-        }
-        /* Classic */
-        tmp = log( kBT / ( CNS_h * A->nu[i] * CNS_C * 100.0));
-        A->Fm_vib_cumul_cl_k[i] = -CNS_j2kcal * CNS_NA * kBT * tmp;
-        A->Fm_vib_cumul_cl[ndx] -= CNS_j2kcal * CNS_NA * kBT * tmp;
-        /* Quantic */
-        tmp = ( CNS_h * A->nu[i] * CNS_C * 100.0) / (2.0*kBT);
-        A->Fm_vib_cumul_qm_k[i] = -CNS_j2kcal * CNS_NA * kBT * (-log(2.0*sinh(tmp)));
-        A->Fm_vib_cumul_qm[ndx] -= CNS_j2kcal * CNS_NA * kBT * (-log(2.0*sinh(tmp)));
-	}
-
     /* Vibrational quantum correction ~ see M. Cecchini, JCTC 2015 */
     A->qm_corr = 0;
 
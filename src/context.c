@@ -0,0 +1,125 @@
+
+/*
+    Context of the computations: where the log goes, what is done with the
+    error messages and how the arrays of a Thermo structure are allocated.
+
+    Each thread has a current context, set with thermo_context_set; without
+    one, a default context of the thread is used, which logs to stderr,
+    prints errors to stderr and uses the C library allocator. Contexts are
+    never shared behind the back of the caller, so that threads with their
+    own contexts can compute different systems at the same time. A Thermo
+    structure must be freed under a context with the same allocator it was
+    filled with.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+
+static _Thread_local ThermoContext *context_current = NULL;
+static _Thread_local ThermoContext context_default = { NULL, NULL, NULL, NULL };
+
+/* Initialize a context to the defaults */
+void
+thermo_context_init(ThermoContext *ctx)
+{
+    ctx->out   = stderr;
+    ctx->error = NULL;
+    ctx->alloc = NULL;
+    ctx->data  = NULL;
+}
+
+/* Current context of the calling thread */
+ThermoContext *
+thermo_context(void)
+{
+    if (context_current!=NULL) return context_current;
+    if (context_default.out==NULL) context_default.out = stderr;
+    return &context_default;
+}
+
+/* Make ctx (NULL for the default) the current context of the calling thread, returning the previous one */
+ThermoContext *
+thermo_context_set(ThermoContext *ctx)
+{
+    ThermoContext *old = context_current;
+    context_current = ctx;
+    return old;
+}
+
+/* Report an error message through the current context */
+void
+thermo_error(const char *msg)
+{
+    ThermoContext *ctx = thermo_context();
+    if (ctx->error!=NULL) {
+        ctx->error(ctx->data, msg);
+    } else {
+        fputs(msg, stderr);
+    }
+}
+
+/* (Re)allocate size bytes through the current context (free if size is 0) */
+void *
+thermo_realloc(void *ptr, size_t size)
+{
+    ThermoContext *ctx = thermo_context();
+    void *p;
+    if (size==0) {
+        thermo_free(ptr);
+        return NULL;
+    }
+    p = (ctx->alloc!=NULL) ? ctx->alloc(ctx->data, ptr, size) : realloc(ptr, size);
+    cyg_assert(p!=NULL, NULL, "Memory allocation failed for %zu bytes!", size);
+    return p;
+}
+
+/* Free memory of thermo_realloc */
+void
+thermo_free(void *ptr)
+{
+    ThermoContext *ctx = thermo_context();
+    if (ptr==NULL) return;
+    if (ctx->alloc!=NULL) {
+        ctx->alloc(ctx->data, ptr, 0);
+    } else {
+        free(ptr);
+    }
+}
+
+/*
+    Parse the len bytes of text (a thermo input, whose hessian, if any, is
+    read from disk) and compute it under ctx, storing the THERMO_LAST values
+    of its results vector in results. Nothing else is kept: this is the
+    entry point to compute many systems from many threads, each with its own
+    context.
+*/
+int
+thermo_compute_into(ThermoContext *ctx, const char *text, size_t len, double *results)
+{
+    int ret;
+    Thermo A;
+    ThermoContext *old = thermo_context_set(ctx);
+
+    thermo_init(&A);
+    ret = thermo_readthermo_buf(&A, text, len);
+    if (ret==E_SUCCESS && A.hessfile!=NULL) {
+        ret = thermo_readhessian(&A);
+        if (ret==E_SUCCESS) ret = thermo_calcfreqs(&A);
+    }
+    if (ret==E_SUCCESS && A.qhfile!=NULL) {
+        ret = thermo_quasiharmonic(&A);
+    }
+    if (ret==E_SUCCESS) {
+        thermo_calcthermo(&A);
+        if (A.results!=NULL) {
+            memcpy(results, A.results, THERMO_LAST*sizeof(double));
+        } else {
+            ret = E_FAILURE;
+        }
+    }
+    thermo_delete(&A);
+    thermo_context_set(old);
+    return ret;
+}
@@ -31,7 +31,8 @@
  * of the vibrational frequencies. This function generates two file called 
  * @c fname.k.dat and @c fname.f.dat . Both contain the cumulative vibrational 
  * free energy: the first as a function of the number of modes, the second as a 
- * function of the frequency.
+ * function of the frequency. The second is taken from the sorted spectrum of
+ * the modes, built on demand (see spectrum.c).
  * 
  * @param[in] A     Pointer to an initialized @c Thermo structure
  * @param[in] fname Base filename to save the cumulative vibrational free energy
@@ -46,13 +47,19 @@
 #include <thermo.h>
 
 void 
-thermo_cumulvib(const Thermo *A, const char *fname) 
+thermo_cumulvib(Thermo *A, const char *fname) 
 {
 
-    int i;
+    int i, k, nbins;
     double Ftot_CL, F_CL;
     double Ftot_QM, F_QM;
     char *fname_k, *fname_f;
+    const ThermoSpectrum *S = thermo_spectrum(A);
+
+    if (S==NULL) {
+        fprintf(stderr, "ERROR! Impossible to build the spectrum for cumulative free energy!\n\n");
+        return;
+    }
 
     /* Set names for the output files */
     if (fname==NULL) {
@@ -85,23 +92,20 @@ thermo_cumulvib(const Thermo *A, const char *fname)
     Ftot_CL = 0;
     Ftot_QM = 0;
 	for (i=0; i<A->v; i++) {
-        F_CL = A->Fm_vib_cumul_cl_k[i];
-        F_QM = A->Fm_vib_cumul_qm_k[i];
-        Ftot_CL += F_CL;
-        Ftot_QM += F_QM;
+        thermo_modefree(A->nu[i], A->T, &F_CL, &F_QM);
+        Ftot_CL += (A->w!=NULL) ? A->w[i]*F_CL : F_CL;
+        Ftot_QM += (A->w!=NULL) ? A->w[i]*F_QM : F_QM;
         fprintf(fpk, "%12.4f   %12.4f   %12.4f   %12.4f \n", A->nu[i], Ftot_CL, Ftot_QM, Ftot_QM-Ftot_CL);
 	}
 
-    /* Print the cumulative classical and quantum vibrational free energy per mode frequency */
+    /* Print the cumulative classical and quantum vibrational free energy per
+       mode frequency, from zero to the last mode (4000 cm-1 at least): the
+       value at each bin is the prefix sum up to the last mode in it */
     fprintf(fpf, "#freq                FvibCL         FvibQM         Delta \n");
-    Ftot_CL = 0;
-    Ftot_QM = 0;
-    for (i=0; i<A->nu_np; i++) {
-        F_CL = A->Fm_vib_cumul_cl[i];
-        F_QM = A->Fm_vib_cumul_qm[i];
-        Ftot_CL += F_CL;
-        Ftot_QM += F_QM;
-        fprintf(fpf, "%12.4f   %12.4f   %12.4f   %12.4f \n", A->dnu*i, Ftot_CL, Ftot_QM, Ftot_QM-Ftot_CL);
+    nbins = thermo_spectrum_nbins(S, A->dnu, A->nu_np);
+    for (i=0, k=0; i<nbins; i++) {
+        while (k<S->n && thermo_spectrum_bin(S, k, A->dnu)<=i) k++;
+        fprintf(fpf, "%12.4f   %12.4f   %12.4f   %12.4f \n", A->dnu*i, S->Fcl[k], S->Fqm[k], S->Fqm[k]-S->Fcl[k]);
     }
 
     /* Clean memory and return */
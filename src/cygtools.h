@@ -56,21 +56,42 @@
 /* Print current function, position and line. */
 #define cyg_printsource(fp) fprintf(fp, "%s (file %s, line %d):\n", CYG_FUNC, CYG_FILE, CYG_LINE);
 
+/*
+    Report an error message (a whole string): to stderr, unless CYG_ERROR is
+    defined (e.g. -DCYG_ERROR=myhandler) to a void function taking the message.
+*/
+#ifdef CYG_ERROR
+void CYG_ERROR(const char *msg);
+#else
+#define CYG_ERROR(msg) fputs(msg, stderr)
+#endif
+
+/* Format an error at the current position in buf, adding the optional detail */
+#define cyg_formatErr(buf, detail, ...) {\
+    int cyg_n = snprintf(buf, sizeof(buf), "\n%s (file %s, line %d):\n    ERROR!! ", CYG_FUNC, CYG_FILE, CYG_LINE);\
+    if (cyg_n<0 || (size_t)cyg_n>=sizeof(buf)) cyg_n = 0;\
+    cyg_n += snprintf(buf+cyg_n, sizeof(buf)-(size_t)cyg_n, __VA_ARGS__);\
+    if (cyg_n<0 || (size_t)cyg_n>=sizeof(buf)-1) cyg_n = (int)sizeof(buf)-2;\
+    snprintf(buf+cyg_n, sizeof(buf)-(size_t)cyg_n, "\n%s", detail);\
+}
+
 /* Print an error. */
 #define cyg_logErr(...) {\
-    fprintf(stderr, "\n"); \
-    cyg_printsource(stderr); \
-    fprintf(stderr, "    ERROR!! "); \
-    fprintf(stderr, __VA_ARGS__); \
-    fprintf(stderr, "\n"); \
+    char cyg_msg[1024];\
+    cyg_formatErr(cyg_msg, "", __VA_ARGS__);\
+    CYG_ERROR(cyg_msg);\
 }
 
 /* Check an expression. If false print message and return error code. */
 #define cyg_assert(expr, ret, ...) {\
     if (!(expr)) {\
-        cyg_logErr("Assert failed! %s", #expr);\
-        fprintf(stderr, __VA_ARGS__);\
-        fprintf(stderr, "\n");\
+        char cyg_msg[1024], cyg_detail[512];\
+        int cyg_d = snprintf(cyg_detail, sizeof(cyg_detail)-1, __VA_ARGS__);\
+        if (cyg_d<0 || (size_t)cyg_d>=sizeof(cyg_detail)-1) cyg_d = (int)sizeof(cyg_detail)-2;\
+        cyg_detail[cyg_d] = '\n';\
+        cyg_detail[cyg_d+1] = '\0';\
+        cyg_formatErr(cyg_msg, cyg_detail, "Assert failed! %s", #expr);\
+        CYG_ERROR(cyg_msg);\
         return ret;\
     }\
 }
@@ -106,7 +127,7 @@ static inline bool cyg_isstrempty(char *str, const char *vals) {
 }    
 
 /* Read a line from a stream */
-int cyg_getline (char **lineptr, FILE *stream);
+int cyg_getline (char **lineptr, size_t *n, FILE *stream);
 
 #endif
 
@@ -0,0 +1,156 @@
+
+/*
+    Compression of degenerate and near degenerate vibrational modes.
+
+    The modes are sorted by a radix sort on the bits of their frequencies
+    (the bits of a double, with the sign flipped and negative values
+    complemented, are ordered as unsigned integers), eight bits at a time,
+    skipping the bytes common to all keys. Runs of modes whose frequency is
+    within tol of the first of the run (and of its sign) are then merged into one mode at their
+    weighted mean frequency, with their total weight as multiplicity, so that
+    the vibrational kernels, the cumulative free energy and the VDOS run on
+    the compressed list (see A->w).
+
+    The free energy of a mode, classical or quantum, has second derivative
+    |F''(nu)| <= kB T / nu^2, and merging at the mean cancels the first order
+    terms: the error on the vibrational free energy is bounded by
+    kB T / 2 sum_i w_i (nu_i - mean)^2 / nu_min^2 over the runs, where nu_min
+    is the lowest frequency of the run.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+#include <thermoint.h>
+
+/* Unsigned key ordered as the double x */
+static uint64_t degenerate_key(double x) {
+    uint64_t u;
+    memcpy(&u, &x, sizeof(u));
+    return (u>>63) ? ~u : u|((uint64_t)1<<63);
+}
+
+/*
+    Sort the n frequencies nu, and their weights w (if not NULL), in
+    increasing order, by a least significant digit radix sort.
+*/
+int
+thermo_sortmodes(int n, double *nu, double *w)
+{
+    int i, b, pass;
+    size_t count[256], pos, c;
+    uint64_t *key, *tkey, *tmpk, diff = 0;
+    double *tnu, *tw = NULL;
+
+    if (n<2) return E_SUCCESS;
+    key = thermo_realloc(NULL, 2*(size_t)n*sizeof(uint64_t));
+    tnu = thermo_realloc(NULL, 2*(size_t)n*sizeof(double));
+    if (key==NULL || tnu==NULL) {
+        thermo_free(key);
+        thermo_free(tnu);
+        cyg_logErr("Memory allocation failed!");
+        return E_FAILURE;
+    }
+    tkey = key + n;
+    if (w!=NULL) tw = tnu + n;
+
+    for (i=0; i<n; i++) {
+        key[i] = degenerate_key(nu[i]);
+        diff |= key[i]^key[0];
+    }
+
+    /* One stable counting pass per byte in which the keys differ */
+    for (pass=0; pass<8; pass++) {
+        b = 8*pass;
+        if (((diff>>b)&0xff)==0) continue;
+        memset(count, 0, sizeof(count));
+        for (i=0; i<n; i++) count[(key[i]>>b)&0xff]++;
+        for (pos=0, c=0; c<256; c++) {
+            size_t t = count[c];
+            count[c] = pos;
+            pos += t;
+        }
+        for (i=0; i<n; i++) {
+            pos = count[(key[i]>>b)&0xff]++;
+            tkey[pos] = key[i];
+            tnu[pos]  = nu[i];
+            if (w!=NULL) tw[pos] = w[i];
+        }
+        tmpk = key; key = tkey; tkey = tmpk;
+        memcpy(nu, tnu, (size_t)n*sizeof(double));
+        if (w!=NULL) memcpy(w, tw, (size_t)n*sizeof(double));
+    }
+
+    thermo_free((key<tkey) ? key : tkey);
+    thermo_free(tnu);
+    return E_SUCCESS;
+}
+
+/*
+    Merge the modes of A within tol [cm-1] of the lowest of their run (and of
+    its sign) into (frequency, multiplicity) pairs, keeping in A->mergevar
+    the sum of w (nu-mean)^2/nu_min^2 for the error bound.
+*/
+int
+thermo_mergemodes(Thermo *A, double tol)
+{
+    int i, j, k, n = A->v, m = 0;
+    double sw, swnu, var = 0.0, *nu, *w;
+
+    /* Own copies of frequencies and weights (the frequencies may be mapped from a file) */
+    nu = thermo_realloc(NULL, (size_t)(n>0 ? n : 1)*sizeof(double));
+    w  = thermo_realloc(NULL, (size_t)(n>0 ? n : 1)*sizeof(double));
+    if (nu==NULL || w==NULL) {
+        thermo_free(nu);
+        thermo_free(w);
+        cyg_logErr("Memory allocation failed!");
+        return E_FAILURE;
+    }
+    for (i=0; i<n; i++) {
+        nu[i] = A->nu[i];
+        w[i]  = (A->w!=NULL) ? A->w[i] : 1.0;
+    }
+    if (thermo_sortmodes(n, nu, w)!=E_SUCCESS) {
+        thermo_free(nu);
+        thermo_free(w);
+        return E_FAILURE;
+    }
+
+    /* Runs of modes, merged at their weighted mean */
+    for (i=0; i<n; i=j) {
+        sw = swnu = 0.0;
+        for (j=i; j<n && nu[j]-nu[i]<=tol && (nu[j]>0.0)==(nu[i]>0.0); j++) {
+            sw   += w[j];
+            swnu += w[j]*nu[j];
+        }
+        swnu = (sw!=0.0) ? swnu/sw : nu[i];
+        if (nu[i]>0.0) {
+            for (k=i; k<j; k++) var += fabs(w[k])*(nu[k]-swnu)*(nu[k]-swnu)/(nu[i]*nu[i]);
+        }
+        nu[m] = swnu;
+        w[m]  = sw;
+        m++;
+    }
+
+    thermo_freearray(A->nu, &A->numap);
+    thermo_free(A->w);
+    A->nu = nu;
+    A->w  = w;
+    A->v  = m;
+    A->mergevar = var;
+    fprintf(fpout, "Merged %d vibrational modes into %d within %g cm-1 (error on the vibrational free energy below %.3e kcal/mol)\n",
+            n, m, tol, thermo_mergeerror(A, A->T));
+    return E_SUCCESS;
+}
+
+/*
+    Bound on the error [kcal/mol] of the classical and quantum vibrational
+    free energy at temperature T introduced by merging the modes of A.
+*/
+double
+thermo_mergeerror(const Thermo *A, double T)
+{
+    if (isnan(A->mergevar)) return 0.0;
+    return 0.5*CNS_kB*T*CNS_NA*CNS_j2kcal*A->mergevar;
+}
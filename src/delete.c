@@ -13,16 +13,16 @@
 void
 thermo_delete(Thermo *A)
 {
-    if (A->nu!=NULL) {free(A->nu); A->nu=NULL;}
-    if (A->I!=NULL) {free(A->I); A->I=NULL;}
-    if (A->Fm_vib_cumul_cl!=NULL) {free(A->Fm_vib_cumul_cl); A->Fm_vib_cumul_cl=NULL;}
-    if (A->Fm_vib_cumul_cl_k!=NULL) {free(A->Fm_vib_cumul_cl_k); A->Fm_vib_cumul_cl_k=NULL;}
-    if (A->Fm_vib_cumul_qm!=NULL) {free(A->Fm_vib_cumul_qm); A->Fm_vib_cumul_qm=NULL;}
-    if (A->Fm_vib_cumul_qm_k!=NULL) {free(A->Fm_vib_cumul_qm_k); A->Fm_vib_cumul_qm_k=NULL;}
-    if (A->vdos!=NULL) {free(A->vdos); A->vdos=NULL;}
-    if (A->hessfile) {free(A->hessfile); A->hessfile=NULL;}
-    if (A->hessian) {free(A->hessian); A->hessian=NULL;}
-    if (A->results) {free(A->results); A->results=NULL;}
+    if (A->nu!=NULL) {thermo_freearray(A->nu, &A->numap); A->nu=NULL;}
+    if (A->w!=NULL) {thermo_free(A->w); A->w=NULL;}
+    if (A->I!=NULL) {thermo_freearray(A->I, &A->Imap); A->I=NULL;}
+    if (A->spectrum!=NULL) {thermo_spectrum_free(A->spectrum); A->spectrum=NULL;}
+    if (A->hessfile) {thermo_free(A->hessfile); A->hessfile=NULL;}
+    if (A->hessian) {thermo_free(A->hessian); A->hessian=NULL;}
+    if (A->qhfile) {thermo_free(A->qhfile); A->qhfile=NULL;}
+    if (A->qhmasses) {thermo_free(A->qhmasses); A->qhmasses=NULL;}
+    if (A->ensfile) {thermo_free(A->ensfile); A->ensfile=NULL;}
+    if (A->results) {thermo_free(A->results); A->results=NULL;}
     return;
 }
 
@@ -48,6 +48,8 @@
 void
 thermo_diffthermo(const Thermo *A, const Thermo *B, int nA, int nB, Thermo *D)
 {
+    int i;
+
     D->q_elec = 0; // nB * B->q_elec  - nA * A->q_elec    ; 
     D->q_tr   = 0; // nB * B->q_tr    - nA * A->q_tr      ;
     D->q_rot  = 0; // nB * B->q_rot   - nA * A->q_rot     ;
@@ -106,41 +108,13 @@ thermo_diffthermo(const Thermo *A, const Thermo *B, int nA, int nB, Thermo *D)
 
     D->ZPE      = nB * B->ZPE      - nA * A->ZPE      ;
 
-    /* Cumulative vibrational free energy.
-       If a conformational equilibrium is studied, clauclate the cumulative
-       as a function of both number of modes and frequency, if a generic
-       equilibrium, calculate only the frequency one. */
-
-    int i;
-
-    if ( (nA==nB) && (A->v==B->v) ) {
-        D->n = A->v;
-    } else {
-        D->v = 0;
-    }
-
-    D->Fm_vib_cumul_cl   = malloc((size_t)(D->nu_np)*sizeof(double));
-    D->Fm_vib_cumul_cl_k = malloc((size_t)(D->v)*sizeof(double));
-    D->Fm_vib_cumul_qm   = malloc((size_t)(D->nu_np)*sizeof(double));
-    D->Fm_vib_cumul_qm_k = malloc((size_t)(D->v)*sizeof(double));
-
-    /* Frequency-based */
-    for (i=0; i<D->nu_np; i++) {
-        D->Fm_vib_cumul_cl[i] = nB * B->Fm_vib_cumul_cl[i] - nA * A->Fm_vib_cumul_cl[i];
-        D->Fm_vib_cumul_qm[i] = nB * B->Fm_vib_cumul_qm[i] - nA * A->Fm_vib_cumul_qm[i];
-    }
-
-    /* Modes-based */
-    for (i=0; i<D->v; i++) {
-        D->Fm_vib_cumul_cl_k[i] = nB * B->Fm_vib_cumul_cl_k[i] - nA * A->Fm_vib_cumul_cl_k[i];
-        D->Fm_vib_cumul_qm_k[i] = nB * B->Fm_vib_cumul_qm_k[i] - nA * A->Fm_vib_cumul_qm_k[i];
-	}
-
     /* Vibrational quantum correction ~ see M. Cecchini, JCTC 2015 */
     D->qm_corr = D->Fm_totqm - D->Fm_totcl;
 
-    /* Results array */
-    D->results = malloc(THERMO_LAST*sizeof(double));
+    /* Results array (the spectrum, for the cumulative free energy, is built by thermo_spectrum_diff) */
+    thermo_spectrum_free(D->spectrum);
+    D->spectrum = NULL;
+    D->results = thermo_realloc(D->results, THERMO_LAST*sizeof(double));
     for (i=0; i<THERMO_LAST; i++) {
         D->results[i] = nB * B->results[i] - nA * A->results[i];
     }
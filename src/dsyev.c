@@ -1,6 +1,7 @@
 
 /*
-    Call lapack function DSYEV to diagonalize symmetric matrix.
+    Call lapack function DSYEV to diagonalize symmetric matrix, and DPOTRF
+    for the Cholesky factorization of a positive definite one.
 
     Simone Conti 2016-2017
 */
@@ -10,6 +11,7 @@
 
 extern void dsyev_(const char* jobz, const char* uplo, int* n, double* a, int* lda,
                 double* w, double* work, int* lwork, int* info );
+extern void dpotrf_(const char* uplo, int* n, double* a, int* lda, int* info );
 
 int
 mtx_dsyev(int n, double *a, double *w, const char *JOBZ, const char *UPLO) 
@@ -44,3 +46,21 @@ mtx_dsyev(int n, double *a, double *w, const char *JOBZ, const char *UPLO)
     #endif
 }
 
+
+int
+mtx_dpotrf(int n, double *a, const char *UPLO)
+{
+
+    #ifndef HAVE_LAPACK
+        cyg_logErr("Code compiled without LAPACK support. Impossible to use this functon.");
+        return E_FAILURE;
+    #else
+
+    int info;
+
+    dpotrf_(UPLO, &n, a, &n, &info);
+    cyg_assert(info==0, E_FAILURE, "The matrix is not positive definite.\n");
+    return E_SUCCESS;
+
+    #endif
+}
@@ -0,0 +1,227 @@
+
+/*
+    Boltzmann ensemble of conformers.
+
+    The conformers are the records of a batch file (input files listed one
+    per line and/or inline records), each with its own energy, frequencies
+    and so on. They are read and computed one at a time at the temperature
+    of the ensemble, and folded into a running state: with x = -F/RT the
+    quantum free energy of a conformer in units of RT, the state keeps the
+    largest x seen, m, and the sums of exp(x-m), of x exp(x-m) and of the
+    results weighted by exp(x-m), rescaled whenever m grows, so that no
+    exponential overflows (an online log-sum-exp). Two states merge in the
+    same way: chunks of conformers are folded on separate threads and their
+    states merged in order, so that the results do not depend on the number
+    of threads.
+
+    With Z = sum exp(x) and the populations p = exp(x)/Z:
+
+        F = -RT ln Z
+        X = sum p X            (U, S and all other quantities)
+        S_mix = -R sum p ln p = R (ln Z - sum p x)
+
+    The mixing entropy (-T S_mix on the free energy, S_mix/R on ln q) is
+    added to the electronic contribution, where the conformers differ, so
+    that the quantum free energy of the ensemble is -RT ln Z.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+#include <thermoint.h>
+
+#define ENS_CHUNK 16    /* Conformers folded by one task */
+
+/* Running state of (part of) an ensemble */
+typedef struct {
+    int    n;                   /* Number of conformers */
+    double max;                 /* Largest x = -F/RT */
+    double sum;                 /* Sum of exp(x-max) */
+    double sumx;                /* Sum of x exp(x-max) */
+    double acc[THERMO_LAST];    /* Sum of the results times exp(x-max) */
+} EnsState;
+
+/* State shared by the tasks of an ensemble */
+typedef struct {
+    const Thermo *A;
+    double T;           /* Temperature of the ensemble */
+    const ThermoBatch *B;
+    ThermoContext ctx;  /* Context of the caller, with the log of the conformers discarded */
+    EnsState *S;        /* State of each chunk */
+    int *fail;          /* Failed conformer of each chunk, -1 if none */
+} EnsJob;
+
+/* Empty state */
+static void ens_init(EnsState *S) {
+    S->n    = 0;
+    S->max  = -INFINITY;
+    S->sum  = 0.0;
+    S->sumx = 0.0;
+    memset(S->acc, 0, sizeof(S->acc));
+}
+
+/* Move the shift of S up to max */
+static void ens_rescale(EnsState *S, double max) {
+    int i;
+    double f;
+    if (max<=S->max) return;
+    f = exp(S->max-max);
+    S->sum  *= f;
+    S->sumx *= f;
+    for (i=0; i<THERMO_LAST; i++) S->acc[i] *= f;
+    S->max = max;
+}
+
+/* Fold a conformer, of reduced free energy x and results res, into S */
+static void ens_add(EnsState *S, double x, const double *res) {
+    int i;
+    double w;
+    ens_rescale(S, x);
+    w = exp(x-S->max);
+    S->n++;
+    S->sum  += w;
+    S->sumx += w*x;
+    for (i=0; i<THERMO_LAST; i++) S->acc[i] += w*res[i];
+}
+
+/* Merge the state T into S */
+static void ens_merge(EnsState *S, EnsState *T) {
+    int i;
+    if (T->n==0) return;
+    ens_rescale(S, T->max);
+    ens_rescale(T, S->max);
+    S->n    += T->n;
+    S->sum  += T->sum;
+    S->sumx += T->sumx;
+    for (i=0; i<THERMO_LAST; i++) S->acc[i] += T->acc[i];
+}
+
+/* Task: compute and fold a chunk of conformers */
+static void ens_chunk(int task, int worker, void *data) {
+    EnsJob *J = data;
+    const Thermo *A = J->A;
+    EnsState *S = J->S+task;
+    ThermoContext *old = thermo_context_set(&J->ctx);
+    double RT = CNS_kB*CNS_NA*CNS_j2kcal*J->T, U, Sm, F, *res;
+    int i, last = (task+1)*ENS_CHUNK;
+    Thermo C;
+
+    (void)worker;
+    if (last>J->B->nrec) last = J->B->nrec;
+    ens_init(S);
+    for (i=task*ENS_CHUNK; i<last && J->fail[task]<0; i++) {
+        thermo_init(&C);
+        C.dnu   = A->dnu;
+        C.nu_np = A->nu_np;
+        res = NULL;
+        if (thermo_computerecord(&C, J->B->rec+i)==E_SUCCESS) {
+            res = (C.T==J->T) ? C.results : thermo_computeat(&C, J->T);
+        }
+        if (res!=NULL) {
+            thermo_totqm(res, &U, &Sm, &F);
+            ens_add(S, -F/RT, res);
+            if (res!=C.results) thermo_free(res);
+        } else {
+            J->fail[task] = i;
+        }
+        thermo_delete(&C);
+    }
+    thermo_context_set(old);
+}
+
+/*
+    Results vector (to be freed) of the ensemble of the conformers listed in
+    A->ensfile at temperature T, computed with A->njobs threads. The number
+    of conformers and the mixing entropy [cal/mol/K] are set in n and smixm,
+    if not NULL. Return NULL on failure.
+*/
+double *
+thermo_ensembleat(const Thermo *A, double T, int *n, double *smixm)
+{
+    int t, ntasks, fail = -1;
+    double smix, RT = CNS_kB*CNS_NA*CNS_j2kcal*T, *res;
+    ThermoBatch B;
+    EnsState S;
+    EnsJob J;
+
+    cyg_assert(thermo_readbatch(&B, A->ensfile)==E_SUCCESS, NULL, "Failing reading the conformers of <%s>", A->ensfile);
+    if (B.nrec<1) {
+        thermo_deletebatch(&B);
+        cyg_logErr("No conformers in <%s>", A->ensfile);
+        return NULL;
+    }
+    ntasks = (B.nrec+ENS_CHUNK-1)/ENS_CHUNK;
+
+    J.A    = A;
+    J.T    = T;
+    J.B    = &B;
+    J.ctx  = *thermo_context();
+    J.ctx.out = fopen("/dev/null", "w");
+    J.S    = thermo_realloc(NULL, (size_t)ntasks*sizeof(EnsState));
+    J.fail = thermo_realloc(NULL, (size_t)ntasks*sizeof(int));
+    if (J.ctx.out==NULL || J.S==NULL || J.fail==NULL) {
+        if (J.ctx.out!=NULL) fclose(J.ctx.out);
+        thermo_free(J.S);
+        thermo_free(J.fail);
+        thermo_deletebatch(&B);
+        cyg_logErr("Memory allocation failed!");
+        return NULL;
+    }
+    for (t=0; t<ntasks; t++) J.fail[t] = -1;
+
+#ifdef HAVE_THREADS
+    ThermoPool *pool = (A->njobs>1 && ntasks>1) ? thermo_pool_start(A->njobs, ntasks, NULL, ens_chunk, &J) : NULL;
+    if (pool!=NULL) {
+        thermo_pool_wait(pool);
+    } else {
+        for (t=0; t<ntasks; t++) ens_chunk(t, 0, &J);
+    }
+#else
+    for (t=0; t<ntasks; t++) ens_chunk(t, 0, &J);
+#endif
+    fclose(J.ctx.out);
+
+    /* Merge the chunks in order */
+    ens_init(&S);
+    for (t=0; t<ntasks && fail<0; t++) {
+        fail = J.fail[t];
+        ens_merge(&S, J.S+t);
+    }
+    thermo_free(J.S);
+    thermo_free(J.fail);
+    if (fail>=0) {
+        cyg_logErr("Failing computing conformer <%s> of ensemble <%s>", B.rec[fail].name, A->ensfile);
+        thermo_deletebatch(&B);
+        return NULL;
+    }
+    thermo_deletebatch(&B);
+
+    res = thermo_realloc(NULL, THERMO_LAST*sizeof(double));
+    cyg_assert(res!=NULL, NULL, "Memory allocation failed!");
+    for (t=0; t<THERMO_LAST; t++) res[t] = S.acc[t]/S.sum;
+
+    /* Mixing entropy, in units of R, on the electronic contribution */
+    smix = S.max + log(S.sum) - S.sumx/S.sum;
+    if (smix<0.0) smix = 0.0;
+    res[THERMO_LNQ_ELEC] += smix;
+    res[THERMO_LNQ]      += smix;
+    res[THERMO_S_ELEC]   += 1000.0*RT/T*smix;
+    res[THERMO_S]        += 1000.0*RT/T*smix;
+    res[THERMO_F_ELEC]   -= RT*smix;
+    res[THERMO_F]        -= RT*smix;
+    if (n!=NULL) *n = S.n;
+    if (smixm!=NULL) *smixm = 1000.0*RT/T*smix;
+    return res;
+}
+
+/* Compute the ensemble of the conformers listed in A->ensfile at the temperature of A, into A->results */
+int
+thermo_ensemble(Thermo *A)
+{
+    A->results = thermo_ensembleat(A, A->T, &(A->ens_n), &(A->ens_smix));
+    cyg_assert(A->results!=NULL, E_FAILURE, "Failing computing ensemble <%s>", A->ensfile);
+    fprintf(fpout, "Ensemble of %d conformers from <%s>: mixing entropy %.4f cal/mol/K (%.3f effective conformers)\n",
+            A->ens_n, A->ensfile, A->ens_smix, exp(A->ens_smix/(1000.0*CNS_kB*CNS_NA*CNS_j2kcal)));
+    return E_SUCCESS;
+}
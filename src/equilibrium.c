@@ -0,0 +1,298 @@
+
+/*
+    Equilibrium composition of a reaction network.
+
+    The species with a total concentration are the components, and every
+    other species with a formula is made of them, as dimer = 2 monomer. Only
+    the translational free energy depends on the concentration, and it does
+    so analytically, F_tr(c) = F_tr(1 M) + RT ln(c). The rest of the free
+    energy is computed once, giving the formation constant of each species
+    from its components at the 1 M standard state:
+
+        ln c_j = lnK_j + sum_k A_jk ln x_k
+
+    with x_k the free concentration of component k and A the formula matrix.
+    The mass balance, sum_j A_jk c_j = total_k, is solved by Newton in the
+    unknowns y_k = ln x_k. It is the gradient of the convex function
+
+        phi(y) = sum_j c_j(y) - sum_k total_k y_k
+
+    whose Hessian, J = A^T diag(c) A, is positive definite. Each Newton step
+    is thus solved by Cholesky and made safe by backtracking on phi. Solving
+    for the logarithm of the mass balance makes the step almost exact when a
+    single species dominates, as far from the solution.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+#include <sys/time.h>
+
+#define EQ_MAXITER  200         /* Maximum number of Newton iterations */
+#define EQ_TOL      1E-12       /* Relative tolerance on the mass balance */
+#define EQ_MAXSTEP  10.0        /* Maximum change of ln x in one step */
+#define EQ_MAXLN    700.0       /* Largest ln c before overflow */
+
+/* Equilibrium problem for a network, set up once */
+typedef struct {
+    int ncomp;              /* Number of components */
+    int nsp;                /* Number of species taking part */
+    int *comp;              /* Network index of each component */
+    int *sp;                /* Network index of each species */
+    double *A;              /* Formula matrix (nsp x ncomp) */
+    double *lnK;            /* ln formation constant of each species */
+    double *total;          /* Total concentration of each component [M] */
+    double *y;              /* ln free concentration of each component */
+    double *c;              /* Concentration of each species [M] */
+    double *work;           /* Work space: f, step, trial y, J and its copy */
+} Equilibrium;
+
+/* Concentrations at y, returning phi(y) */
+static double eq_conc(Equilibrium *E, const double *y) {
+    int j, k;
+    double lnc, phi = 0.0;
+    for (j=0; j<E->nsp; j++) {
+        lnc = E->lnK[j];
+        for (k=0; k<E->ncomp; k++) lnc += E->A[j*E->ncomp+k]*y[k];
+        E->c[j] = exp(lnc<EQ_MAXLN ? lnc : EQ_MAXLN);
+        phi += E->c[j];
+    }
+    for (k=0; k<E->ncomp; k++) phi -= E->total[k]*y[k];
+    return phi;
+}
+
+/* Solve J x = b in place (b overwritten by x) by Cholesky, J destroyed */
+static int eq_cholesky(int n, double *J, double *b) {
+    int i, j, k;
+    for (j=0; j<n; j++) {
+        for (k=0; k<j; k++) J[j*n+j] -= J[j*n+k]*J[j*n+k];
+        if (!(J[j*n+j]>0.0)) return E_FAILURE;
+        J[j*n+j] = sqrt(J[j*n+j]);
+        for (i=j+1; i<n; i++) {
+            for (k=0; k<j; k++) J[i*n+j] -= J[i*n+k]*J[j*n+k];
+            J[i*n+j] /= J[j*n+j];
+        }
+    }
+    for (i=0; i<n; i++) {
+        for (k=0; k<i; k++) b[i] -= J[i*n+k]*b[k];
+        b[i] /= J[i*n+i];
+    }
+    for (i=n-1; i>=0; i--) {
+        for (k=i+1; k<n; k++) b[i] -= J[k*n+i]*b[k];
+        b[i] /= J[i*n+i];
+    }
+    return E_SUCCESS;
+}
+
+/*
+    Solve the mass balance starting from the current E->y. Return the number
+    of iterations, or -1 if not converged.
+*/
+static int eq_solve(Equilibrium *E) {
+    int n = E->ncomp, it, j, k, l;
+    double *f = E->work, *dy = f+n, *yt = dy+n, *J = yt+n;
+    double phi, phit = 0.0, slope, t, err, maxdy;
+
+    phi = eq_conc(E, E->y);
+    for (it=0; it<EQ_MAXITER; it++) {
+
+        /* Residual of the mass balance and Jacobian */
+        for (k=0; k<n; k++) f[k] = -E->total[k];
+        for (k=0; k<n*n; k++) J[k] = 0.0;
+        for (j=0; j<E->nsp; j++) {
+            const double *a = E->A + j*n;
+            for (k=0; k<n; k++) {
+                if (a[k]==0.0) continue;
+                f[k] += a[k]*E->c[j];
+                for (l=0; l<=k; l++) J[k*n+l] += a[k]*a[l]*E->c[j];
+            }
+        }
+        err = 0.0;
+        for (k=0; k<n; k++) {
+            if (fabs(f[k])/E->total[k]>err) err = fabs(f[k])/E->total[k];
+        }
+        if (err<EQ_TOL) return it;
+
+        /*
+            Newton step on the logarithm of the mass balance, which is almost
+            linear in y when far from the solution, falling back to the plain
+            Newton step if it is not a descent direction for phi.
+        */
+        for (k=0; k<n*n; k++) J[n*n+k] = J[k];
+        for (k=0; k<n; k++) {
+            double s = f[k]+E->total[k];
+            dy[k] = (s>0.0) ? -s*log(s/E->total[k]) : -f[k];
+        }
+        if (eq_cholesky(n, J, dy)!=E_SUCCESS) return -1;
+        slope = 0.0;
+        for (k=0; k<n; k++) slope += f[k]*dy[k];
+        if (!(slope<0.0)) {
+            for (k=0; k<n; k++) dy[k] = -f[k];
+            if (eq_cholesky(n, J+n*n, dy)!=E_SUCCESS) return -1;
+        }
+        maxdy = 0.0;
+        for (k=0; k<n; k++) {
+            if (fabs(dy[k])>maxdy) maxdy = fabs(dy[k]);
+        }
+        if (maxdy>EQ_MAXSTEP) {
+            for (k=0; k<n; k++) dy[k] *= EQ_MAXSTEP/maxdy;
+        }
+
+        /* Backtracking on phi (Armijo) */
+        slope = 0.0;
+        for (k=0; k<n; k++) slope += f[k]*dy[k];
+        for (t=1.0; t>1E-12; t*=0.5) {
+            for (k=0; k<n; k++) yt[k] = E->y[k] + t*dy[k];
+            phit = eq_conc(E, yt);
+            if (phit<=phi+1E-4*t*slope) break;
+        }
+        for (k=0; k<n; k++) E->y[k] = yt[k];
+        phi = phit;
+    }
+    return -1;
+}
+
+/* Set up the equilibrium problem from the computed network */
+static int eq_setup(Equilibrium *E, const ThermoNetwork *N, double *T) {
+    int i, j, k;
+    double U, S, F, RT;
+    double *mu0;
+    const double R = CNS_kB*CNS_NA*CNS_j2kcal;
+
+    cyg_assert(N->total!=NULL, E_FAILURE, "No total concentration given in the network");
+
+    E->ncomp = E->nsp = 0;
+    E->comp = cyg_malloc(NULL, N->nspecies*cyg_sizeof(int));
+    E->sp   = cyg_malloc(NULL, N->nspecies*cyg_sizeof(int));
+    mu0     = cyg_malloc(NULL, N->nspecies*cyg_sizeof(double));
+    cyg_assert(E->comp!=NULL && E->sp!=NULL && mu0!=NULL, E_FAILURE, "Memory allocation failed!");
+    for (i=0; i<N->nspecies; i++) {
+        if (N->total[i]>0.0) {
+            cyg_assert(!N->hasformula[i], E_FAILURE, "Component <%s> cannot have a formula", N->species[i].name);
+            E->comp[E->ncomp++] = i;
+        }
+        if (N->total[i]>0.0 || N->hasformula[i]) E->sp[E->nsp++] = i;
+    }
+    cyg_assert(E->ncomp>0, E_FAILURE, "No total concentration given in the network");
+    for (i=0; i<N->nspecies; i++) {
+        for (k=0; N->hasformula[i] && k<N->nspecies; k++) {
+            cyg_assert(N->formula[i*N->nspecies+k]==0.0 || N->total[k]>0.0, E_FAILURE,
+                "Formula of <%s> uses <%s>, which is not a component", N->species[i].name, N->species[k].name);
+        }
+    }
+
+    /* Everything at the temperature of the first component */
+    *T = N->T[E->comp[0]];
+    RT = R*(*T);
+    for (j=0; j<E->nsp; j++) {
+        i = E->sp[j];
+        if (fabs(N->T[i]-*T)>1E-6) {
+            fprintf(stderr, "Warning! Species <%s> is at T = %g K. Using T = %g K\n", N->species[i].name, N->T[i], *T);
+        }
+        /* Standard (1 M) chemical potential */
+        thermo_totqm(N->results+i*THERMO_LAST, &U, &S, &F);
+        mu0[i] = F - RT*log(N->conc[i]);
+    }
+
+    E->A     = cyg_malloc(NULL, E->nsp*E->ncomp*cyg_sizeof(double));
+    E->lnK   = cyg_malloc(NULL, E->nsp*cyg_sizeof(double));
+    E->total = cyg_malloc(NULL, E->ncomp*cyg_sizeof(double));
+    E->y     = cyg_malloc(NULL, E->ncomp*cyg_sizeof(double));
+    E->c     = cyg_malloc(NULL, E->nsp*cyg_sizeof(double));
+    E->work  = cyg_malloc(NULL, (3*E->ncomp+2*E->ncomp*E->ncomp)*cyg_sizeof(double));
+    cyg_assert(E->A!=NULL && E->lnK!=NULL && E->total!=NULL && E->y!=NULL && E->c!=NULL && E->work!=NULL,
+        E_FAILURE, "Memory allocation failed!");
+
+    /* Formula matrix and formation constants from the components */
+    for (j=0; j<E->nsp; j++) {
+        i = E->sp[j];
+        E->lnK[j] = -mu0[i]/RT;
+        for (k=0; k<E->ncomp; k++) {
+            if (N->hasformula[i]) {
+                E->A[j*E->ncomp+k] = N->formula[i*N->nspecies+E->comp[k]];
+            } else {
+                E->A[j*E->ncomp+k] = (E->comp[k]==i) ? 1.0 : 0.0;
+            }
+            E->lnK[j] += E->A[j*E->ncomp+k]*mu0[E->comp[k]]/RT;
+        }
+    }
+    for (k=0; k<E->ncomp; k++) {
+        E->total[k] = N->total[E->comp[k]];
+        E->y[k] = log(E->total[k]);
+    }
+    free(mu0);
+    return E_SUCCESS;
+}
+
+/* Free an equilibrium problem */
+static void eq_delete(Equilibrium *E) {
+    free(E->comp);
+    free(E->sp);
+    free(E->A);
+    free(E->lnK);
+    free(E->total);
+    free(E->y);
+    free(E->c);
+    free(E->work);
+}
+
+/*
+    Solve and print the equilibrium composition of a computed network, for
+    the given totals or along the titration of one component. Each point of
+    the titration starts from the solution of the previous one.
+*/
+int
+thermo_printequilibrium(const ThermoNetwork *N, FILE *fp, bool timing)
+{
+    Equilibrium E;
+    int p, np = 1, j, k, kt = -1, it, nit = 0, nfail = 0;
+    double T, from = 0.0, to = 0.0, dt = 0.0;
+    struct timeval t0, t1;
+
+    cyg_assert(eq_setup(&E, N, &T)==E_SUCCESS, E_FAILURE, "Failing setting up the equilibrium");
+
+    if (N->titrate>=0) {
+        for (k=0; k<E.ncomp; k++) {
+            if (E.comp[k]==N->titrate) kt = k;
+        }
+        cyg_assert(kt>=0, E_FAILURE, "Titrated species <%s> is not a component", N->species[N->titrate].name);
+        from = N->titration[0];
+        to   = N->titration[1];
+        np   = (int)N->titration[2];
+    }
+
+    fprintf(fp, "# Equilibrium composition at T = %.2f K: %d components, %d species (concentrations in M)\n", T, E.ncomp, E.nsp);
+    fprintf(fp, "%-6s", "#point");
+    for (k=0; k<E.ncomp; k++) fprintf(fp, " total_%-7s", N->species[E.comp[k]].name);
+    for (j=0; j<E.nsp; j++) fprintf(fp, " %-13s", N->species[E.sp[j]].name);
+    fprintf(fp, "\n");
+
+    for (p=0; p<np; p++) {
+        if (kt>=0) {
+            E.total[kt] = (np>1) ? from*pow(to/from, (double)p/(np-1)) : from;
+        }
+        gettimeofday(&t0, NULL);
+        it = eq_solve(&E);
+        gettimeofday(&t1, NULL);
+        dt += (double)(t1.tv_sec-t0.tv_sec)*1E6 + (double)(t1.tv_usec-t0.tv_usec);
+        if (it<0) {
+            fprintf(stderr, "Warning! Equilibrium not converged at point %d\n", p);
+            nfail++;
+        } else {
+            nit += it;
+        }
+        fprintf(fp, "%-6d", p);
+        for (k=0; k<E.ncomp; k++) fprintf(fp, " %13.6e", E.total[k]);
+        for (j=0; j<E.nsp; j++) fprintf(fp, " %13.6e", E.c[j]);
+        fprintf(fp, "\n");
+    }
+    if (timing) {
+        fprintf(stderr, "Equilibrium: %d points in %.1f us (%.2f us and %.1f iterations per point)\n",
+            np, dt, dt/np, (double)nit/np);
+    }
+
+    eq_delete(&E);
+    return nfail==0 ? E_SUCCESS : E_FAILURE;
+}
+
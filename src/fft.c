@@ -0,0 +1,105 @@
+
+/*
+    Fast Fourier transform of complex data.
+
+    Iterative radix-2 transform, in place on separate real and imaginary
+    arrays: bit reversal permutation, then log2(n) stages of butterflies
+    with tabulated twiddle factors, which can be shared by many transforms
+    of the same length. The length must be a power of two; callers pad
+    their data with zeros (see broaden.c and vacf.c).
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+
+/* Smallest power of two not less than n */
+int
+thermo_fft_size(int n)
+{
+    int m = 1;
+    while (m<n && m<(1<<30)) m <<= 1;
+    return m;
+}
+
+/* Twiddle factors of a transform of n points: cos(2 pi k/n) and sin(2 pi k/n) for k<n/2 */
+double *
+thermo_fft_twiddles(int n)
+{
+    int k;
+    double *tw = thermo_realloc(NULL, (size_t)(n>1 ? n : 2)*sizeof(double));
+    cyg_assert(tw!=NULL, NULL, "Memory allocation failed!");
+    for (k=0; k<n/2; k++) {
+        tw[k]     = cos(2.0*M_PI*k/n);
+        tw[n/2+k] = sin(2.0*M_PI*k/n);
+    }
+    return tw;
+}
+
+/*
+    Transform re + i im (n points, n power of two) in place, with the twiddle
+    factors tw of thermo_fft_twiddles: forward with the kernel exp(-2 pi i
+    jk/n), or inverse with exp(+2 pi i jk/n) and the 1/n normalization.
+    Reusing the factors saves the trigonometry for many transforms of the
+    same length.
+*/
+void
+thermo_fft_tw(double *re, double *im, int n, bool inverse, const double *tw)
+{
+    int i, j, k, len, half, step;
+    double tr, ti, wr, wi, sign = inverse ? 1.0 : -1.0;
+    const double *cs = tw, *sn = tw + n/2;
+
+    if (n<2) return;
+
+    /* Bit reversal */
+    for (i=1, j=0; i<n; i++) {
+        k = n>>1;
+        for (; j&k; k>>=1) j ^= k;
+        j ^= k;
+        if (i<j) {
+            tr = re[i]; re[i] = re[j]; re[j] = tr;
+            ti = im[i]; im[i] = im[j]; im[j] = ti;
+        }
+    }
+
+    /* Butterflies */
+    for (len=2; len<=n; len<<=1) {
+        half = len/2;
+        step = n/len;
+        for (i=0; i<n; i+=len) {
+            for (k=0; k<half; k++) {
+                wr = cs[k*step];
+                wi = sign*sn[k*step];
+                j  = i+k+half;
+                tr = wr*re[j] - wi*im[j];
+                ti = wr*im[j] + wi*re[j];
+                re[j] = re[i+k] - tr;
+                im[j] = im[i+k] - ti;
+                re[i+k] += tr;
+                im[i+k] += ti;
+            }
+        }
+    }
+
+    if (inverse) {
+        for (i=0; i<n; i++) {
+            re[i] /= n;
+            im[i] /= n;
+        }
+    }
+}
+
+/* Transform re + i im (n points, n power of two) in place, as thermo_fft_tw */
+int
+thermo_fft(double *re, double *im, int n, bool inverse)
+{
+    double *tw;
+    cyg_assert(n>0 && (n&(n-1))==0, E_FAILURE, "FFT length %d is not a power of two", n);
+    tw = thermo_fft_twiddles(n);
+    cyg_assert(tw!=NULL, E_FAILURE, "Failing computing the twiddle factors");
+    thermo_fft_tw(re, im, n, inverse, tw);
+    thermo_free(tw);
+    return E_SUCCESS;
+}
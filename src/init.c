@@ -28,8 +28,21 @@ thermo_init(Thermo *A)
     A->pressure = -1;   /* Pressure (set negative as flag) */
     A->dnu = 1.0;     /* Accuracy in vibrational spectra */
     A->nu_np = (int)lrint(ceil(4000.0/A->dnu));
-    A->vdos=NULL;
+    A->spectrum = NULL;
+    A->w = NULL;
+    A->mergetol = 0.0;
+    A->mergevar = NAN;
+    A->unc_nu = 0.0;
+    A->unc_scale = 0.0;
+    A->unc_E = 0.0;
     A->hessfile = NULL;
+    A->qhfile = NULL;
+    A->qhmasses = NULL;
+    A->qhevery = 0;
+    A->njobs = 1;
+    A->ensfile = NULL;
+    A->ens_n = 0;
+    A->ens_smix = 0.0;
 
     A->solute_volume = NAN;
     A->rgyr_m = NAN;
@@ -0,0 +1,241 @@
+
+/*
+    Restart journal of a batch.
+
+    The journal is an append-only file: a header identifying the batch (its
+    records and the format of the output), then one fixed size entry per
+    completed record, in input order, with its return code and the size of
+    the output once it was written. Entries are buffered and written in
+    groups: the output is synced first, then the entries, so that every
+    entry on disk refers to output which is on disk too.
+
+    A new run with the same journal skips the records it lists, cuts the
+    output back to the size after the last of them (dropping any record
+    written after the last sync) and appends the others. A torn entry at the
+    end of the journal, left by a run killed while writing it, is dropped.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+#include <thermoint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define JOURNAL_MAGIC "THERMOJ1"
+#define JOURNAL_SYNCTIME 1.0    /* Seconds between two syncs, at most */
+
+/* Wall time in seconds */
+static double journal_time(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + 1E-6*(double)tv.tv_usec;
+}
+
+/* Checksum of an entry */
+static uint64_t journal_check(const ThermoJournalEntry *e) {
+    uint64_t h = thermo_hash(THERMO_HASH_INIT, &(e->id), sizeof(e->id));
+    h = thermo_hash(h, &(e->status), sizeof(e->status));
+    return thermo_hash(h, &(e->end), sizeof(e->end));
+}
+
+/* Read exactly n bytes, returning false at the end of the file */
+static bool journal_read(int fd, void *buf, size_t n) {
+    ssize_t r;
+    char *p = buf;
+    while (n>0) {
+        r = read(fd, p, n);
+        if (r<0 && errno==EINTR) continue;
+        if (r<=0) return false;
+        p += r;
+        n -= (size_t)r;
+    }
+    return true;
+}
+
+/* Write exactly n bytes */
+static int journal_write(int fd, const void *buf, size_t n) {
+    ssize_t r;
+    const char *p = buf;
+    while (n>0) {
+        r = write(fd, p, n);
+        if (r<0 && errno==EINTR) continue;
+        cyg_assert(r>0, E_FAILURE, "Failing writing journal: %s", strerror(errno));
+        p += r;
+        n -= (size_t)r;
+    }
+    return E_SUCCESS;
+}
+
+/* Open (or create) the journal fname in J, reading the records of previous runs */
+static int journal_open(ThermoJournal *J, const char *fname) {
+    ThermoJournalEntry e;
+    struct stat st;
+
+    memset(J, 0, sizeof(*J));
+    J->fd = open(fname, O_RDWR|O_CREAT, 0666);
+    cyg_assert(J->fd>=0, E_FAILURE, "Impossible to open journal <%s>: %s", fname, strerror(errno));
+    cyg_assert(fstat(J->fd, &st)==0, E_FAILURE, "Impossible to read journal <%s>: %s", fname, strerror(errno));
+
+    /* A new journal, or one killed before its header was written */
+    if ((size_t)st.st_size<sizeof(ThermoJournalHeader)) {
+        cyg_assert(ftruncate(J->fd, 0)==0, E_FAILURE, "Impossible to truncate journal <%s>: %s", fname, strerror(errno));
+        return E_SUCCESS;
+    }
+
+    cyg_assert(journal_read(J->fd, &(J->header), sizeof(J->header)) && memcmp(J->header.magic, JOURNAL_MAGIC, 8)==0,
+        E_FAILURE, "File <%s> is not a journal", fname);
+    J->resume = true;
+    J->end = J->header.start;
+    while (journal_read(J->fd, &e, sizeof(e)) && e.id==J->ndone && e.check==journal_check(&e)) {
+        J->ndone++;
+        if (e.status!=E_SUCCESS) J->nfail++;
+        J->end = e.end;
+    }
+
+    /* Drop anything after the last valid entry */
+    cyg_assert(ftruncate(J->fd, (off_t)(sizeof(J->header)+(size_t)J->ndone*sizeof(e)))==0 &&
+        lseek(J->fd, 0, SEEK_END)>=0, E_FAILURE, "Impossible to truncate journal <%s>: %s", fname, strerror(errno));
+    return E_SUCCESS;
+}
+
+/*
+    Open (or create) the journal fname and read the records completed by
+    previous runs, if any. Return NULL on failure.
+*/
+ThermoJournal *
+thermo_journal_open(const char *fname)
+{
+    ThermoJournal *J = cyg_malloc(NULL, cyg_sizeof(ThermoJournal));
+    cyg_assert(J!=NULL, NULL, "Memory allocation failed!");
+    if (journal_open(J, fname)!=E_SUCCESS) {
+        if (J->fd>=0) close(J->fd);
+        free(J);
+        return NULL;
+    }
+    return J;
+}
+
+/* True if the journal has records of previous runs, to be appended to */
+bool
+thermo_journal_resumed(const ThermoJournal *J)
+{
+    return J->resume;
+}
+
+/*
+    Check that a journal of a previous run belongs to the batch B, written
+    with the format and fields of O, or prepare the header of a new one.
+*/
+int
+thermo_journal_check(ThermoJournal *J, const ThermoBatch *B, const ThermoOutput *O)
+{
+    int i;
+    uint64_t batch = THERMO_HASH_INIT, output;
+
+    for (i=0; i<B->nrec; i++) batch = thermo_hash(batch, B->rec[i].name, strlen(B->rec[i].name)+1);
+    output = thermo_hash(THERMO_HASH_INIT, &(O->format), sizeof(O->format));
+    output = thermo_hash(output, O->field, (size_t)O->nfields*sizeof(int));
+
+    if (J->resume) {
+        cyg_assert(J->header.nrec==(uint64_t)B->nrec && J->header.batch==batch && J->header.output==output,
+            E_FAILURE, "The journal is of another batch or output format; remove it to start again");
+        cyg_assert(J->ndone<=B->nrec, E_FAILURE, "The journal has more records than the batch");
+        return E_SUCCESS;
+    }
+    memcpy(J->header.magic, JOURNAL_MAGIC, 8);
+    J->header.nrec   = (uint64_t)B->nrec;
+    J->header.batch  = batch;
+    J->header.output = output;
+    return E_SUCCESS;
+}
+
+/*
+    Start journaling the records written to out (through the writer w, if not
+    NULL) or stored in the results file R (if not NULL). The output must be
+    ready for the first record not yet done: for a new journal, the header is
+    written with the current size of the output.
+*/
+int
+thermo_journal_start(ThermoJournal *J, FILE *out, ThermoWriter *w, ThermoResults *R)
+{
+    off_t start;
+
+    J->out = out;
+    J->w   = w;
+    J->R   = R;
+    J->tsync = journal_time();
+    if (J->resume) return E_SUCCESS;
+
+    if (w!=NULL) thermo_writer_flush(w);
+    fflush(out);
+    start = ftello(out);
+    cyg_assert(start>=0 && fsync(fileno(out))==0, E_FAILURE, "Failing syncing output: %s", strerror(errno));
+    J->header.start = (uint64_t)start;
+    J->end = J->header.start;
+    cyg_assert(journal_write(J->fd, &(J->header), sizeof(J->header))==E_SUCCESS && fsync(J->fd)==0,
+        E_FAILURE, "Failing writing journal: %s", strerror(errno));
+    J->resume = true;
+    return E_SUCCESS;
+}
+
+/* Sync the output, then write and sync the pending entries */
+int
+thermo_journal_sync(ThermoJournal *J)
+{
+    int i;
+
+    if (J->npending==0) return E_SUCCESS;
+    if (J->R!=NULL) {
+        cyg_assert(msync(J->R->map, J->R->size, MS_SYNC)==0, E_FAILURE, "Failing syncing results file: %s", strerror(errno));
+    } else {
+        if (J->w!=NULL) thermo_writer_flush(J->w);
+        cyg_assert(fflush(J->out)==0 && fsync(fileno(J->out))==0, E_FAILURE, "Failing syncing output: %s", strerror(errno));
+    }
+    for (i=0; i<J->npending; i++) J->pending[i].check = journal_check(J->pending+i);
+    cyg_assert(journal_write(J->fd, J->pending, (size_t)J->npending*sizeof(ThermoJournalEntry))==E_SUCCESS &&
+        fdatasync(J->fd)==0, E_FAILURE, "Failing writing journal: %s", strerror(errno));
+    J->npending = 0;
+    J->tsync = journal_time();
+    return E_SUCCESS;
+}
+
+/*
+    Add record id, completed with the given return code, once it is written
+    to the output. Records must be added in input order. The journal is synced every THERMO_JOURNAL_GROUP
+    records or every JOURNAL_SYNCTIME seconds, whichever comes first.
+*/
+int
+thermo_journal_add(ThermoJournal *J, int id, int status)
+{
+    ThermoJournalEntry *e;
+    off_t end = 0;
+    if (J->npending==THERMO_JOURNAL_GROUP && thermo_journal_sync(J)!=E_SUCCESS) return E_FAILURE;
+    if (J->R==NULL) {
+        end = ftello(J->out);
+        cyg_assert(end>=0, E_FAILURE, "Failing reading the size of the output: %s", strerror(errno));
+        if (J->w!=NULL) end += (off_t)J->w->len;
+    }
+    e = J->pending + J->npending++;
+    memset(e, 0, sizeof(*e));
+    e->id     = id;
+    e->status = status;
+    e->end    = (uint64_t)end;
+    if (J->npending==THERMO_JOURNAL_GROUP || journal_time()-J->tsync>=JOURNAL_SYNCTIME) {
+        return thermo_journal_sync(J);
+    }
+    return E_SUCCESS;
+}
+
+/* Sync the pending entries, close the journal and free J */
+int
+thermo_journal_close(ThermoJournal *J)
+{
+    int ret = thermo_journal_sync(J);
+    close(J->fd);
+    free(J);
+    return ret;
+}
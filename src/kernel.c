@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include <thermo.h>
 
 
@@ -18,6 +19,7 @@
 #define LIGHTSPEED  299792458.0                 /* Speed of light [ m/s ]             */
 #define J2KCALMOL   (AVOGADRO/(4.184*1000.0))   /* Convert joule to kcal/mol [ kcal/J ] */
 #define PI          M_PI                        /* 3.14... */
+#define ELECTRONVOLT 1.602176565E-19            /* Electronvolt [ J ] */
 
 
 /*
@@ -35,6 +37,18 @@ double thermo_kelvin2cm(double kelvin) {
     return kelvin*(BOLTZMANN/(PLANCK*LIGHTSPEED*100.0));
 }
 
+/*
+    Factor converting vibrational frequencies in unit (cm-1, K, Hz or eV)
+    to cm-1, or 0 for an unknown unit.
+*/
+double thermo_freqfactor(const char *unit) {
+    if (strcmp(unit, "cm-1")==0) return 1.0;
+    if (strncmp(unit, "K", 1)==0) return BOLTZMANN/(PLANCK*LIGHTSPEED*100.0);
+    if (strcmp(unit, "Hz")==0)   return 1.0/(LIGHTSPEED*100.0);
+    if (strcmp(unit, "eV")==0)   return ELECTRONVOLT/(PLANCK*LIGHTSPEED*100.0);
+    return 0.0;
+}
+
 /*
     Convert a rotational temperature to a moment of inertia in (g/mol)*A^2.
 */
@@ -305,6 +319,63 @@ static inline void thermo_vibqm(double temperature, int nvib, double *freq, doub
 }
 
 
+/*
+    Weighted vibrations (density of states)
+    ---------------------------------------
+
+    The same quantities for the nvib points of a density of states, each one
+    with its weight w_i (the number of modes it stands for, e.g. the height of
+    a histogram bin times its width, or the weight of a q-point): the sums
+    above become quadratures over the density of states,
+
+    log(q_vib) = sum_i^nvib w_i log(q_i)
+
+    evaluated in one pass, at a cost that depends on the number of points and
+    not on the number of modes. The classical internal energy is kB T times
+    the total weight.
+*/
+
+/* Compute the number of modes (total weight) of a density of states */
+static inline double thermo_vib_dof(int nvib, const double *weight) {
+    int i;
+    double dof = 0.0;
+    for (i=0; i<nvib; i++) {
+        dof += weight[i];
+    }
+    return dof;
+}
+
+/* Compute all F, U, S for classical vibrations over a density of states */
+static inline void thermo_vibcl_w(double temperature, int nvib, double *freq, const double *weight, double *LNQ, double *F, double *U, double *S) {
+    int i;
+    double logq = 0.0;
+    for (i=0; i<nvib; i++) {
+        logq += weight[i]*thermo_vibcl_lnq_one(temperature, freq[i]);
+    }
+    *LNQ = logq;
+    *F   = (-J2KCALMOL*BOLTZMANN)*temperature*logq;
+    *U   = (J2KCALMOL*BOLTZMANN)*temperature*thermo_vib_dof(nvib, weight);
+    *S   = 1000.0 * ( *U - *F ) / temperature;
+}
+
+/* Compute all F, U, S for quantum vibrations over a density of states */
+static inline void thermo_vibqm_w(double temperature, int nvib, double *freq, const double *weight, double *LNQ, double *F, double *U, double *S, double *ZPE) {
+    int i;
+    double x, logq = 0.0, u = 0.0, zpe = 0.0;
+    for (i=0; i<nvib; i++) {
+        x = ((PLANCK*LIGHTSPEED*100.0)*freq[i])/(2.0*BOLTZMANN*temperature);
+        logq += weight[i]*(-log(2.0*sinh(x)));
+        u    += weight[i]*(x/tanh(x));
+        zpe  += weight[i]*freq[i];
+    }
+    *LNQ = logq;
+    *F   = (-J2KCALMOL*BOLTZMANN)*temperature*logq;
+    *U   = (J2KCALMOL*BOLTZMANN)*temperature*u;
+    *S   = 1000.0 * ( *U - *F ) / temperature;
+    *ZPE = (0.5*J2KCALMOL*PLANCK*LIGHTSPEED*100.0)*zpe;
+}
+
+
 /*
     Solation entropy as by:
         A. J. Garza "Solvation Entropy Made Simple", JCTC 2019.
@@ -371,50 +442,117 @@ static inline void solvation_entropy_easysolv(double temperature, double MWs, do
 /*
     Return a description of the given id (index of results array).
 */
+static const char *thermo_desc[THERMO_LAST] = {
+    [THERMO_FIRST]                = "NOTHING_DO_NOT_USE",
+    [THERMO_LNQ_TR]               = "log_translational_partition_function",
+    [THERMO_LNQ_ROT]              = "log_rotational_partition_function",
+    [THERMO_LNQ_VIBCL]            = "log_classical_vibrational_partition_function",
+    [THERMO_LNQ_VIBQM]            = "log_quantum_vibrational_partition_function",
+    [THERMO_LNQ_ELEC]             = "log_electronic_partition_function",
+    [THERMO_LNQ]                  = "log_total_partition_function",
+    [THERMO_U_TR]                 = "translational_internal_energy",
+    [THERMO_U_ROT]                = "rotational_internal_energy",
+    [THERMO_U_VIBCL]              = "classical_vibrational_internal_energy",
+    [THERMO_U_VIBQM]              = "quantum_vibrational_internal_energy",
+    [THERMO_U_ELEC]               = "electronic_internal_energy",
+    [THERMO_U]                    = "total_internal_energy",
+    [THERMO_S_TR]                 = "translational_entropy",
+    [THERMO_S_ROT]                = "rotational_entropy",
+    [THERMO_S_VIBCL]              = "classical_vibrational_entropy",
+    [THERMO_S_VIBQM]              = "quantum_vibrational_entropy",
+    [THERMO_S_ELEC]               = "electronic_vibrational_entropy",
+    [THERMO_S]                    = "total_entropy",
+    [THERMO_F_TR]                 = "translational_free_energy",
+    [THERMO_F_ROT]                = "rotational_free_energy",
+    [THERMO_F_VIBCL]              = "classical_vibrational_free_energy",
+    [THERMO_F_VIBQM]              = "quantum_vibrational_free_energy",
+    [THERMO_F_ELEC]               = "electronic_free_energy",
+    [THERMO_F]                    = "total_free_energy",
+    [THERMO_ZPE]                  = "zero_point_vibrational_energy",
+    [THERMO_S_SOLV_VNEXCL]        = "solvation_entropy_nonexcluded",
+    [THERMO_S_SOLV_VFREE]         = "solvation_entropy_free_volume",
+    [THERMO_S_EASYSOLV_TR]        = "solvation_entropy_easysolv_translations",
+    [THERMO_S_EASYSOLV_ROT]       = "solvation_entropy_easysolv_rotations",
+    [THERMO_S_EASYSOLV_CAV_OMEGA] = "solvation_entropy_easysolv_cavity_omega",
+    [THERMO_S_EASYSOLV_CAV_EPS]   = "solvation_entropy_easysolv_cavity_epsilon",
+    [THERMO_S_EASYSOLV_CAV_ALPHA] = "solvation_entropy_easysolv_cavity_alpha",
+    [THERMO_S_EASYSOLV_TOT_OMEGA] = "solvation_entropy_easysolv_total_omega",
+    [THERMO_S_EASYSOLV_TOT_EPS]   = "solvation_entropy_easysolv_total_epsilon",
+    [THERMO_S_EASYSOLV_TOT_ALPHA] = "solvation_entropy_easysolv_total_alpha",
+};
+
 const char *thermo_description(int id) {
     if (id<=THERMO_FIRST || id>=THERMO_LAST) {
         fprintf(stderr, "Out of bound value for id = %d", id);
         return NULL;
     }
-    const char *desc[THERMO_LAST+1];
-    desc[THERMO_FIRST]                = "NOTHING_DO_NOT_USE";
-    desc[THERMO_LNQ_TR]               = "log_translational_partition_function";
-    desc[THERMO_LNQ_ROT]              = "log_rotational_partition_function";
-    desc[THERMO_LNQ_VIBCL]            = "log_classical_vibrational_partition_function";
-    desc[THERMO_LNQ_VIBQM]            = "log_quantum_vibrational_partition_function";
-    desc[THERMO_LNQ_ELEC]             = "log_electronic_partition_function";
-    desc[THERMO_LNQ]                  = "log_total_partition_function";
-    desc[THERMO_U_TR]                 = "translational_internal_energy";
-    desc[THERMO_U_ROT]                = "rotational_internal_energy";
-    desc[THERMO_U_VIBCL]              = "classical_vibrational_internal_energy";
-    desc[THERMO_U_VIBQM]              = "quantum_vibrational_internal_energy";
-    desc[THERMO_U_ELEC]               = "electronic_internal_energy";
-    desc[THERMO_U]                    = "total_internal_energy";
-    desc[THERMO_S_TR]                 = "translational_entropy";
-    desc[THERMO_S_ROT]                = "rotational_entropy";
-    desc[THERMO_S_VIBCL]              = "classical_vibrational_entropy";
-    desc[THERMO_S_VIBQM]              = "quantum_vibrational_entropy";
-    desc[THERMO_S_ELEC]               = "electronic_vibrational_entropy";
-    desc[THERMO_S]                    = "total_entropy";
-    desc[THERMO_F_TR]                 = "translational_free_energy";
-    desc[THERMO_F_ROT]                = "rotational_free_energy";
-    desc[THERMO_F_VIBCL]              = "classical_vibrational_free_energy";
-    desc[THERMO_F_VIBQM]              = "quantum_vibrational_free_energy";
-    desc[THERMO_F_ELEC]               = "electronic_free_energy";
-    desc[THERMO_F]                    = "total_free_energy";
-    desc[THERMO_ZPE]                  = "zero_point_vibrational_energy";
-    desc[THERMO_S_SOLV_VNEXCL]        = "solvation_entropy_nonexcluded";
-    desc[THERMO_S_SOLV_VFREE]         = "solvation_entropy_free_volume";
-    desc[THERMO_S_EASYSOLV_TR]        = "solvation_entropy_easysolv_translations";
-    desc[THERMO_S_EASYSOLV_ROT]       = "solvation_entropy_easysolv_rotations";
-    desc[THERMO_S_EASYSOLV_CAV_OMEGA] = "solvation_entropy_easysolv_cavity_omega";
-    desc[THERMO_S_EASYSOLV_CAV_EPS]   = "solvation_entropy_easysolv_cavity_epsilon";
-    desc[THERMO_S_EASYSOLV_CAV_ALPHA] = "solvation_entropy_easysolv_cavity_alpha";
-    desc[THERMO_S_EASYSOLV_TOT_OMEGA] = "solvation_entropy_easysolv_total_omega";
-    desc[THERMO_S_EASYSOLV_TOT_EPS]   = "solvation_entropy_easysolv_total_epsilon";
-    desc[THERMO_S_EASYSOLV_TOT_ALPHA] = "solvation_entropy_easysolv_total_alpha";
-    desc[THERMO_LAST]                 = "NOTHING_DO_NOT_USE";
-    return desc[id];
+    return thermo_desc[id];
+}
+
+/* Short name (the THERMO_* enum without prefix) and unit of each quantity */
+static const struct {
+    const char *name;
+    const char *unit;
+} thermo_field[THERMO_LAST] = {
+    [THERMO_FIRST]                = { "FIRST", "" },
+    [THERMO_LNQ_TR]               = { "LNQ_TR", "" },
+    [THERMO_LNQ_ROT]              = { "LNQ_ROT", "" },
+    [THERMO_LNQ_VIBCL]            = { "LNQ_VIBCL", "" },
+    [THERMO_LNQ_VIBQM]            = { "LNQ_VIBQM", "" },
+    [THERMO_LNQ_ELEC]             = { "LNQ_ELEC", "" },
+    [THERMO_LNQ]                  = { "LNQ", "" },
+    [THERMO_U_TR]                 = { "U_TR", "kcal/mol" },
+    [THERMO_U_ROT]                = { "U_ROT", "kcal/mol" },
+    [THERMO_U_VIBCL]              = { "U_VIBCL", "kcal/mol" },
+    [THERMO_U_VIBQM]              = { "U_VIBQM", "kcal/mol" },
+    [THERMO_U_ELEC]               = { "U_ELEC", "kcal/mol" },
+    [THERMO_U]                    = { "U", "kcal/mol" },
+    [THERMO_S_TR]                 = { "S_TR", "cal/mol/K" },
+    [THERMO_S_ROT]                = { "S_ROT", "cal/mol/K" },
+    [THERMO_S_VIBCL]              = { "S_VIBCL", "cal/mol/K" },
+    [THERMO_S_VIBQM]              = { "S_VIBQM", "cal/mol/K" },
+    [THERMO_S_ELEC]               = { "S_ELEC", "cal/mol/K" },
+    [THERMO_S]                    = { "S", "cal/mol/K" },
+    [THERMO_F_TR]                 = { "F_TR", "kcal/mol" },
+    [THERMO_F_ROT]                = { "F_ROT", "kcal/mol" },
+    [THERMO_F_VIBCL]              = { "F_VIBCL", "kcal/mol" },
+    [THERMO_F_VIBQM]              = { "F_VIBQM", "kcal/mol" },
+    [THERMO_F_ELEC]               = { "F_ELEC", "kcal/mol" },
+    [THERMO_F]                    = { "F", "kcal/mol" },
+    [THERMO_ZPE]                  = { "ZPE", "kcal/mol" },
+    [THERMO_S_SOLV_VNEXCL]        = { "S_SOLV_VNEXCL", "cal/mol/K" },
+    [THERMO_S_SOLV_VFREE]         = { "S_SOLV_VFREE", "cal/mol/K" },
+    [THERMO_S_EASYSOLV_TR]        = { "S_EASYSOLV_TR", "cal/mol/K" },
+    [THERMO_S_EASYSOLV_ROT]       = { "S_EASYSOLV_ROT", "cal/mol/K" },
+    [THERMO_S_EASYSOLV_CAV_OMEGA] = { "S_EASYSOLV_CAV_OMEGA", "cal/mol/K" },
+    [THERMO_S_EASYSOLV_CAV_EPS]   = { "S_EASYSOLV_CAV_EPS", "cal/mol/K" },
+    [THERMO_S_EASYSOLV_CAV_ALPHA] = { "S_EASYSOLV_CAV_ALPHA", "cal/mol/K" },
+    [THERMO_S_EASYSOLV_TOT_OMEGA] = { "S_EASYSOLV_TOT_OMEGA", "cal/mol/K" },
+    [THERMO_S_EASYSOLV_TOT_EPS]   = { "S_EASYSOLV_TOT_EPS", "cal/mol/K" },
+    [THERMO_S_EASYSOLV_TOT_ALPHA] = { "S_EASYSOLV_TOT_ALPHA", "cal/mol/K" },
+};
+
+/* Return the short name of the given id (index of results array) */
+const char *thermo_name(int id) {
+    if (id<=THERMO_FIRST || id>=THERMO_LAST) return NULL;
+    return thermo_field[id].name;
+}
+
+/* Return the unit of the given id (index of results array) */
+const char *thermo_unit(int id) {
+    if (id<=THERMO_FIRST || id>=THERMO_LAST) return NULL;
+    return thermo_field[id].unit;
+}
+
+
+/*
+    Total internal energy, entropy and free energy of a results array, using
+    the quantum instead of the classical vibrational contribution.
+*/
+void thermo_totqm(const double *res, double *U, double *S, double *F) {
+    *U = res[THERMO_U] - res[THERMO_U_VIBCL] + res[THERMO_U_VIBQM];
+    *S = res[THERMO_S] - res[THERMO_S_VIBCL] + res[THERMO_S_VIBQM];
+    *F = res[THERMO_F] - res[THERMO_F_VIBCL] + res[THERMO_F_VIBQM];
 }
 
 
@@ -428,14 +566,27 @@ double *thermo_compute(double temperature, double energy,
     double solute_volume, double solvent_volume, double solvent_mass, double solvent_density,
     double solvent_acentricity, double solvent_permittivity, double solvent_expansion,
     double rgyr_m, double rgyr_s, double asa_m, double asa_s) {
+    return thermo_compute_weighted(temperature, energy, ntr, mass, volume, nmols, nrot, inertia, symmetry,
+        nvib, freq, NULL, solute_volume, solvent_volume, solvent_mass, solvent_density,
+        solvent_acentricity, solvent_permittivity, solvent_expansion, rgyr_m, rgyr_s, asa_m, asa_s);
+}
+
+/*
+    As thermo_compute, with the vibrations given as the nvib points freq of a
+    density of states with weights weight (one mode each if NULL).
+*/
+double *thermo_compute_weighted(double temperature, double energy,
+    int ntr, double mass, double volume, double nmols,
+    int nrot, double *inertia, double symmetry,
+    int nvib, double *freq, const double *weight,
+    double solute_volume, double solvent_volume, double solvent_mass, double solvent_density,
+    double solvent_acentricity, double solvent_permittivity, double solvent_expansion,
+    double rgyr_m, double rgyr_s, double asa_m, double asa_s) {
 
     /* Vector to store all results */
     double *res;
-    res = malloc(THERMO_LAST*sizeof(double));
-    if (!res) {
-        fprintf(stderr, "Memory allocation failed!\n");
-        return NULL;
-    }
+    res = thermo_realloc(NULL, THERMO_LAST*sizeof(double));
+    if (!res) return NULL;
 
     /* Initialize everything to zero */
     int i;
@@ -452,8 +603,13 @@ double *thermo_compute(double temperature, double energy,
     /* Ideal gas */
     thermo_tr(temperature, ntr, mass, volume, nmols, res+THERMO_LNQ_TR, res+THERMO_F_TR, res+THERMO_U_TR, res+THERMO_S_TR);
     thermo_rot(temperature, nrot, inertia, symmetry, res+THERMO_LNQ_ROT, res+THERMO_F_ROT, res+THERMO_U_ROT, res+THERMO_S_ROT);
-    thermo_vibcl(temperature, nvib, freq, res+THERMO_LNQ_VIBCL, res+THERMO_F_VIBCL, res+THERMO_U_VIBCL, res+THERMO_S_VIBCL);
-    thermo_vibqm(temperature, nvib, freq, res+THERMO_LNQ_VIBQM, res+THERMO_F_VIBQM, res+THERMO_U_VIBQM, res+THERMO_S_VIBQM, res+THERMO_ZPE);
+    if (weight==NULL) {
+        thermo_vibcl(temperature, nvib, freq, res+THERMO_LNQ_VIBCL, res+THERMO_F_VIBCL, res+THERMO_U_VIBCL, res+THERMO_S_VIBCL);
+        thermo_vibqm(temperature, nvib, freq, res+THERMO_LNQ_VIBQM, res+THERMO_F_VIBQM, res+THERMO_U_VIBQM, res+THERMO_S_VIBQM, res+THERMO_ZPE);
+    } else {
+        thermo_vibcl_w(temperature, nvib, freq, weight, res+THERMO_LNQ_VIBCL, res+THERMO_F_VIBCL, res+THERMO_U_VIBCL, res+THERMO_S_VIBCL);
+        thermo_vibqm_w(temperature, nvib, freq, weight, res+THERMO_LNQ_VIBQM, res+THERMO_F_VIBQM, res+THERMO_U_VIBQM, res+THERMO_S_VIBQM, res+THERMO_ZPE);
+    }
 
     /* Sum totals ideal gas */
     res[THERMO_LNQ] = res[THERMO_LNQ_TR] + res[THERMO_LNQ_ROT] + res[THERMO_LNQ_VIBCL] + res[THERMO_LNQ_ELEC];
@@ -475,3 +631,67 @@ double *thermo_compute(double temperature, double energy,
 }
 
 
+
+/*
+    Batched kernel for many samples of the same system (e.g. the Monte Carlo
+    samples of thermo_uncertainty): the nsamp results vectors res (nsamp x
+    THERMO_LAST, with the translational, rotational and solvation entries
+    already set) get the electronic entries of their energy, the vibrational
+    entries of their nvib frequencies and the totals. The frequencies are
+    stored mode by mode, freq[k*nsamp+s] for mode k of sample s, so that the
+    inner loops run over the samples on contiguous arrays; weight is as in
+    thermo_compute_weighted. Return 0, or 1 if out of memory.
+*/
+int thermo_compute_batch(double temperature, int nsamp, const double *energy,
+    int nvib, const double *freq, const double *weight, double *res) {
+
+    int i, k;
+    double x, w, c, *lnqcl, *lnqqm, *u, *zpe, *r;
+    double kT = J2KCALMOL*BOLTZMANN*temperature, hc = PLANCK*LIGHTSPEED*100.0;
+    double dof = (weight==NULL) ? nvib : thermo_vib_dof(nvib, weight);
+
+    lnqcl = thermo_realloc(NULL, 4*(size_t)(nsamp>0 ? nsamp : 1)*sizeof(double));
+    if (!lnqcl) return 1;
+    lnqqm = lnqcl + nsamp;
+    u     = lnqqm + nsamp;
+    zpe   = u + nsamp;
+    for (i=0; i<nsamp; i++) lnqcl[i] = lnqqm[i] = u[i] = zpe[i] = 0.0;
+
+    /* Classical and quantum sums, one mode at a time over all samples */
+    c = BOLTZMANN*temperature/hc;
+    for (k=0; k<nvib; k++) {
+        const double *f = freq + (size_t)k*(size_t)nsamp;
+        w = (weight==NULL) ? 1.0 : weight[k];
+        for (i=0; i<nsamp; i++) {
+            x = hc*f[i]/(2.0*BOLTZMANN*temperature);
+            lnqcl[i] += w*log(c/f[i]);
+            lnqqm[i] += w*(-log(2.0*sinh(x)));
+            u[i]     += w*(x/tanh(x));
+            zpe[i]   += w*f[i];
+        }
+    }
+
+    for (i=0; i<nsamp; i++) {
+        r = res + (size_t)i*THERMO_LAST;
+        r[THERMO_LNQ_ELEC] = energy[i]/kT;
+        r[THERMO_U_ELEC]   = energy[i];
+        r[THERMO_S_ELEC]   = 0.0;
+        r[THERMO_F_ELEC]   = energy[i];
+        r[THERMO_LNQ_VIBCL] = lnqcl[i];
+        r[THERMO_F_VIBCL]   = -kT*lnqcl[i];
+        r[THERMO_U_VIBCL]   = kT*dof;
+        r[THERMO_S_VIBCL]   = 1000.0*(r[THERMO_U_VIBCL]-r[THERMO_F_VIBCL])/temperature;
+        r[THERMO_LNQ_VIBQM] = lnqqm[i];
+        r[THERMO_F_VIBQM]   = -kT*lnqqm[i];
+        r[THERMO_U_VIBQM]   = kT*u[i];
+        r[THERMO_S_VIBQM]   = 1000.0*(r[THERMO_U_VIBQM]-r[THERMO_F_VIBQM])/temperature;
+        r[THERMO_ZPE]       = (0.5*J2KCALMOL*PLANCK*LIGHTSPEED*100.0)*zpe[i];
+        r[THERMO_LNQ] = r[THERMO_LNQ_TR] + r[THERMO_LNQ_ROT] + r[THERMO_LNQ_VIBCL] + r[THERMO_LNQ_ELEC];
+        r[THERMO_U]   = r[THERMO_U_TR] + r[THERMO_U_ROT] + r[THERMO_U_VIBCL] + r[THERMO_U_ELEC];
+        r[THERMO_S]   = r[THERMO_S_TR] + r[THERMO_S_ROT] + r[THERMO_S_VIBCL] + r[THERMO_S_ELEC];
+        r[THERMO_F]   = r[THERMO_F_TR] + r[THERMO_F_ROT] + r[THERMO_F_VIBCL] + r[THERMO_F_ELEC];
+    }
+
+    thermo_free(lnqcl);
+    return 0;
+}
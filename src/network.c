@@ -0,0 +1,372 @@
+
+/*
+    Reaction network: a set of species, each computed only once, and a set of
+    reactions with arbitrary stoichiometry among them.
+
+    The network file contains lines like:
+
+        species monomer = monomer.inp
+        species dimer   = dimer.inp
+        reaction dimerization = 2 monomer -> dimer
+
+    Species input files are taken relative to the network file. A species must
+    be defined before being used in a reaction. The differences of all
+    thermodynamic quantities for all reactions are obtained as the product of
+    the (sparse) stoichiometry matrix and the matrix of the species results.
+
+    To compute the equilibrium composition (see equilibrium.c), the total
+    concentration of the components and the composition of the other species
+    are given, after all species, as:
+
+        total monomer = 1E-3
+        formula dimer = 2 monomer
+        titration monomer = 1E-6 1E-1 50
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+#include <thermoint.h>
+
+
+/* Remove leading and trailing spaces */
+static char *network_strip(char *str) {
+    size_t l;
+    while (*str!='\0' && strchr(" \t", *str)!=NULL) str++;
+    l = strlen(str);
+    while (l>0 && strchr(" \t\r\n", str[l-1])!=NULL) str[--l] = '\0';
+    return str;
+}
+
+/* Return the index of a species from its name, -1 if not found */
+int
+thermo_network_species(const ThermoNetwork *N, const char *name)
+{
+    int i;
+    for (i=0; i<N->nspecies; i++) {
+        if (strcmp(N->species[i].name, name)==0) return i;
+    }
+    return -1;
+}
+
+/* Add coefficient c for species j to the last reaction */
+static int network_addterm(ThermoNetwork *N, int j, double c) {
+    int k, nnz = N->rowptr[N->nreact];
+    for (k=N->rowptr[N->nreact-1]; k<nnz; k++) {
+        if (N->col[k]==j) {
+            N->nu[k] += c;
+            return E_SUCCESS;
+        }
+    }
+    N->col = cyg_malloc(N->col, (nnz+1)*cyg_sizeof(int));
+    N->nu  = cyg_malloc(N->nu,  (nnz+1)*cyg_sizeof(double));
+    cyg_assert(N->col!=NULL && N->nu!=NULL, E_FAILURE, "Memory allocation failed!");
+    N->col[nnz] = j;
+    N->nu[nnz]  = c;
+    N->rowptr[N->nreact]++;
+    return E_SUCCESS;
+}
+
+/*
+    Parse a sum as "a X + b Y + ...", adding sign*coefficients to the last
+    reaction, or to row of the formula matrix if row is not NULL
+*/
+static int network_addside(ThermoNetwork *N, char *side, double sign, double *row) {
+    char *term, *saveptr, name[64];
+    double c;
+    int j;
+    for (term=strtok_r(side, "+", &saveptr); term!=NULL; term=strtok_r(NULL, "+", &saveptr)) {
+        if (sscanf(term, "%lf %63s", &c, name)!=2) {
+            c = 1.0;
+            cyg_assert(sscanf(term, "%63s", name)==1, E_FAILURE, "Invalid term <%s>", term);
+        }
+        j = thermo_network_species(N, name);
+        cyg_assert(j>=0, E_FAILURE, "Unknown species <%s>", name);
+        if (row!=NULL) {
+            row[j] += sign*c;
+        } else {
+            cyg_assert(network_addterm(N, j, sign*c)==E_SUCCESS, E_FAILURE, "Impossible to add species <%s>", name);
+        }
+    }
+    return E_SUCCESS;
+}
+
+/* Allocate the equilibrium data, once all species are known */
+static int network_initequilibrium(ThermoNetwork *N) {
+    int i;
+    if (N->total!=NULL) return E_SUCCESS;
+    N->total   = cyg_malloc(NULL, N->nspecies*cyg_sizeof(double));
+    N->formula = cyg_malloc(NULL, N->nspecies*N->nspecies*cyg_sizeof(double));
+    N->hasformula = cyg_malloc(NULL, N->nspecies*cyg_sizeof(bool));
+    cyg_assert(N->total!=NULL && N->formula!=NULL && N->hasformula!=NULL, E_FAILURE, "Memory allocation failed!");
+    for (i=0; i<N->nspecies; i++) {
+        N->total[i] = -1.0;
+        N->hasformula[i] = false;
+    }
+    for (i=0; i<N->nspecies*N->nspecies; i++) {
+        N->formula[i] = 0.0;
+    }
+    return E_SUCCESS;
+}
+
+/* Parse a reaction as "reactants -> products" (or "<->") */
+static int network_addreaction(ThermoNetwork *N, const char *name, char *val) {
+    char *arrow = strstr(val, "->");
+    cyg_assert(arrow!=NULL, E_FAILURE, "No arrow -> found in reaction <%s>", name);
+    *arrow = '\0';
+    if (arrow>val && arrow[-1]=='<') arrow[-1] = '\0';
+
+    N->reaction = cyg_malloc(N->reaction, (N->nreact+1)*cyg_sizeof(char *));
+    N->rowptr   = cyg_malloc(N->rowptr, (N->nreact+2)*cyg_sizeof(int));
+    cyg_assert(N->reaction!=NULL && N->rowptr!=NULL, E_FAILURE, "Memory allocation failed!");
+    N->reaction[N->nreact] = strdup(name);
+    N->nreact++;
+    N->rowptr[N->nreact] = N->rowptr[N->nreact-1];
+
+    cyg_assert(network_addside(N, val, -1.0, NULL)==E_SUCCESS, E_FAILURE, "Invalid reactants in reaction <%s>", name);
+    cyg_assert(network_addside(N, arrow+2, 1.0, NULL)==E_SUCCESS, E_FAILURE, "Invalid products in reaction <%s>", name);
+    return E_SUCCESS;
+}
+
+/* Initialize an empty network */
+static void network_init(ThermoNetwork *N) {
+    N->nspecies = 0;
+    N->species  = NULL;
+    N->results  = NULL;
+    N->T        = NULL;
+    N->conc     = NULL;
+    N->nreact   = 0;
+    N->reaction = NULL;
+    N->rowptr   = cyg_malloc(NULL, cyg_sizeof(int));
+    N->rowptr[0] = 0;
+    N->col      = NULL;
+    N->nu       = NULL;
+    N->delta    = NULL;
+    N->total    = NULL;
+    N->formula  = NULL;
+    N->hasformula = NULL;
+    N->titrate  = -1;
+}
+
+/* Read a network file */
+int
+thermo_readnetwork(ThermoNetwork *N, const char *fname)
+{
+    char *row=NULL, *eq, *val, key[16], name[64];
+    int nr, j;
+    size_t rowsize=0;
+    FILE *fp;
+
+    network_init(N);
+
+    fp = cyg_fopen(fname, "r");
+    cyg_assert(fp!=NULL, E_FAILURE, "Error opening network file.");
+
+    while (cyg_getline(&row, &rowsize, fp) != -1) {
+
+        /* Skip empty or comment lines */
+        if (cyg_isstrempty(row, "# \n\r\t\0")) continue;
+
+        /* Split as "key name = value" */
+        eq = strchr(row, '=');
+        cyg_assert(eq!=NULL, E_FAILURE, "Cannot read value in line <%s>", row);
+        *eq = '\0';
+        val = network_strip(eq+1);
+        nr = sscanf(row, "%15s %63s", key, name);
+        cyg_assert(nr==2, E_FAILURE, "Cannot read key and name in line <%s>", row);
+
+        /* Species and its thermo input file */
+        if (strcmp(key, "species")==0) {
+            cyg_assert(thermo_network_species(N, name)<0, E_FAILURE, "Species <%s> defined twice", name);
+            cyg_assert(N->total==NULL, E_FAILURE, "Species <%s> must be defined before totals and formulas", name);
+            N->species = cyg_malloc(N->species, (N->nspecies+1)*cyg_sizeof(ThermoRecord));
+            cyg_assert(N->species!=NULL, E_FAILURE, "Memory allocation failed!");
+            N->species[N->nspecies].name = strdup(name);
+            N->species[N->nspecies].path = thermo_resolvepath(fname, val);
+            N->species[N->nspecies].text = NULL;
+            N->species[N->nspecies].len  = 0;
+            N->nspecies++;
+        }
+
+        /* Reaction among the species defined so far */
+        else if (strcmp(key, "reaction")==0) {
+            cyg_assert(network_addreaction(N, name, val)==E_SUCCESS, E_FAILURE, "Failing reading reaction <%s>", name);
+        }
+
+        /* Total concentration [M] of a component */
+        else if (strcmp(key, "total")==0) {
+            j = thermo_network_species(N, name);
+            cyg_assert(j>=0, E_FAILURE, "Unknown species <%s>", name);
+            cyg_assert(network_initequilibrium(N)==E_SUCCESS, E_FAILURE, "Impossible to setup the equilibrium");
+            nr = sscanf(val, "%lf", N->total+j);
+            cyg_assert(nr==1 && N->total[j]>0.0, E_FAILURE, "Invalid total concentration <%s> for <%s>", val, name);
+        }
+
+        /* Composition of a species in terms of the components */
+        else if (strcmp(key, "formula")==0) {
+            j = thermo_network_species(N, name);
+            cyg_assert(j>=0, E_FAILURE, "Unknown species <%s>", name);
+            cyg_assert(network_initequilibrium(N)==E_SUCCESS, E_FAILURE, "Impossible to setup the equilibrium");
+            cyg_assert(network_addside(N, val, 1.0, N->formula+j*N->nspecies)==E_SUCCESS, E_FAILURE, "Invalid formula for <%s>", name);
+            N->hasformula[j] = true;
+        }
+
+        /* Scan the total concentration of a component */
+        else if (strcmp(key, "titration")==0) {
+            N->titrate = thermo_network_species(N, name);
+            cyg_assert(N->titrate>=0, E_FAILURE, "Unknown species <%s>", name);
+            nr = sscanf(val, "%lf %lf %lf", N->titration, N->titration+1, N->titration+2);
+            cyg_assert(nr==3 && N->titration[0]>0.0 && N->titration[1]>0.0 && N->titration[2]>=1.0,
+                E_FAILURE, "Invalid titration <%s> for <%s>: expected from, to, number of points", val, name);
+        }
+
+        /* Unknown Keyword */
+        else {
+            cyg_logErr("Unknown keyword <%s>", key);
+            return E_FAILURE;
+        }
+    }
+
+    fclose(fp);
+    free(row);
+    return E_SUCCESS;
+}
+
+/* Store the results of a species coming out of the pipeline */
+static void network_store(ThermoJob *job, void *data) {
+    ThermoNetwork *N = data;
+    int i;
+    fwrite(job->log, 1, job->loglen, stderr);
+    if (job->status!=E_SUCCESS) {
+        fprintf(stderr, "Failing computing species <%s>\n", job->rec->name);
+        return;
+    }
+    for (i=0; i<THERMO_LAST; i++) {
+        N->results[job->id*THERMO_LAST+i] = job->A->results[i];
+    }
+    N->T[job->id] = job->A->T;
+    N->conc[job->id] = job->A->n/job->A->V;
+}
+
+/*
+    Compute all species (once each) and the differences for all reactions,
+    as delta = nu * results, with nu the sparse stoichiometry matrix.
+*/
+int
+thermo_calcnetwork(ThermoNetwork *N, double dnu, bool timing)
+{
+    int r, k, i, nfail;
+    const double *res;
+
+    N->results = cyg_malloc(N->results, N->nspecies*THERMO_LAST*cyg_sizeof(double));
+    N->T       = cyg_malloc(N->T, N->nspecies*cyg_sizeof(double));
+    N->conc    = cyg_malloc(N->conc, N->nspecies*cyg_sizeof(double));
+    N->delta   = cyg_malloc(N->delta, N->nreact*THERMO_LAST*cyg_sizeof(double));
+    cyg_assert(N->nspecies==0 || (N->results!=NULL && N->T!=NULL && N->conc!=NULL), E_FAILURE, "Memory allocation failed!");
+    cyg_assert(N->nreact==0 || N->delta!=NULL, E_FAILURE, "Memory allocation failed!");
+
+    /* Compute every species exactly once */
+    nfail = thermo_pipeline(N->nspecies, N->species, NULL, dnu, network_store, N, timing);
+    cyg_assert(nfail==0, E_FAILURE, "Failing computing %d species", nfail);
+
+    /* Sparse stoichiometry matrix times the results matrix */
+    for (r=0; r<N->nreact; r++) {
+        double *d = N->delta + r*THERMO_LAST;
+        for (i=0; i<THERMO_LAST; i++) d[i] = 0.0;
+        for (k=N->rowptr[r]; k<N->rowptr[r+1]; k++) {
+            res = N->results + N->col[k]*THERMO_LAST;
+            for (i=0; i<THERMO_LAST; i++) {
+                d[i] += N->nu[k] * res[i];
+            }
+        }
+    }
+
+    return E_SUCCESS;
+}
+
+/* Temperature of a reaction, taken from its first species */
+static double network_temperature(const ThermoNetwork *N, int r) {
+    int k;
+    double T = (N->rowptr[r]<N->rowptr[r+1]) ? N->T[N->col[N->rowptr[r]]] : 0.0;
+    for (k=N->rowptr[r]+1; k<N->rowptr[r+1]; k++) {
+        if (fabs(N->T[N->col[k]]-T)>1E-6) {
+            fprintf(stderr, "Warning! Species of reaction <%s> have different temperatures. Using T = %g K\n", N->reaction[r], T);
+            break;
+        }
+    }
+    return T;
+}
+
+/*
+    Print the molar differences for all reactions, using quantum vibrations,
+    together with the equilibrium constant K = exp(-dF/RT).
+*/
+void
+thermo_printnetwork(const ThermoNetwork *N, FILE *fp)
+{
+    int r;
+    double T, dU, dS, dF, lnK;
+    const double R = CNS_kB*CNS_NA*CNS_j2kcal;
+
+    fprintf(fp, "# Reaction network: %d species, %d reactions\n", N->nspecies, N->nreact);
+    fprintf(fp, "# Molar differences with quantum vibrations (dUm, dFm in kcal/mol, dSm in cal/mol/K)\n");
+    fprintf(fp, "%-20s %10s %12s %12s %12s %12s %14s\n", "#reaction", "T", "dUm", "dSm", "dFm", "lnK", "K");
+    for (r=0; r<N->nreact; r++) {
+        T = network_temperature(N, r);
+        thermo_totqm(N->delta+r*THERMO_LAST, &dU, &dS, &dF);
+        lnK = -dF/(R*T);
+        fprintf(fp, "%-20s %10.2f %12.3f %12.3f %12.3f %12.4f %14.6e\n", N->reaction[r], T, dU, dS, dF, lnK, exp(lnK));
+    }
+    return;
+}
+
+/* Write one record per species, then one per reaction (the differences) */
+int
+thermo_outputnetwork(const ThermoNetwork *N, const ThermoOutput *O, FILE *fp)
+{
+    int i;
+    ThermoWriter *w = cyg_malloc(NULL, cyg_sizeof(ThermoWriter));
+    cyg_assert(w!=NULL, E_FAILURE, "Memory allocation failed!");
+    thermo_writer_init(w, fp);
+    thermo_output_header(O, w);
+    for (i=0; i<N->nspecies; i++) {
+        thermo_output_record(O, w, N->species[i].name, N->results+i*THERMO_LAST);
+    }
+    for (i=0; i<N->nreact; i++) {
+        thermo_output_record(O, w, N->reaction[i], N->delta+i*THERMO_LAST);
+    }
+    i = thermo_writer_flush(w);
+    free(w);
+    return i;
+}
+
+/* Free all memory of a network */
+void
+thermo_deletenetwork(ThermoNetwork *N)
+{
+    int i;
+    for (i=0; i<N->nspecies; i++) {
+        free(N->species[i].name);
+        free(N->species[i].path);
+    }
+    for (i=0; i<N->nreact; i++) {
+        free(N->reaction[i]);
+    }
+    free(N->species);
+    free(N->results);
+    free(N->T);
+    free(N->conc);
+    free(N->total);
+    free(N->formula);
+    free(N->hasformula);
+    free(N->reaction);
+    free(N->rowptr);
+    free(N->col);
+    free(N->nu);
+    free(N->delta);
+    N->nspecies = 0;
+    N->nreact   = 0;
+    return;
+}
+
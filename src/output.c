@@ -0,0 +1,419 @@
+
+/*
+    Machine-readable output: one record per line as JSON Lines or CSV, with
+    a selectable set of fields, written through a buffered writer.
+
+    Doubles are written with the shortest digits that read back to the same
+    value, using the Grisu2 algorithm (F. Loitsch, "Printing floating-point
+    numbers quickly and accurately with integers", PLDI 2010): the value and
+    its rounding boundaries are scaled by a cached power of ten so that all
+    digits are generated with 64 bit integer arithmetic only.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+
+/* Floating point number f*2^e with a 64 bit significand */
+typedef struct {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+#define DP_HIDDEN   0x0010000000000000ULL
+#define DP_FRACTION 0x000FFFFFFFFFFFFFULL
+#define DP_EXPONENT 0x7FF0000000000000ULL
+
+/* Normalized 64 bit approximations of 10^k, for k = -348, -340, ..., 340 */
+static const uint64_t dtoa_powf[] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL, 0xcf42894a5dce35eaULL,
+    0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL, 0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL,
+    0xbe5691ef416bd60cULL, 0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL, 0xc21094364dfb5637ULL,
+    0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL, 0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL,
+    0xb23867fb2a35b28eULL, 0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL, 0xb5b5ada8aaff80b8ULL,
+    0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL, 0x964e858c91ba2655ULL, 0xdff9772470297ebdULL,
+    0xa6dfbd9fb8e5b88fULL, 0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL, 0xaa242499697392d3ULL,
+    0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL, 0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL,
+    0x9c40000000000000ULL, 0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL, 0x9f4f2726179a2245ULL,
+    0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL, 0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL,
+    0x924d692ca61be758ULL, 0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL, 0x952ab45cfa97a0b3ULL,
+    0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL, 0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL,
+    0x88fcf317f22241e2ULL, 0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL, 0x8bab8eefb6409c1aULL,
+    0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL, 0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL,
+    0x80444b5e7aa7cf85ULL, 0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL,
+};
+static const int16_t dtoa_powe[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927,
+    -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608,
+    -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316, -289,
+    -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+    56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667,
+    694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986,
+    1013, 1039, 1066,
+};
+
+static const uint32_t dtoa_pow10[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+
+static DiyFp dtoa_diyfp(double d) {
+    DiyFp x;
+    uint64_t u, e;
+    memcpy(&u, &d, sizeof(u));
+    e = (u & DP_EXPONENT) >> 52;
+    if (e!=0) {
+        x.f = (u & DP_FRACTION) + DP_HIDDEN;
+        x.e = (int)e - 1075;
+    } else {
+        x.f = u & DP_FRACTION;
+        x.e = -1074;
+    }
+    return x;
+}
+
+/* Product rounded to the upper 64 bits */
+static DiyFp dtoa_mul(DiyFp x, DiyFp y) {
+    const uint64_t M32 = 0xFFFFFFFFULL;
+    uint64_t a = x.f >> 32, b = x.f & M32, c = y.f >> 32, d = y.f & M32;
+    uint64_t ac = a*c, bc = b*c, ad = a*d, bd = b*d;
+    uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32) + (1ULL << 31);
+    DiyFp r = { ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64 };
+    return r;
+}
+
+static DiyFp dtoa_normalize(DiyFp x) {
+    while (!(x.f & 0x8000000000000000ULL)) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+/* Boundaries m- and m+ of x, normalized with the same exponent */
+static void dtoa_boundaries(DiyFp x, DiyFp *mm, DiyFp *mp) {
+    DiyFp p = { (x.f << 1) + 1, x.e - 1 }, m;
+    p = dtoa_normalize(p);
+    if (x.f==DP_HIDDEN) {
+        m.f = (x.f << 2) - 1;
+        m.e = x.e - 2;
+    } else {
+        m.f = (x.f << 1) - 1;
+        m.e = x.e - 1;
+    }
+    m.f <<= m.e - p.e;
+    m.e = p.e;
+    *mm = m;
+    *mp = p;
+}
+
+/* Cached power c = 10^-K such that the product with 2^e has exponent in [-60,-32] */
+static DiyFp dtoa_cachedpower(int e, int *K) {
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int k = (int)dk, index;
+    DiyFp c;
+    if (dk - k > 0.0) k++;
+    index = (k >> 3) + 1;
+    *K = -(-348 + index*8);
+    c.f = dtoa_powf[index];
+    c.e = dtoa_powe[index];
+    return c;
+}
+
+static int dtoa_countdigits(uint32_t n) {
+    int d = 1;
+    while (d<10 && n>=dtoa_pow10[d]) d++;
+    return d;
+}
+
+/* Move the last digit towards w, while staying within the boundaries */
+static void dtoa_round(char *buf, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w) {
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        buf[len-1]--;
+        rest += ten_kappa;
+    }
+}
+
+/* Generate the shortest digits of w within (mp-delta, mp) */
+static int dtoa_digits(DiyFp w, DiyFp mp, uint64_t delta, char *buf, int *K) {
+    DiyFp one = { 1ULL << -mp.e, mp.e };
+    uint64_t wp_w = mp.f - w.f, p2 = mp.f & (one.f - 1), tmp;
+    uint32_t p1 = (uint32_t)(mp.f >> -one.e), d;
+    int kappa = dtoa_countdigits(p1), len = 0;
+
+    while (kappa > 0) {
+        d = p1 / dtoa_pow10[kappa-1];
+        p1 %= dtoa_pow10[kappa-1];
+        if (d || len) buf[len++] = (char)('0' + d);
+        kappa--;
+        tmp = ((uint64_t)p1 << -one.e) + p2;
+        if (tmp <= delta) {
+            *K += kappa;
+            dtoa_round(buf, len, delta, tmp, (uint64_t)dtoa_pow10[kappa] << -one.e, wp_w);
+            return len;
+        }
+    }
+    while (1) {
+        p2 *= 10;
+        delta *= 10;
+        d = (uint32_t)(p2 >> -one.e);
+        if (d || len) buf[len++] = (char)('0' + d);
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta) {
+            *K += kappa;
+            dtoa_round(buf, len, delta, p2, one.f, wp_w * (-kappa < 10 ? dtoa_pow10[-kappa] : 0));
+            return len;
+        }
+    }
+}
+
+/* Write digits[0..len) * 10^k in the shortest of fixed or exponential notation */
+static int dtoa_format(char *buf, int len, int k) {
+    int i, kk = len + k;   /* 10^(kk-1) <= v < 10^kk */
+    if (0 <= k && kk <= 21) {
+        /* Integer: 1234e7 -> 12340000000 */
+        for (i=len; i<kk; i++) buf[i] = '0';
+        return kk;
+    } else if (0 < kk && kk <= 21) {
+        /* 1234e-2 -> 12.34 */
+        memmove(buf+kk+1, buf+kk, (size_t)(len-kk));
+        buf[kk] = '.';
+        return len+1;
+    } else if (-6 < kk && kk <= 0) {
+        /* 1234e-6 -> 0.001234 */
+        int offset = 2 - kk;
+        memmove(buf+offset, buf, (size_t)len);
+        buf[0] = '0';
+        buf[1] = '.';
+        for (i=2; i<offset; i++) buf[i] = '0';
+        return len+offset;
+    } else {
+        /* 1234e30 -> 1.234e33 */
+        if (len>1) {
+            memmove(buf+2, buf+1, (size_t)(len-1));
+            buf[1] = '.';
+            len++;
+        }
+        return len + sprintf(buf+len, "e%d", kk-1);
+    }
+}
+
+/*
+    Write in buf (at least 32 chars) the shortest text reading back as v, and
+    return its length. NaN and infinities are written as "nan", "inf", "-inf".
+*/
+int
+thermo_dtoa(double v, char *buf)
+{
+    DiyFp w, mm, mp, c;
+    int K, len, neg = 0;
+
+    if (isnan(v)) return sprintf(buf, "nan");
+    if (signbit(v)) {
+        *buf++ = '-';
+        v = -v;
+        neg = 1;
+    }
+    if (isinf(v)) return neg + sprintf(buf, "inf");
+    if (v==0.0) {
+        buf[0] = '0';
+        return neg+1;
+    }
+
+    w = dtoa_diyfp(v);
+    dtoa_boundaries(w, &mm, &mp);
+    c = dtoa_cachedpower(mp.e, &K);
+    w  = dtoa_mul(dtoa_normalize(w), c);
+    mp = dtoa_mul(mp, c);
+    mm = dtoa_mul(mm, c);
+    mm.f++;
+    mp.f--;
+    len = dtoa_digits(w, mp, mp.f - mm.f, buf, &K);
+    return neg + dtoa_format(buf, len, K);
+}
+
+/* Start writing to fp */
+void
+thermo_writer_init(ThermoWriter *w, FILE *fp)
+{
+    w->fp  = fp;
+    w->len = 0;
+}
+
+/* Write the buffered text to the stream */
+int
+thermo_writer_flush(ThermoWriter *w)
+{
+    size_t n = fwrite(w->buf, 1, w->len, w->fp);
+    cyg_assert(n==w->len, E_FAILURE, "Impossible to write the output: %s", strerror(errno));
+    w->len = 0;
+    return E_SUCCESS;
+}
+
+/* Append len bytes of str */
+void
+thermo_write_str(ThermoWriter *w, const char *str, size_t len)
+{
+    if (w->len+len > THERMO_WRITER_SIZE) thermo_writer_flush(w);
+    if (len > THERMO_WRITER_SIZE) {
+        fwrite(str, 1, len, w->fp);
+        return;
+    }
+    memcpy(w->buf+w->len, str, len);
+    w->len += len;
+}
+
+/* Append a double, with the shortest text reading back as the same value */
+void
+thermo_write_double(ThermoWriter *w, double v)
+{
+    if (w->len+32 > THERMO_WRITER_SIZE) thermo_writer_flush(w);
+    w->len += (size_t)thermo_dtoa(v, w->buf+w->len);
+}
+
+/* Append a record name, quoted and escaped as needed by the format */
+static void output_name(ThermoWriter *w, int format, const char *name) {
+    const char *p;
+    char esc[8];
+    if (format==THERMO_FORMAT_JSONL) {
+        thermo_write_str(w, "\"", 1);
+        for (p=name; *p; p++) {
+            if (*p=='"' || *p=='\\') {
+                esc[0] = '\\';
+                esc[1] = *p;
+                thermo_write_str(w, esc, 2);
+            } else if ((unsigned char)*p < 0x20) {
+                snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char)*p);
+                thermo_write_str(w, esc, 6);
+            } else {
+                thermo_write_str(w, p, 1);
+            }
+        }
+        thermo_write_str(w, "\"", 1);
+    } else if (format==THERMO_FORMAT_CSV && strpbrk(name, ",\"\r\n")!=NULL) {
+        thermo_write_str(w, "\"", 1);
+        for (p=name; *p; p++) {
+            thermo_write_str(w, p, 1);
+            if (*p=='"') thermo_write_str(w, "\"", 1);
+        }
+        thermo_write_str(w, "\"", 1);
+    } else {
+        thermo_write_str(w, name, strlen(name));
+    }
+}
+
+/* Index in the results array of the field called name, or -1 */
+int
+thermo_findfield(const char *name)
+{
+    int i;
+    for (i=THERMO_FIRST+1; i<THERMO_LAST; i++) {
+        if (strcmp(name, thermo_description(i))==0) return i;
+    }
+    return -1;
+}
+
+/*
+    Setup the output of records: format is "text" (the default, one row of
+    fixed precision values), "jsonl", "csv" or "bin" (a results file, batch
+    mode only); fields is a comma separated list of field names (all fields
+    if NULL).
+*/
+int
+thermo_output_init(ThermoOutput *O, const char *format, const char *fields)
+{
+    char *list, *tok, *save = NULL;
+    int id;
+
+    if (format==NULL || strcmp(format, "text")==0) {
+        O->format = THERMO_FORMAT_TEXT;
+    } else if (strcmp(format, "jsonl")==0) {
+        O->format = THERMO_FORMAT_JSONL;
+    } else if (strcmp(format, "csv")==0) {
+        O->format = THERMO_FORMAT_CSV;
+    } else if (strcmp(format, "bin")==0) {
+        O->format = THERMO_FORMAT_BINARY;
+    } else {
+        cyg_logErr("Unknown output format <%s>: use text, jsonl, csv or bin", format);
+        return E_FAILURE;
+    }
+
+    O->nfields = 0;
+    if (fields==NULL) {
+        for (id=THERMO_FIRST+1; id<THERMO_LAST; id++) O->field[O->nfields++] = id;
+        return E_SUCCESS;
+    }
+    list = strdup(fields);
+    cyg_assert(list!=NULL, E_FAILURE, "Memory allocation failed!");
+    for (tok=strtok_r(list, ",", &save); tok!=NULL; tok=strtok_r(NULL, ",", &save)) {
+        id = thermo_findfield(tok);
+        if (id<0 || O->nfields>=THERMO_LAST) {
+            cyg_logErr("Unknown output field <%s>", tok);
+            free(list);
+            return E_FAILURE;
+        }
+        O->field[O->nfields++] = id;
+    }
+    free(list);
+    cyg_assert(O->nfields>0, E_FAILURE, "No output fields selected");
+    return E_SUCCESS;
+}
+
+/* Write the header line of the records (nothing for JSON Lines) */
+void
+thermo_output_header(const ThermoOutput *O, ThermoWriter *w)
+{
+    int i;
+    const char *desc;
+    const char *head = (O->format==THERMO_FORMAT_CSV) ? "record" : "#record";
+    const char *sep  = (O->format==THERMO_FORMAT_CSV) ? "," : " ";
+    if (O->format==THERMO_FORMAT_JSONL) return;
+    thermo_write_str(w, head, strlen(head));
+    for (i=0; i<O->nfields; i++) {
+        desc = thermo_description(O->field[i]);
+        thermo_write_str(w, sep, 1);
+        thermo_write_str(w, desc, strlen(desc));
+    }
+    thermo_write_str(w, "\n", 1);
+}
+
+/* Write the selected fields of the results of one record */
+void
+thermo_output_record(const ThermoOutput *O, ThermoWriter *w, const char *name, const double *results)
+{
+    int i;
+    double v;
+    char num[512];   /* Fits any %.6f */
+    const char *desc;
+
+    if (O->format==THERMO_FORMAT_JSONL) thermo_write_str(w, "{\"record\":", 10);
+    output_name(w, O->format, name);
+    for (i=0; i<O->nfields; i++) {
+        v = results[O->field[i]];
+        switch (O->format) {
+            case THERMO_FORMAT_JSONL:
+                desc = thermo_description(O->field[i]);
+                thermo_write_str(w, ",\"", 2);
+                thermo_write_str(w, desc, strlen(desc));
+                thermo_write_str(w, "\":", 2);
+                if (isfinite(v)) thermo_write_double(w, v); else thermo_write_str(w, "null", 4);
+                break;
+            case THERMO_FORMAT_CSV:
+                thermo_write_str(w, ",", 1);
+                thermo_write_double(w, v);
+                break;
+            default:
+                thermo_write_str(w, num, (size_t)snprintf(num, sizeof(num), " %.6f", v));
+        }
+    }
+    if (O->format==THERMO_FORMAT_JSONL) thermo_write_str(w, "}", 1);
+    thermo_write_str(w, "\n", 1);
+}
@@ -0,0 +1,94 @@
+
+/*
+    Fast conversion of text to double, for long lists of numbers.
+
+    Numbers with at most 19 significant digits and a decimal exponent within
+    +-22 are converted exactly with a single floating point multiplication
+    or division: both the integer made of the digits (if below 2^53) and the
+    power of ten are exactly representable, so the result is correctly
+    rounded (W. D. Clinger, "How to read floating point numbers accurately",
+    PLDI 1990). Anything else (more digits, large exponents, hexadecimal,
+    inf, nan) goes through strtod, so that the result is always the same.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+
+static const double parse_pow10[] = {
+    1E0,  1E1,  1E2,  1E3,  1E4,  1E5,  1E6,  1E7,  1E8,  1E9,  1E10, 1E11,
+    1E12, 1E13, 1E14, 1E15, 1E16, 1E17, 1E18, 1E19, 1E20, 1E21, 1E22
+};
+
+/* Fallback: copy the token to a terminated buffer and use strtod */
+static const char *parse_strtod(const char *p, const char *end, double *v) {
+    char buf[128], *stop;
+    size_t n = 0;
+    double x;
+    while (p+n<end && n<sizeof(buf)-1 && p[n]!='\n' && p[n]!='\0') n++;
+    memcpy(buf, p, n);
+    buf[n] = '\0';
+    x = strtod(buf, &stop);
+    if (stop==buf) return NULL;
+    *v = x;
+    return p + (stop-buf);
+}
+
+/*
+    Read a double from [p, end), after optional blanks, as sscanf("%lf")
+    would. Return the first character after the number, or NULL if there is
+    no number.
+*/
+const char *
+thermo_parsedouble(const char *p, const char *end, double *v)
+{
+    const char *start, *q;
+    uint64_t m = 0;
+    int ndig = 0, nsig = 0, exp10 = 0, e = 0, esign = 1;
+    bool neg = false;
+
+    while (p<end && (*p==' ' || *p=='\t' || *p=='\r' || *p=='\v' || *p=='\f')) p++;
+    start = p;
+    if (p<end && (*p=='-' || *p=='+')) neg = (*p++=='-');
+
+    /* Integer and fractional digits: leading zeros are not significant */
+    for (; p<end && *p>='0' && *p<='9'; p++, ndig++) {
+        if (m==0 && *p=='0') continue;
+        if (nsig++<19) m = 10*m + (uint64_t)(*p-'0'); else exp10++;
+    }
+    if (p<end && *p=='.') {
+        for (p++; p<end && *p>='0' && *p<='9'; p++, ndig++) {
+            if (m==0 && *p=='0') {
+                exp10--;
+                continue;
+            }
+            if (nsig++<19) {
+                m = 10*m + (uint64_t)(*p-'0');
+                exp10--;
+            }
+        }
+    }
+    if (ndig==0) return parse_strtod(start, end, v);
+
+    /* Exponent, only if followed by digits */
+    if (p<end && (*p=='e' || *p=='E')) {
+        q = p+1;
+        if (q<end && (*q=='-' || *q=='+')) esign = (*q++=='-') ? -1 : 1;
+        if (q<end && *q>='0' && *q<='9') {
+            for (; q<end && *q>='0' && *q<='9'; q++) {
+                if (e<100000) e = 10*e + (*q-'0');
+            }
+            exp10 += esign*e;
+            p = q;
+        }
+    }
+    if (p<end && (*p=='x' || *p=='X')) return parse_strtod(start, end, v);
+
+    /* Clinger's fast path, else strtod */
+    if (nsig>19 || m>(1ULL<<53) || exp10<-22 || exp10>22) return parse_strtod(start, end, v);
+    *v = (double)m;
+    *v = (exp10<0) ? *v/parse_pow10[-exp10] : *v*parse_pow10[exp10];
+    if (neg) *v = -*v;
+    return p;
+}
@@ -0,0 +1,436 @@
+
+/*
+    Staged pipeline to process a list of records:
+
+        read -> parse -> diagonalize -> compute -> format
+
+    Each stage runs in its own thread and consecutive stages are connected by
+    bounded queues, so that while a record is being diagonalized the next one
+    is already read (together with its hessian file) and parsed. The format
+    stage runs in the calling thread, in input order. The messages printed
+    while processing a record are kept in a per-record log, so that the
+    formatted output does not depend on the scheduling.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+#include <thermoint.h>
+#include <stdatomic.h>
+
+#define PIPE_NSTAGES 5      /* Number of stages, including format */
+#define PIPE_QUEUE   2      /* Capacity of the queues between stages */
+
+static const char *pipeline_stagename[PIPE_NSTAGES] = {"read", "parse", "diagonalize", "compute", "format"};
+
+/* Wall time in seconds */
+static double pipeline_time(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + 1E-6*(double)tv.tv_usec;
+}
+
+/* Find the value of the hessian key in the text of a record */
+static bool pipeline_hessfile(const char *text, size_t len, char *hessfile) {
+    const char *row = text, *end = text+len, *val;
+    while (row<end) {
+        if (strncmp(row, "hessian", 4)==0) {
+            val = memchr(row, '=', (size_t)(end-row));
+            return (val!=NULL && sscanf(val+1, "%127s", hessfile)==1);
+        }
+        row = memchr(row, '\n', (size_t)(end-row));
+        if (row==NULL) break;
+        row++;
+    }
+    return false;
+}
+
+/* Stage: read the record (and its hessian) in memory */
+static int pipeline_read(ThermoJob *job) {
+    char hessfile[128];
+    if (job->rec->path!=NULL) {
+        job->text = thermo_slurp(job->rec->path, &job->len);
+        cyg_assert(job->text!=NULL, E_FAILURE, "Failing reading thermo input file <%s>", job->rec->path);
+    } else {
+        job->text = job->rec->text;
+        job->len  = job->rec->len;
+    }
+    if (job->len>0 && pipeline_hessfile(job->text, job->len, hessfile)) {
+        /* If it fails the parse stage will try again and report the error */
+        job->hess = thermo_slurp(hessfile, &job->hesslen);
+    }
+    return E_SUCCESS;
+}
+
+/*
+    Stage: parse the record and the hessian. With a cache, the results of a
+    temporary Thermo structure are looked up, and the hessian is left to the
+    diagonalize stage, which can skip it if its eigenvalues are cached.
+*/
+static int pipeline_parse(ThermoJob *job) {
+    int ret = E_SUCCESS, n;
+    FILE *fp;
+    ret = thermo_readthermo_buf(job->A, job->text, job->len);
+    if (ret!=E_SUCCESS && job->rec->path!=NULL) {
+        free(job->text);
+        job->text = NULL;
+    }
+    cyg_assert(ret==E_SUCCESS, E_FAILURE, "Failing reading thermo input file <%s>", job->rec->name);
+    if (!job->A->hessfile || job->hess!=NULL) {
+        job->key = thermo_arraykey(thermo_cache_key(job->text, job->len, job->hess, job->hesslen), job->A);
+    }
+    if (thermo_cache_enabled() && job->owned && (!job->A->hessfile || job->hess!=NULL) && !job->A->qhfile && !job->A->ensfile) {
+        job->haskey = true;
+        job->A->results = thermo_cache_get(THERMO_CACHE_RESULTS, job->key, &n);
+        job->cached = (job->A->results!=NULL && n==THERMO_LAST);
+    }
+    if (job->rec->path!=NULL) free(job->text);
+    job->text = NULL;
+    if (job->cached || (thermo_cache_enabled() && job->hess!=NULL)) return E_SUCCESS;
+    if (job->A->hessfile) {
+        if (job->hess!=NULL) {
+            fp = fmemopen(job->hess, job->hesslen, "r");
+            cyg_assert(fp!=NULL, E_FAILURE, "Impossible to open hessian <%s>: %s", job->A->hessfile, strerror(errno));
+            ret = thermo_readhessian_fp(job->A, fp);
+            fclose(fp);
+        } else {
+            ret = thermo_readhessian(job->A);
+        }
+    }
+    free(job->hess);
+    job->hess = NULL;
+    return ret;
+}
+
+/* Stage: diagonalize the hessian, or the covariance of the trajectory */
+static int pipeline_diagonalize(ThermoJob *job) {
+    int ret;
+    if (job->cached) return E_SUCCESS;
+    if (job->A->qhfile) return thermo_quasiharmonic(job->A);
+    if (!job->A->hessfile) return E_SUCCESS;
+    if (job->hess==NULL) return thermo_calcfreqs(job->A);
+    ret = thermo_cache_freqs(job->A, job->hess, job->hesslen);
+    free(job->hess);
+    job->hess = NULL;
+    return ret;
+}
+
+/* Stage: compute the thermodynamic quantities */
+static int pipeline_compute(ThermoJob *job) {
+    if (job->cached) return E_SUCCESS;
+    thermo_calcthermo(job->A);
+    if (job->A->results==NULL) return E_FAILURE;
+    if (job->haskey) thermo_cache_put(THERMO_CACHE_RESULTS, job->key, job->A->results, THERMO_LAST);
+    return E_SUCCESS;
+}
+
+static int (*pipeline_stage[PIPE_NSTAGES-1])(ThermoJob *) = {pipeline_read, pipeline_parse, pipeline_diagonalize, pipeline_compute};
+
+/* Run one stage on a job, with the messages going to the job log */
+static double pipeline_runstage(int stage, ThermoJob *job) {
+    double t0 = pipeline_time();
+    FILE *fplog = fpout;
+    if (job->status==E_SUCCESS) {
+        fpout = job->logfp;
+        job->status = pipeline_stage[stage](job);
+        fpout = fplog;
+    }
+    return pipeline_time()-t0;
+}
+
+/* Create a new job for record i */
+static ThermoJob *pipeline_newjob(int i, const ThermoRecord *rec, Thermo **A, double dnu) {
+    ThermoJob *job = cyg_malloc(NULL, cyg_sizeof(ThermoJob));
+    cyg_assert(job!=NULL, NULL, "Memory allocation failed!");
+    job->id      = i;
+    job->rec     = rec+i;
+    job->status  = E_SUCCESS;
+    job->log     = NULL;
+    job->loglen  = 0;
+    job->text    = NULL;
+    job->len     = 0;
+    job->hess    = NULL;
+    job->hesslen = 0;
+    job->owned   = (A==NULL);
+    job->cached  = false;
+    job->haskey  = false;
+    job->key     = 0;
+    job->logfp   = open_memstream(&job->log, &job->loglen);
+    cyg_assert(job->logfp!=NULL, NULL, "Impossible to open log: %s", strerror(errno));
+    if (A!=NULL) {
+        job->A = A[i];
+    } else {
+        job->A = cyg_malloc(NULL, cyg_sizeof(Thermo));
+        cyg_assert(job->A!=NULL, NULL, "Memory allocation failed!");
+        thermo_init(job->A);
+        job->A->dnu   = dnu;
+        job->A->nu_np = (int)lrint(ceil(4000.0/dnu));
+    }
+    return job;
+}
+
+/* Free a job, with its log already closed */
+static void pipeline_freejob(ThermoJob *job) {
+    free(job->log);
+    free(job->hess);
+    if (job->rec->path!=NULL) free(job->text);
+    if (job->owned) {
+        thermo_delete(job->A);
+        free(job->A);
+    }
+    free(job);
+}
+
+/* Format a job, then free it */
+static int pipeline_format(ThermoJob *job, ThermoFormatFn format, void *data) {
+    int ret = job->status;
+    fclose(job->logfp);
+    format(job, data);
+    pipeline_freejob(job);
+    return ret;
+}
+
+/* Index of the record of a job */
+int
+thermo_job_id(const ThermoJob *job)
+{
+    return job->id;
+}
+
+/* The record of a job */
+const ThermoRecord *
+thermo_job_record(const ThermoJob *job)
+{
+    return job->rec;
+}
+
+/* Where the record of a job is computed */
+Thermo *
+thermo_job_thermo(const ThermoJob *job)
+{
+    return job->A;
+}
+
+/* E_SUCCESS if all stages of a job succeeded */
+int
+thermo_job_status(const ThermoJob *job)
+{
+    return job->status;
+}
+
+/* Messages printed while processing a job, with their length in len */
+const char *
+thermo_job_log(const ThermoJob *job, size_t *len)
+{
+    *len = job->loglen;
+    return job->log;
+}
+
+/* Print how busy each stage has been */
+static void pipeline_report(int nrec, double wall, const double *busy) {
+    int s;
+    fprintf(stderr, "Pipeline: %d records in %.3f s; stage utilization:", nrec, wall);
+    for (s=0; s<PIPE_NSTAGES; s++) {
+        fprintf(stderr, " %s %.1f%%", pipeline_stagename[s], (wall>0.0) ? 100.0*busy[s]/wall : 0.0);
+    }
+    fprintf(stderr, "\n");
+}
+
+#ifdef HAVE_THREADS
+
+/* Bounded queue of jobs between two stages */
+typedef struct {
+    ThermoJob *job[PIPE_QUEUE];
+    int head, count;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t notempty, notfull;
+} PipeQueue;
+
+/* Argument of a stage thread */
+typedef struct {
+    int stage;
+    PipeQueue *in, *out;
+    int nrec;
+    const ThermoRecord *rec;
+    Thermo **A;
+    double dnu;
+    double busy;
+    int lost;           /* Records never created (read stage) */
+    _Atomic int stop;   /* Stop creating records (read stage) */
+    ThermoContext ctx;  /* Copy of the context of the caller, current in the stage */
+} PipeStage;
+
+static void pipeline_push(PipeQueue *q, ThermoJob *job) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count==PIPE_QUEUE) pthread_cond_wait(&q->notfull, &q->lock);
+    q->job[(q->head+q->count)%PIPE_QUEUE] = job;
+    q->count++;
+    pthread_cond_signal(&q->notempty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Return NULL when the queue is closed and empty */
+static ThermoJob *pipeline_pop(PipeQueue *q) {
+    ThermoJob *job = NULL;
+    pthread_mutex_lock(&q->lock);
+    while (q->count==0 && !q->closed) pthread_cond_wait(&q->notempty, &q->lock);
+    if (q->count>0) {
+        job = q->job[q->head];
+        q->head = (q->head+1)%PIPE_QUEUE;
+        q->count--;
+        pthread_cond_signal(&q->notfull);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+static void pipeline_close(PipeQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = true;
+    pthread_cond_broadcast(&q->notempty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Main loop of a stage thread */
+static void *pipeline_thread(void *arg) {
+    PipeStage *st = arg;
+    ThermoJob *job;
+    int i = 0;
+    thermo_context_set(&st->ctx);
+    while (1) {
+        if (st->in==NULL) {
+            if (i>=st->nrec || st->stop) break;
+            job = pipeline_newjob(i, st->rec, st->A, st->dnu);
+            if (job==NULL) {
+                st->lost = st->nrec-i;
+                break;
+            }
+            i++;
+        } else {
+            job = pipeline_pop(st->in);
+            if (job==NULL) break;
+        }
+        st->busy += pipeline_runstage(st->stage, job);
+        pipeline_push(st->out, job);
+    }
+    pipeline_close(st->out);
+    thermo_context_set(NULL);
+    return NULL;
+}
+
+#endif
+
+/*
+    Process nrec records through the pipeline, calling format on each of them
+    in input order. If A is not NULL, record i is computed in A[i] (already
+    initialized) and kept, otherwise a temporary Thermo structure with the
+    given dnu is used. If timing, the utilization of each stage is printed.
+    The stages run under copies of the context of the caller, so its error
+    callback may be called from several threads. Return the number of
+    records that failed.
+*/
+int
+thermo_pipeline(int nrec, const ThermoRecord *rec, Thermo **A, double dnu,
+    ThermoFormatFn format, void *data, bool timing)
+{
+    int s, nfail=0;
+    double t0, busy[PIPE_NSTAGES];
+    ThermoJob *job;
+
+    t0 = pipeline_time();
+    for (s=0; s<PIPE_NSTAGES; s++) busy[s] = 0.0;
+
+#ifdef HAVE_THREADS
+    PipeQueue queue[PIPE_NSTAGES-1];
+    PipeStage stage[PIPE_NSTAGES-1];
+    pthread_t thread[PIPE_NSTAGES-1];
+    double tf;
+
+    for (s=0; s<PIPE_NSTAGES-1; s++) {
+        queue[s].head   = 0;
+        queue[s].count  = 0;
+        queue[s].closed = false;
+        pthread_mutex_init(&queue[s].lock, NULL);
+        pthread_cond_init(&queue[s].notempty, NULL);
+        pthread_cond_init(&queue[s].notfull, NULL);
+    }
+    for (s=0; s<PIPE_NSTAGES-1; s++) {
+        stage[s].stage = s;
+        stage[s].in    = (s>0) ? queue+s-1 : NULL;
+        stage[s].out   = queue+s;
+        stage[s].nrec  = nrec;
+        stage[s].rec   = rec;
+        stage[s].A     = A;
+        stage[s].dnu   = dnu;
+        stage[s].busy  = 0.0;
+        stage[s].lost  = 0;
+        stage[s].stop  = 0;
+        stage[s].ctx   = *thermo_context();
+        if (pthread_create(thread+s, NULL, pipeline_thread, stage+s)!=0) {
+            cyg_logErr("Impossible to start stage %s", pipeline_stagename[s]);
+            break;
+        }
+    }
+
+    /* Not all stages started: stop reading, drop the jobs of the last one and wait for them */
+    if (s<PIPE_NSTAGES-1) {
+        int started = s;
+        if (started>0) {
+            stage[0].stop = 1;
+            while ((job=pipeline_pop(queue+started-1))!=NULL) {
+                fclose(job->logfp);
+                pipeline_freejob(job);
+            }
+        }
+        for (s=0; s<started; s++) pthread_join(thread[s], NULL);
+        for (s=0; s<PIPE_NSTAGES-1; s++) {
+            pthread_mutex_destroy(&queue[s].lock);
+            pthread_cond_destroy(&queue[s].notempty);
+            pthread_cond_destroy(&queue[s].notfull);
+        }
+        return nrec;
+    }
+
+    /* Format stage, in this thread */
+    while ((job=pipeline_pop(queue+PIPE_NSTAGES-2))!=NULL) {
+        tf = pipeline_time();
+        if (pipeline_format(job, format, data)!=E_SUCCESS) nfail++;
+        busy[PIPE_NSTAGES-1] += pipeline_time()-tf;
+    }
+
+    for (s=0; s<PIPE_NSTAGES-1; s++) {
+        pthread_join(thread[s], NULL);
+        busy[s] = stage[s].busy;
+    }
+    nfail += stage[0].lost;
+    for (s=0; s<PIPE_NSTAGES-1; s++) {
+        pthread_mutex_destroy(&queue[s].lock);
+        pthread_cond_destroy(&queue[s].notempty);
+        pthread_cond_destroy(&queue[s].notfull);
+    }
+#else
+    /* No threads: run all stages one after the other */
+    int i;
+    double tf;
+    for (i=0; i<nrec; i++) {
+        job = pipeline_newjob(i, rec, A, dnu);
+        if (job==NULL) {
+            cyg_logErr("Impossible to create job for record %d", i);
+            nfail += nrec-i;
+            break;
+        }
+        for (s=0; s<PIPE_NSTAGES-1; s++) {
+            busy[s] += pipeline_runstage(s, job);
+        }
+        tf = pipeline_time();
+        if (pipeline_format(job, format, data)!=E_SUCCESS) nfail++;
+        busy[PIPE_NSTAGES-1] += pipeline_time()-tf;
+    }
+#endif
+
+    if (timing) pipeline_report(nrec, pipeline_time()-t0, busy);
+    return nfail;
+}
+
@@ -0,0 +1,182 @@
+
+/*
+    Work-stealing thread pool to run a fixed set of independent tasks.
+
+    Tasks are dealt round-robin to the workers in the order given by the
+    caller (e.g. largest first). Each worker takes the tasks from the front of
+    its own queue and, when it is empty, steals from the back of the queue of
+    the other workers.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+
+#ifdef HAVE_THREADS
+
+/* Queue of task ids owned by one worker */
+typedef struct {
+    int *task;              /* Task ids */
+    int  head;              /* First task not yet taken */
+    int  tail;              /* One past the last task not yet taken */
+    pthread_mutex_t lock;
+} PoolQueue;
+
+/* The pool */
+struct ThermoPool {
+    int nthreads;           /* Number of queues */
+    int nstarted;           /* Number of workers running */
+    PoolQueue *queue;       /* One queue per worker */
+    pthread_t *thread;      /* Worker threads */
+    ThermoTaskFn fn;        /* Function running one task */
+    void *data;             /* User data passed to fn */
+};
+
+/* Argument of a worker thread */
+typedef struct {
+    ThermoPool *pool;
+    int worker;
+} PoolWorker;
+
+/* Take a task from the front of our queue */
+static int pool_pop(PoolQueue *q) {
+    int task = -1;
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) task = q->task[q->head++];
+    pthread_mutex_unlock(&q->lock);
+    return task;
+}
+
+/* Steal a task from the back of the queue of another worker */
+static int pool_steal(PoolQueue *q) {
+    int task = -1;
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) task = q->task[--q->tail];
+    pthread_mutex_unlock(&q->lock);
+    return task;
+}
+
+/* Main loop of a worker */
+static void *pool_worker(void *arg) {
+    PoolWorker *w = arg;
+    ThermoPool *pool = w->pool;
+    int i, task;
+    while (1) {
+        task = pool_pop(pool->queue+w->worker);
+        for (i=1; task<0 && i<pool->nthreads; i++) {
+            task = pool_steal(pool->queue+(w->worker+i)%pool->nthreads);
+        }
+        if (task<0) break;
+        pool->fn(task, w->worker, pool->data);
+    }
+    free(w);
+    return NULL;
+}
+
+/* Free a pool whose first nqueues queues are initialized */
+static void pool_free(ThermoPool *pool, int nqueues) {
+    int w;
+    for (w=0; w<nqueues; w++) {
+        pthread_mutex_destroy(&pool->queue[w].lock);
+        free(pool->queue[w].task);
+    }
+    free(pool->queue);
+    free(pool->thread);
+    free(pool);
+}
+
+#endif
+
+/*
+    Start running ntasks tasks on nthreads workers. The tasks are started
+    following order (task ids, NULL for 0..ntasks-1). Return NULL on failure,
+    when no task has been started. If only some workers can be started, they
+    run all the tasks (taking them from the queues of the others), and the
+    pool is returned as usual.
+*/
+ThermoPool *
+thermo_pool_start(int nthreads, int ntasks, const int *order, ThermoTaskFn fn, void *data)
+{
+#ifndef HAVE_THREADS
+    (void)nthreads; (void)ntasks; (void)order; (void)fn; (void)data;
+    cyg_logErr("Code compiled without threads support. Impossible to use this functon.");
+    return NULL;
+#else
+    int i, w;
+    ThermoPool *pool;
+
+    cyg_assert(nthreads>0, NULL, "Invalid number of threads %d", nthreads);
+    pool = cyg_malloc(NULL, cyg_sizeof(ThermoPool));
+    cyg_assert(pool!=NULL, NULL, "Memory allocation failed!");
+    pool->nthreads = nthreads;
+    pool->nstarted = 0;
+    pool->fn       = fn;
+    pool->data     = data;
+    pool->queue    = cyg_malloc(NULL, nthreads*cyg_sizeof(PoolQueue));
+    pool->thread   = cyg_malloc(NULL, nthreads*cyg_sizeof(pthread_t));
+    if (pool->queue==NULL || pool->thread==NULL) {
+        pool_free(pool, 0);
+        cyg_logErr("Memory allocation failed!");
+        return NULL;
+    }
+
+    /* Deal the tasks round-robin */
+    for (w=0; w<nthreads; w++) {
+        pool->queue[w].task = cyg_malloc(NULL, (ntasks/nthreads+1)*cyg_sizeof(int));
+        if (pool->queue[w].task==NULL) {
+            pool_free(pool, w);
+            cyg_logErr("Memory allocation failed!");
+            return NULL;
+        }
+        pool->queue[w].head = 0;
+        pool->queue[w].tail = 0;
+        pthread_mutex_init(&pool->queue[w].lock, NULL);
+    }
+    for (i=0; i<ntasks; i++) {
+        PoolQueue *q = pool->queue + i%nthreads;
+        q->task[q->tail++] = order ? order[i] : i;
+    }
+
+    /* Start the workers: the running ones steal the tasks of those failing to start */
+    for (w=0; w<nthreads; w++) {
+        PoolWorker *arg = cyg_malloc(NULL, cyg_sizeof(PoolWorker));
+        if (arg==NULL) {
+            cyg_logErr("Memory allocation failed!");
+            break;
+        }
+        arg->pool   = pool;
+        arg->worker = w;
+        if (pthread_create(pool->thread+w, NULL, pool_worker, arg)!=0) {
+            cyg_logErr("Impossible to start thread %d", w);
+            free(arg);
+            break;
+        }
+        pool->nstarted++;
+    }
+    if (pool->nstarted==0) {
+        pool_free(pool, nthreads);
+        return NULL;
+    }
+
+    return pool;
+#endif
+}
+
+/* Wait for all tasks to complete and free the pool */
+void
+thermo_pool_wait(ThermoPool *pool)
+{
+#ifdef HAVE_THREADS
+    int w;
+    if (pool==NULL) return;
+    for (w=0; w<pool->nstarted; w++) {
+        pthread_join(pool->thread[w], NULL);
+    }
+    pool_free(pool, pool->nthreads);
+#else
+    (void)pool;
+#endif
+    return;
+}
+
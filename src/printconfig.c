@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <math.h>
 #include <thermo.h>
+#include <thermoint.h>
 
 void
 thermo_printconfig(const Thermo *A, bool raw_output)
@@ -27,6 +28,13 @@ thermo_printconfig(const Thermo *A, bool raw_output)
     } else {
         fprintf(fpout, "   Concentration [M]:         %g\n", A->n/A->V);
     }
+    if (A->ensfile!=NULL) {
+        fprintf(fpout, "   Ensemble of conformers:    %s\n", A->ensfile);
+        fprintf(fpout, "      conformers:             %d\n", A->ens_n);
+        fprintf(fpout, "      mixing entropy [cal/mol/K]: %.6f\n", A->ens_smix);
+        fprintf(fpout, "\n");
+        return;
+    }
     fprintf(fpout, "   Molecular mass [g/mol]:    %g\n",A->m);
     fprintf(fpout, "   Molar energy [kcal/mol]:   %.6f\n",A->E);
     fprintf(fpout, "   Degree of freedom:\n");
@@ -37,13 +45,37 @@ thermo_printconfig(const Thermo *A, bool raw_output)
     fprintf(fpout, "            %.6f\n",A->I[i]);
     }
     fprintf(fpout, "         symmetry number:     %d\n",A->s);
-    fprintf(fpout, "      vibrational modes:      %d\n",A->v);
-    fprintf(fpout, "         frequencies [1/cm]: \n");
-    for (i=0; i<A->v; i++) {
-        fprintf(fpout, "%11.6f  ",A->nu[i]);
-        if ((i+1)%6==0 && i+1!=A->v) {fprintf(fpout, "\n");}
+    if (A->w!=NULL && !isnan(A->mergevar)) {
+        double dof = 0.0;
+        for (i=0; i<A->v; i++) dof += A->w[i];
+        fprintf(fpout, "      vibrational modes:      %g\n", dof);
+        fprintf(fpout, "         merged within %g 1/cm into %d (error below %.3e kcal/mol)\n", A->mergetol, A->v, thermo_mergeerror(A, A->T));
+        fprintf(fpout, "         frequencies [1/cm] (multiplicity): \n");
+        for (i=0; i<A->v; i++) {
+            fprintf(fpout, "%11.6f (%g)  ",A->nu[i], A->w[i]);
+            if ((i+1)%4==0 && i+1!=A->v) {fprintf(fpout, "\n");}
+        }
+        fprintf(fpout, "\n");
+    } else if (A->w!=NULL) {
+        double dof = 0.0, lo = INFINITY, hi = -INFINITY;
+        for (i=0; i<A->v; i++) {
+            dof += A->w[i];
+            lo = fmin(lo, A->nu[i]);
+            hi = fmax(hi, A->nu[i]);
+        }
+        fprintf(fpout, "      vibrational modes:      %g\n", dof);
+        fprintf(fpout, "         density of states:   %d points", A->v);
+        if (A->v>0) fprintf(fpout, " from %.4f to %.4f 1/cm", lo, hi);
+        fprintf(fpout, "\n");
+    } else {
+        fprintf(fpout, "      vibrational modes:      %d\n",A->v);
+        fprintf(fpout, "         frequencies [1/cm]: \n");
+        for (i=0; i<A->v; i++) {
+            fprintf(fpout, "%11.6f  ",A->nu[i]);
+            if ((i+1)%6==0 && i+1!=A->v) {fprintf(fpout, "\n");}
+        }
+        fprintf(fpout, "\n");
     }
-    fprintf(fpout, "\n");
 
     if (!isnan(A->solute_volume))     fprintf(fpout, "   Solute vdw volume:          %g\n", A->solute_volume);
     if (!isnan(A->rgyr_m))            fprintf(fpout, "   Solute gyration radius:     %g\n", A->rgyr_m);
@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <math.h>
 #include <thermo.h>
+#include <thermoint.h>
 
 void 
 thermo_printthermo(const Thermo *A, int onlyInt, bool raw_output)
@@ -30,7 +31,8 @@ thermo_printthermo(const Thermo *A, int onlyInt, bool raw_output)
                     A->U_elec, A->U_tr, A->U_rot, A->U_vibcl, A->U_vibqm, A->U_totcl, A->U_totqm);
     fprintf(fpout, "   S  %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f  cal\n",
                     A->S_elec, A->S_tr, A->S_rot, A->S_vibcl, A->S_vibqm, A->S_totcl, A->S_totqm);
-    fprintf(fpout, " -TS  %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f kcal\n", 0.0,
+    fprintf(fpout, " -TS  %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f kcal\n",
+                    (A->S_elec!=0.0) ? -A->T*A->S_elec/1000.0 : 0.0,
                     -A->T*A->S_tr/1000.0, -A->T*A->S_rot/1000.0, -A->T*A->S_vibcl/1000.0,
                     -A->T*A->S_vibqm/1000.0, -A->T*A->S_totcl/1000.0, -A->T*A->S_totqm/1000.0);
     fprintf(fpout, "   F  %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f kcal\n",
@@ -43,7 +45,8 @@ thermo_printthermo(const Thermo *A, int onlyInt, bool raw_output)
                     A->Um_elec, A->Um_tr, A->Um_rot, A->Um_vibcl, A->Um_vibqm, A->Um_totcl, A->Um_totqm);
     fprintf(fpout, "   Sm %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f  cal/mol\n",
                     A->Sm_elec, A->Sm_tr, A->Sm_rot, A->Sm_vibcl, A->Sm_vibqm, A->Sm_totcl, A->Sm_totqm);
-    fprintf(fpout, " -TSm %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f kcal/mol\n", 0.0,
+    fprintf(fpout, " -TSm %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f kcal/mol\n",
+                    (A->Sm_elec!=0.0) ? -A->T*A->Sm_elec/1000.0 : 0.0,
                     -A->T*A->Sm_tr/1000.0, -A->T*A->Sm_rot/1000.0, -A->T*A->Sm_vibcl/1000.0,
                     -A->T*A->Sm_vibqm/1000.0, -A->T*A->Sm_totcl/1000.0, -A->T*A->Sm_totqm/1000.0);
     fprintf(fpout, "   Fm %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f kcal/mol\n",
@@ -77,3 +80,30 @@ thermo_printthermo(const Thermo *A, int onlyInt, bool raw_output)
     return;
 }
 
+
+/* Print the header of the table written by thermo_printrow */
+void
+thermo_printrowheader(FILE *fp)
+{
+    int i;
+    fprintf(fp, "#record");
+    for (i=1; i<THERMO_LAST; i++) {
+        fprintf(fp, " %s", thermo_description(i));
+    }
+    fprintf(fp, "\n");
+    return;
+}
+
+/* Print all computed quantities of one record in a single row */
+void
+thermo_printrow(FILE *fp, const char *name, const double *results)
+{
+    int i;
+    fprintf(fp, "%s", name);
+    for (i=1; i<THERMO_LAST; i++) {
+        fprintf(fp, " %.6f", results[i]);
+    }
+    fprintf(fp, "\n");
+    return;
+}
+
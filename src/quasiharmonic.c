@@ -0,0 +1,392 @@
+
+/*
+    Quasi-harmonic analysis of a coordinate trajectory.
+
+    The frames are read one at a time (see traj.c), centered on their center
+    of mass and rotated onto the first frame by the mass weighted optimal
+    rotation (the quaternion of Horn's method, the eigenvector of a 4x4
+    matrix). The mass weighted coordinates are collected in blocks of
+    QH_BLOCK frames: each block is centered on its own mean, and its scatter
+    matrix is added to the running one together with the shift of the mean
+    (Chan's pairwise update), as one extra row of the block. The update of
+    the lower triangle is a rank-k SYRK, split in tiles computed in parallel;
+    each element is summed in the same order whatever the number of threads.
+    Memory is O((3N)^2), independent of the number of frames.
+
+    The eigenvalues l of the covariance matrix give the effective harmonic
+    frequencies w = sqrt(kB T / l); the smallest A->t + A->r, which alignment
+    leaves near zero, are skipped as translations and rotations.
+
+    To follow the convergence with the length of the trajectory, every
+    A->qhevery frames the running covariance gives Schlitter's entropy,
+    S = k/2 ln det(1 + kT e^2/hbar^2 M), from the diagonal of its Cholesky
+    factor: a third of the cost of the eigenvalues, with no need to skip the
+    rigid modes (they add ln 1). The checkpoints of the last half of the
+    trajectory are fitted by S(t) = S_inf - a/t, the entropy of infinite
+    sampling.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+#include <thermoint.h>
+
+/* Frames per block of the covariance update */
+#define QH_BLOCK 64
+
+/* Rows and columns of a tile of the SYRK */
+#define QH_TILE 64
+
+/* One block of mass weighted, centered frames and the running scatter matrix */
+typedef struct {
+    int n;                  /* 3 natoms */
+    int nrows;              /* Rows of D in the block (frames, and the shift of the mean) */
+    int ntiles;             /* Tiles along each side of the matrix */
+    const double *D;        /* Rows of the block, n values each */
+    double *M2;             /* Scatter matrix, n*n, lower triangle */
+} QhBlock;
+
+/* Add the rows of the block to the lower triangle of one tile of the scatter matrix */
+static void qh_tile(int task, int worker, void *data) {
+    const QhBlock *G = data;
+    int I = 0, J, i, j, f, n = G->n;
+    int i0, i1, j0, j1;
+    double acc[QH_TILE][QH_TILE], di;
+    const double *row;
+    (void)worker;
+
+    /* Tile (I, J) with J<=I of the lower triangle, from the task index */
+    while ((I+1)*(I+2)/2<=task) I++;
+    J  = task - I*(I+1)/2;
+    i0 = I*QH_TILE;
+    i1 = (i0+QH_TILE<n) ? i0+QH_TILE : n;
+    j0 = J*QH_TILE;
+    j1 = (j0+QH_TILE<n) ? j0+QH_TILE : n;
+
+    for (i=0; i<i1-i0; i++) {
+        for (j=0; j<j1-j0; j++) acc[i][j] = 0.0;
+    }
+    for (f=0; f<G->nrows; f++) {
+        row = G->D + (size_t)f*(size_t)n;
+        for (i=i0; i<i1; i++) {
+            di = row[i];
+            for (j=j0; j<j1 && j<=i; j++) acc[i-i0][j-j0] += di*row[j];
+        }
+    }
+    for (i=i0; i<i1; i++) {
+        for (j=j0; j<j1 && j<=i; j++) G->M2[(size_t)i*(size_t)n+(size_t)j] += acc[i-i0][j-j0];
+    }
+}
+
+/* Add a block to the scatter matrix, with njobs threads */
+static void qh_syrk(QhBlock *G, int njobs) {
+    int t, ntasks = G->ntiles*(G->ntiles+1)/2;
+#ifdef HAVE_THREADS
+    ThermoPool *pool = (njobs>1) ? thermo_pool_start(njobs, ntasks, NULL, qh_tile, G) : NULL;
+    if (pool!=NULL) {
+        thermo_pool_wait(pool);
+        return;
+    }
+#else
+    (void)njobs;
+#endif
+    for (t=0; t<ntasks; t++) qh_tile(t, 0, G);
+}
+
+/* Center x (natoms) on its center of mass, with masses m */
+static void qh_center(double *x, const double *m, int natoms) {
+    int i, d;
+    double c[3] = {0.0, 0.0, 0.0}, mtot = 0.0;
+    for (i=0; i<natoms; i++) {
+        for (d=0; d<3; d++) c[d] += m[i]*x[3*i+d];
+        mtot += m[i];
+    }
+    for (i=0; i<natoms; i++) {
+        for (d=0; d<3; d++) x[3*i+d] -= c[d]/mtot;
+    }
+}
+
+/* Rotate the centered x (natoms) onto the centered ref, minimizing the mass weighted deviation */
+static int qh_align(double *x, const double *ref, const double *m, int natoms) {
+    int i, a, b;
+    double S[3][3] = {{0.0}}, K[16], ev[4], q[4], R[3][3], y[3];
+
+    for (i=0; i<natoms; i++) {
+        for (a=0; a<3; a++) {
+            for (b=0; b<3; b++) S[a][b] += m[i]*x[3*i+a]*ref[3*i+b];
+        }
+    }
+
+    /* Horn's matrix: its eigenvector of largest eigenvalue is the optimal quaternion */
+    K[0]  = S[0][0]+S[1][1]+S[2][2];
+    K[1]  = S[1][2]-S[2][1];
+    K[2]  = S[2][0]-S[0][2];
+    K[3]  = S[0][1]-S[1][0];
+    K[5]  = S[0][0]-S[1][1]-S[2][2];
+    K[6]  = S[0][1]+S[1][0];
+    K[7]  = S[2][0]+S[0][2];
+    K[10] = -S[0][0]+S[1][1]-S[2][2];
+    K[11] = S[1][2]+S[2][1];
+    K[15] = -S[0][0]-S[1][1]+S[2][2];
+    K[4]  = K[1];  K[8]  = K[2];  K[9]  = K[6];
+    K[12] = K[3];  K[13] = K[7];  K[14] = K[11];
+    cyg_assert(mtx_dsyev(4, K, ev, "V", "L")==E_SUCCESS, E_FAILURE, "Failing computing the optimal rotation");
+    for (a=0; a<4; a++) q[a] = K[12+a];
+
+    R[0][0] = q[0]*q[0]+q[1]*q[1]-q[2]*q[2]-q[3]*q[3];
+    R[0][1] = 2.0*(q[1]*q[2]-q[0]*q[3]);
+    R[0][2] = 2.0*(q[1]*q[3]+q[0]*q[2]);
+    R[1][0] = 2.0*(q[1]*q[2]+q[0]*q[3]);
+    R[1][1] = q[0]*q[0]-q[1]*q[1]+q[2]*q[2]-q[3]*q[3];
+    R[1][2] = 2.0*(q[2]*q[3]-q[0]*q[1]);
+    R[2][0] = 2.0*(q[1]*q[3]-q[0]*q[2]);
+    R[2][1] = 2.0*(q[2]*q[3]+q[0]*q[1]);
+    R[2][2] = q[0]*q[0]-q[1]*q[1]-q[2]*q[2]+q[3]*q[3];
+    for (i=0; i<natoms; i++) {
+        for (a=0; a<3; a++) y[a] = R[a][0]*x[3*i]+R[a][1]*x[3*i+1]+R[a][2]*x[3*i+2];
+        for (a=0; a<3; a++) x[3*i+a] = y[a];
+    }
+    return E_SUCCESS;
+}
+
+/* Checkpoints of the convergence of the entropy */
+typedef struct {
+    int n, size;            /* Checkpoints stored, and allocated */
+    double (*pt)[2];        /* Frames and entropy [cal/mol/K] of each checkpoint */
+    double *W;              /* Work matrix for the Cholesky factor, n*n */
+} QhConv;
+
+/* Print and store Schlitter's entropy of the scatter matrix M2 (lower triangle) of nframes frames */
+static int qh_checkpoint(QhConv *C, const double *M2, int n, long nframes, double T, double dt) {
+    int i, j;
+    double S = 0.0, hbar = CNS_h/(2.0*M_PI);
+    double alpha = CNS_kB*T*M_E*M_E/(hbar*hbar) * 1E-3/CNS_NA*1E-20 / (double)nframes;
+    double (*tmp)[2];
+
+    /* Lower triangle by rows is the upper one by columns, as LAPACK sees it */
+    for (i=0; i<n; i++) {
+        for (j=0; j<=i; j++) C->W[(size_t)i*(size_t)n+(size_t)j] = alpha*M2[(size_t)i*(size_t)n+(size_t)j] + (i==j);
+    }
+    cyg_assert(mtx_dpotrf(n, C->W, "U")==E_SUCCESS, E_FAILURE, "Failing factorizing the covariance of %ld frames", nframes);
+    for (i=0; i<n; i++) S += log(C->W[(size_t)i*(size_t)n+(size_t)i]);
+    S *= CNS_kB*CNS_NA/CNS_cal;
+
+    if (C->n==C->size) {
+        C->size = (C->size>0) ? 2*C->size : 64;
+        tmp = thermo_realloc(C->pt, (size_t)C->size*sizeof(*tmp));
+        cyg_assert(tmp!=NULL, E_FAILURE, "Memory allocation failed!");
+        C->pt = tmp;
+    }
+    C->pt[C->n][0] = (double)nframes;
+    C->pt[C->n][1] = S;
+    if (C->n++==0) {
+        fprintf(fpout, "Convergence of the quasi-harmonic (Schlitter) entropy:\n");
+        fprintf(fpout, "      Frames   Time [ps]   S [cal/mol/K]  -TS [kcal/mol]\n");
+    }
+    fprintf(fpout, "   %9ld %11.3f %15.4f %15.4f\n", nframes, (double)nframes*dt/1000.0, S, -T*S/1000.0);
+    return E_SUCCESS;
+}
+
+/* Fit the checkpoints of the last half of the trajectory by S(t) = S_inf - a/t */
+static void qh_extrapolate(const QhConv *C, double T) {
+    int i, np = 0;
+    double x, sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0, a, Sinf;
+    double half = (C->n>0) ? C->pt[C->n-1][0]/2.0 : 0.0;
+
+    for (i=0; i<C->n; i++) {
+        if (C->pt[i][0]<half) continue;
+        x = 1.0/C->pt[i][0];
+        sx  += x;
+        sy  += C->pt[i][1];
+        sxx += x*x;
+        sxy += x*C->pt[i][1];
+        np++;
+    }
+    if (np<2) {
+        fprintf(fpout, "Too few checkpoints in the last half of the trajectory to extrapolate the entropy\n");
+        return;
+    }
+    a    = -(np*sxy - sx*sy)/(np*sxx - sx*sx);
+    Sinf = (sy + a*sx)/np;
+    fprintf(fpout, "Extrapolated to infinite sampling (S = S_inf - a/frames, %d checkpoints):\n", np);
+    fprintf(fpout, "   S_inf [cal/mol/K]:         %.4f\n", Sinf);
+    fprintf(fpout, "   -TS_inf [kcal/mol]:        %.4f\n", -T*Sinf/1000.0);
+    fprintf(fpout, "   a [cal/mol/K frames]:      %.4f\n", a);
+}
+
+/*
+    Add the first k rows of the block D (mass weighted frames) to the mean
+    and scatter matrix of the nframes frames seen so far: D is centered on
+    its own mean, and row k is set to the shift of the mean, scaled so that
+    its outer product is the correction of Chan's update.
+*/
+static void qh_update(QhBlock *G, double *D, int k, double *mean, long nframes, int njobs) {
+    int i, f, n = G->n;
+    double mb, delta, na = (double)nframes, nb = (double)k;
+    double *shift = D + (size_t)k*(size_t)n;
+
+    for (i=0; i<n; i++) {
+        mb = 0.0;
+        for (f=0; f<k; f++) mb += D[(size_t)f*(size_t)n+(size_t)i];
+        mb /= nb;
+        for (f=0; f<k; f++) D[(size_t)f*(size_t)n+(size_t)i] -= mb;
+        delta    = mb - mean[i];
+        shift[i] = delta*sqrt(na*nb/(na+nb));
+        mean[i] += delta*nb/(na+nb);
+    }
+    G->D     = D;
+    G->nrows = (nframes>0) ? k+1 : k;
+    qh_syrk(G, njobs);
+}
+
+/*
+    Effective frequencies of A from the covariance of the coordinates of its
+    trajectory A->qhfile, with the masses in A->qhmasses (unit masses if
+    NULL), at temperature A->T, computed by A->njobs threads.
+*/
+int
+thermo_quasiharmonic(Thermo *A)
+{
+    int i, n, k, ret, natoms = 0, skip = 0;
+    long nframes = 0;
+    double *mass = NULL, *m, *sqrtm, *ref, *frame, *mean, *M2, *D, *eival;
+    double lambda, amu = 1E-3/CNS_NA, kBT = CNS_kB*A->T;
+    ThermoMap massmap = { NULL, 0 };
+    ThermoTraj T;
+    QhBlock G;
+    QhConv C = { 0, 0, NULL, NULL };
+
+    if (A->qhmasses!=NULL) {
+        mass = thermo_readarray(A->qhmasses, &natoms, false, &massmap);
+        cyg_assert(mass!=NULL, E_FAILURE, "Failing reading masses file <%s>", A->qhmasses);
+    }
+    if (thermo_traj_open(&T, A->qhfile, natoms)!=E_SUCCESS) {
+        thermo_freearray(mass, &massmap);
+        cyg_logErr("Failing opening trajectory <%s>", A->qhfile);
+        return E_FAILURE;
+    }
+    natoms = T.natoms;
+    n = 3*natoms;
+    fprintf(fpout, "Quasi-harmonic analysis of trajectory <%s>...\n", A->qhfile);
+
+    /* Masses, reference, mean and scatter matrix, and one block of frames */
+    m     = thermo_realloc(NULL, (size_t)(2*natoms+4*n)*sizeof(double));
+    M2    = thermo_realloc(NULL, (size_t)n*(size_t)n*sizeof(double));
+    D     = thermo_realloc(NULL, (size_t)(QH_BLOCK+1)*(size_t)n*sizeof(double));
+    if (A->qhevery>0) C.W = thermo_realloc(NULL, (size_t)n*(size_t)n*sizeof(double));
+    ret = (m!=NULL && M2!=NULL && D!=NULL && (A->qhevery==0 || C.W!=NULL)) ? E_SUCCESS : E_FAILURE;
+    if (ret==E_SUCCESS) {
+        sqrtm = m + natoms;
+        ref   = sqrtm + natoms;
+        frame = ref + n;
+        mean  = frame + n;
+        eival = mean + n;
+        for (i=0; i<natoms; i++) {
+            m[i] = (mass!=NULL) ? mass[i] : 1.0;
+            sqrtm[i] = sqrt(m[i]);
+        }
+        for (i=0; i<n; i++) mean[i] = 0.0;
+        for (i=0; i<n*n; i++) M2[i] = 0.0;
+        G.n      = n;
+        G.M2     = M2;
+        G.ntiles = (n+QH_TILE-1)/QH_TILE;
+
+        /* Stream the frames, aligned on the first one, with a checkpoint every A->qhevery */
+        k = 0;
+        while ((ret = thermo_traj_read(&T, frame))==1) {
+            qh_center(frame, m, natoms);
+            if (nframes+k==0) {
+                memcpy(ref, frame, (size_t)n*sizeof(double));
+            } else if (qh_align(frame, ref, m, natoms)!=E_SUCCESS) {
+                ret = -2;
+                break;
+            }
+            for (i=0; i<n; i++) D[(size_t)k*(size_t)n+(size_t)i] = sqrtm[i/3]*frame[i];
+            if (++k==QH_BLOCK || (A->qhevery>0 && (nframes+k)%A->qhevery==0)) {
+                qh_update(&G, D, k, mean, nframes, A->njobs);
+                nframes += k;
+                k = 0;
+                if (A->qhevery>0 && nframes%A->qhevery==0 && nframes>1
+                        && qh_checkpoint(&C, M2, n, nframes, A->T, T.dt)!=E_SUCCESS) {
+                    ret = -2;
+                    break;
+                }
+            }
+        }
+        if (ret==0 && k>0) {
+            qh_update(&G, D, k, mean, nframes, A->njobs);
+            nframes += k;
+            if (A->qhevery>0 && nframes>1 && qh_checkpoint(&C, M2, n, nframes, A->T, T.dt)!=E_SUCCESS) ret = -2;
+        }
+        if (ret==0 && A->qhevery>0) qh_extrapolate(&C, A->T);
+        if (ret<0) {
+            if (ret==-1) cyg_logErr("Failing reading frame %ld of <%s>", nframes+k+1, A->qhfile);
+            ret = E_FAILURE;
+        } else if (nframes<2) {
+            cyg_logErr("Trajectory <%s> has %ld frames: at least two are needed", A->qhfile, nframes);
+            ret = E_FAILURE;
+        } else {
+            ret = E_SUCCESS;
+        }
+    } else {
+        cyg_logErr("Memory allocation failed!");
+    }
+
+    /* Covariance matrix, its eigenvalues and the effective frequencies */
+    if (ret==E_SUCCESS) {
+        for (i=0; i<n; i++) {
+            for (k=0; k<=i; k++) {
+                M2[(size_t)i*(size_t)n+(size_t)k] /= (double)nframes;
+                M2[(size_t)k*(size_t)n+(size_t)i] = M2[(size_t)i*(size_t)n+(size_t)k];
+            }
+        }
+        fprintf(fpout, "Diagonalizing the mass weighted covariance of %ld frames...\n", nframes);
+        ret = mtx_dsyev(n, M2, eival, "N", "L");
+    }
+    if (ret==E_SUCCESS) {
+        skip = A->t + A->r;
+        if (skip>n) skip = n;
+        if (nframes<=n-skip) {
+            fprintf(fpout, "Warning! Only %ld frames for %d degrees of freedom: the covariance is singular\n", nframes, n-skip);
+        }
+        if (A->numap.addr!=NULL) {
+            thermo_freearray(A->nu, &A->numap);
+            A->nu = NULL;
+        }
+        A->nu = thermo_realloc(A->nu, (size_t)(n>0 ? n : 1)*sizeof(double));
+        thermo_free(A->w);
+        A->w = NULL;
+        A->mergevar = NAN;
+        if (A->nu==NULL) {
+            cyg_logErr("Memory allocation failed!");
+            ret = E_FAILURE;
+        }
+    }
+    if (ret==E_SUCCESS) {
+        fprintf(fpout, "Number of atoms: %d\n", natoms);
+        fprintf(fpout, "Total number of degrees of freedom: %d\n", n);
+        fprintf(fpout, "Skipping %d for translations and rotations.\n", skip);
+        fprintf(fpout, "Obtained %d vibrational modes.\n", n-skip);
+        for (i=0; i<n-skip && ret==E_SUCCESS; i++) {
+            lambda = eival[n-1-i];
+            if (lambda<=0.0) {
+                cyg_logErr("Covariance eigenvalue %d of <%s> is not positive: more frames are needed", n-i, A->qhfile);
+                ret = E_FAILURE;
+            } else {
+                A->nu[i] = sqrt(kBT/(lambda*amu*1E-20)) / (2.0*M_PI*CNS_C*100.0);
+            }
+        }
+        A->natoms = natoms;
+        A->v = (ret==E_SUCCESS) ? n-skip : 0;
+    }
+
+    thermo_traj_close(&T);
+    thermo_freearray(mass, &massmap);
+    thermo_free(m);
+    thermo_free(M2);
+    thermo_free(D);
+    thermo_free(C.W);
+    thermo_free(C.pt);
+    return ret;
+}
@@ -0,0 +1,216 @@
+
+/*
+    Read arrays of numbers (frequencies, moments of inertia) from binary
+    files, for systems with millions of modes.
+
+    Two formats are understood: numpy .npy files of 64 or 32 bit floats, in
+    either byte order and of any shape, and raw files of native 64 bit
+    floats (32 bit if the name ends in .f32).
+
+    Files of native doubles are mapped in memory and used in place, so that
+    nothing is copied or parsed. The mapping is private: the caller can
+    convert the values in place without changing the file. Other files are
+    converted to a new array in one pass over the mapping.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define NPY_MAGIC "\x93NUMPY"
+
+/* True if this machine is little endian */
+static bool array_littleendian(void) {
+    const uint16_t one = 1;
+    return *(const unsigned char *)&one == 1;
+}
+
+/* Read a value of n bytes (2 or 4) stored little endian */
+static size_t array_le(const unsigned char *p, int n) {
+    size_t v = 0;
+    while (n-->0) v = (v<<8) | p[n];
+    return v;
+}
+
+/*
+    Parse the header of a .npy file of size bytes. Set the offset of the
+    data, the number of elements, the size of each element (4 or 8) and if
+    they have to be byte swapped.
+*/
+static int array_npyheader(const char *fname, const unsigned char *map, size_t size,
+                           size_t *offset, size_t *n, int *itemsize, bool *swap) {
+    char header[4096], *p;
+    size_t hlen, dim;
+
+    cyg_assert(size>=10 && memcmp(map, NPY_MAGIC, 6)==0, E_FAILURE, "File <%s> is not a .npy file", fname);
+    if (map[6]==1) {
+        hlen = array_le(map+8, 2);
+        *offset = 10+hlen;
+    } else {
+        cyg_assert(size>=12, E_FAILURE, "Invalid .npy file <%s>", fname);
+        hlen = array_le(map+8, 4);
+        *offset = 12+hlen;
+    }
+    cyg_assert(*offset<=size && hlen<sizeof(header), E_FAILURE, "Invalid header in .npy file <%s>", fname);
+    memcpy(header, map+*offset-hlen, hlen);
+    header[hlen] = '\0';
+
+    /* Type: little (<), big (>) or native (=) endian float of 4 or 8 bytes */
+    p = strstr(header, "'descr'");
+    cyg_assert(p!=NULL && (p=strchr(p+7, '\''))!=NULL, E_FAILURE, "No type in .npy file <%s>", fname);
+    if (strncmp(p+1, "<f8'", 4)==0 || strncmp(p+1, ">f8'", 4)==0 || strncmp(p+1, "=f8'", 4)==0) {
+        *itemsize = 8;
+    } else if (strncmp(p+1, "<f4'", 4)==0 || strncmp(p+1, ">f4'", 4)==0 || strncmp(p+1, "=f4'", 4)==0) {
+        *itemsize = 4;
+    } else {
+        cyg_logErr("Unsupported type in .npy file <%s>: only float64 and float32", fname);
+        return E_FAILURE;
+    }
+    *swap = (p[1]=='<' && !array_littleendian()) || (p[1]=='>' && array_littleendian());
+
+    /* Shape: all elements are read, whatever the shape */
+    p = strstr(header, "'shape'");
+    cyg_assert(p!=NULL && (p=strchr(p, '('))!=NULL, E_FAILURE, "No shape in .npy file <%s>", fname);
+    *n = 1;
+    for (p++; *p!=')' && *p!='\0'; ) {
+        if (*p>='0' && *p<='9') {
+            dim = (size_t)strtoul(p, &p, 10);
+            *n *= dim;
+        } else {
+            p++;
+        }
+    }
+    return E_SUCCESS;
+}
+
+/*
+    Number of elements of the size bytes of file fname, mapped at mem, with
+    the offset of the data, the size of each element and if they have to be
+    byte swapped.
+*/
+static int array_count(const char *fname, const unsigned char *mem, size_t size,
+                       size_t *offset, size_t *nel, int *itemsize, bool *swap) {
+    size_t len = strlen(fname);
+    *offset   = 0;
+    *itemsize = 8;
+    *swap     = false;
+    if (len>4 && strcmp(fname+len-4, ".npy")==0) {
+        if (array_npyheader(fname, mem, size, offset, nel, itemsize, swap)!=E_SUCCESS) return E_FAILURE;
+    } else {
+        if (len>4 && strcmp(fname+len-4, ".f32")==0) *itemsize = 4;
+        *nel = size/(size_t)*itemsize;
+        cyg_assert(*nel*(size_t)*itemsize==size, E_FAILURE, "Size of array file <%s> is not a multiple of %d bytes", fname, *itemsize);
+    }
+    cyg_assert(*nel>0 && *nel<=INT_MAX && *offset+*nel*(size_t)*itemsize<=size, E_FAILURE,
+        "Invalid number of elements in array file <%s>", fname);
+    return E_SUCCESS;
+}
+
+/* Map the file fname privately (writable if asked), setting its size. Return MAP_FAILED on failure */
+static unsigned char *array_map(const char *fname, size_t *size, bool writable) {
+    int fd;
+    unsigned char *mem;
+    struct stat st;
+    fd = open(fname, O_RDONLY);
+    cyg_assert(fd>=0, MAP_FAILED, "Impossible to open array file <%s>: %s", fname, strerror(errno));
+    if (fstat(fd, &st)!=0 || st.st_size==0) {
+        close(fd);
+        cyg_logErr("Array file <%s> is empty", fname);
+        return MAP_FAILED;
+    }
+    *size = (size_t)st.st_size;
+    mem   = mmap(NULL, *size, PROT_READ|(writable ? PROT_WRITE : 0), MAP_PRIVATE, fd, 0);
+    close(fd);
+    cyg_assert(mem!=MAP_FAILED, MAP_FAILED, "Impossible to map array file <%s>: %s", fname, strerror(errno));
+    return mem;
+}
+
+/* Number of numbers in the file fname, from its header or size only */
+int
+thermo_arraylen(const char *fname, int *n)
+{
+    int itemsize, ret;
+    size_t offset, nel, size;
+    bool swap;
+    unsigned char *mem = array_map(fname, &size, false);
+    if (mem==MAP_FAILED) return E_FAILURE;
+    ret = array_count(fname, mem, size, &offset, &nel, &itemsize, &swap);
+    munmap(mem, size);
+    if (ret==E_SUCCESS) *n = (int)nel;
+    return ret;
+}
+
+/*
+    Read all numbers of the file fname, setting their number in n. If the
+    file can be used in place, the array is mapped in memory and map is set;
+    otherwise the array is allocated and map->addr is NULL. With writable,
+    the array can be modified. Free with thermo_freearray.
+*/
+double *
+thermo_readarray(const char *fname, int *n, bool writable, ThermoMap *map)
+{
+    int itemsize, i, k;
+    size_t offset, nel, size;
+    bool swap;
+    unsigned char *mem, *p, b[8];
+    double *x;
+    float f;
+
+    map->addr = NULL;
+    map->size = 0;
+
+    mem = array_map(fname, &size, writable);
+    if (mem==MAP_FAILED) return NULL;
+
+    /* Type and number of elements */
+    if (array_count(fname, mem, size, &offset, &nel, &itemsize, &swap)!=E_SUCCESS) {
+        munmap(mem, size);
+        return NULL;
+    }
+    *n = (int)nel;
+
+    /* Native doubles: use the mapping */
+    if (itemsize==8 && !swap && offset%sizeof(double)==0) {
+        map->addr = mem;
+        map->size = size;
+        return (double *)(void *)(mem+offset);
+    }
+
+    /* Anything else: convert */
+    x = thermo_realloc(NULL, nel*sizeof(double));
+    if (x==NULL) {
+        munmap(mem, size);
+        return NULL;
+    }
+    p = mem+offset;
+    for (i=0; i<*n; i++, p+=itemsize) {
+        for (k=0; k<itemsize; k++) b[k] = swap ? p[itemsize-1-k] : p[k];
+        if (itemsize==8) {
+            memcpy(x+i, b, 8);
+        } else {
+            memcpy(&f, b, 4);
+            x[i] = (double)f;
+        }
+    }
+    munmap(mem, size);
+    return x;
+}
+
+/* Free an array read by thermo_readarray (or allocated, if map->addr is NULL) */
+void
+thermo_freearray(double *x, ThermoMap *map)
+{
+    if (map->addr!=NULL) {
+        munmap(map->addr, map->size);
+        map->addr = NULL;
+        map->size = 0;
+    } else {
+        thermo_free(x);
+    }
+}
@@ -7,17 +7,28 @@
 
 #include <cygtools.h>
 #include <thermo.h>
+#include <thermoint.h>
 
 int 
 thermo_readhessian(Thermo *A)
 {
-
-    fprintf(fpout, "Reading hessian file <%s>...\n", A->hessfile);
-
+    int ret;
     char *filename=A->hessfile;
     FILE *fp=cyg_fopen(filename, "r");
     cyg_assert(fp!=NULL, E_FAILURE, "Impossible to open <%s>!\n", filename);
 
+    ret = thermo_readhessian_fp(A, fp);
+    fclose(fp);
+    return ret;
+}
+
+/* Read the hessian from an already opened stream (with the content of A->hessfile) */
+int 
+thermo_readhessian_fp(Thermo *A, FILE *fp)
+{
+
+    fprintf(fpout, "Reading hessian file <%s>...\n", A->hessfile);
+
     int i, j, nf, nat, nat3;
     double tmp;
 
@@ -38,7 +49,7 @@ thermo_readhessian(Thermo *A)
     }
 
     /* Read the hessian */
-    A->hessian = cyg_malloc(A->hessian, nat3*nat3*cyg_sizeof(double));
+    A->hessian = thermo_realloc(A->hessian, (size_t)(nat3*nat3)*sizeof(double));
     cyg_assert(A->hessian!=NULL, E_FAILURE, "Memory allocation failed!");
     for (i=0; i<nat3; i++) {
         for (j=i; j<nat3; j++) {
@@ -49,7 +60,6 @@ thermo_readhessian(Thermo *A)
     }
     A->natoms = nat;
 
-    fclose(fp);
     return E_SUCCESS;
 
 }
@@ -2,64 +2,263 @@
 /*
     Read a thermo file and save all quantities inside a Thermo structure.
 
+    The whole input is read in memory and split in lines without copying
+    them. Keywords are matched on their first four characters (and on a
+    longer prefix for some of them) through a perfect hash of those four
+    characters, and numbers are converted by thermo_parsedouble.
+
     Copyright (C) 2014-2019 Simone Conti
     Copyright (C) 2015 Université de Strasbourg
 */
 
 #include <cygtools.h>
 #include <thermo.h>
+#include <thermoint.h>
+
+/* Keywords, grouped by their first four characters */
+enum {
+    KEY_TEMPERATURE,
+    KEY_NMOLES,
+    KEY_VOLUME,
+    KEY_CONCENTRATION,
+    KEY_PRESSURE,
+    KEY_MASS,
+    KEY_TRANSLATIONS,
+    KEY_QUASIHARMONIC,
+    KEY_SIGMA,
+    KEY_ROTATIONS,
+    KEY_VIBRATIONS,
+    KEY_DOS,
+    KEY_ENSEMBLE,
+    KEY_DEGENERACY,
+    KEY_UNCERTAINTY,
+    KEY_ENERGY,
+    KEY_HESSIAN,
+    KEY_VVDW,
+    KEY_RGYR,
+    KEY_BBOX,
+    KEY_SOLVENT_VOLUME,
+    KEY_SOLVENT_MASS,
+    KEY_SOLVENT_DENSITY,
+    KEY_SOLVENT_ACENTRICITY,
+    KEY_SOLVENT_PERMITTIVITY,
+    KEY_SOLVENT_EXPANSION,
+    KEY_SOLVENT_RGYR,
+    KEY_SOLVENT_SASA,
+    KEY_SOLVENT,
+    KEY_UNKNOWN
+};
+
+/* A key matches if its first n characters are those of name (all of them if n is 0) */
+static const struct {
+    const char *name;
+    size_t n;
+} readthermo_key[KEY_UNKNOWN] = {
+    [KEY_TEMPERATURE]          = { "temperature", 4 },
+    [KEY_NMOLES]               = { "nmoles", 4 },
+    [KEY_VOLUME]               = { "volume", 4 },
+    [KEY_CONCENTRATION]        = { "concentration", 13 },
+    [KEY_PRESSURE]             = { "pressure", 4 },
+    [KEY_MASS]                 = { "mass", 4 },
+    [KEY_TRANSLATIONS]         = { "translations", 4 },
+    [KEY_QUASIHARMONIC]        = { "quasiharmonic", 4 },
+    [KEY_SIGMA]                = { "sigma", 4 },
+    [KEY_ROTATIONS]            = { "rotations", 4 },
+    [KEY_VIBRATIONS]           = { "vibrations", 4 },
+    [KEY_DOS]                  = { "dos", 3 },
+    [KEY_ENSEMBLE]             = { "ensemble", 4 },
+    [KEY_DEGENERACY]           = { "degeneracy", 4 },
+    [KEY_UNCERTAINTY]          = { "uncertainty", 4 },
+    [KEY_ENERGY]               = { "energy", 4 },
+    [KEY_HESSIAN]              = { "hessian", 4 },
+    [KEY_VVDW]                 = { "vvdw", 4 },
+    [KEY_RGYR]                 = { "rgyr", 4 },
+    [KEY_BBOX]                 = { "bbox", 4 },
+    [KEY_SOLVENT_VOLUME]       = { "solvent_volume", 14 },
+    [KEY_SOLVENT_MASS]         = { "solvent_mass", 12 },
+    [KEY_SOLVENT_DENSITY]      = { "solvent_density", 15 },
+    [KEY_SOLVENT_ACENTRICITY]  = { "solvent_acentricity", 19 },
+    [KEY_SOLVENT_PERMITTIVITY] = { "solvent_permittivity", 20 },
+    [KEY_SOLVENT_EXPANSION]    = { "solvent_expansion", 17 },
+    [KEY_SOLVENT_RGYR]         = { "solvent_rgyr", 12 },
+    [KEY_SOLVENT_SASA]         = { "solvent_sasa", 12 },
+    [KEY_SOLVENT]              = { "solvent ", 0 },
+};
+
+/*
+    Perfect hash of the first four characters x of the keywords: slot
+    (x*READ_HASH_MULT)>>27 holds the range of keywords starting with them.
+*/
+#define READ_HASH_MULT 0x4bfc7463u
+static const struct {
+    int first, count;
+} readthermo_hash[32] = {
+    [28] = { KEY_TEMPERATURE, 1 },      /* temp */
+    [11] = { KEY_NMOLES, 1 },           /* nmol */
+    [26] = { KEY_VOLUME, 1 },           /* volu */
+    [4]  = { KEY_CONCENTRATION, 1 },    /* conc */
+    [1]  = { KEY_PRESSURE, 1 },         /* pres */
+    [24] = { KEY_MASS, 1 },             /* mass */
+    [15] = { KEY_TRANSLATIONS, 2 },     /* tran, quas */
+    [21] = { KEY_SIGMA, 1 },            /* sigm */
+    [17] = { KEY_ROTATIONS, 1 },        /* rota */
+    [6]  = { KEY_VIBRATIONS, 1 },       /* vibr */
+    [25] = { KEY_DOS, 2 },              /* dos, ense */
+    [13] = { KEY_DOS, 1 },              /* dos= */
+    [5]  = { KEY_DEGENERACY, 1 },       /* dege */
+    [8]  = { KEY_UNCERTAINTY, 1 },      /* unce */
+    [14] = { KEY_ENERGY, 1 },           /* ener */
+    [7]  = { KEY_HESSIAN, 1 },          /* hess */
+    [27] = { KEY_VVDW, 1 },             /* vvdw */
+    [16] = { KEY_RGYR, 1 },             /* rgyr */
+    [19] = { KEY_BBOX, 1 },             /* bbox */
+    [10] = { KEY_SOLVENT_VOLUME, KEY_UNKNOWN-KEY_SOLVENT_VOLUME },   /* solv */
+};
+
+/* Keyword of a key, or KEY_UNKNOWN */
+static int readthermo_lookup(const char *key) {
+    uint32_t x = 0;
+    int i, k;
+    for (i=0; i<4 && key[i]!='\0'; i++) x |= (uint32_t)(unsigned char)key[i] << (8*i);
+    i = (int)((uint32_t)(x*READ_HASH_MULT) >> 27);
+    for (k=readthermo_hash[i].first; k<readthermo_hash[i].first+readthermo_hash[i].count; k++) {
+        if (readthermo_key[k].n==0 ? strcmp(key, readthermo_key[k].name)==0
+                                   : strncmp(key, readthermo_key[k].name, readthermo_key[k].n)==0) return k;
+    }
+    return KEY_UNKNOWN;
+}
+
+/* Name of keyword id, or NULL past the last one */
+const char *
+thermo_keyword(int id)
+{
+    return (id>=0 && id<KEY_UNKNOWN) ? readthermo_key[id].name : NULL;
+}
+
+/* Keyword matching key (as index for thermo_keyword), or -1 */
+int
+thermo_findkeyword(const char *key)
+{
+    int k = readthermo_lookup(key);
+    return (k==KEY_UNKNOWN) ? -1 : k;
+}
+
+/*
+    Next line of [*pos, end), with its new line: point line to it, set its
+    length and move *pos after it. Return false at the end.
+*/
+static bool readthermo_nextline(const char **pos, const char *end, const char **line, size_t *len) {
+    const char *nl;
+    if (*pos>=end) return false;
+    nl = memchr(*pos, '\n', (size_t)(end-*pos));
+    *line = *pos;
+    *pos  = (nl==NULL) ? end : nl+1;
+    *len  = (size_t)(*pos-*line);
+    return true;
+}
+
+/* Copy a line to a NUL terminated buffer, to be split in key and value */
+static int readthermo_copyline(char **row, size_t *size, const char *line, size_t len) {
+    if (len+1 > *size) {
+        char *tmp = realloc(*row, len+1);
+        cyg_assert(tmp!=NULL, E_FAILURE, "Memory allocation failed!");
+        *row  = tmp;
+        *size = len+1;
+    }
+    memcpy(*row, line, len);
+    (*row)[len] = '\0';
+    return E_SUCCESS;
+}
+
+/*
+    Read the array of a "key = file:name" value to *x and *n, replacing any
+    previous one.
+*/
+static int readthermo_array(const char *fname, double **x, int *n, ThermoMap *map, bool writable) {
+    thermo_freearray(*x, map);
+    *x = thermo_readarray(fname, n, writable, map);
+    cyg_assert(*x!=NULL, E_FAILURE, "Failing reading array file <%s>", fname);
+    fprintf(fpout, "Read %d values from <%s>\n", *n, fname);
+    return E_SUCCESS;
+}
 
 /* Read a system from file */
-int 
-thermo_readthermo(Thermo *A, const char *fname) 
+int
+thermo_readthermo(Thermo *A, const char *fname)
 {
+    int ret;
+    size_t len;
+    char *text = thermo_slurp(fname, &len);
+    cyg_assert(text!=NULL, E_FAILURE, "Error opening input file.");
+    ret = thermo_readthermo_buf(A, text, len);
+    free(text);
+    return ret;
+}
 
-    char    *row=NULL, *key, *val;
-    char    unit[8];
-    int     nr, i, solvent_id;
-    double  tmpd, concentration;
-    FILE    *fp;
-    bool    convert_density_to_volume=false;
-    char solvent_name[32];
+/* Read a system from an already opened stream, up to its end */
+int
+thermo_readthermo_fp(Thermo *A, FILE *fp)
+{
+    int ret;
+    size_t len;
+    char *text = thermo_slurp_fp(fp, &len);
+    cyg_assert(text!=NULL, E_FAILURE, "Error reading input stream.");
+    ret = thermo_readthermo_buf(A, text, len);
+    free(text);
+    return ret;
+}
 
-    /* Open input config file */
-    fp = cyg_fopen(fname, "r");
-    cyg_assert(fp!=NULL, E_FAILURE, "Error opening input file.");
+/*
+    Read a system from the len bytes of text, copying each line to *row (of
+    size *size, grown as needed), which the caller frees on every return.
+*/
+static int readthermo_parse(Thermo *A, const char *text, size_t len, char **row, size_t *size) {
 
+    const char *pos = text, *end = text+len, *line;
+    size_t  linelen;
+    char    *key, *val, *saveptr;
+    char    unit[8];
+    int     nr, i, k, solvent_id;
+    double  tmpd, concentration, scale;
+    bool    convert_density_to_volume=false;
+    char solvent_name[32], fname[256];
+    bool    isfile;
 
     /* Read all elements */
-    while (cyg_getline(&row, fp) != -1) {
+    while (readthermo_nextline(&pos, end, &line, &linelen)) {
 
         /* Skip empty or comment lines */
-        if (cyg_isstrempty(row, "# \n\r\t\0")) continue;
+        if (strchr("# \n\r\t", line[0])!=NULL) continue;
+        cyg_assert(readthermo_copyline(row, size, line, linelen)==E_SUCCESS, E_FAILURE, "Failing reading input");
 
         /* Parse all key:val pairs */
-        key = strtok(row, "=");
-        val = strtok(NULL, "=");
+        key = strtok_r(*row, "=", &saveptr);
+        val = strtok_r(NULL, "=", &saveptr);
         cyg_assert(val, E_FAILURE, "Cannot read value for key <%s>", key);
+        k = readthermo_lookup(key);
 
         /* Temperature in kelvin */
-        if (strncmp(key, "temperature", 4)==0) {
-            nr = sscanf(val, "%lf", &(A->T));
+        if (k==KEY_TEMPERATURE) {
+            nr = (thermo_parsedouble(val, val+strlen(val), &(A->T))!=NULL);
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
         }
 
         /* Number of moles */
-        else if (strncmp(key, "nmoles", 4)==0) {
-            nr = sscanf(val, "%lf", &(A->n));
+        else if (k==KEY_NMOLES) {
+            nr = (thermo_parsedouble(val, val+strlen(val), &(A->n))!=NULL);
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
         }
 
         /* Volume (liters) */
-        else if (strncmp(key, "volume", 4)==0) {
-            nr = sscanf(val, "%lf", &(A->V));
+        else if (k==KEY_VOLUME) {
+            nr = (thermo_parsedouble(val, val+strlen(val), &(A->V))!=NULL);
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
         }
 
         /* Concentration */
-        else if (strncmp(key, "concentration", 13)==0) {
+        else if (k==KEY_CONCENTRATION) {
             memset(unit, '\0', sizeof(unit));
-            nr = sscanf(val, "%lf", &concentration);
+            nr = (thermo_parsedouble(val, val+strlen(val), &concentration)!=NULL);
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
             if (strstr(val, "unit")!=NULL) {
                 nr = sscanf(val, " %*f %*s %7s", unit);
@@ -80,36 +279,63 @@ thermo_readthermo(Thermo *A, const char *fname)
         }
 
         /* Pressure (atm) */
-        else if (strncmp(key, "pressure", 4)==0) {
-            nr = sscanf(val, "%lf", &(A->pressure));
+        else if (k==KEY_PRESSURE) {
+            nr = (thermo_parsedouble(val, val+strlen(val), &(A->pressure))!=NULL);
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
         }
 
         /* Molecular mass in g/mol */
-        else if (strncmp(key, "mass", 4)==0) {
-            nr = sscanf(val, "%lf", &(A->m));
+        else if (k==KEY_MASS) {
+            nr = (thermo_parsedouble(val, val+strlen(val), &(A->m))!=NULL);
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
         }
 
         /* Translational degree of freedom */
-        else if (strncmp(key, "translations", 4)==0) {
+        else if (k==KEY_TRANSLATIONS) {
             nr = sscanf(val, "%d", &(A->t));
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
         }
 
+        /* Trajectory (and masses) for the quasi-harmonic analysis */
+        else if (k==KEY_QUASIHARMONIC) {
+            char tmpstr[256], tmpmass[256], *opt;
+            nr = sscanf(val, "%255s", tmpstr);
+            cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
+            if ((opt = strstr(val, " masses "))!=NULL) {
+                cyg_assert(sscanf(opt, " masses %255s", tmpmass)==1, E_FAILURE, "Invalid value <%s> for key <%s> while reading masses", val, key);
+                nr = 2;
+            }
+            A->qhevery = 0;
+            if ((opt = strstr(val, " every "))!=NULL) {
+                cyg_assert(sscanf(opt, " every %d", &(A->qhevery))==1 && A->qhevery>0, E_FAILURE,
+                    "Invalid value <%s> for key <%s> while reading the frames between checkpoints", val, key);
+            }
+            A->qhfile = thermo_realloc(A->qhfile, strlen(tmpstr)+1);
+            cyg_assert(A->qhfile!=NULL, E_FAILURE, "Memory allocation failed!");
+            strcpy(A->qhfile, tmpstr);
+            thermo_free(A->qhmasses);
+            A->qhmasses = NULL;
+            if (nr==2) {
+                A->qhmasses = thermo_realloc(NULL, strlen(tmpmass)+1);
+                cyg_assert(A->qhmasses!=NULL, E_FAILURE, "Memory allocation failed!");
+                strcpy(A->qhmasses, tmpmass);
+            }
+        }
+
         /* Symmetry Number */
-        else if (strncmp(key, "sigma", 4)==0) {
+        else if (k==KEY_SIGMA) {
             nr = sscanf(val, "%d", &(A->s));
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
         }
 
         /* Rotational degree of freedom and moments of inertia */
-        else if (strncmp(key, "rotations", 4)==0) {
+        else if (k==KEY_ROTATIONS) {
             memset(unit, '\0', sizeof(unit));
-            nr = sscanf(val, "%d", &(A->r));
+            isfile = (sscanf(val, " file:%255s", fname)==1);
+            nr = isfile ? 1 : sscanf(val, "%d", &(A->r));
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
             if (strstr(val, "unit")!=NULL) {
-                nr = sscanf(val, " %*d %*s %7s", unit);
+                nr = isfile ? sscanf(val, " %*s %*s %7s", unit) : sscanf(val, " %*d %*s %7s", unit);
                 cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s> while reading unit", val, key);
                 if (strncmp(unit, "K", 1)==0 || strncmp(unit, "gmolA2", 6)==0 || strncmp(unit, "cm-1", 4)==0) {
                     fprintf(fpout, "Found unit <%s> for rotations\n", unit);
@@ -118,14 +344,25 @@ thermo_readthermo(Thermo *A, const char *fname)
                     return E_FAILURE;
                 }
             }
+            /* Read inertia moments from a binary file, converting them in place */
+            if (isfile) {
+                cyg_assert(readthermo_array(fname, &(A->I), &(A->r), &(A->Imap), unit[0]!='\0')==E_SUCCESS, E_FAILURE,
+                    "Invalid value <%s> for key <%s>", val, key);
+                if (strncmp(unit, "K", 1)==0) {
+                    for (i=0; i<A->r; i++) A->I[i] = thermo_kelvin2inertia(A->I[i]);
+                } else if (strncmp(unit, "cm-1", 4)==0) {
+                    for (i=0; i<A->r; i++) A->I[i] = thermo_freq2inertia(A->I[i]);
+                }
+                A->arrayhash = thermo_hash(A->arrayhash ? A->arrayhash : THERMO_HASH_INIT, A->I, (size_t)A->r*sizeof(double));
+            }
             /* Read inertia moments */
-            if (A->r>0) {
-                A->I = cyg_malloc(NULL, (A->r)*cyg_sizeof(double));
+            else if (A->r>0) {
+                A->I = thermo_realloc(NULL, (size_t)(A->r)*sizeof(double));
                 cyg_assert(A->I!=NULL, E_FAILURE, "Memory allocation failed!");
                 for (i=0; i<A->r; i++) {
-                    if (cyg_getline(&row, fp) != -1) {
-                        if (cyg_isstrempty(row, "#\n\0")) continue;
-                        nr=sscanf(row, "%lf", &tmpd);
+                    if (readthermo_nextline(&pos, end, &line, &linelen)) {
+                        if (line[0]=='#' || line[0]=='\n') continue;
+                        nr = (thermo_parsedouble(line, line+linelen, &tmpd)!=NULL);
                         cyg_assert(nr==1, E_FAILURE, "Impossible to read inertia moment #%d (expected #%d)", i, A->r);
                         if (strncmp(unit, "K", 1)==0) {
                             A->I[i] = thermo_kelvin2inertia(tmpd);
@@ -140,120 +377,236 @@ thermo_readthermo(Thermo *A, const char *fname)
         }
 
         /* Vibrational degree of freedom and normal mode frequencies */
-        else if (strncmp(key, "vibrations", 4)==0) {
-            memset(unit, '\0', sizeof(unit));
-            nr = sscanf(val, "%d", &(A->v));
+        else if (k==KEY_VIBRATIONS) {
+            thermo_free(A->w);
+            A->w = NULL;
+            A->mergevar = NAN;
+            strcpy(unit, "cm-1");
+            isfile = (sscanf(val, " file:%255s", fname)==1);
+            nr = isfile ? 1 : sscanf(val, "%d", &(A->v));
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
             if (strstr(val, "unit")!=NULL) {
-                nr = sscanf(val, " %*d %*s %7s", unit);
+                nr = isfile ? sscanf(val, " %*s %*s %7s", unit) : sscanf(val, " %*d %*s %7s", unit);
                 cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s> while reading unit", val, key);
-                if (strncmp(unit, "K", 1)==0 || strncmp(unit, "cm-1", 6)==0) {
+                if (thermo_freqfactor(unit)>0.0) {
                     fprintf(fpout, "Found unit <%s> for vibrations\n", unit);
                 } else {
-                    cyg_logErr("Impossible to understand unit <%s> for vibrations. Possible values are cm-1 (default) or K\n", unit);
+                    cyg_logErr("Impossible to understand unit <%s> for vibrations. Possible values are cm-1 (default), K, Hz or eV\n", unit);
                     return E_FAILURE;
                 }
             }
+            scale = thermo_freqfactor(unit);
+            /* Read vibrational modes from a binary file, converting them in place */
+            if (isfile) {
+                cyg_assert(readthermo_array(fname, &(A->nu), &(A->v), &(A->numap), scale!=1.0)==E_SUCCESS, E_FAILURE,
+                    "Invalid value <%s> for key <%s>", val, key);
+                if (scale!=1.0) {
+                    for (i=0; i<A->v; i++) A->nu[i] *= scale;
+                }
+                A->arrayhash = thermo_hash(A->arrayhash ? A->arrayhash : THERMO_HASH_INIT, A->nu, (size_t)A->v*sizeof(double));
+                continue;
+            }
             /* Read vibrational modes */
             if (A->v<1) continue;
-            A->nu = cyg_malloc(NULL, (A->v)*cyg_sizeof(double));
+            A->nu = thermo_realloc(NULL, (size_t)(A->v)*sizeof(double));
             cyg_assert(A->nu!=NULL, E_FAILURE, "Memory allocation failed!");
             for (i=0; i<A->v; i++) {
-                if (cyg_getline(&row, fp) != -1) {
-                    if (cyg_isstrempty(row, "#\n\0")) continue;
-                    nr=sscanf(row, "%lf", &tmpd);
+                if (readthermo_nextline(&pos, end, &line, &linelen)) {
+                    if (line[0]=='#' || line[0]=='\n') continue;
+                    nr = (thermo_parsedouble(line, line+linelen, &tmpd)!=NULL);
                     cyg_assert(nr==1, E_FAILURE, "Impossible to read vibration #%d (expected #%d)", i, A->v);
-                    if (strncmp(unit, "K", 1)==0) {
-                        A->nu[i] = thermo_kelvin2cm(tmpd);
-                    } else {
-                        A->nu[i] = tmpd;
-                    }
+                    A->nu[i] = tmpd*scale;
+                }
+            }
+        }
+
+        /* Density of states: points of frequency and weight (number of modes) */
+        else if (k==KEY_DOS) {
+            strcpy(unit, "cm-1");
+            isfile = (sscanf(val, " file:%255s", fname)==1);
+            nr = isfile ? 1 : sscanf(val, "%d", &(A->v));
+            cyg_assert(nr==1 && (isfile || A->v>=0), E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
+            if (strstr(val, "unit")!=NULL) {
+                nr = isfile ? sscanf(val, " %*s %*s %7s", unit) : sscanf(val, " %*d %*s %7s", unit);
+                cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s> while reading unit", val, key);
+                if (thermo_freqfactor(unit)>0.0) {
+                    fprintf(fpout, "Found unit <%s> for density of states\n", unit);
+                } else {
+                    cyg_logErr("Impossible to understand unit <%s> for density of states. Possible values are cm-1 (default), K, Hz or eV\n", unit);
+                    return E_FAILURE;
+                }
+            }
+            scale = thermo_freqfactor(unit);
+            double *pairs = NULL, wdrop = 0.0;
+            ThermoMap pairmap = { NULL, 0 };
+            int np, ndrop = 0;
+            if (isfile) {
+                cyg_assert(readthermo_array(fname, &pairs, &np, &pairmap, false)==E_SUCCESS, E_FAILURE,
+                    "Invalid value <%s> for key <%s>", val, key);
+                if (np%2!=0) {
+                    thermo_freearray(pairs, &pairmap);
+                    cyg_logErr("Density of states <%s> has %d values, not (frequency, weight) pairs", fname, np);
+                    return E_FAILURE;
+                }
+                A->v = np/2;
+                A->arrayhash = thermo_hash(A->arrayhash ? A->arrayhash : THERMO_HASH_INIT, pairs, (size_t)np*sizeof(double));
+            }
+            thermo_freearray(A->nu, &(A->numap));
+            A->nu = thermo_realloc(NULL, (size_t)(A->v>0 ? A->v : 1)*sizeof(double));
+            A->w  = thermo_realloc(A->w, (size_t)(A->v>0 ? A->v : 1)*sizeof(double));
+            if (A->nu==NULL || A->w==NULL) {
+                thermo_freearray(pairs, &pairmap);
+                cyg_logErr("Memory allocation failed!");
+                return E_FAILURE;
+            }
+            for (i=0; i<A->v; i++) {
+                if (isfile) {
+                    A->nu[i] = pairs[2*i]*scale;
+                    A->w[i]  = pairs[2*i+1];
+                } else if (readthermo_nextline(&pos, end, &line, &linelen)) {
+                    const char *p = thermo_parsedouble(line, line+linelen, &tmpd);
+                    nr = (p!=NULL && thermo_parsedouble(p, line+linelen, &(A->w[i]))!=NULL);
+                    cyg_assert(nr==1, E_FAILURE, "Impossible to read point #%d of the density of states (expected %d)", i, A->v);
+                    A->nu[i] = tmpd*scale;
+                } else {
+                    cyg_logErr("Density of states ended after %d points (expected %d)", i, A->v);
+                    return E_FAILURE;
+                }
+            }
+            thermo_freearray(pairs, &pairmap);
+            /* Points at zero or negative frequency (e.g. the first bin) have no harmonic free energy */
+            for (i=0, np=0; i<A->v; i++) {
+                if (A->nu[i]>0.0) {
+                    A->nu[np]  = A->nu[i];
+                    A->w[np++] = A->w[i];
+                } else {
+                    ndrop++;
+                    wdrop += A->w[i];
                 }
             }
+            if (ndrop>0) {
+                fprintf(fpout, "Skipping %d points of the density of states at zero or negative frequency (%g modes)\n", ndrop, wdrop);
+            }
+            A->v = np;
+            A->mergevar = NAN;
+        }
+
+        /* Conformers of a Boltzmann ensemble, as records of a batch file */
+        else if (k==KEY_ENSEMBLE) {
+            char tmpstr[256];
+            nr = sscanf(val, "%255s", tmpstr);
+            cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
+            A->ensfile = thermo_realloc(A->ensfile, strlen(tmpstr)+1);
+            cyg_assert(A->ensfile!=NULL, E_FAILURE, "Memory allocation failed!");
+            strcpy(A->ensfile, tmpstr);
+        }
+
+        /* Merge the modes within a tolerance [cm-1] */
+        else if (k==KEY_DEGENERACY) {
+            nr = (thermo_parsedouble(val, val+strlen(val), &(A->mergetol))!=NULL);
+            cyg_assert(nr==1 && A->mergetol>=0.0, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
+        }
+
+        /* Relative uncertainty of the frequencies, and of their scaling and of the energy [kcal/mol] */
+        else if (k==KEY_UNCERTAINTY) {
+            char *opt;
+            nr = sscanf(val, "%lf", &(A->unc_nu));
+            cyg_assert(nr==1 && A->unc_nu>=0.0, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
+            A->unc_scale = A->unc_E = 0.0;
+            if ((opt = strstr(val, " scale "))!=NULL) {
+                cyg_assert(sscanf(opt, " scale %lf", &(A->unc_scale))==1 && A->unc_scale>=0.0, E_FAILURE,
+                    "Invalid value <%s> for key <%s> while reading the uncertainty of the scaling", val, key);
+            }
+            if ((opt = strstr(val, " energy "))!=NULL) {
+                cyg_assert(sscanf(opt, " energy %lf", &(A->unc_E))==1 && A->unc_E>=0.0, E_FAILURE,
+                    "Invalid value <%s> for key <%s> while reading the uncertainty of the energy", val, key);
+            }
         }
 
         /* Energy in kcal/mol */
-        else if (strncmp(key, "energy", 4)==0) {
-            nr = sscanf(val, "%lf", &(A->E));
+        else if (k==KEY_ENERGY) {
+            nr = (thermo_parsedouble(val, val+strlen(val), &(A->E))!=NULL);
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
         }
 
         /* Hessian matrix file */
-        else if (strncmp(key, "hessian", 4)==0) {
+        else if (k==KEY_HESSIAN) {
             char tmpstr[128];
             nr = sscanf(val, "%127s", tmpstr);
-            A->hessfile = strdup(tmpstr);
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
+            A->hessfile = thermo_realloc(A->hessfile, strlen(tmpstr)+1);
+            cyg_assert(A->hessfile!=NULL, E_FAILURE, "Memory allocation failed!");
+            strcpy(A->hessfile, tmpstr);
         }
 
         /* van der Waals volume of the solute [A^3] */
-        else if (strncmp(key, "vvdw", 4)==0) {
-            nr = sscanf(val, "%lf", &(A->solute_volume));
+        else if (k==KEY_VVDW) {
+            nr = (thermo_parsedouble(val, val+strlen(val), &(A->solute_volume))!=NULL);
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
         }
 
         /* van der Waals volume of the solute [A^3] */
-        else if (strncmp(key, "solvent_volume", 14)==0) {
-            nr = sscanf(val, "%lf", &(A->solvent.vvdw));
+        else if (k==KEY_SOLVENT_VOLUME) {
+            nr = (thermo_parsedouble(val, val+strlen(val), &(A->solvent.vvdw))!=NULL);
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
         }
 
         /* solvent molecular weight [g/mol] */
-        else if (strncmp(key, "solvent_mass", 12)==0) {
-            nr = sscanf(val, "%lf", &(A->solvent.mass));
+        else if (k==KEY_SOLVENT_MASS) {
+            nr = (thermo_parsedouble(val, val+strlen(val), &(A->solvent.mass))!=NULL);
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
         }
 
         /* density of the solvent [g/ml] */
-        else if (strncmp(key, "solvent_density", 15)==0) {
-            nr = sscanf(val, "%lf", &(A->solvent.density));
+        else if (k==KEY_SOLVENT_DENSITY) {
+            nr = (thermo_parsedouble(val, val+strlen(val), &(A->solvent.density))!=NULL);
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
         }
 
         /* acentricity of the solvent */
-        else if (strncmp(key, "solvent_acentricity", 19)==0) {
-            nr = sscanf(val, "%lf", &(A->solvent.acentricity));
+        else if (k==KEY_SOLVENT_ACENTRICITY) {
+            nr = (thermo_parsedouble(val, val+strlen(val), &(A->solvent.acentricity))!=NULL);
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
         }
 
         /* permittivity of the solvent */
-        else if (strncmp(key, "solvent_permittivity", 20)==0) {
-            nr = sscanf(val, "%lf", &(A->solvent.permittivity));
+        else if (k==KEY_SOLVENT_PERMITTIVITY) {
+            nr = (thermo_parsedouble(val, val+strlen(val), &(A->solvent.permittivity))!=NULL);
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
         }
 
         /* isobaric thermcal expansion coefficient of the solvent [10^-3/K] */
-        else if (strncmp(key, "solvent_expansion", 17)==0) {
-            nr = sscanf(val, "%lf", &(A->solvent.expansion));
+        else if (k==KEY_SOLVENT_EXPANSION) {
+            nr = (thermo_parsedouble(val, val+strlen(val), &(A->solvent.expansion))!=NULL);
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
         }
 
         /* radius of gyration of the solute [A] */
-        else if (strncmp(key, "rgyr", 4)==0) {
-            nr = sscanf(val, "%lf", &(A->rgyr_m));
+        else if (k==KEY_RGYR) {
+            nr = (thermo_parsedouble(val, val+strlen(val), &(A->rgyr_m))!=NULL);
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
         }
 
         /* radius of gyration of the solvent [A] */
-        else if (strncmp(key, "solvent_rgyr", 12)==0) {
-            nr = sscanf(val, "%lf", &(A->solvent.rgyr));
+        else if (k==KEY_SOLVENT_RGYR) {
+            nr = (thermo_parsedouble(val, val+strlen(val), &(A->solvent.rgyr))!=NULL);
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
         }
 
         /* sasa of the solute [A^2] */
-        else if (strncmp(key, "bbox", 4)==0) {
-            nr = sscanf(val, "%lf", &(A->asa_m));
+        else if (k==KEY_BBOX) {
+            nr = (thermo_parsedouble(val, val+strlen(val), &(A->asa_m))!=NULL);
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
         }
 
         /* sasa of the solvent [A^2] */
-        else if (strncmp(key, "solvent_sasa", 12)==0) {
-            nr = sscanf(val, "%lf", &(A->solvent.bbox));
+        else if (k==KEY_SOLVENT_SASA) {
+            nr = (thermo_parsedouble(val, val+strlen(val), &(A->solvent.bbox))!=NULL);
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
         }
 
         /* Solvent name */
-        else if (strcmp(key, "solvent ")==0) {
+        else if (k==KEY_SOLVENT) {
             nr = sscanf(val, "%31s", solvent_name);
             cyg_assert(nr==1, E_FAILURE, "Invalid value <%s> for key <%s>", val, key);
             solvent_id = thermo_get_solvent_from_name(solvent_name);
@@ -277,9 +630,22 @@ thermo_readthermo(Thermo *A, const char *fname)
         A->V *= A->m;
     }
 
-    /* Clean and return */
-    fclose(fp);
-    free(row);
+    /* Check and return */
+    cyg_assert(A->hessfile==NULL || A->qhfile==NULL, E_FAILURE, "Keys <hessian> and <quasiharmonic> cannot be used together");
+    cyg_assert(A->ensfile==NULL || (A->hessfile==NULL && A->qhfile==NULL), E_FAILURE,
+        "Key <ensemble> cannot be used together with <hessian> or <quasiharmonic>");
     return E_SUCCESS;
 }
 
+/* Read a system from the len bytes of text */
+int
+thermo_readthermo_buf(Thermo *A, const char *text, size_t len)
+{
+    int ret;
+    char *row = NULL;
+    size_t size = 0;
+    ret = readthermo_parse(A, text, len, &row, &size);
+    free(row);
+    return ret;
+}
+
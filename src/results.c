@@ -0,0 +1,255 @@
+
+/*
+    Columnar binary results file, for large batches.
+
+    The file is made of, in order:
+
+        header      ThermoResultsHeader: magic, number of records and
+                    columns, offsets of the following sections
+        columns     one ThermoResultsColumn per quantity: THERMO_* index,
+                    short name and unit
+        data        one contiguous column of nrec doubles per quantity, each
+                    aligned to 64 bytes
+        meta        one ThermoResultsMeta per record: temperature, hash of
+                    the input, status and offset of its name
+        strings     names of the records, NUL terminated
+
+    All numbers are in the native byte order. The size of the file is known
+    as soon as the names of the records are, so it is created at its final
+    size and mapped in memory: each record is stored in place by whichever
+    thread computed it, with no ordering or locking. Readers map the file and
+    get pointers to the columns, with no copies.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RESULTS_MAGIC "THERMOR1"
+#define RESULTS_ALIGN 64
+
+/* Round n up to a multiple of RESULTS_ALIGN */
+static uint64_t results_align(uint64_t n) {
+    return (n + RESULTS_ALIGN-1) / RESULTS_ALIGN * RESULTS_ALIGN;
+}
+
+/* Set the pointers to the sections of a mapped file */
+static void results_setup(ThermoResults *R) {
+    R->header  = (const ThermoResultsHeader *)R->map;
+    R->column  = (ThermoResultsColumn *)(R->map + sizeof(ThermoResultsHeader));
+    R->data    = (double *)(R->map + R->header->data);
+    R->meta    = (ThermoResultsMeta *)(R->map + R->header->meta);
+    R->strings = R->map + R->header->strings;
+}
+
+/*
+    True if the mapped file R is consistent: sections in order, inside the
+    file and aligned, each name inside the strings, which end with a NUL.
+*/
+static bool results_valid(const ThermoResults *R) {
+    const ThermoResultsHeader *h = (const ThermoResultsHeader *)R->map;
+    const ThermoResultsMeta *meta;
+    uint64_t i;
+    if (memcmp(h->magic, RESULTS_MAGIC, 8)!=0 || h->size!=R->size || h->nrec>INT_MAX) return false;
+    if (h->data%sizeof(double)!=0 || h->meta%sizeof(double)!=0) return false;
+    if (h->data>h->meta || h->meta>h->strings || h->strings>h->size) return false;
+    if (h->data<sizeof(ThermoResultsHeader) || h->stride<h->nrec) return false;
+    if (h->ncol > (h->data-sizeof(ThermoResultsHeader))/sizeof(ThermoResultsColumn)) return false;
+    if (h->ncol>0 && h->stride > (h->meta-h->data)/sizeof(double)/h->ncol) return false;
+    if (h->nrec > (h->strings-h->meta)/sizeof(ThermoResultsMeta)) return false;
+    if (h->nrec>0 && (h->strings==h->size || R->map[h->size-1]!='\0')) return false;
+    meta = (const ThermoResultsMeta *)(R->map + h->meta);
+    for (i=0; i<h->nrec; i++) {
+        if (meta[i].name >= h->size-h->strings) return false;
+    }
+    return true;
+}
+
+/*
+    Create a results file on fd (a regular file open for reading and
+    writing) for nrec records, with the fields selected in O as columns. The
+    names of the records are written now; all values are NaN until stored by
+    thermo_results_put.
+*/
+int
+thermo_results_create(ThermoResults *R, int fd, int nrec, const ThermoRecord *rec, const ThermoOutput *O)
+{
+    int i, k;
+    uint64_t n = (uint64_t)nrec, stride = results_align(n*sizeof(double)), slen = 0, pos;
+    ThermoResultsHeader h;
+    struct stat st;
+
+    cyg_assert(fstat(fd, &st)==0 && S_ISREG(st.st_mode), E_FAILURE, "Binary results can only be written to a regular file");
+    for (i=0; i<nrec; i++) slen += strlen(rec[i].name)+1;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, RESULTS_MAGIC, 8);
+    h.nrec    = n;
+    h.ncol    = (uint64_t)O->nfields;
+    h.stride  = stride/sizeof(double);
+    h.data    = results_align(sizeof(h) + h.ncol*sizeof(ThermoResultsColumn));
+    h.meta    = h.data + h.ncol*stride;
+    h.strings = h.meta + n*sizeof(ThermoResultsMeta);
+    h.size    = h.strings + slen;
+
+    cyg_assert(ftruncate(fd, 0)==0 && ftruncate(fd, (off_t)h.size)==0, E_FAILURE,
+        "Impossible to resize results file: %s", strerror(errno));
+    R->size = (size_t)h.size;
+    R->map  = mmap(NULL, R->size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    cyg_assert(R->map!=MAP_FAILED, E_FAILURE, "Impossible to map results file: %s", strerror(errno));
+    memcpy(R->map, &h, sizeof(h));
+    results_setup(R);
+
+    for (k=0; k<O->nfields; k++) {
+        ThermoResultsColumn *c = R->column + k;
+        memset(c, 0, sizeof(*c));
+        c->id = O->field[k];
+        snprintf(c->name, sizeof(c->name), "%s", thermo_name(O->field[k]));
+        snprintf(c->unit, sizeof(c->unit), "%s", thermo_unit(O->field[k]));
+        for (i=0; i<nrec; i++) R->data[(uint64_t)k*h.stride+(uint64_t)i] = NAN;
+    }
+    for (i=0, pos=0; i<nrec; i++) {
+        R->meta[i].T      = NAN;
+        R->meta[i].hash   = 0;
+        R->meta[i].name   = pos;
+        R->meta[i].status = E_FAILURE;
+        strcpy(R->strings+pos, rec[i].name);
+        pos += strlen(rec[i].name)+1;
+    }
+    return E_SUCCESS;
+}
+
+/*
+    Store the results of record i, computed at temperature T from inputs
+    with the given hash. A NULL results marks the record as failed.
+*/
+void
+thermo_results_put(ThermoResults *R, int i, double T, uint64_t hash, const double *results)
+{
+    uint64_t k;
+    R->meta[i].T    = T;
+    R->meta[i].hash = hash;
+    if (results==NULL) return;
+    for (k=0; k<R->header->ncol; k++) {
+        R->data[k*R->header->stride+(uint64_t)i] = results[R->column[k].id];
+    }
+    R->meta[i].status = E_SUCCESS;
+}
+
+/* Open and map a results file for reading */
+int
+thermo_results_open(ThermoResults *R, const char *fname)
+{
+    struct stat st;
+    int fd = open(fname, O_RDONLY);
+    cyg_assert(fd>=0, E_FAILURE, "Impossible to open results file <%s>: %s", fname, strerror(errno));
+    if (fstat(fd, &st)!=0 || (size_t)st.st_size<sizeof(ThermoResultsHeader)) {
+        close(fd);
+        cyg_logErr("Results file <%s> is too short", fname);
+        return E_FAILURE;
+    }
+    R->size = (size_t)st.st_size;
+    R->map  = mmap(NULL, R->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    cyg_assert(R->map!=MAP_FAILED, E_FAILURE, "Impossible to map results file <%s>: %s", fname, strerror(errno));
+
+    if (!results_valid(R)) {
+        munmap(R->map, R->size);
+        cyg_logErr("Invalid results file <%s>", fname);
+        return E_FAILURE;
+    }
+    results_setup(R);
+    return E_SUCCESS;
+}
+
+/*
+    Map again, for reading and writing, the results file on fd created by
+    thermo_results_create for nrec records and the fields of O.
+*/
+int
+thermo_results_reopen(ThermoResults *R, int fd, int nrec, const ThermoOutput *O)
+{
+    int k;
+    struct stat st;
+    ThermoResultsHeader h;
+
+    cyg_assert(fstat(fd, &st)==0 && (size_t)st.st_size>=sizeof(h) && pread(fd, &h, sizeof(h), 0)==(ssize_t)sizeof(h),
+        E_FAILURE, "Impossible to read results file");
+    cyg_assert(memcmp(h.magic, RESULTS_MAGIC, 8)==0 && h.size==(uint64_t)st.st_size && h.nrec==(uint64_t)nrec &&
+        h.ncol==(uint64_t)O->nfields, E_FAILURE, "The results file does not match the batch");
+    R->size = (size_t)h.size;
+    R->map  = mmap(NULL, R->size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    cyg_assert(R->map!=MAP_FAILED, E_FAILURE, "Impossible to map results file: %s", strerror(errno));
+    results_setup(R);
+    for (k=0; k<O->nfields; k++) {
+        if (R->column[k].id!=O->field[k]) {
+            munmap(R->map, R->size);
+            cyg_logErr("The results file does not match the batch");
+            return E_FAILURE;
+        }
+    }
+    return E_SUCCESS;
+}
+
+/* Column of the quantity id (a THERMO_* index), or NULL if not in the file */
+const double *
+thermo_results_column(const ThermoResults *R, int id)
+{
+    uint64_t k;
+    for (k=0; k<R->header->ncol; k++) {
+        if (R->column[k].id==id) return R->data + k*R->header->stride;
+    }
+    return NULL;
+}
+
+/* Name of record i */
+const char *
+thermo_results_name(const ThermoResults *R, int i)
+{
+    return R->strings + R->meta[i].name;
+}
+
+/* Unmap a results file, writing it to disk if it was created */
+int
+thermo_results_close(ThermoResults *R)
+{
+    int ret = munmap(R->map, R->size);
+    R->map = NULL;
+    cyg_assert(ret==0, E_FAILURE, "Failing closing results file: %s", strerror(errno));
+    return E_SUCCESS;
+}
+
+/* Write all records of a results file, with the fields of O that are in the file */
+int
+thermo_results_print(const ThermoResults *R, const ThermoOutput *O, FILE *fp)
+{
+    int i, k, n = (int)R->header->nrec;
+    double res[THERMO_LAST];
+    const double *col[THERMO_LAST];
+    ThermoOutput out = *O;
+    ThermoWriter *w = cyg_malloc(NULL, cyg_sizeof(ThermoWriter));
+    cyg_assert(w!=NULL, E_FAILURE, "Memory allocation failed!");
+
+    out.nfields = 0;
+    for (k=0; k<O->nfields; k++) {
+        col[out.nfields] = thermo_results_column(R, O->field[k]);
+        if (col[out.nfields]!=NULL) out.field[out.nfields++] = O->field[k];
+    }
+
+    thermo_writer_init(w, fp);
+    thermo_output_header(&out, w);
+    for (i=0; i<n; i++) {
+        if (R->meta[i].status!=E_SUCCESS) continue;
+        for (k=0; k<out.nfields; k++) res[out.field[k]] = col[k][i];
+        thermo_output_record(&out, w, thermo_results_name(R, i), res);
+    }
+    k = thermo_writer_flush(w);
+    free(w);
+    return k;
+}
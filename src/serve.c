@@ -0,0 +1,442 @@
+
+/*
+    Server mode: a long-lived process computing thermo records sent over a
+    Unix domain socket, avoiding the startup cost of one process per record.
+
+    Each request is a thermo input (the usual key = value lines) framed as:
+
+        BEGIN id
+        temperature = 300
+        ...
+        END
+
+    and gets a single line reply, with the same fields as a batch row:
+
+        RESULT id value value ...
+        ERROR id message
+
+    Requests on a connection can be pipelined: they are computed by a pool of
+    workers and replied as soon as they are done, so the replies can come in
+    a different order (matched by their id). The line "FIELDS" replies with
+    the header of the result fields and "QUIT" closes the connection. The
+    message of an error is the first one reported while computing the
+    request. An END without BEGIN, and a BEGIN inside an open request (which
+    rejects both), are answered with an ERROR line.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef HAVE_THREADS
+
+/* A client connection, alive while read or with requests pending */
+typedef struct ServeConn {
+    int fd;
+    int refs;               /* Reader plus pending requests */
+    pthread_mutex_t lock;   /* Protects refs */
+    pthread_mutex_t wlock;  /* Serializes the replies */
+    struct ServeConn *prev, *next;  /* Connections being read, under the queue lock */
+} ServeConn;
+
+/* A request waiting for a worker */
+typedef struct ServeJob {
+    ServeConn *conn;
+    ThermoRecord rec;       /* Request id as name, and inline text */
+    struct ServeJob *next;
+} ServeJob;
+
+/* Queue of requests shared by all connections and workers */
+typedef struct {
+    double dnu;
+    ServeJob *head, *tail;
+    ServeConn *conns;       /* Connections being read */
+    bool stop;              /* No more requests: the workers exit once the queue is empty */
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;   /* A request was queued, or stop */
+    pthread_cond_t  idle;   /* A connection is no longer read */
+} ServeQueue;
+
+/* Argument of a connection thread */
+typedef struct {
+    ServeQueue *queue;
+    ServeConn  *conn;
+} ServeReader;
+
+static volatile sig_atomic_t serve_stop = 0;
+
+static void serve_signal(int sig) {
+    (void)sig;
+    serve_stop = 1;
+}
+
+/* Write all len bytes of a reply, under the connection lock */
+static void serve_reply(ServeConn *conn, const char *buf, size_t len) {
+    ssize_t n;
+    pthread_mutex_lock(&conn->wlock);
+    while (len>0) {
+        n = write(conn->fd, buf, len);
+        if (n<0 && errno==EINTR) continue;
+        if (n<=0) break;
+        buf += n;
+        len -= (size_t)n;
+    }
+    pthread_mutex_unlock(&conn->wlock);
+}
+
+/* Drop a reference to a connection, closing it with the last one */
+static void serve_release(ServeConn *conn) {
+    int refs;
+    pthread_mutex_lock(&conn->lock);
+    refs = --conn->refs;
+    pthread_mutex_unlock(&conn->lock);
+    if (refs>0) return;
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->lock);
+    pthread_mutex_destroy(&conn->wlock);
+    free(conn);
+}
+
+/* First error of a request, kept on one line for the reply */
+typedef struct {
+    char msg[256];
+} ServeError;
+
+/* Error callback of the context of a worker: keep the first message */
+static void serve_error(void *data, const char *msg) {
+    ServeError *e = data;
+    const char *p, *line = NULL, *end;
+    size_t n;
+    if (e->msg[0]!='\0') return;
+
+    /* The last non empty line of the message, without the ERROR!! tag */
+    for (p=msg; *p!='\0'; p=end) {
+        end = p+strcspn(p, "\n");
+        if (p+strspn(p, " \t\r")<end) line = p;
+        if (*end=='\n') end++;
+    }
+    if (line==NULL) line = "invalid record";
+    line += strspn(line, " \t");
+    if (strncmp(line, "ERROR!! ", 8)==0) line += 8;
+    n = strcspn(line, "\r\n");
+    if (n>=sizeof(e->msg)) n = sizeof(e->msg)-1;
+    memcpy(e->msg, line, n);
+    e->msg[n] = '\0';
+}
+
+/* Compute one request and reply */
+static void serve_compute(ServeJob *job, double dnu, FILE *out, char **buf, ServeError *err) {
+    Thermo A;
+    thermo_init(&A);
+    A.dnu   = dnu;
+    A.nu_np = (int)lrint(ceil(4000.0/dnu));
+    rewind(out);
+    err->msg[0] = '\0';
+    if (thermo_computerecord(&A, &job->rec)==E_SUCCESS) {
+        fprintf(out, "RESULT ");
+        thermo_printrow(out, job->rec.name, A.results);
+    } else {
+        fprintf(out, "ERROR %s %s\n", job->rec.name, (err->msg[0]!='\0') ? err->msg : "invalid record");
+    }
+    fflush(out);
+    serve_reply(job->conn, *buf, (size_t)ftell(out));
+    thermo_delete(&A);
+}
+
+/* Main loop of a worker, until stopped with the queue empty */
+static void *serve_worker(void *arg) {
+    ServeQueue *q = arg;
+    ServeJob *job;
+    char *buf = NULL;
+    size_t size = 0;
+    ServeError err;
+    ThermoContext ctx;
+    FILE *out = open_memstream(&buf, &size);
+    cyg_assert(out!=NULL, NULL, "Impossible to open the reply buffer");
+
+    /* Log to stderr, errors to the reply of the request */
+    thermo_context_init(&ctx);
+    ctx.out   = stderr;
+    ctx.error = serve_error;
+    ctx.data  = &err;
+    thermo_context_set(&ctx);
+
+    while (1) {
+        pthread_mutex_lock(&q->lock);
+        while (q->head==NULL && !q->stop) pthread_cond_wait(&q->cond, &q->lock);
+        job = q->head;
+        if (job==NULL) {
+            pthread_mutex_unlock(&q->lock);
+            break;
+        }
+        q->head = job->next;
+        if (q->head==NULL) q->tail = NULL;
+        pthread_mutex_unlock(&q->lock);
+
+        serve_compute(job, q->dnu, out, &buf, &err);
+        serve_release(job->conn);
+        free(job->rec.name);
+        free(job->rec.text);
+        free(job);
+    }
+    fclose(out);
+    free(buf);
+    thermo_context_set(NULL);
+    return NULL;
+}
+
+/* Add a request to the queue */
+static void serve_push(ServeQueue *q, ServeJob *job) {
+    pthread_mutex_lock(&job->conn->lock);
+    job->conn->refs++;
+    pthread_mutex_unlock(&job->conn->lock);
+    job->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail!=NULL) q->tail->next = job; else q->head = job;
+    q->tail = job;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Add a connection to the ones being read */
+static void serve_list(ServeQueue *q, ServeConn *conn) {
+    pthread_mutex_lock(&q->lock);
+    conn->prev = NULL;
+    conn->next = q->conns;
+    if (q->conns!=NULL) q->conns->prev = conn;
+    q->conns = conn;
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Remove a connection from the ones being read */
+static void serve_unlist(ServeQueue *q, ServeConn *conn) {
+    pthread_mutex_lock(&q->lock);
+    if (conn->prev!=NULL) conn->prev->next = conn->next; else q->conns = conn->next;
+    if (conn->next!=NULL) conn->next->prev = conn->prev;
+    pthread_cond_broadcast(&q->idle);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Drop a request that was not queued */
+static void serve_discard(ServeJob *job, FILE *text) {
+    fclose(text);
+    free(job->rec.name);
+    free(job->rec.text);
+    free(job);
+}
+
+/* Read the requests of a connection, line by line */
+static void *serve_reader(void *arg) {
+    ServeReader *r = arg;
+    ServeConn *conn = r->conn;
+    ServeJob *job = NULL;
+    FILE *in, *text = NULL;
+    char *row = NULL, *buf = NULL, id[64], err[160];
+    size_t tsize = 0, size = 0, rowsize = 0;
+    bool skip = false;  /* In the body of a rejected request */
+    int n;
+
+    in = fdopen(dup(conn->fd), "r");
+    while (in!=NULL && cyg_getline(&row, &rowsize, in) != -1) {
+
+        /* Body of a request, or of a rejected one up to its END */
+        if ((job!=NULL || skip) && strncmp(row, "END", 3)!=0 && strncmp(row, "BEGIN", 5)!=0) {
+            if (job!=NULL) fputs(row, text);
+            continue;
+        }
+
+        if (job!=NULL && strncmp(row, "BEGIN", 5)==0) {
+            /* A request inside another: both are rejected */
+            n = snprintf(err, sizeof(err), "ERROR %s BEGIN before END\n", job->rec.name);
+            serve_reply(conn, err, (n>0 && (size_t)n<sizeof(err)) ? (size_t)n : strlen(err));
+            if (sscanf(row, "BEGIN %63s", id)==1 && strcmp(id, job->rec.name)!=0) {
+                n = snprintf(err, sizeof(err), "ERROR %s BEGIN before END\n", id);
+                serve_reply(conn, err, (n>0 && (size_t)n<sizeof(err)) ? (size_t)n : strlen(err));
+            }
+            serve_discard(job, text);
+            job = NULL;
+            skip = true;
+        } else if (strncmp(row, "END", 3)==0 && job==NULL) {
+            if (!skip) {
+                const char nobegin[] = "ERROR - END without BEGIN\n";
+                serve_reply(conn, nobegin, sizeof(nobegin)-1);
+            }
+            skip = false;
+        } else if (strncmp(row, "END", 3)==0) {
+            fclose(text);
+            job->rec.len = tsize;
+            serve_push(r->queue, job);
+            job = NULL;
+        } else if (sscanf(row, "BEGIN %63s", id)==1) {
+            job = cyg_malloc(NULL, cyg_sizeof(ServeJob));
+            if (job==NULL) {
+                cyg_logErr("Memory allocation failed!");
+                break;
+            }
+            job->conn = conn;
+            job->rec.name = strdup(id);
+            job->rec.path = NULL;
+            job->rec.text = NULL;
+            text = open_memstream(&job->rec.text, &tsize);
+            if (text==NULL) {
+                cyg_logErr("Impossible to open the request buffer");
+                free(job->rec.name);
+                free(job);
+                job = NULL;
+                break;
+            }
+            skip = false;
+        } else if (strncmp(row, "FIELDS", 6)==0) {
+            FILE *out = open_memstream(&buf, &size);
+            thermo_printrowheader(out);
+            fclose(out);
+            serve_reply(conn, buf, size);
+            free(buf);
+        } else if (strncmp(row, "QUIT", 4)==0) {
+            break;
+        } else if (!cyg_isstrempty(row, " \n\r\t\0")) {
+            const char unknown[] = "ERROR - unknown command\n";
+            serve_reply(conn, unknown, sizeof(unknown)-1);
+        }
+    }
+
+    /* Connection closed in the middle of a request */
+    if (job!=NULL) serve_discard(job, text);
+    if (in!=NULL) fclose(in);
+    shutdown(conn->fd, SHUT_RD);
+    free(row);
+    serve_unlist(r->queue, conn);
+    free(r);
+    serve_release(conn);
+    return NULL;
+}
+
+#endif
+
+/*
+    Serve requests on the Unix socket at path with njobs workers, until
+    interrupted by SIGINT or SIGTERM. Then the connections are no longer
+    read, and the requests already received are computed and replied before
+    returning.
+*/
+int
+thermo_serve(const char *path, double dnu, int njobs)
+{
+#ifndef HAVE_THREADS
+    (void)path; (void)dnu; (void)njobs;
+    cyg_logErr("Code compiled without threads support. Impossible to use this functon.");
+    return E_FAILURE;
+#else
+    int i, fd, cfd, nworkers, ret = E_SUCCESS;
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    pthread_t thread, *worker;
+    ServeConn *conn;
+    ServeQueue queue = { dnu, NULL, NULL, NULL, false, PTHREAD_MUTEX_INITIALIZER,
+        PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+    cyg_assert(strlen(path)<sizeof(addr.sun_path), E_FAILURE, "Socket path <%s> is too long", path);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    cyg_assert(fd>=0, E_FAILURE, "Impossible to create socket: %s", strerror(errno));
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))!=0) {
+        cyg_logErr("Impossible to bind socket <%s>: %s", path, strerror(errno));
+        close(fd);
+        return E_FAILURE;
+    }
+    worker = cyg_malloc(NULL, njobs*cyg_sizeof(pthread_t));
+    if (listen(fd, 64)!=0 || worker==NULL) {
+        cyg_logErr("Impossible to listen on socket <%s>: %s", path, (worker==NULL) ? "memory allocation failed" : strerror(errno));
+        free(worker);
+        close(fd);
+        unlink(path);
+        return E_FAILURE;
+    }
+
+    /* Stop on SIGINT/SIGTERM (interrupting accept), survive closed clients */
+    serve_stop = 0;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (nworkers=0; nworkers<njobs; nworkers++) {
+        if (pthread_create(worker+nworkers, NULL, serve_worker, &queue)!=0) {
+            cyg_logErr("Impossible to start worker %d", nworkers);
+            ret = E_FAILURE;
+            break;
+        }
+    }
+    if (ret==E_SUCCESS) fprintf(stderr, "Serving on <%s> with %d workers\n", path, njobs);
+
+    while (ret==E_SUCCESS && !serve_stop) {
+        cfd = accept(fd, NULL, NULL);
+        if (cfd<0) {
+            if (errno==EINTR) continue;
+            cyg_logErr("Failing accepting connection: %s", strerror(errno));
+            ret = E_FAILURE;
+            break;
+        }
+        ServeReader *r = cyg_malloc(NULL, cyg_sizeof(ServeReader));
+        conn = cyg_malloc(NULL, cyg_sizeof(ServeConn));
+        if (r==NULL || conn==NULL) {
+            cyg_logErr("Memory allocation failed!");
+            close(cfd);
+            free(r);
+            free(conn);
+            continue;
+        }
+        conn->fd   = cfd;
+        conn->refs = 1;
+        pthread_mutex_init(&conn->lock, NULL);
+        pthread_mutex_init(&conn->wlock, NULL);
+        r->queue = &queue;
+        r->conn  = conn;
+        serve_list(&queue, conn);
+        if (pthread_create(&thread, NULL, serve_reader, r)!=0) {
+            cyg_logErr("Impossible to start connection thread");
+            serve_unlist(&queue, conn);
+            close(cfd);
+            pthread_mutex_destroy(&conn->lock);
+            pthread_mutex_destroy(&conn->wlock);
+            free(r);
+            free(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    close(fd);
+    unlink(path);
+
+    /* Stop reading the connections, then let the workers empty the queue */
+    pthread_mutex_lock(&queue.lock);
+    for (conn=queue.conns; conn!=NULL; conn=conn->next) {
+        shutdown(conn->fd, SHUT_RD);
+    }
+    while (queue.conns!=NULL) pthread_cond_wait(&queue.idle, &queue.lock);
+    queue.stop = true;
+    pthread_cond_broadcast(&queue.cond);
+    pthread_mutex_unlock(&queue.lock);
+    for (i=0; i<nworkers; i++) {
+        pthread_join(worker[i], NULL);
+    }
+    free(worker);
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.cond);
+    pthread_cond_destroy(&queue.idle);
+
+    fprintf(stderr, "Server on <%s> stopped\n", path);
+    return ret;
+#endif
+}
+
@@ -0,0 +1,420 @@
+
+/*
+    Shared memory coupling to a running simulation: thermodynamics on the
+    fly, without writing trajectories to disk.
+
+    The simulation engine (the producer) creates a POSIX shared memory ring
+    of slots, each holding one set of frequencies (e.g. from a quasi-harmonic
+    or instantaneous normal mode analysis) and its temperature, and pushes
+    sets without ever waiting: when the ring is full the oldest set is
+    overwritten. Each slot has a sequence counter (a seqlock), odd while the
+    set k is written and 2k+2 when it is complete, so that Thermo (the
+    consumer) copies a set without locks, and detects the sets overwritten
+    before or while it read them. The number of sets pushed and a closed flag
+    are C11 atomics in the header of the ring.
+
+    Each set is computed with thermo_computeat on the system of the input
+    file, and the results of the last set, and their running mean and
+    standard deviation, are published, again under a seqlock, in a second
+    shared memory block, name.results, that the engine can read at any time.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_SHM
+#include <stdatomic.h>
+
+#define SHM_MAGIC   0x4d485354u     /* "TSHM" */
+#define SHM_VERSION 1u
+#define SHM_ALIGN   64              /* Slots start on their own cache lines */
+#define SHM_POLL    1000000L        /* Wait between polls of an empty ring [ns] */
+
+/* Header of the ring, followed by the slots */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nslots;                /* Slots of the ring */
+    uint32_t maxmodes;              /* Frequencies per slot, at most */
+    _Atomic uint64_t head;          /* Sets pushed so far */
+    _Atomic uint32_t closed;        /* No more sets will be pushed */
+} ShmRing;
+
+/* Header of a slot, followed by maxmodes frequencies */
+typedef struct {
+    _Atomic uint64_t seq;           /* 2k+1 while set k is written, 2k+2 when complete */
+    int32_t n;                      /* Frequencies of the set */
+    int32_t pad;
+    double  T;                      /* Temperature, 0 for that of the input */
+} ShmSlot;
+
+/* Results block */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    _Atomic uint64_t seq;           /* Odd while the results are written */
+    ThermoShmResults R;
+} ShmOut;
+
+/* Size of the header and of a slot, rounded to SHM_ALIGN */
+static size_t shm_round(size_t n) { return (n+SHM_ALIGN-1)/SHM_ALIGN*SHM_ALIGN; }
+static size_t shm_slotsize(uint32_t maxmodes) { return shm_round(sizeof(ShmSlot)+maxmodes*sizeof(double)); }
+
+static ShmSlot *shm_slot(const ThermoShm *S, uint64_t k) {
+    const ShmRing *H = S->ring;
+    return (ShmSlot *)((char *)S->ring + shm_round(sizeof(ShmRing)) + (k%H->nslots)*shm_slotsize(H->maxmodes));
+}
+
+/* Name of the block, with the leading slash (and suffix) */
+static char *shm_name(const char *name, const char *suffix) {
+    size_t l = strlen(name) + strlen(suffix) + 2;
+    char *s = thermo_realloc(NULL, l);
+    cyg_assert(s!=NULL, NULL, "Memory allocation failed!");
+    snprintf(s, l, "%s%s%s", (name[0]=='/') ? "" : "/", name, suffix);
+    return s;
+}
+
+/* Map the block name of size bytes (0 to take its size), creating it if create */
+static void *shm_map(const char *name, size_t *size, bool create) {
+    int fd;
+    struct stat st;
+    void *p;
+
+    fd = shm_open(name, create ? O_RDWR|O_CREAT : O_RDWR, 0600);
+    cyg_assert(fd>=0, NULL, "Impossible to open shared memory <%s>: %s", name, strerror(errno));
+    if (create && ftruncate(fd, (off_t)*size)!=0) {
+        close(fd);
+        cyg_logErr("Impossible to size shared memory <%s>: %s", name, strerror(errno));
+        return NULL;
+    }
+    if (*size==0) {
+        if (fstat(fd, &st)!=0 || st.st_size<=0) {
+            close(fd);
+            cyg_logErr("Impossible to get the size of shared memory <%s>", name);
+            return NULL;
+        }
+        *size = (size_t)st.st_size;
+    }
+    p = mmap(NULL, *size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    cyg_assert(p!=MAP_FAILED, NULL, "Impossible to map shared memory <%s>: %s", name, strerror(errno));
+    return p;
+}
+
+/* Sleep while the ring is empty */
+static void shm_wait(void) {
+    struct timespec ts = { 0, SHM_POLL };
+    nanosleep(&ts, NULL);
+}
+
+/*
+    Create the ring name of nslots sets of at most maxmodes frequencies, for
+    a producer. A stale ring of the same name is replaced.
+*/
+int
+thermo_shm_create(ThermoShm *S, const char *name, int nslots, int maxmodes)
+{
+    ShmRing *H;
+
+    memset(S, 0, sizeof(ThermoShm));
+    cyg_assert(nslots>0 && maxmodes>0, E_FAILURE, "Invalid size of the ring: %d sets of %d frequencies", nslots, maxmodes);
+    S->name = shm_name(name, "");
+    cyg_assert(S->name!=NULL, E_FAILURE, "Failing creating shared memory <%s>", name);
+    shm_unlink(S->name);
+    S->ringsize = shm_round(sizeof(ShmRing)) + (size_t)nslots*shm_slotsize((uint32_t)maxmodes);
+    S->ring = shm_map(S->name, &S->ringsize, true);
+    if (S->ring==NULL) {
+        thermo_shm_close(S);
+        return E_FAILURE;
+    }
+    S->owner = true;
+
+    /* The pages are zero: no set is complete. The magic goes last. */
+    H = S->ring;
+    H->version  = SHM_VERSION;
+    H->nslots   = (uint32_t)nslots;
+    H->maxmodes = (uint32_t)maxmodes;
+    atomic_store(&H->head, 0);
+    atomic_store(&H->closed, 0);
+    atomic_thread_fence(memory_order_release);
+    H->magic = SHM_MAGIC;
+    return E_SUCCESS;
+}
+
+/*
+    Push the set of n frequencies nu [cm-1] at temperature T (0 for that of
+    the input), overwriting the oldest set if the ring is full. Never waits.
+*/
+int
+thermo_shm_push(ThermoShm *S, int n, const double *nu, double T)
+{
+    ShmRing *H = S->ring;
+    ShmSlot *slot;
+    uint64_t k;
+
+    cyg_assert(n>=0 && (uint32_t)n<=H->maxmodes, E_FAILURE, "Set of %d frequencies, but the ring holds %u", n, H->maxmodes);
+    k = atomic_load_explicit(&H->head, memory_order_relaxed);
+    slot = shm_slot(S, k);
+    atomic_store_explicit(&slot->seq, 2*k+1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->n = n;
+    slot->T = T;
+    memcpy(slot+1, nu, (size_t)n*sizeof(double));
+    atomic_store_explicit(&slot->seq, 2*k+2, memory_order_release);
+    atomic_store_explicit(&H->head, k+1, memory_order_release);
+    return E_SUCCESS;
+}
+
+/* Tell the consumer that no more sets will be pushed */
+void
+thermo_shm_finish(ThermoShm *S)
+{
+    ShmRing *H = S->ring;
+    atomic_store_explicit(&H->closed, 1, memory_order_release);
+}
+
+/*
+    Copy the latest published results of the ring S in R. Return E_FAILURE
+    if no set was computed yet.
+*/
+int
+thermo_shm_results(ThermoShm *S, ThermoShmResults *R)
+{
+    ShmOut *O;
+    uint64_t s1, s2;
+    char *name;
+
+    if (S->out==NULL) {
+        name = shm_name(S->name, ".results");
+        cyg_assert(name!=NULL, E_FAILURE, "Failing reading the results of <%s>", S->name);
+        S->outsize = 0;
+        S->out = shm_map(name, &S->outsize, false);
+        thermo_free(name);
+        cyg_assert(S->out!=NULL, E_FAILURE, "No results published for <%s>", S->name);
+    }
+    O = S->out;
+    cyg_assert(S->outsize>=sizeof(ShmOut) && O->magic==SHM_MAGIC && O->version==SHM_VERSION, E_FAILURE,
+            "Invalid results block for <%s>", S->name);
+    do {
+        s1 = atomic_load_explicit(&O->seq, memory_order_acquire);
+        memcpy(R, &O->R, sizeof(ThermoShmResults));
+        atomic_thread_fence(memory_order_acquire);
+        s2 = atomic_load_explicit(&O->seq, memory_order_relaxed);
+    } while (s1!=s2 || (s1&1));
+    return (R->nsets>0) ? E_SUCCESS : E_FAILURE;
+}
+
+/* Unmap the ring and the results; the owner also removes them */
+void
+thermo_shm_close(ThermoShm *S)
+{
+    char *name;
+    if (S->ring!=NULL) munmap(S->ring, S->ringsize);
+    if (S->out!=NULL) munmap(S->out, S->outsize);
+    if (S->owner && S->name!=NULL) {
+        shm_unlink(S->name);
+        name = shm_name(S->name, ".results");
+        if (name!=NULL) shm_unlink(name);
+        thermo_free(name);
+    }
+    thermo_free(S->name);
+    memset(S, 0, sizeof(ThermoShm));
+}
+
+/* Publish the results under the seqlock */
+static void shm_publish(ShmOut *O, const ThermoShmResults *R) {
+    uint64_t s = atomic_load_explicit(&O->seq, memory_order_relaxed);
+    atomic_store_explicit(&O->seq, s+1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&O->R, R, sizeof(ThermoShmResults));
+    atomic_store_explicit(&O->seq, s+2, memory_order_release);
+}
+
+/*
+    Read the next complete set k of the ring in nu, n and T. Return 1, 0 if
+    the ring is empty, -1 if the set was overwritten before it was read.
+*/
+static int shm_pull(const ThermoShm *S, uint64_t k, double *nu, int *n, double *T) {
+    const ShmRing *H = S->ring;
+    ShmSlot *slot = shm_slot(S, k);
+    uint64_t s1, s2;
+
+    s1 = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (s1<2*k+2) return 0;
+    if (s1>2*k+2) return -1;
+    *n = slot->n;
+    *T = slot->T;
+    if (*n<0 || (uint32_t)*n>H->maxmodes) *n = 0;
+    memcpy(nu, slot+1, (size_t)*n*sizeof(double));
+    atomic_thread_fence(memory_order_acquire);
+    s2 = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    return (s1==s2) ? 1 : -1;
+}
+
+/*
+    Consume the ring name until the producer finishes it: compute each set of
+    frequencies on the system A, print a row per set on fp, and publish the
+    last results and their running statistics in name.results.
+*/
+int
+thermo_shm_run(Thermo *A, const char *name, FILE *fp)
+{
+    int i, n = 0;
+    uint64_t k = 0, head;
+    uint32_t closed;
+    double T = 0.0, U, Sm, F, d, *nu, *res, *M2;
+    double q[3] = { 0.0, 0.0, 0.0 }, qM2[3] = { 0.0, 0.0, 0.0 };
+    ThermoShm S;
+    ThermoShmResults R;
+    ShmRing *H;
+    ShmOut *O;
+    Thermo X;
+    char *outname;
+
+    cyg_assert(A->ensfile==NULL, E_FAILURE, "The frequencies of a ring cannot be used with an ensemble of conformers");
+
+    /* Attach the ring, and create the results block */
+    memset(&S, 0, sizeof(ThermoShm));
+    S.name = shm_name(name, "");
+    cyg_assert(S.name!=NULL, E_FAILURE, "Failing opening shared memory <%s>", name);
+    S.ring = shm_map(S.name, &S.ringsize, false);
+    if (S.ring==NULL) {
+        thermo_shm_close(&S);
+        return E_FAILURE;
+    }
+    H = S.ring;
+    if (S.ringsize>=sizeof(ShmRing)) atomic_thread_fence(memory_order_acquire);
+    if (S.ringsize<sizeof(ShmRing) || H->magic!=SHM_MAGIC || H->version!=SHM_VERSION || H->nslots==0 ||
+            S.ringsize<shm_round(sizeof(ShmRing))+H->nslots*shm_slotsize(H->maxmodes)) {
+        thermo_shm_close(&S);
+        cyg_logErr("<%s> is not a Thermo ring (or it is not initialized yet)", name);
+        return E_FAILURE;
+    }
+    outname = shm_name(S.name, ".results");
+    S.outsize = sizeof(ShmOut);
+    S.out = (outname!=NULL) ? shm_map(outname, &S.outsize, true) : NULL;
+    thermo_free(outname);
+    nu = thermo_realloc(NULL, (H->maxmodes>0 ? H->maxmodes : 1)*sizeof(double));
+    M2 = thermo_realloc(NULL, THERMO_LAST*sizeof(double));
+    if (S.out==NULL || nu==NULL || M2==NULL) {
+        thermo_free(nu);
+        thermo_free(M2);
+        thermo_shm_close(&S);
+        cyg_logErr("Failing creating the results of <%s>", name);
+        return E_FAILURE;
+    }
+    O = S.out;
+    memset(&R, 0, sizeof(ThermoShmResults));
+    memset(M2, 0, THERMO_LAST*sizeof(double));
+    O->version = SHM_VERSION;
+    shm_publish(O, &R);
+    O->magic = SHM_MAGIC;
+
+    fprintf(fp, "Frequency sets from shared memory <%s> (%u slots of %u frequencies):\n", name, H->nslots, H->maxmodes);
+    fprintf(fp, "         Set      T [K]  Modes    Um [kcal/mol]  Sm [cal/mol/K]    Fm [kcal/mol]\n");
+
+    /* Sets in order, skipping those overwritten: never blocks the producer */
+    while (1) {
+        closed = atomic_load_explicit(&H->closed, memory_order_acquire);
+        head = atomic_load_explicit(&H->head, memory_order_acquire);
+        if (k==head) {
+            if (closed) break;
+            shm_wait();
+            continue;
+        }
+        if (head-k>H->nslots) {
+            R.nlost += head-H->nslots-k;
+            k = head-H->nslots;
+        }
+        i = shm_pull(&S, k, nu, &n, &T);
+        if (i==0) continue;
+        if (i<0) {
+            R.nlost++;
+            k++;
+            continue;
+        }
+
+        /* The system of the input, with the frequencies of the set */
+        X = *A;
+        X.v  = n;
+        X.nu = nu;
+        X.w  = NULL;
+        if (T<=0.0) T = A->T;
+        res = thermo_computeat(&X, T);
+        if (res==NULL) {
+            cyg_logErr("Failing computing set %lu of <%s>", (unsigned long)k, name);
+            R.nlost++;
+            k++;
+            continue;
+        }
+
+        /* Running mean and variance (Welford) */
+        R.nsets++;
+        R.T = T;
+        for (i=0; i<THERMO_LAST; i++) {
+            R.last[i] = res[i];
+            d = res[i] - R.mean[i];
+            R.mean[i] += d/(double)R.nsets;
+            M2[i] += d*(res[i]-R.mean[i]);
+            R.sd[i] = (R.nsets>1) ? sqrt(M2[i]/(double)(R.nsets-1)) : 0.0;
+        }
+        shm_publish(O, &R);
+
+        /* Same for the totals with quantum vibrations, printed */
+        thermo_totqm(res, &U, &Sm, &F);
+        for (i=0; i<3; i++) {
+            d = ((i==0) ? U : (i==1) ? Sm : F) - q[i];
+            q[i] += d/(double)R.nsets;
+            qM2[i] += d*(((i==0) ? U : (i==1) ? Sm : F)-q[i]);
+        }
+        fprintf(fp, "   %9lu %10.2f %6d %16.4f %15.4f %16.4f\n", (unsigned long)k, T, n, U, Sm, F);
+        thermo_free(res);
+        k++;
+    }
+
+    fprintf(fp, "\n");
+    fprintf(fp, "Sets computed: %lu, overwritten before being read: %lu\n", (unsigned long)R.nsets, (unsigned long)R.nlost);
+    if (R.nsets>0) {
+        fprintf(fp, "Mean and standard deviation over the sets:\n");
+        fprintf(fp, "   Um %12.4f +/- %.4f kcal/mol\n", q[0], (R.nsets>1) ? sqrt(qM2[0]/(double)(R.nsets-1)) : 0.0);
+        fprintf(fp, "   Sm %12.4f +/- %.4f  cal/mol/K\n", q[1], (R.nsets>1) ? sqrt(qM2[1]/(double)(R.nsets-1)) : 0.0);
+        fprintf(fp, "   Fm %12.4f +/- %.4f kcal/mol\n", q[2], (R.nsets>1) ? sqrt(qM2[2]/(double)(R.nsets-1)) : 0.0);
+    }
+    thermo_free(nu);
+    thermo_free(M2);
+    thermo_shm_close(&S);
+    return E_SUCCESS;
+}
+
+#else
+
+int thermo_shm_create(ThermoShm *S, const char *name, int nslots, int maxmodes) {
+    (void)S; (void)nslots; (void)maxmodes;
+    cyg_logErr("Shared memory <%s> is not available: Thermo was built without POSIX shared memory", name);
+    return E_FAILURE;
+}
+int thermo_shm_push(ThermoShm *S, int n, const double *nu, double T) {
+    (void)S; (void)n; (void)nu; (void)T;
+    return E_FAILURE;
+}
+void thermo_shm_finish(ThermoShm *S) { (void)S; }
+int thermo_shm_results(ThermoShm *S, ThermoShmResults *R) {
+    (void)S; (void)R;
+    return E_FAILURE;
+}
+void thermo_shm_close(ThermoShm *S) { (void)S; }
+int thermo_shm_run(Thermo *A, const char *name, FILE *fp) {
+    (void)A; (void)fp;
+    cyg_logErr("Shared memory <%s> is not available: Thermo was built without POSIX shared memory", name);
+    return E_FAILURE;
+}
+
+#endif
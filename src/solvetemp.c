@@ -0,0 +1,109 @@
+
+/*
+    Temperature at which the free energy of the reaction nA A <-> nB B
+    vanishes, and ln K over a range of temperatures.
+
+    The frequencies of A and B are read and diagonalized once; only the
+    partition functions are evaluated again at each temperature. The root of
+    dF(T) is found by Newton, using the analytic derivative dF/dT = -dS from
+    the kernels, safeguarded by bisection within a bracket taken from the
+    table.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+
+#define SOLVET_MAXITER 100      /* Maximum number of iterations */
+#define SOLVET_TOL     1E-10    /* Relative tolerance on T */
+
+/*
+    Molar differences (quantum vibrations) at temperature T. Return dF
+    [kcal/mol] and its derivative with respect to T [kcal/mol/K].
+*/
+static double solvet_eval(const Thermo *A, const Thermo *B, int nA, int nB, double T,
+    double *dU, double *dS, double *dFdT) {
+    double *ra = thermo_computeat(A, T);
+    double *rb = thermo_computeat(B, T);
+    double UA, SA, FA, UB, SB, FB;
+    const double R = 1000.0*CNS_kB*CNS_NA*CNS_j2kcal;
+    cyg_assert(ra!=NULL && rb!=NULL, NAN, "Failing computing thermo at T = %g K", T);
+    thermo_totqm(ra, &UA, &SA, &FA);
+    thermo_totqm(rb, &UB, &SB, &FB);
+    thermo_free(ra);
+    thermo_free(rb);
+    *dU = nB*UB - nA*UA;
+    *dS = nB*SB - nA*SA;
+    /* At constant pressure the volume grows with T: d(-RT ln V)/dT = -R */
+    *dFdT = -(*dS + (B->pressure>0.0 ? nB*R : 0.0) - (A->pressure>0.0 ? nA*R : 0.0))/1000.0;
+    return nB*FB - nA*FA;
+}
+
+/* Move a system to temperature T, recomputing all its quantities */
+static void solvet_settemp(Thermo *A, double T) {
+    if (A->pressure>0.0) A->V *= T/A->T;
+    A->T = T;
+    thermo_calcthermo(A);
+}
+
+/*
+    Print the molar differences and ln K of the reaction nA A <-> nB B for
+    npoints temperatures from Tmin to Tmax, then find the temperature where
+    dF = 0 and recompute A and B there. Return E_FAILURE if there is no such
+    temperature in the range.
+*/
+int
+thermo_solvetemp(Thermo *A, Thermo *B, int nA, int nB, double Tmin, double Tmax, int npoints, FILE *fp)
+{
+    int i, it, ilo = -1;
+    double T, dU, dS, dF, dFdT, step, lo = 0.0, hi = 0.0, flo = 0.0, fhi = 0.0, Tprev = 0.0, Fprev = 0.0;
+    const double R = CNS_kB*CNS_NA*CNS_j2kcal;
+
+    cyg_assert(Tmin>0.0 && Tmax>Tmin && npoints>=2, E_FAILURE, "Invalid temperature range %g-%g K with %d points", Tmin, Tmax, npoints);
+
+    /* Dense table, looking for the first change of sign */
+    fprintf(fp, "\nReaction %dA <-> %dB versus temperature (quantum vibrations)\
+                \n---------------------------------------------\n\n", nA, nB);
+    fprintf(fp, "%10s %12s %12s %12s %12s\n", "#T", "dUm", "dSm", "dFm", "lnK");
+    for (i=0; i<npoints; i++) {
+        T = Tmin + (Tmax-Tmin)*i/(npoints-1);
+        dF = solvet_eval(A, B, nA, nB, T, &dU, &dS, &dFdT);
+        fprintf(fp, "%10.2f %12.3f %12.3f %12.3f %12.4f\n", T, dU, dS, dF, -dF/(R*T));
+        if (i>0 && ilo<0 && (dF==0.0 || (dF>0.0)!=(Fprev>0.0))) {
+            ilo = i;
+            lo = Tprev; flo = Fprev;
+            hi = T; fhi = dF;
+        }
+        Tprev = T;
+        Fprev = dF;
+    }
+    if (ilo<0) {
+        fprintf(fp, "\n# dFm does not change sign between %.2f and %.2f K\n", Tmin, Tmax);
+        return E_FAILURE;
+    }
+
+    /* Safeguarded Newton within [lo, hi], starting from the secant */
+    T = lo - flo*(hi-lo)/(fhi-flo);
+    for (it=1; it<=SOLVET_MAXITER; it++) {
+        dF = solvet_eval(A, B, nA, nB, T, &dU, &dS, &dFdT);
+        if (dF==0.0) break;
+        if ((dF>0.0)==(flo>0.0)) {
+            lo = T; flo = dF;
+        } else {
+            hi = T;
+        }
+        step = -dF/dFdT;
+        if (!isfinite(step) || T+step<=fmin(lo,hi) || T+step>=fmax(lo,hi)) {
+            step = 0.5*(lo+hi) - T;
+        }
+        T += step;
+        if (fabs(step)<SOLVET_TOL*T) break;
+    }
+    fprintf(fp, "\n# dFm = 0 at T = %.4f K (%d iterations)\n", T, it);
+
+    solvet_settemp(A, T);
+    solvet_settemp(B, T);
+    return E_SUCCESS;
+}
+
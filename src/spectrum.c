@@ -0,0 +1,205 @@
+
+/*
+    Vibrational spectrum of a system, for the cumulative free energy and the
+    vibrational density of states.
+
+    The modes are sorted by frequency once, together with their weight (1,
+    the weight of a point of a density of states, or times the
+    stoichiometric coefficient for a reaction) and their classical
+    and quantum free energy, and prefix sums of the three are kept. The
+    number of modes or their free energy below any frequency then takes a
+    binary search, and any histogram a single pass over bins and modes:
+    memory grows with the number of modes, not with the frequency range or
+    the resolution. The spectrum is built on demand, the first time it is
+    needed, and dropped when the thermodynamic quantities are recomputed.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+#include <limits.h>
+
+/* Classical and quantum molar free energy [kcal/mol] of a mode of frequency nu [cm-1] at temperature T */
+void
+thermo_modefree(double nu, double T, double *Fcl, double *Fqm)
+{
+    double kBT = CNS_kB * T;
+    double hnu = CNS_h * nu * CNS_C * 100.0;
+    *Fcl = -CNS_j2kcal * CNS_NA * kBT * log(kBT / hnu);
+    *Fqm = -CNS_j2kcal * CNS_NA * kBT * (-log(2.0*sinh(hnu/(2.0*kBT))));
+}
+
+/* Allocate a spectrum of n modes */
+static ThermoSpectrum *spectrum_new(int n) {
+    ThermoSpectrum *S = thermo_realloc(NULL, sizeof(ThermoSpectrum));
+    cyg_assert(S!=NULL, NULL, "Memory allocation failed!");
+    S->n   = n;
+    S->nu  = thermo_realloc(NULL, (size_t)n*sizeof(double));
+    S->w   = thermo_realloc(NULL, (size_t)n*sizeof(double));
+    S->W   = thermo_realloc(NULL, (size_t)(n+1)*sizeof(double));
+    S->Fcl = thermo_realloc(NULL, (size_t)(n+1)*sizeof(double));
+    S->Fqm = thermo_realloc(NULL, (size_t)(n+1)*sizeof(double));
+    if ((n>0 && (S->nu==NULL || S->w==NULL)) || S->W==NULL || S->Fcl==NULL || S->Fqm==NULL) {
+        thermo_spectrum_free(S);
+        cyg_logErr("Memory allocation failed!");
+        return NULL;
+    }
+    return S;
+}
+
+/* Prefix sums from the weighted free energies, stored shifted by one in Fcl and Fqm */
+static void spectrum_prefix(ThermoSpectrum *S) {
+    int i;
+    double cl, qm;
+    S->W[0] = S->Fcl[0] = S->Fqm[0] = 0.0;
+    for (i=0; i<S->n; i++) {
+        cl = S->Fcl[i+1];
+        qm = S->Fqm[i+1];
+        S->W[i+1]   = S->W[i]   + S->w[i];
+        S->Fcl[i+1] = S->Fcl[i] + cl;
+        S->Fqm[i+1] = S->Fqm[i] + qm;
+    }
+}
+
+/* Order of two modes by frequency */
+static int spectrum_cmp(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x>y) - (x<y);
+}
+
+/*
+    Set the spectrum of A to the n modes of frequencies nu and weights w (1
+    if NULL), e.g. the points of a density of states, replacing any previous
+    one.
+*/
+const ThermoSpectrum *
+thermo_spectrum_weighted(Thermo *A, int n, const double *nu, const double *w)
+{
+    int i;
+    double (*mode)[4];
+    ThermoSpectrum *S;
+
+    S = spectrum_new(n);
+    cyg_assert(S!=NULL, NULL, "Failing building the spectrum");
+
+    /* Sort frequency, weight and free energies together */
+    mode = thermo_realloc(NULL, (size_t)n*sizeof(*mode));
+    if (n>0 && mode==NULL) {
+        thermo_spectrum_free(S);
+        return NULL;
+    }
+    for (i=0; i<n; i++) {
+        mode[i][0] = nu[i];
+        mode[i][1] = (w!=NULL) ? w[i] : 1.0;
+        thermo_modefree(nu[i], A->T, mode[i]+2, mode[i]+3);
+        mode[i][2] *= mode[i][1];
+        mode[i][3] *= mode[i][1];
+    }
+    qsort(mode, (size_t)n, sizeof(*mode), spectrum_cmp);
+    for (i=0; i<n; i++) {
+        S->nu[i]    = mode[i][0];
+        S->w[i]     = mode[i][1];
+        S->Fcl[i+1] = mode[i][2];
+        S->Fqm[i+1] = mode[i][3];
+    }
+    thermo_free(mode);
+    spectrum_prefix(S);
+    thermo_spectrum_free(A->spectrum);
+    A->spectrum = S;
+    return S;
+}
+
+/* Spectrum of A (built at the first call) */
+const ThermoSpectrum *
+thermo_spectrum(Thermo *A)
+{
+    if (A->spectrum!=NULL) return A->spectrum;
+    return thermo_spectrum_weighted(A, A->v, A->nu, A->w);
+}
+
+/*
+    Spectrum of the reaction nA A -> nB B in D: the modes of B, weighted nB,
+    and those of A, weighted -nA, merged in frequency order.
+*/
+const ThermoSpectrum *
+thermo_spectrum_diff(Thermo *D, Thermo *A, Thermo *B, int nA, int nB)
+{
+    int i, k, a = 0, b = 0;
+    double s;
+    const ThermoSpectrum *SA = thermo_spectrum(A), *SB = thermo_spectrum(B), *X;
+    ThermoSpectrum *S;
+
+    cyg_assert(SA!=NULL && SB!=NULL, NULL, "Failing building the spectra of the reaction");
+    S = spectrum_new(SA->n+SB->n);
+    cyg_assert(S!=NULL, NULL, "Failing building the spectrum of the reaction");
+    for (i=0; i<S->n; i++) {
+        if (b<SB->n && (a>=SA->n || SB->nu[b]<=SA->nu[a])) {
+            X = SB;
+            s = nB;
+            b++;
+        } else {
+            X = SA;
+            s = -nA;
+            a++;
+        }
+        k = (X==SB) ? b-1 : a-1;
+        S->nu[i]    = X->nu[k];
+        S->w[i]     = s*X->w[k];
+        S->Fcl[i+1] = s*(X->Fcl[k+1]-X->Fcl[k]);
+        S->Fqm[i+1] = s*(X->Fqm[k+1]-X->Fqm[k]);
+    }
+    spectrum_prefix(S);
+    thermo_spectrum_free(D->spectrum);
+    D->spectrum = S;
+    return S;
+}
+
+/* Number of modes of S with frequency below x */
+int
+thermo_spectrum_count(const ThermoSpectrum *S, double x)
+{
+    int lo = 0, hi = S->n, mid;
+    while (lo<hi) {
+        mid = lo + (hi-lo)/2;
+        if (S->nu[mid]<x) lo = mid+1; else hi = mid;
+    }
+    return lo;
+}
+
+/* Classical or quantum free energy of the modes of S below x */
+double
+thermo_spectrum_cumul(const ThermoSpectrum *S, double x, bool quantum)
+{
+    int k = thermo_spectrum_count(S, x);
+    return quantum ? S->Fqm[k] : S->Fcl[k];
+}
+
+/* Bin of mode k: bins have width dnu and are centered on its multiples (modes below zero go to the first one) */
+int
+thermo_spectrum_bin(const ThermoSpectrum *S, int k, double dnu)
+{
+    long bin = lrint(S->nu[k]/dnu);
+    return (bin<0) ? 0 : (bin>INT_MAX-1) ? INT_MAX-1 : (int)bin;
+}
+
+/* Number of bins from zero to the last mode, at least nmin */
+int
+thermo_spectrum_nbins(const ThermoSpectrum *S, double dnu, int nmin)
+{
+    int last = (S->n>0) ? thermo_spectrum_bin(S, S->n-1, dnu)+1 : 0;
+    return (last>nmin) ? last : nmin;
+}
+
+/* Free a spectrum */
+void
+thermo_spectrum_free(ThermoSpectrum *S)
+{
+    if (S==NULL) return;
+    thermo_free(S->nu);
+    thermo_free(S->w);
+    thermo_free(S->W);
+    thermo_free(S->Fcl);
+    thermo_free(S->Fqm);
+    thermo_free(S);
+}
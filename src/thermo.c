@@ -8,15 +8,25 @@
 
 #include <cygtools.h>
 #include <thermo.h>
+#include <thermoint.h>
 
 
+/* Options to print a molecule */
+typedef struct {
+    bool raw_output;
+    int hasStechio, cumul, vdos;
+    const ThermoBroaden *broaden;   /* Broadening of the VDOS */
+    const ThermoOutput *out;    /* Machine-readable records, if not text */
+    ThermoWriter *w;            /* Where the records are written */
+} MolFormat;
+
 /* Functions defined at the end of this file */
+static void format_molecule(ThermoJob *job, void *data);  /* Print a molecule */
 static void version(void);  /* Print version info */
 static void version2(void);  /* Print version info -- more system specifics*/
 static void usage(void);    /* Print the usage of the software */
 static void help(void);     /* Print some help */
 
-FILE *fpout=NULL;
 
 /* Main */
 int 
@@ -24,10 +34,21 @@ main(int argc, char *argv[])
 {
 
     /* Declare used variables */
-    int hasA=0, hasB=0, hasStechio=0, nA, nB, nr, cumul=0, vdos=0, ret;
-    char *nameA=NULL, *nameB=NULL;
-    char *outfile=NULL;
+    int hasA=0, hasB=0, hasStechio=0, nA, nB, nr, cumul=0, vdos=0, njobs=1, ret;
+    bool timing = false, solveT = false;
+    double Tmin, Tmax;
+    int nT = 101;
+    char *nameA=NULL, *nameB=NULL, *namebatch=NULL, *namenetwork=NULL, *namesocket=NULL, *namecache=NULL, *nameresults=NULL, *namejournal=NULL;
+    char *outfile=NULL, *format=NULL, *fields=NULL;
+    char *namevacf=NULL, *namemasses=NULL, *nameshm=NULL;
+    double temperature = 300.0, timestep = 0.0;
+    int window = 1024;
+    int nsamples = 0;
+    unsigned long long seed = 1;
     bool raw_output = false;
+    ThermoOutput output;
+    ThermoJournal *journal = NULL;
+    ThermoBroaden broaden = { THERMO_BROADEN_TRIANGLE, 0.0 };
     fpout = stderr;
 
     /* Define and initialize Thermo structures */
@@ -41,12 +62,31 @@ main(int argc, char *argv[])
     static struct option long_options[] = {
         {"A",       required_argument, 0, 'A'},
         {"B",       required_argument, 0, 'B'},
+        {"batch",   required_argument, 0, 'b'},
+        {"jobs",    required_argument, 0, 'j'},
+        {"network", required_argument, 0, 'N'},
         {"out",     required_argument, 0, 'o'},
         {"raw",     no_argument,       0, 'r'},
         {"stechio", required_argument, 0, 's'},
         {"cumul",   no_argument,       0, 'c'},
         {"vdos",    no_argument,       0, 'd'},
         {"dnu",     required_argument, 0, 'n'},
+        {"broaden", required_argument, 0, 'k'},
+        {"timing",  no_argument,       0, 't'},
+        {"solve-T", required_argument, 0, 'T'},
+        {"serve",   required_argument, 0, 'S'},
+        {"cache",   required_argument, 0, 'C'},
+        {"format",  required_argument, 0, 'F'},
+        {"fields",  required_argument, 0, 'f'},
+        {"read",    required_argument, 0, 'R'},
+        {"journal", required_argument, 0, 'J'},
+        {"vacf",    required_argument, 0, 'V'},
+        {"masses",  required_argument, 0, 'M'},
+        {"timestep",required_argument, 0, 'D'},
+        {"window",  required_argument, 0, 'W'},
+        {"temperature", required_argument, 0, 'K'},
+        {"shm",     required_argument, 0, 'm'},
+        {"uncertainty", required_argument, 0, 'U'},
         {"version", no_argument,       0, 'v'},
         {"help",    no_argument,       0, 'h'},
         {0, 0, 0, 0}
@@ -55,7 +95,7 @@ main(int argc, char *argv[])
 
     /* Parse command line options */
     while (1) {
-        c = getopt_long_only(argc, argv, "A:B:o:rs:cdn:vh", long_options, &option_index);
+        c = getopt_long_only(argc, argv, "A:B:b:j:N:o:rs:cdn:k:tT:S:C:F:f:R:J:V:M:D:W:K:m:U:vh", long_options, &option_index);
 
         /* Detect the end of the options. */
         if (c == -1) break;
@@ -72,6 +112,24 @@ main(int argc, char *argv[])
                 nameB = optarg;
                 break;
 
+            case 'b': /* Batch of records */
+                namebatch = optarg;
+                break;
+
+            case 'j': /* Number of parallel jobs */
+                nr = sscanf(optarg, "%d", &njobs);
+                if (nr!=1 || njobs<1) {
+                    version();
+                    fprintf(stderr, "Error parsing --jobs option! The number of jobs must be a positive integer!\n\n");
+                    usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'N': /* Reaction network */
+                namenetwork = optarg;
+                break;
+
             case 'o': /* Output file */
                 outfile = optarg;
                 break;
@@ -114,6 +172,106 @@ main(int argc, char *argv[])
                 D.nu_np = A.nu_np;
                 break;
 
+            case 'k': /* Broadening of the VDOS */
+                if (thermo_broaden_parse(&broaden, optarg)!=E_SUCCESS) {
+                    version();
+                    fprintf(stderr, "Error parsing --broaden option! Expected kind[:width] with kind triangle, box, gauss or lorentz!\n\n");
+                    usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 't': /* Report timings */
+                timing = true;
+                break;
+
+            case 'T': /* Temperature range to solve dF(T)=0 */
+                nr = sscanf(optarg, "%lf:%lf:%d", &Tmin, &Tmax, &nT);
+                if (nr<2 || Tmin<=0.0 || Tmax<=Tmin || nT<2) {
+                    version();
+                    fprintf(stderr, "Error parsing --solve-T option! Expected Tmin:Tmax[:npoints] with 0<Tmin<Tmax and npoints>1!\n\n");
+                    usage();
+                    return EXIT_FAILURE;
+                }
+                solveT = true;
+                break;
+
+            case 'S': /* Server on a Unix socket */
+                namesocket = optarg;
+                break;
+
+            case 'C': /* Cache directory */
+                namecache = optarg;
+                break;
+
+            case 'F': /* Format of the records */
+                format = optarg;
+                break;
+
+            case 'f': /* Fields of the records */
+                fields = optarg;
+                break;
+
+            case 'R': /* Results file to read */
+                nameresults = optarg;
+                break;
+
+            case 'J': /* Restart journal of a batch */
+                namejournal = optarg;
+                break;
+
+            case 'V': /* Velocity trajectory */
+                namevacf = optarg;
+                break;
+
+            case 'm': /* Shared memory ring of a running simulation */
+                nameshm = optarg;
+                break;
+
+            case 'M': /* Atomic masses of the trajectory */
+                namemasses = optarg;
+                break;
+
+            case 'D': /* Time between frames */
+                nr = sscanf(optarg, "%lf", &timestep);
+                if (nr!=1 || timestep<=0.0) {
+                    version();
+                    fprintf(stderr, "Error parsing --timestep option! The time step must be a positive number of fs!\n\n");
+                    usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'W': /* Correlation window */
+                nr = sscanf(optarg, "%d", &window);
+                if (nr!=1 || window<2) {
+                    version();
+                    fprintf(stderr, "Error parsing --window option! The window must be an integer number of frames above one!\n\n");
+                    usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'K': /* Temperature of the trajectory */
+                nr = sscanf(optarg, "%lf", &temperature);
+                if (nr!=1 || temperature<=0.0) {
+                    version();
+                    fprintf(stderr, "Error parsing --temperature option! The temperature must be positive!\n\n");
+                    usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'U': /* Monte Carlo samples of the uncertainty, and seed */
+                nr = sscanf(optarg, "%d:%llu", &nsamples, &seed);
+                if (nr<1 || nsamples<2) {
+                    version();
+                    fprintf(stderr, "Error parsing --uncertainty option! Expected nsamples[:seed] with at least 2 samples!\n\n");
+                    usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+
             case 'v': /* Version */
                 version();
                 version2();
@@ -153,9 +311,44 @@ main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    /* Format and fields of the records */
+    if (thermo_output_init(&output, format, fields)!=E_SUCCESS) {
+        version();
+        fprintf(stderr, "Error parsing --format or --fields option!\n\n");
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    if (output.format==THERMO_FORMAT_BINARY && !(namebatch && outfile)) {
+        version();
+        fprintf(stderr, "Error! The bin format can only be used with --batch and --out!\n\n");
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    /* Restart journal: a run with an existing journal appends to its output */
+    if (namejournal) {
+        if (!(namebatch && outfile)) {
+            version();
+            fprintf(stderr, "Error! The --journal option can only be used with --batch and --out!\n\n");
+            usage();
+            return EXIT_FAILURE;
+        }
+        journal = thermo_journal_open(namejournal);
+        if (journal==NULL) {
+            fprintf(stderr, "Error! Impossible to use <%s> as journal!\n", namejournal);
+            return EXIT_FAILURE;
+        }
+    }
+
     /* Open outfile for writing */
     if (outfile) {
-        fpout = fopen(outfile, "w");
+        /* A results file is mapped in memory, so it needs read access too */
+        if (journal!=NULL && thermo_journal_resumed(journal)) {
+            fpout = fopen(outfile, "r+");
+        } else {
+            fpout = fopen(outfile, (output.format==THERMO_FORMAT_BINARY) ? "w+" : "w");
+        }
         if (!fpout) {
             version();
             fprintf(stderr, "ERROR! Impossible to open file <%s> for writing!\n", outfile);
@@ -165,8 +358,110 @@ main(int argc, char *argv[])
         fpout = stdout;
     }
 
+    /* Cache of eigenvalues and results */
+    if (namecache && thermo_cache_open(namecache)!=E_SUCCESS) {
+        fprintf(stderr, "Error! Impossible to use <%s> as cache directory!\n", namecache);
+        return EXIT_FAILURE;
+    }
+
+    /* Server mode: no banner, serve requests until interrupted */
+    if (namesocket) {
+        if (hasA || hasB || namebatch || namenetwork) {
+            fprintf(stderr, "Error! The --serve option cannot be used together with A, B, --batch or --network!\n");
+            return EXIT_FAILURE;
+        }
+        ret = thermo_serve(namesocket, A.dnu, njobs);
+        return (ret==E_SUCCESS) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    /* Results file: print its records and exit */
+    if (nameresults) {
+        ThermoResults results;
+        if (thermo_results_open(&results, nameresults)!=E_SUCCESS) return EXIT_FAILURE;
+        ret = thermo_results_print(&results, &output, fpout);
+        thermo_results_close(&results);
+        return (ret==E_SUCCESS) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     /* Print version */
-    if (!raw_output) version();
+    if (!raw_output && output.format==THERMO_FORMAT_TEXT && !(journal!=NULL && thermo_journal_resumed(journal))) version();
+
+    /* Batch mode: compute all records and exit */
+    if (namebatch) {
+        if (hasA || hasB) {
+            fprintf(stderr, "Error! The --batch option cannot be used together with A or B!\n");
+            return EXIT_FAILURE;
+        }
+        ThermoBatch batch;
+        ret = thermo_readbatch(&batch, namebatch);
+        cyg_assert(ret==E_SUCCESS, E_FAILURE, "Failing reading batch file <%s>", namebatch);
+        ret = thermo_runbatch(&batch, A.dnu, njobs, timing, &output, fpout, journal);
+        if (ret>0) fprintf(stderr, "Error! %d of %d records failed!\n", ret, batch.nrec);
+        thermo_deletebatch(&batch);
+        return (ret==0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    /* Shared memory ring: sets of frequencies of a running simulation, and exit */
+    if (nameshm) {
+        if (!hasA || hasB || namebatch || namenetwork) {
+            fprintf(stderr, "Error! The --shm option needs A, and cannot be used together with B, --batch or --network!\n");
+            return EXIT_FAILURE;
+        }
+        ret = thermo_readthermo(&A, nameA);
+        cyg_assert(ret==E_SUCCESS, EXIT_FAILURE, "Failing reading <%s>", nameA);
+        ret = thermo_shm_run(&A, nameshm, fpout);
+        thermo_delete(&A);
+        return (ret==E_SUCCESS) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    /* Velocity trajectory: density of states and vibrational quantities, and exit */
+    if (namevacf) {
+        if (hasA || hasB || namebatch || namenetwork) {
+            fprintf(stderr, "Error! The --vacf option cannot be used together with A, B, --batch or --network!\n");
+            return EXIT_FAILURE;
+        }
+        ThermoVacf V;
+        ThermoMap massmap = { NULL, 0 };
+        double *mass = NULL;
+        int nmass = 0;
+        if (namemasses) {
+            mass = thermo_readarray(namemasses, &nmass, false, &massmap);
+            cyg_assert(mass!=NULL, EXIT_FAILURE, "Failing reading masses file <%s>", namemasses);
+        }
+        ret = thermo_vacf(&V, namevacf, mass, nmass, timestep, window, njobs);
+        thermo_freearray(mass, &massmap);
+        cyg_assert(ret==E_SUCCESS, EXIT_FAILURE, "Failing computing the density of states of <%s>", namevacf);
+        A.T = temperature;
+        thermo_vacf_print(&V, namevacf, A.T, fpout);
+        if (cumul || vdos) {
+            thermo_spectrum_weighted(&A, V.n-1, V.nu+1, V.w+1);
+            if (cumul) thermo_cumulvib(&A, "cumul_vacf");
+            if (vdos)  thermo_vdos(&A, "vdos_vacf.dat", &broaden);
+        }
+        thermo_vacf_free(&V);
+        thermo_delete(&A);
+        return EXIT_SUCCESS;
+    }
+
+    /* Reaction network: compute all species and reactions and exit */
+    if (namenetwork) {
+        if (hasA || hasB || namebatch) {
+            fprintf(stderr, "Error! The --network option cannot be used together with A, B or --batch!\n");
+            return EXIT_FAILURE;
+        }
+        ThermoNetwork network;
+        ret = thermo_readnetwork(&network, namenetwork);
+        cyg_assert(ret==E_SUCCESS, E_FAILURE, "Failing reading network file <%s>", namenetwork);
+        ret = thermo_calcnetwork(&network, A.dnu, timing);
+        if (ret==E_SUCCESS && output.format!=THERMO_FORMAT_TEXT) {
+            ret = thermo_outputnetwork(&network, &output, fpout);
+        } else if (ret==E_SUCCESS) {
+            thermo_printnetwork(&network, fpout);
+            if (network.total!=NULL) ret = thermo_printequilibrium(&network, fpout, timing);
+        }
+        thermo_deletenetwork(&network);
+        return ret;
+    }
 
     /* Check if you gave at least A or B */
     if (!hasA && !hasB) {
@@ -174,51 +469,87 @@ main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    if (solveT && !(hasA && hasB && hasStechio)) {
+        fprintf(stderr, "Error! The --solve-T option needs A, B and --stechio!\n");
+        return EXIT_FAILURE;
+    }
+    if (nsamples>0 && (!hasA || output.format!=THERMO_FORMAT_TEXT)) {
+        fprintf(stderr, "Error! The --uncertainty option needs A, and cannot be used together with --format!\n");
+        return EXIT_FAILURE;
+    }
+    if (solveT && output.format!=THERMO_FORMAT_TEXT) {
+        fprintf(stderr, "Error! The --solve-T option cannot be used together with --format!\n");
+        return EXIT_FAILURE;
+    }
+
     /* Command line parsing went ok. Can continue. */
 
-    /* Work with mol A */
+    /* Read, diagonalize, compute and print A and B through the pipeline */
+    A.njobs = B.njobs = njobs;
+    ThermoRecord mol[2];
+    Thermo *thermo[2];
+    char label[2][2] = { "A", "B" };
+    int nmol = 0;
+    ThermoWriter *w = NULL;
+    if (output.format!=THERMO_FORMAT_TEXT) {
+        w = cyg_malloc(NULL, cyg_sizeof(ThermoWriter));
+        cyg_assert(w!=NULL, EXIT_FAILURE, "Memory allocation failed!");
+        thermo_writer_init(w, fpout);
+        thermo_output_header(&output, w);
+    }
+    MolFormat fmt = { raw_output, hasStechio, cumul, vdos, &broaden, &output, w };
     if (hasA) {
-        char *sname = strrchr(nameA, '/'); if (sname==NULL) sname=nameA; else sname++;
-        if (!(raw_output && !hasStechio)) fprintf(fpout, "\nMolecule A: <%s>\
-                \n---------------------------------------------\n\n", sname);
-        ret = thermo_readthermo(&A, nameA);
-        cyg_assert(ret==E_SUCCESS, E_FAILURE, "Failing reading thermo input file <%s>", nameA);
-        if (A.hessfile) {
-            thermo_readhessian(&A);
-            thermo_calcfreqs(&A);
-        }
-        thermo_printconfig(&A, raw_output);
-        thermo_calcthermo(&A);
-        thermo_printthermo(&A,0, raw_output);
-        if (cumul) thermo_cumulvib(&A, "cumul_A");
-        if (vdos)  thermo_vdos(&A, "vdos_A.dat");
+        mol[nmol] = (ThermoRecord){ label[0], nameA, NULL, 0 };
+        thermo[nmol++] = &A;
     }
-
-    /* Work with mol B */
     if (hasB) {
-        char *sname = strrchr(nameB, '/'); if (sname==NULL) sname=nameB; else sname++;
-        if (!(raw_output && !hasStechio)) fprintf(fpout, "\nMolecule B: <%s>\
-                \n---------------------------------------------\n\n", sname);
-        ret = thermo_readthermo(&B, nameB);
-        cyg_assert(ret==E_SUCCESS, E_FAILURE, "Failing reading thermo input file <%s>", nameB);
-        if (B.hessfile) {
-            thermo_readhessian(&B);
-            thermo_calcfreqs(&B);
-        }
-        thermo_printconfig(&B, raw_output);
-        thermo_calcthermo(&B);
-        thermo_printthermo(&B,0, raw_output);
-        if (cumul) thermo_cumulvib(&B, "cumul_B");
-        if (vdos)  thermo_vdos(&B, "vdos_B.dat");
+        mol[nmol] = (ThermoRecord){ label[1], nameB, NULL, 0 };
+        thermo[nmol++] = &B;
     }
+    ret = thermo_pipeline(nmol, mol, thermo, A.dnu, format_molecule, &fmt, timing);
+    if (ret>0) return EXIT_FAILURE;
 
     /* Evaluate difference in reaction */
-    if (hasA && hasB && hasStechio) {
+    if (w!=NULL) {
+        if (hasA && hasB && hasStechio) {
+            char reaction[64];
+            snprintf(reaction, sizeof(reaction), "%dA<->%dB", nA, nB);
+            thermo_diffthermo(&A, &B, nA, nB, &D);
+            thermo_output_record(&output, w, reaction, D.results);
+        }
+        thermo_writer_flush(w);
+        free(w);
+    } else if (hasA && hasB && hasStechio) {
         fprintf(fpout, "\nDifferences for the reaction %dA <-> %dB\
                 \n---------------------------------------------\n\n", nA, nB);
         thermo_diffthermo(&A, &B, nA, nB, &D);
         thermo_printthermo(&D,1, raw_output);
-        if (cumul) thermo_cumulvib(&D, "cumul_D");
+        if (cumul) {
+            thermo_spectrum_diff(&D, &A, &B, nA, nB);
+            thermo_cumulvib(&D, "cumul_D");
+        }
+    }
+
+    /* Monte Carlo uncertainty of A, B and the reaction */
+    if (nsamples>0) {
+        ThermoUncertainty unc;
+        ret = thermo_uncertainty(&unc, &A, hasB ? &B : NULL, nsamples, seed, njobs);
+        cyg_assert(ret==E_SUCCESS, EXIT_FAILURE, "Failing sampling the uncertainty");
+        unc.nA = hasStechio ? nA : 1;
+        unc.nB = hasStechio ? nB : 1;
+        thermo_uncertainty_print(&unc, &A, hasB ? &B : NULL, hasB && hasStechio, &output, fpout);
+        thermo_uncertainty_free(&unc);
+    }
+
+    /* Temperature where the reaction free energy vanishes */
+    if (solveT) {
+        ret = thermo_solvetemp(&A, &B, nA, nB, Tmin, Tmax, nT, fpout);
+        if (ret==E_SUCCESS) {
+            fprintf(fpout, "\nDifferences for the reaction %dA <-> %dB at T = %.4f K\
+                \n---------------------------------------------\n\n", nA, nB, A.T);
+            thermo_diffthermo(&A, &B, nA, nB, &D);
+            thermo_printthermo(&D,1, raw_output);
+        }
     }
 
     /* Cleaning */
@@ -229,6 +560,36 @@ main(int argc, char *argv[])
     return 0;
 }
 
+/* Print a molecule computed by the pipeline */
+void format_molecule(ThermoJob *job, void *data) {
+    const MolFormat *fmt = data;
+    const char *name = job->rec->path;
+    const char *sname = strrchr(name, '/'); if (sname==NULL) sname=name; else sname++;
+    char fname[16];
+    if (fmt->w!=NULL) {
+        fwrite(job->log, 1, job->loglen, stderr);
+        if (job->status!=E_SUCCESS) {
+            cyg_logErr("Failing computing molecule %s from <%s>", job->rec->name, name);
+            return;
+        }
+        thermo_output_record(fmt->out, fmt->w, job->rec->name, job->A->results);
+        return;
+    }
+    if (!(fmt->raw_output && !fmt->hasStechio)) fprintf(fpout, "\nMolecule %s: <%s>\
+                \n---------------------------------------------\n\n", job->rec->name, sname);
+    fwrite(job->log, 1, job->loglen, fpout);
+    if (job->status!=E_SUCCESS) {
+        cyg_logErr("Failing computing molecule %s from <%s>", job->rec->name, name);
+        return;
+    }
+    thermo_printconfig(job->A, fmt->raw_output);
+    thermo_printthermo(job->A, 0, fmt->raw_output);
+    snprintf(fname, sizeof(fname), "cumul_%s", job->rec->name);
+    if (fmt->cumul) thermo_cumulvib(job->A, fname);
+    snprintf(fname, sizeof(fname), "vdos_%s.dat", job->rec->name);
+    if (fmt->vdos)  thermo_vdos(job->A, fname, fmt->broaden);
+}
+
 void version() {
     fprintf(fpout, "\n");
     fprintf(fpout, "    Thermo 2.0\n");
@@ -257,11 +618,35 @@ void usage() {
     fprintf(fpout, "Options:\n");
     fprintf(fpout, "   -A, --A        fname   Input thermo file for the molecule A\n");
     fprintf(fpout, "   -B, --B        fname   Input thermo file for the molecule B\n");
+    fprintf(fpout, "   -b, --batch    fname   Compute all records listed in a batch file, one row per record\n");
+    fprintf(fpout, "   -j, --jobs     int     Number of parallel jobs in batch mode, --vacf and quasi-harmonic analyses\n");
+    fprintf(fpout, "   -N, --network  fname   Compute all reactions of a reaction network\n");
     fprintf(fpout, "   -o, --out      fname   Output file\n");
     fprintf(fpout, "   -s, --stechio  a:b     Stechiometric coefficients for the reaction aA<->bB\n");
     fprintf(fpout, "   -c, --cumul    fname   Print the cumulative vibrational chemical potential\n");
     fprintf(fpout, "   -d, --vdos     fname   Print the vibrational density of state\n");
     fprintf(fpout, "   -n, --dnu      real    Accuracy in the calculation of the vibration hystograms\n");
+    fprintf(fpout, "   -k, --broaden  kind:w  Broadening of the VDOS: triangle or box of half width w, gauss or lorentz\n");
+    fprintf(fpout, "                          of FWHM w (in cm-1, default triangle of 5 bins)\n");
+    fprintf(fpout, "   -T, --solve-T  T1:T2:n Find T in [T1,T2] where dF of the reaction vanishes, print ln K on n points\n");
+    fprintf(fpout, "   -S, --serve    socket  Serve requests on a Unix socket, computed by --jobs workers\n");
+    fprintf(fpout, "   -C, --cache    dir     Cache eigenvalues and results in dir, shared among runs\n");
+    fprintf(fpout, "   -F, --format   fmt     Write one record per molecule or reaction as text, jsonl or csv\n");
+    fprintf(fpout, "                          (or bin, a columnar results file, with --batch and --out)\n");
+    fprintf(fpout, "   -f, --fields   f1,f2   Fields of the records (default all)\n");
+    fprintf(fpout, "   -R, --read     fname   Print the records of a results file written with --format bin\n");
+    fprintf(fpout, "   -J, --journal  fname   Restart journal of a batch: skip the records it lists, append the others\n");
+    fprintf(fpout, "   -V, --vacf     fname   Density of states and vibrational quantities of a velocity trajectory\n");
+    fprintf(fpout, "                          (DCD, or raw frames of doubles, or of floats if named .f32)\n");
+    fprintf(fpout, "   -M, --masses   fname   Atomic masses of the --vacf trajectory (npy or raw doubles)\n");
+    fprintf(fpout, "   -D, --timestep real    Time between frames of the --vacf trajectory in fs (default from DCD)\n");
+    fprintf(fpout, "   -W, --window   int     Frames of the --vacf correlation window (default 1024)\n");
+    fprintf(fpout, "   -K, --temperature real Temperature of the --vacf trajectory (default 300 K)\n");
+    fprintf(fpout, "   -m, --shm      name    Compute the sets of frequencies pushed by a simulation in a shared memory ring,\n");
+    fprintf(fpout, "                          on the system of A, and publish the results in name.results\n");
+    fprintf(fpout, "   -U, --uncertainty n:s  Mean, standard deviation and quantiles of n Monte Carlo samples (seed s)\n");
+    fprintf(fpout, "                          of the inputs perturbed as given by their uncertainty key\n");
+    fprintf(fpout, "   -t, --timing           Report the utilization of each stage of the pipeline\n");
     fprintf(fpout, "   -h, --help             Show this help and exit\n");
     fprintf(fpout, "   -v, --version          Print version information and exit\n");
     fprintf(fpout, "\n");
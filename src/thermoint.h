@@ -0,0 +1,66 @@
+
+/*
+    Internal header of libthermo: shared by the library sources and the
+    thermo program, not installed.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#ifndef _THERMO_INTERNAL_
+#define _THERMO_INTERNAL_
+
+#include <thermo.h>
+
+/* File pointer for the output: the log of the current context */
+#define fpout (thermo_context()->out)
+
+/* Restart journal of a batch */
+#define THERMO_JOURNAL_GROUP 4096   /* Records between two syncs, at most */
+typedef struct {
+    char     magic[8];          /* "THERMOJ1" */
+    uint64_t nrec;              /* Number of records of the batch */
+    uint64_t batch;             /* Hash of the names of the records */
+    uint64_t output;            /* Hash of the format and fields of the output */
+    uint64_t start;             /* Size of the output before the first record */
+} ThermoJournalHeader;
+typedef struct {
+    int32_t  id;                /* Index of the record */
+    int32_t  status;            /* Its return code */
+    uint64_t end;               /* Size of the output after the record */
+    uint64_t check;             /* Hash of the fields above */
+} ThermoJournalEntry;
+struct ThermoJournal {
+    int      fd;                /* The journal file */
+    bool     resume;            /* It has a header: records are appended to the output */
+    ThermoJournalHeader header;
+    int      ndone;             /* Records completed by previous runs */
+    int      nfail;             /* Of which failed */
+    uint64_t end;               /* Size of the output after them */
+    FILE    *out;               /* Output, synced before the entries */
+    ThermoWriter  *w;           /* Writer on out, if any */
+    ThermoResults *R;           /* Results file, for the binary format */
+    int      npending;          /* Entries not yet written */
+    double   tsync;             /* Time of the last sync */
+    ThermoJournalEntry pending[THERMO_JOURNAL_GROUP];
+};
+
+/* A record going through the pipeline */
+struct ThermoJob {
+    int     id;                 /* Index of the record */
+    const ThermoRecord *rec;    /* The record */
+    Thermo *A;                  /* Where the record is computed */
+    int     status;             /* E_SUCCESS if all stages succeeded */
+    char   *log;                /* Messages printed while processing the record */
+    size_t  loglen;             /* Length of the log */
+    FILE   *logfp;              /* Stream writing to the log */
+    char   *text;               /* Text of the record */
+    size_t  len;                /* Length of the text */
+    char   *hess;               /* Content of the hessian file */
+    size_t  hesslen;            /* Length of the hessian file */
+    bool    owned;              /* A is a temporary structure */
+    bool    cached;             /* Results taken from the cache */
+    bool    haskey;             /* The results can be cached with key */
+    uint64_t key;               /* Hash of the record and its hessian (cache key of the results) */
+};
+
+#endif
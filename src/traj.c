@@ -0,0 +1,197 @@
+
+/*
+    Read trajectories (coordinates or velocities) one frame at a time, so
+    that memory does not depend on their length.
+
+    Two formats are understood: DCD files (CHARMM, NAMD, X-PLOR), in either
+    byte order, with or without unit cell, and raw files of frames of
+    natoms*3 native 64 bit floats (32 bit if the name ends in .f32), in the
+    order x1 y1 z1 x2 ... DCD files with fixed atoms are not supported.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+
+/* AKMA time unit of DCD files [fs] */
+#define TRAJ_AKMA 48.88821
+
+/* Swap the bytes of n values of 4 bytes */
+static void traj_swap4(void *p, size_t n) {
+    unsigned char *c = p, t;
+    size_t i;
+    for (i=0; i<n; i++, c+=4) {
+        t = c[0]; c[0] = c[3]; c[3] = t;
+        t = c[1]; c[1] = c[2]; c[2] = t;
+    }
+}
+
+/*
+    Read a Fortran record of a DCD file in buf (at most size bytes, or skip
+    it if buf is NULL). Return its length, or -1 on error or at the end.
+*/
+static long traj_record(ThermoTraj *T, void *buf, size_t size) {
+    int32_t head, tail;
+    if (fread(&head, sizeof(head), 1, T->fp)!=1) return -1;
+    if (T->swap) traj_swap4(&head, 1);
+    if (head<0 || (buf!=NULL && (size_t)head>size)) return -1;
+    if (buf!=NULL) {
+        if (fread(buf, 1, (size_t)head, T->fp)!=(size_t)head) return -1;
+    } else if (fseek(T->fp, head, SEEK_CUR)!=0) {
+        return -1;
+    }
+    if (fread(&tail, sizeof(tail), 1, T->fp)!=1) return -1;
+    if (T->swap) traj_swap4(&tail, 1);
+    return (tail==head) ? head : -1;
+}
+
+/* Read the header of a DCD file */
+static int traj_dcdheader(ThermoTraj *T, const char *fname) {
+    int32_t marker, icntrl[20], natoms;
+    float delta;
+    double xdelta;
+    char hdr[84];
+
+    cyg_assert(fread(&marker, sizeof(marker), 1, T->fp)==1, E_FAILURE, "Failing reading <%s>", fname);
+    rewind(T->fp);
+    if (marker!=84) {
+        traj_swap4(&marker, 1);
+        cyg_assert(marker==84, E_FAILURE, "<%s> is not a DCD file", fname);
+        T->swap = true;
+    }
+
+    /* Header: type, control integers and time step */
+    cyg_assert(traj_record(T, hdr, sizeof(hdr))==84, E_FAILURE, "Failing reading the header of <%s>", fname);
+    memcpy(icntrl, hdr+4, 20*sizeof(int32_t));
+    if (T->swap) traj_swap4(icntrl, 20);
+    cyg_assert(icntrl[8]==0, E_FAILURE, "DCD files with fixed atoms are not supported (<%s>)", fname);
+    T->nframes = icntrl[0];
+    if (icntrl[19]!=0) {
+        /* CHARMM: single precision time step, optional unit cell and fourth dimension */
+        memcpy(&delta, hdr+4+9*sizeof(int32_t), sizeof(delta));
+        if (T->swap) traj_swap4(&delta, 1);
+        xdelta = delta;
+        T->box   = (icntrl[10]!=0);
+        T->extra = (icntrl[11]!=0);
+    } else {
+        /* X-PLOR: double precision time step */
+        memcpy(&xdelta, hdr+4+9*sizeof(int32_t), sizeof(xdelta));
+        if (T->swap) {
+            uint32_t w[2], t;
+            memcpy(w, &xdelta, sizeof(w));
+            traj_swap4(w, 2);
+            t = w[0]; w[0] = w[1]; w[1] = t;
+            memcpy(&xdelta, w, sizeof(w));
+        }
+    }
+    T->dt = (icntrl[2]>0) ? xdelta*icntrl[2]*TRAJ_AKMA : xdelta*TRAJ_AKMA;
+
+    /* Title and number of atoms */
+    cyg_assert(traj_record(T, NULL, 0)>=0, E_FAILURE, "Failing reading the title of <%s>", fname);
+    cyg_assert(traj_record(T, &natoms, sizeof(natoms))==4, E_FAILURE, "Failing reading the number of atoms of <%s>", fname);
+    if (T->swap) traj_swap4(&natoms, 1);
+    cyg_assert(natoms>0, E_FAILURE, "Invalid number of atoms %d in <%s>", natoms, fname);
+    cyg_assert(T->natoms<=0 || T->natoms==natoms, E_FAILURE,
+            "<%s> has %d atoms, but %d were expected", fname, natoms, T->natoms);
+    T->natoms = natoms;
+    T->buf = thermo_realloc(NULL, (size_t)natoms*sizeof(float));
+    cyg_assert(T->buf!=NULL, E_FAILURE, "Memory allocation failed!");
+    return E_SUCCESS;
+}
+
+/*
+    Open the trajectory fname. For raw files, natoms must be given; for DCD
+    files it is read from the header (and checked, if positive).
+*/
+int
+thermo_traj_open(ThermoTraj *T, const char *fname, int natoms)
+{
+    int32_t marker = 0;
+    size_t l = strlen(fname);
+    long size;
+
+    memset(T, 0, sizeof(ThermoTraj));
+    T->natoms  = natoms;
+    T->nframes = -1;
+    T->fp = fopen(fname, "rb");
+    cyg_assert(T->fp!=NULL, E_FAILURE, "Impossible to open trajectory <%s>", fname);
+
+    /* DCD files start with a record of 84 bytes */
+    if (fread(&marker, sizeof(marker), 1, T->fp)==1 && (marker==84 || marker==0x54000000)) {
+        rewind(T->fp);
+        T->dcd = true;
+        if (traj_dcdheader(T, fname)!=E_SUCCESS) {
+            thermo_traj_close(T);
+            return E_FAILURE;
+        }
+        return E_SUCCESS;
+    }
+
+    /* Raw floats */
+    rewind(T->fp);
+    if (natoms<=0) {
+        thermo_traj_close(T);
+        cyg_logErr("The number of atoms of the raw trajectory <%s> is unknown", fname);
+        return E_FAILURE;
+    }
+    T->f32 = (l>4 && strcmp(fname+l-4, ".f32")==0);
+    if (fseek(T->fp, 0, SEEK_END)==0 && (size = ftell(T->fp))>=0) {
+        T->nframes = size / (3L*natoms*(T->f32 ? 4 : 8));
+    }
+    rewind(T->fp);
+    if (T->f32) {
+        T->buf = thermo_realloc(NULL, 3*(size_t)natoms*sizeof(float));
+        cyg_assert(T->buf!=NULL, E_FAILURE, "Memory allocation failed!");
+    }
+    return E_SUCCESS;
+}
+
+/* Read the next frame in xyz (natoms*3 values). Return 1, 0 at the end, -1 on error. */
+int
+thermo_traj_read(ThermoTraj *T, double *xyz)
+{
+    int i, d;
+    size_t n = (size_t)T->natoms;
+    long len;
+
+    if (!T->dcd) {
+        if (!T->f32) {
+            n = fread(xyz, sizeof(double), 3*n, T->fp);
+        } else {
+            n = fread(T->buf, sizeof(float), 3*n, T->fp);
+            for (i=0; i<(int)n; i++) xyz[i] = T->buf[i];
+        }
+        if (n==0 && feof(T->fp)) return 0;
+        cyg_assert(n==3*(size_t)T->natoms, -1, "Truncated frame in trajectory");
+        return 1;
+    }
+
+    /* Unit cell, then x, y, z, then the fourth dimension */
+    if (T->box) {
+        len = traj_record(T, NULL, 0);
+        if (len<0 && feof(T->fp)) return 0;
+        cyg_assert(len==48, -1, "Invalid unit cell record in DCD file");
+    }
+    for (d=0; d<3; d++) {
+        len = traj_record(T, T->buf, n*sizeof(float));
+        if (len<0 && d==0 && !T->box && feof(T->fp)) return 0;
+        cyg_assert(len==(long)(n*sizeof(float)), -1, "Invalid or truncated frame in DCD file");
+        if (T->swap) traj_swap4(T->buf, n);
+        for (i=0; i<T->natoms; i++) xyz[3*i+d] = T->buf[i];
+    }
+    if (T->extra) {
+        cyg_assert(traj_record(T, NULL, 0)>=0, -1, "Invalid or truncated frame in DCD file");
+    }
+    return 1;
+}
+
+/* Close a trajectory */
+void
+thermo_traj_close(ThermoTraj *T)
+{
+    if (T->fp!=NULL) fclose(T->fp);
+    thermo_free(T->buf);
+    T->fp  = NULL;
+    T->buf = NULL;
+}
@@ -0,0 +1,285 @@
+
+/*
+    Monte Carlo propagation of the uncertainty of the frequencies and of the
+    energy to all thermodynamic quantities, and to those of a reaction.
+
+    Each sample perturbs the input: every frequency is multiplied by its own
+    Gaussian factor 1 + unc_nu z_k and by a scaling 1 + unc_scale z_s common
+    to all the modes of the sample (the error of a scaling factor, the same
+    for the molecules computed with the same method: z_s is shared by A and
+    B), and the energy gets a Gaussian error unc_E z_E.
+
+    The normal deviates come from a counter based generator (Philox4x32-10,
+    Salmon et al., SC11) through the Box-Muller transform: the deviates of a
+    sample are a function of the seed and of the index of the sample only, so
+    the samples can be computed in any order, by any number of threads, with
+    the same results. The samples are split in batches computed in parallel,
+    each one evaluated at once by thermo_compute_batch.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+
+/* Samples of a task of the pool, evaluated at once by the batched kernel */
+#define UNC_BATCH 256
+
+/* Streams of random numbers of a sample */
+#define UNC_STREAM_SCALE 0          /* Common scaling of the frequencies, shared by A and B */
+#define UNC_STREAM_MOL   1          /* First of the molecules: energy, then the modes */
+
+/*
+    Philox4x32-10: the four 32 bit random numbers out of the counter ctr
+    with the 64 bit key seed.
+*/
+void
+thermo_philox(const uint32_t ctr[4], uint64_t seed, uint32_t out[4])
+{
+    int r;
+    uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+    uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed>>32);
+    uint64_t p0, p1;
+
+    for (r=0; r<10; r++) {
+        p0 = (uint64_t)0xD2511F53u * c0;
+        p1 = (uint64_t)0xCD9E8D57u * c2;
+        c0 = (uint32_t)(p1>>32) ^ c1 ^ k0;
+        c1 = (uint32_t)p1;
+        c2 = (uint32_t)(p0>>32) ^ c3 ^ k1;
+        c3 = (uint32_t)p0;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+/* Two standard normal deviates from the counter ctr (Box-Muller) */
+void
+thermo_normal2(const uint32_t ctr[4], uint64_t seed, double z[2])
+{
+    uint32_t x[4];
+    double u1, u2, r;
+
+    thermo_philox(ctr, seed, x);
+    u1 = (double)(((((uint64_t)x[0]<<32)|x[1])>>11) + 1) * 0x1p-53;     /* (0,1] */
+    u2 = (double)((((uint64_t)x[2]<<32)|x[3])>>11) * 0x1p-53;           /* [0,1) */
+    r  = sqrt(-2.0*log(u1));
+    z[0] = r*cos(2.0*M_PI*u2);
+    z[1] = r*sin(2.0*M_PI*u2);
+}
+
+/* Work shared by the tasks */
+typedef struct {
+    ThermoUncertainty *U;
+    const Thermo *X[2];         /* The molecules (B may be NULL) */
+    int nmol;
+    int nvib;                   /* Largest number of modes */
+    double *freq;               /* Frequencies of a batch, for each worker */
+    double *energy;             /* Energies of a batch, for each worker */
+    int *fail;                  /* Failure of each task */
+} UncJob;
+
+/* Compute the samples of a batch */
+static void unc_batch(int task, int worker, void *data) {
+    const UncJob *J = data;
+    const Thermo *X;
+    int i, k, m, g, s0 = task*UNC_BATCH;
+    int nb = (s0+UNC_BATCH < J->U->nsamp) ? UNC_BATCH : J->U->nsamp-s0;
+    double *freq = J->freq + (size_t)worker*(size_t)J->nvib*UNC_BATCH;
+    double *energy = J->energy + (size_t)worker*UNC_BATCH;
+    double scale[UNC_BATCH], z[2], *res;
+    uint32_t ctr[4];
+
+    /* Common scaling of each sample */
+    for (i=0; i<nb; i++) {
+        g = s0 + i;
+        ctr[0] = (uint32_t)g; ctr[1] = 0; ctr[2] = UNC_STREAM_SCALE; ctr[3] = 0;
+        thermo_normal2(ctr, J->U->seed, z);
+        scale[i] = z[0];
+    }
+
+    for (m=0; m<J->nmol; m++) {
+        X = J->X[m];
+        for (i=0; i<nb; i++) {
+            g = s0 + i;
+            ctr[0] = (uint32_t)g; ctr[1] = 0; ctr[2] = UNC_STREAM_MOL + (uint32_t)m;
+            ctr[3] = 0;
+            thermo_normal2(ctr, J->U->seed, z);
+            energy[i] = X->E + X->unc_E*z[0];
+            for (k=0; k<X->v; k++) {
+                if (k%2==0) {
+                    ctr[3] = 1 + (uint32_t)(k/2);
+                    thermo_normal2(ctr, J->U->seed, z);
+                }
+                freq[(size_t)k*(size_t)nb+(size_t)i] = X->nu[k] * (1.0+X->unc_scale*scale[i]) * (1.0+X->unc_nu*z[k%2]);
+            }
+        }
+
+        /* The entries that do not depend on frequencies and energy, then the batch */
+        res = J->U->res[m] + (size_t)s0*THERMO_LAST;
+        for (i=0; i<nb; i++) memcpy(res+(size_t)i*THERMO_LAST, X->results, THERMO_LAST*sizeof(double));
+        if (thermo_compute_batch(X->T, nb, energy, X->v, freq, X->w, res)!=0) J->fail[task] = 1;
+    }
+}
+
+/*
+    Compute nsamp samples of A and B (if not NULL), both already computed,
+    perturbed as given by their uncertainty keys, with the random numbers of
+    seed, on njobs threads.
+*/
+int
+thermo_uncertainty(ThermoUncertainty *U, const Thermo *A, const Thermo *B, int nsamp, uint64_t seed, int njobs)
+{
+    int t, ntasks;
+    UncJob J;
+
+    memset(U, 0, sizeof(ThermoUncertainty));
+    cyg_assert(nsamp>0, E_FAILURE, "Invalid number of samples %d", nsamp);
+    cyg_assert(A->results!=NULL && (B==NULL || B->results!=NULL), E_FAILURE, "The molecules must be computed before sampling");
+    cyg_assert(A->ensfile==NULL && (B==NULL || B->ensfile==NULL), E_FAILURE, "The uncertainty of an ensemble of conformers is not supported");
+    if (njobs<1) njobs = 1;
+    U->nsamp = nsamp;
+    U->seed  = seed;
+    ntasks = (nsamp+UNC_BATCH-1)/UNC_BATCH;
+
+    J.U = U;
+    J.X[0] = A;
+    J.X[1] = B;
+    J.nmol = (B!=NULL) ? 2 : 1;
+    J.nvib = (B!=NULL && B->v>A->v) ? B->v : A->v;
+    if (J.nvib<1) J.nvib = 1;
+    J.freq   = thermo_realloc(NULL, (size_t)njobs*(size_t)J.nvib*UNC_BATCH*sizeof(double));
+    J.energy = thermo_realloc(NULL, (size_t)njobs*UNC_BATCH*sizeof(double));
+    J.fail   = thermo_realloc(NULL, (size_t)ntasks*sizeof(int));
+    U->res[0] = thermo_realloc(NULL, (size_t)nsamp*THERMO_LAST*sizeof(double));
+    U->res[1] = (B!=NULL) ? thermo_realloc(NULL, (size_t)nsamp*THERMO_LAST*sizeof(double)) : NULL;
+    if (J.freq==NULL || J.energy==NULL || J.fail==NULL || U->res[0]==NULL || (B!=NULL && U->res[1]==NULL)) {
+        thermo_free(J.freq);
+        thermo_free(J.energy);
+        thermo_free(J.fail);
+        thermo_uncertainty_free(U);
+        cyg_logErr("Memory allocation failed!");
+        return E_FAILURE;
+    }
+    for (t=0; t<ntasks; t++) J.fail[t] = 0;
+
+#ifdef HAVE_THREADS
+    ThermoPool *pool = (njobs>1) ? thermo_pool_start(njobs, ntasks, NULL, unc_batch, &J) : NULL;
+    if (pool!=NULL) {
+        thermo_pool_wait(pool);
+    } else {
+        for (t=0; t<ntasks; t++) unc_batch(t, 0, &J);
+    }
+#else
+    for (t=0; t<ntasks; t++) unc_batch(t, 0, &J);
+#endif
+
+    for (t=0; t<ntasks && !J.fail[t]; t++);
+    thermo_free(J.freq);
+    thermo_free(J.energy);
+    thermo_free(J.fail);
+    if (t<ntasks) {
+        thermo_uncertainty_free(U);
+        cyg_logErr("Memory allocation failed!");
+        return E_FAILURE;
+    }
+    return E_SUCCESS;
+}
+
+/* Order of two values */
+static int unc_cmp(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x>y) - (x<y);
+}
+
+/* Quantile p of the n sorted values x (linear interpolation) */
+static double unc_quantile(const double *x, int n, double p) {
+    double h = p*(n-1);
+    int i = (int)floor(h);
+    if (i>=n-1) return x[n-1];
+    return x[i] + (h-i)*(x[i+1]-x[i]);
+}
+
+/* Print the statistics of the samples of A (which 0), B (1) or the reaction (2) */
+static void unc_table(const ThermoUncertainty *U, int which, const double *value, const ThermoOutput *O, double *col, FILE *fp) {
+    int i, j, f;
+    double mean, sd, d;
+
+    fprintf(fp, "   %-21s %12s %12s %12s %12s %12s %12s\n", "Quantity", "Value", "Mean", "SD", "2.5%", "50%", "97.5%");
+    for (j=0; j<O->nfields; j++) {
+        f = O->field[j];
+        mean = 0.0;
+        for (i=0; i<U->nsamp; i++) {
+            if (which<2) {
+                col[i] = U->res[which][(size_t)i*THERMO_LAST+(size_t)f];
+            } else {
+                col[i] = U->nB*U->res[1][(size_t)i*THERMO_LAST+(size_t)f] - U->nA*U->res[0][(size_t)i*THERMO_LAST+(size_t)f];
+            }
+            mean += col[i];
+        }
+        mean /= U->nsamp;
+        for (sd=0.0, i=0; i<U->nsamp; i++) {
+            d = col[i] - mean;
+            sd += d*d;
+        }
+        sd = (U->nsamp>1) ? sqrt(sd/(U->nsamp-1)) : 0.0;
+
+        /* Quantities not computed for this system */
+        if (value[f]==0.0 && mean==0.0 && sd==0.0) continue;
+
+        qsort(col, (size_t)U->nsamp, sizeof(double), unc_cmp);
+        fprintf(fp, "   %-21s %12.4f %12.4f %12.4f %12.4f %12.4f %12.4f%s%s\n", thermo_name(f), value[f], mean, sd,
+                unc_quantile(col, U->nsamp, 0.025), unc_quantile(col, U->nsamp, 0.5), unc_quantile(col, U->nsamp, 0.975),
+                (thermo_unit(f)[0]!='\0') ? " " : "", thermo_unit(f));
+    }
+}
+
+/* Print the uncertainty of a molecule */
+static void unc_molecule(const ThermoUncertainty *U, int which, const char *name, const Thermo *X, const ThermoOutput *O, double *col, FILE *fp) {
+    fprintf(fp, "\nMonte Carlo uncertainty of %s: %d samples (seed %llu)\n", name, U->nsamp, (unsigned long long)U->seed);
+    fprintf(fp, "   Relative uncertainty of each frequency: %g, of their scaling: %g; uncertainty of the energy: %g kcal/mol\n",
+            X->unc_nu, X->unc_scale, X->unc_E);
+    unc_table(U, which, X->results, O, col, fp);
+}
+
+/*
+    Print the mean, standard deviation and 2.5%, 50% and 97.5% quantiles of
+    the fields of O of the samples of A, of B and, if reaction, of the
+    reaction nA A -> nB B (with U->nA and U->nB), as thermo_diffthermo.
+*/
+void
+thermo_uncertainty_print(const ThermoUncertainty *U, const Thermo *A, const Thermo *B, bool reaction, const ThermoOutput *O, FILE *fp)
+{
+    int f;
+    double *col, value[THERMO_LAST];
+
+    col = thermo_realloc(NULL, (size_t)U->nsamp*sizeof(double));
+    if (col==NULL) {
+        cyg_logErr("Memory allocation failed!");
+        return;
+    }
+    unc_molecule(U, 0, "A", A, O, col, fp);
+    if (B!=NULL && U->res[1]!=NULL) {
+        unc_molecule(U, 1, "B", B, O, col, fp);
+        if (reaction) {
+            for (f=0; f<THERMO_LAST; f++) value[f] = U->nB*B->results[f] - U->nA*A->results[f];
+            fprintf(fp, "\nMonte Carlo uncertainty of the reaction %dA <-> %dB: %d samples (seed %llu)\n",
+                    U->nA, U->nB, U->nsamp, (unsigned long long)U->seed);
+            unc_table(U, 2, value, O, col, fp);
+        }
+    }
+    thermo_free(col);
+}
+
+/* Free the samples */
+void
+thermo_uncertainty_free(ThermoUncertainty *U)
+{
+    thermo_free(U->res[0]);
+    thermo_free(U->res[1]);
+    U->res[0] = U->res[1] = NULL;
+}
@@ -0,0 +1,256 @@
+
+/*
+    Vibrational density of states from the velocity autocorrelation function
+    of a molecular dynamics trajectory.
+
+    The velocities are read one frame at a time (see traj.c) into a window
+    of W frames, scaled by the square root of the atomic masses. When the
+    window is full, the power spectrum of each of the 3N velocity series,
+    zero padded to 2W points, is the Fourier transform of its (Bartlett
+    windowed) autocorrelation up to a lag of W frames; the spectra of all
+    windows are summed (Welch's method), so that memory depends on the
+    window and not on the length of the trajectory. Two real series are
+    transformed at once as the real and imaginary parts of one complex FFT,
+    and the series are split in blocks computed in parallel, each block
+    summing its own spectrum, so that the result does not depend on the
+    number of threads.
+
+    The spectrum, normalized to 3N degrees of freedom, is a density of
+    states: the classical and quantum harmonic weighting functions are
+    integrated over it to give the vibrational free energy, energy and
+    entropy. The zero frequency point (diffusion) is left out and reported.
+
+    Copyright (C) 2019 Simone Conti
+*/
+
+#include <cygtools.h>
+#include <thermo.h>
+
+/* Pairs of velocity series in a block (a task of the pool) */
+#define VACF_BLOCK 32
+
+/* One window of velocities, and the spectra summed so far */
+typedef struct {
+    int nseries;            /* 3 natoms */
+    int W;                  /* Frames per window */
+    int N;                  /* Points of the FFT (2W) */
+    const float *buf;       /* Series s at buf[s*W], mass weighted */
+    double *tw;             /* Twiddle factors of the FFT */
+    double *P;              /* Spectrum of each block, W+1 points */
+    double *work;           /* FFT arrays of each worker, 2N points */
+} VacfWindow;
+
+/* Add the power spectra of the series of a block to its spectrum */
+static void vacf_block(int task, int worker, void *data) {
+    const VacfWindow *G = data;
+    int s, t, k, W = G->W, N = G->N;
+    int s0 = task*2*VACF_BLOCK;
+    int s1 = (s0+2*VACF_BLOCK < G->nseries) ? s0+2*VACF_BLOCK : G->nseries;
+    double *re = G->work + (size_t)worker*2*(size_t)N, *im = re + N;
+    double *P = G->P + (size_t)task*(size_t)(W+1);
+    double a, b;
+
+    for (s=s0; s<s1; s+=2) {
+        for (t=0; t<W; t++) {
+            re[t] = G->buf[(size_t)s*(size_t)W+(size_t)t];
+            im[t] = (s+1<s1) ? G->buf[(size_t)(s+1)*(size_t)W+(size_t)t] : 0.0;
+        }
+        for (t=W; t<N; t++) re[t] = im[t] = 0.0;
+        thermo_fft_tw(re, im, N, false, G->tw);
+
+        /* |X(k)|^2+|Y(k)|^2 from Z = X+iY, one sided */
+        for (k=0; k<=W; k++) {
+            a = re[k]*re[k] + im[k]*im[k];
+            b = re[(N-k)%N]*re[(N-k)%N] + im[(N-k)%N]*im[(N-k)%N];
+            P[k] += (k==0 || k==W) ? 0.5*(a+b) : a+b;
+        }
+    }
+}
+
+/* Add the spectra of a full window, with njobs threads */
+static void vacf_window(VacfWindow *G, int nblocks, int njobs) {
+    int b;
+#ifdef HAVE_THREADS
+    ThermoPool *pool = (njobs>1) ? thermo_pool_start(njobs, nblocks, NULL, vacf_block, G) : NULL;
+    if (pool!=NULL) {
+        thermo_pool_wait(pool);
+        return;
+    }
+#else
+    (void)njobs;
+#endif
+    for (b=0; b<nblocks; b++) vacf_block(b, 0, G);
+}
+
+/*
+    Density of states of the velocity trajectory fname, with masses mass
+    (unit masses if NULL) of natoms atoms (read from the file if 0), frames
+    dt fs apart (read from the file if 0), and correlation windows of window
+    frames (rounded to a power of two, and reduced to the length of the
+    trajectory), computed by njobs threads.
+*/
+int
+thermo_vacf(ThermoVacf *V, const char *fname, const double *mass, int natoms, double dt, int window, int njobs)
+{
+    int i, k, t, ret, nblocks;
+    double tot, *frame, *sqrtm;
+    float *buf;
+    ThermoTraj T;
+    VacfWindow G;
+
+    memset(V, 0, sizeof(ThermoVacf));
+    cyg_assert(thermo_traj_open(&T, fname, natoms)==E_SUCCESS, E_FAILURE, "Failing opening trajectory <%s>", fname);
+    natoms = T.natoms;
+    if (dt<=0.0) dt = T.dt;
+    if (dt<=0.0) {
+        thermo_traj_close(&T);
+        cyg_logErr("The time step of <%s> is unknown: give it with --timestep", fname);
+        return E_FAILURE;
+    }
+    G.W = thermo_fft_size(window>1 ? window : 2);
+    while (T.nframes>1 && G.W>T.nframes) G.W /= 2;
+    G.N = 2*G.W;
+    G.nseries = 3*natoms;
+    nblocks = (G.nseries+2*VACF_BLOCK-1)/(2*VACF_BLOCK);
+    if (njobs<1) njobs = 1;
+
+    /* Window, spectra, FFT arrays, and the mass weights */
+    buf   = thermo_realloc(NULL, (size_t)G.nseries*(size_t)G.W*sizeof(float));
+    G.P   = thermo_realloc(NULL, (size_t)nblocks*(size_t)(G.W+1)*sizeof(double));
+    G.work= thermo_realloc(NULL, (size_t)njobs*2*(size_t)G.N*sizeof(double));
+    frame = thermo_realloc(NULL, 4*(size_t)natoms*sizeof(double));
+    G.tw  = thermo_fft_twiddles(G.N);
+    V->nu = thermo_realloc(NULL, (size_t)(G.W+1)*sizeof(double));
+    V->w  = thermo_realloc(NULL, (size_t)(G.W+1)*sizeof(double));
+    ret = (buf!=NULL && G.P!=NULL && G.work!=NULL && frame!=NULL && G.tw!=NULL && V->nu!=NULL && V->w!=NULL) ? E_SUCCESS : E_FAILURE;
+    if (ret==E_SUCCESS) {
+        G.buf = buf;
+        sqrtm = frame + 3*natoms;
+        for (i=0; i<natoms; i++) sqrtm[i] = (mass!=NULL) ? sqrt(mass[i]) : 1.0;
+        for (k=0; k<nblocks*(G.W+1); k++) G.P[k] = 0.0;
+
+        /* Stream the frames, one window at a time (the last partial one is left out) */
+        t = 0;
+        while ((ret = thermo_traj_read(&T, frame))==1) {
+            for (i=0; i<G.nseries; i++) buf[(size_t)i*(size_t)G.W+(size_t)t] = (float)(frame[i]*sqrtm[i/3]);
+            V->nframes++;
+            if (++t==G.W) {
+                vacf_window(&G, nblocks, njobs);
+                V->nwin++;
+                t = 0;
+            }
+        }
+        if (ret<0) {
+            cyg_logErr("Failing reading frame %ld of <%s>", V->nframes+1, fname);
+            ret = E_FAILURE;
+        } else if (V->nwin==0) {
+            cyg_logErr("Trajectory <%s> has %ld frames, fewer than a window of %d", fname, V->nframes, G.W);
+            ret = E_FAILURE;
+        } else {
+            ret = E_SUCCESS;
+        }
+    } else {
+        cyg_logErr("Memory allocation failed!");
+    }
+
+    /* Sum the blocks in order, and normalize to the degrees of freedom */
+    if (ret==E_SUCCESS) {
+        V->natoms = natoms;
+        V->window = G.W;
+        V->dt     = dt;
+        V->n      = G.W+1;
+        tot = 0.0;
+        for (k=0; k<=G.W; k++) {
+            V->w[k] = 0.0;
+            for (i=0; i<nblocks; i++) V->w[k] += G.P[(size_t)i*(size_t)(G.W+1)+(size_t)k];
+            tot += V->w[k];
+            V->nu[k] = k / (G.N*dt*1E-15) / (CNS_C*100.0);
+        }
+        for (k=0; k<=G.W; k++) V->w[k] = (tot>0.0) ? V->w[k]*G.nseries/tot : 0.0;
+    } else {
+        thermo_vacf_free(V);
+    }
+
+    thermo_traj_close(&T);
+    thermo_free(buf);
+    thermo_free(G.P);
+    thermo_free(G.work);
+    thermo_free(frame);
+    thermo_free(G.tw);
+    return ret;
+}
+
+/*
+    Integrate the harmonic weighting functions over the density of states at
+    temperature T: classical and quantum molar free energy, energy [kcal/mol]
+    and entropy [cal/mol/K], and zero point energy [kcal/mol]. The zero
+    frequency point is left out.
+*/
+void
+thermo_vacf_thermo(const ThermoVacf *V, double T, ThermoVacfResults *R)
+{
+    int k;
+    double x, hnu, w, kBT = CNS_kB*T;
+    double e2kcal = CNS_j2kcal*CNS_NA, s2cal = CNS_kB*CNS_NA/CNS_cal;
+
+    memset(R, 0, sizeof(ThermoVacfResults));
+    for (k=1; k<V->n; k++) {
+        w   = V->w[k];
+        hnu = CNS_h * V->nu[k] * CNS_C * 100.0;
+        x   = hnu/kBT;
+        R->dof += w;
+        R->Fcl += w * kBT*log(x);
+        R->Ucl += w * kBT;
+        R->Scl += w * (1.0-log(x));
+        R->Fqm += w * (0.5*hnu + kBT*log1p(-exp(-x)));
+        R->Uqm += w * (0.5*hnu + hnu/expm1(x));
+        R->Sqm += w * (x/expm1(x) - log1p(-exp(-x)));
+        R->ZPE += w * 0.5*hnu;
+    }
+    R->Fcl *= e2kcal;
+    R->Ucl *= e2kcal;
+    R->Fqm *= e2kcal;
+    R->Uqm *= e2kcal;
+    R->ZPE *= e2kcal;
+    R->Scl *= s2cal;
+    R->Sqm *= s2cal;
+}
+
+/* Print the density of states of V and its vibrational quantities at temperature T */
+void
+thermo_vacf_print(const ThermoVacf *V, const char *fname, double T, FILE *fp)
+{
+    ThermoVacfResults R;
+    const char *sname = strrchr(fname, '/');
+    thermo_vacf_thermo(V, T, &R);
+
+    fprintf(fp, "Velocity autocorrelation of <%s>:\n", (sname!=NULL) ? sname+1 : fname);
+    fprintf(fp, "   Atoms:                     %d\n", V->natoms);
+    fprintf(fp, "   Frames:                    %ld\n", V->nframes);
+    fprintf(fp, "   Time step [fs]:            %g\n", V->dt);
+    fprintf(fp, "   Window [frames]:           %d\n", V->window);
+    fprintf(fp, "   Windows averaged:          %d\n", V->nwin);
+    fprintf(fp, "   Resolution [1/cm]:         %.4f\n", V->nu[1]);
+    fprintf(fp, "   Highest frequency [1/cm]:  %.4f\n", V->nu[V->n-1]);
+    fprintf(fp, "   Degree of freedom:         %.4f\n", R.dof+V->w[0]);
+    fprintf(fp, "      at zero frequency:      %.4f (diffusive, left out)\n", V->w[0]);
+    fprintf(fp, "\n");
+    fprintf(fp, "Vibrational quantities from the density of states at %.2f K:\n", T);
+    fprintf(fp, "           VibCl      VibQm \n");
+    fprintf(fp, "   Um %10.3f %10.3f kcal/mol\n", R.Ucl, R.Uqm);
+    fprintf(fp, "   Sm %10.3f %10.3f cal/mol/K\n", R.Scl, R.Sqm);
+    fprintf(fp, " -TSm %10.3f %10.3f kcal/mol\n", -T*R.Scl/1000.0, -T*R.Sqm/1000.0);
+    fprintf(fp, "   Fm %10.3f %10.3f kcal/mol\n", R.Fcl, R.Fqm);
+    fprintf(fp, "\n");
+    fprintf(fp, "Zero point vibrational energy: %11.3f kcal/mol\n", R.ZPE);
+}
+
+/* Free a density of states */
+void
+thermo_vacf_free(ThermoVacf *V)
+{
+    thermo_free(V->nu);
+    thermo_free(V->w);
+    V->nu = V->w = NULL;
+    V->n  = 0;
+}
@@ -32,78 +32,81 @@
  * evaluated as integral over the VDOS (see Theory). In the output file, the VDOS, 
  * the free energy at each point, and the cumulative free energy is printes as a 
  * function of the frequency. To change the resolutin of the calculated VDOS, 
- * use the -n, --dnu command line option.
+ * use the -n, --dnu command line option; to change its broadening (by default
+ * a triangular window of 5 bins), use the --broaden option.
  *
  * @param[in] A Pointer to an initialized @c Thermo structure
  * @param[in] fname Filename where to print the VDOS and the free energy.
+ * @param[in] K Broadening kernel, NULL for the default.
  *
  */
 
 
+#include <cygtools.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <thermo.h>
 
 void 
-thermo_vdos(Thermo *A, const char *fname)
+thermo_vdos(Thermo *A, const char *fname, const ThermoBroaden *K)
 {
 
-    int i, ii;
-    int period = 5;                 /* Period for moving average of VDOS */
-    int weig, totweig;
+    int i, j, k, nbins;
     double accu, F, Ftot;
     double kBT = CNS_kB * A->T;
-    double *vdos_tmp;
-    FILE *out = fopen(fname, "w");
+    double *vdos;
+    const ThermoSpectrum *S = thermo_spectrum(A);
+    FILE *out;
 
-    /* Allocate the vdos and initialize to zero */
-    A->vdos  = malloc((size_t)(A->nu_np)*sizeof(double));
-    vdos_tmp = malloc((size_t)(A->nu_np)*sizeof(double));
-    for (i=0; i<A->nu_np; i++) {
-        A->vdos[i]  = 0;
-        vdos_tmp[i] = 0;
+    if (S==NULL) {
+        fprintf(stderr, "ERROR! Impossible to build the spectrum for the VDOS!\n\n");
+        return;
     }
 
-    /* Populate the vdos */
-    for (i=0; i<A->v; i++) {
-        ii = (int)lrint(A->nu[i]/A->dnu);
-        if (ii>=A->nu_np) ii=A->nu_np-1;
-        A->vdos[ii]++;
+    /* Histogram of the modes, from zero to the last mode (4000 cm-1 at least) */
+    nbins = thermo_spectrum_nbins(S, A->dnu, A->nu_np);
+    vdos  = thermo_realloc(NULL, (size_t)nbins*sizeof(double));
+    if (vdos==NULL) return;
+    for (i=0, k=0; i<nbins; i++) {
+        j = k;
+        while (k<S->n && thermo_spectrum_bin(S, k, A->dnu)<=i) k++;
+        vdos[i] = S->W[k] - S->W[j];
     }
 
-    /* Do moving average */
-    for (i=0; i<A->nu_np; i++) {
-        totweig = 0;
-        for (ii=-period; ii<=period; ii++) {
-            if (i+ii>0 && i+ii<A->nu_np) {
-                weig = period+1-abs(ii);
-                vdos_tmp[i] += A->vdos[i+ii] * weig;
-                totweig  += weig;
-            }
-        }
-        vdos_tmp[i] /= totweig;
+    /* Broaden it */
+    if (thermo_broaden(vdos, nbins, K, A->dnu)!=E_SUCCESS) {
+        fprintf(stderr, "ERROR! Impossible to broaden the VDOS!\n\n");
+        thermo_free(vdos);
+        return;
     }
 
-    /* Normalize it */
+    out = fopen(fname, "w");
+    if (out==NULL) {
+        fprintf(stderr, "ERROR opening %s for the VDOS!\n\n", fname);
+        thermo_free(vdos);
+        return;
+    }
+
+    /* Normalize it to the number of modes */
     accu=0;
-    for (i=0; i<A->nu_np; i++) {
-        accu += vdos_tmp[i];
+    for (i=0; i<nbins; i++) {
+        accu += vdos[i];
     }
-    for (i=0; i<A->nu_np; i++) {
-        A->vdos[i] = vdos_tmp[i] * A->v / accu;
+    for (i=0; i<nbins; i++) {
+        vdos[i] = vdos[i] * S->W[S->n] / accu;
     }
 
     /* Print the vdos, the free energy gain at each point, and the cumulative free energy */
     fprintf(out, "#freq      vdos           F        Ftot\n");
     Ftot=0;
-    for (i=0; i<A->nu_np; i++) {
-        F = -CNS_j2kcal * CNS_NA * kBT * log( kBT / ( CNS_h * (i+1) * A->dnu * CNS_C * 100.0)) * A->vdos[i];
+    for (i=0; i<nbins; i++) {
+        F = -CNS_j2kcal * CNS_NA * kBT * log( kBT / ( CNS_h * (i+1) * A->dnu * CNS_C * 100.0)) * vdos[i];
         Ftot += F;
-        fprintf(out, "%7.2f %+11.4e %+10.4f %+10.4f \n", A->dnu*i, A->vdos[i], F, Ftot);
+        fprintf(out, "%7.2f %+11.4e %+10.4f %+10.4f \n", A->dnu*i, vdos[i], F, Ftot);
     }
 
-    free(vdos_tmp);
+    thermo_free(vdos);
     fclose(out);
 
     return;